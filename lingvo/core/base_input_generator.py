@@ -376,6 +376,83 @@ class BaseInputGeneratorFromFiles(BaseInputGenerator):
         'size of buffers to fit demand. The file_buffer_size parameter is an '
         'upper bound to the buffer size.')
     p.Define('file_parallelism', 16, 'How many files to read concurrently.')
+    p.Define(
+        'file_parallelism_max', 0,
+        'If greater than file_parallelism, the number of files read '
+        'concurrently is tuned between file_parallelism and this many, e.g., '
+        'for jobs running on hosts of different speeds.')
+    p.Define(
+        'file_readahead_blocks', 0,
+        'If positive, each file reader opens its next file and reads up to '
+        'this many 2MB blocks of it in the background while parsing the '
+        'current one. Useful when reading from remote filesystems.')
+    p.Define(
+        'file_list_max_age_secs', 0,
+        'If non-zero, the files matching file_pattern are listed once and '
+        'cached. A list older than this many seconds is refreshed in the '
+        'background, so that new files are picked up by later epochs. If '
+        'negative, the list is never refreshed.')
+    p.Define(
+        'input_state_file', '',
+        'If not empty, the input op resumes reading from the position saved '
+        'in this file by SaveInputState(), e.g., after a restart.')
+    p.Define(
+        'memory_budget_bytes', 0,
+        'If positive, the shuffling buffers, bucketed samples and batches of '
+        'the input op are kept within this many bytes. The shuffling buffers '
+        'hold fewer than file_buffer_size records if needed.')
+    p.Define(
+        'file_cache_dir', '',
+        'If not empty, a local directory the data files are copied into while '
+        'they are read in the first epoch. Later epochs read the local copies, '
+        'which saves reading slow remote files again.')
+    p.Define(
+        'file_cache_max_bytes', 0,
+        'If positive, the least recently used copies in file_cache_dir are '
+        'deleted to keep it within this many bytes.')
+    p.Define(
+        'in_memory_cache_max_bytes', 0,
+        'If positive, the records of the first epoch are kept in memory if '
+        'they total at most this many bytes. Later epochs are then shuffled '
+        'and yielded from memory without reading any file, e.g., for small '
+        'eval or fine-tuning sets.')
+    p.Define(
+        'file_global_shuffle', False,
+        'If True, every epoch reads the records of all files in a random '
+        'permutation by their offsets, which shuffles them well even with a '
+        'small file_buffer_size. The offsets of each file are kept in an '
+        'index file next to it, written on first read if missing. Requires '
+        'uncompressed TFRecord files.')
+    p.Define(
+        'file_interleave_cycle_length', 0,
+        'If greater than 1, each of the file_parallelism iterators reads this '
+        'many files at a time and takes file_interleave_block_length records '
+        'from each in turn. This mixes the records of many files with a much '
+        'smaller file_buffer_size, e.g., on hosts with little memory.')
+    p.Define(
+        'file_interleave_block_length', 1,
+        'Number of consecutive records taken from a file when interleaving.')
+    p.Define(
+        'input_stats_name', '',
+        'If not empty, the input op adds counters and histograms of its file '
+        'reads, shuffling buffer, processing and batching to the stats of this '
+        'name, which InputPipelineStats() returns.')
+    p.Define(
+        'input_source_weights_name', '',
+        'If not empty, SetInputSourceWeights() changes the weights of the '
+        'input sources mixed by the input ops of this name while they run, '
+        'without restarting them.')
+    p.Define(
+        'input_source_max_deficit', 0,
+        'If positive, the input op takes records from other input sources '
+        'while the one sampled has none ready, e.g., on slow storage, rather '
+        'than wait for it. Up to this many records per input source are made '
+        'up for later to keep the mix of the input source weights.')
+    p.Define(
+        'input_state_max_buffered_records', 0,
+        'SaveInputState() saves at most this many records read but not yet '
+        'yielded to the batcher. The others, and those in partially filled '
+        'batches, are skipped for the rest of their epoch after a restart.')
     p.Define(
         'bucket_adjust_every_n', 0, 'If non-zero, optimize the values of '
         'bucket_upper_bound except the last one after every N records '
@@ -385,18 +462,28 @@ class BaseInputGeneratorFromFiles(BaseInputGenerator):
         'so far every these many records are yielded.')
     p.Define('num_batcher_threads', 1, 'Number of threads to use for input '
              'record batcher.')
+    p.Define(
+        'num_batcher_threads_max', 0,
+        'If greater than num_batcher_threads, the number of batcher threads '
+        'is tuned between num_batcher_threads and this many.')
     p.Define(
         'require_sequential_order', False,
         'If true, the input op is required to process the file glob as '
         'well as the contents of each file in a deterministic sequential order.'
         ' This is intended for unit tests. Setting this automatically disables '
-        'file_random_seed, file_buffer_size, file_parallelism, '
-        'num_batcher_threads, and requires a single file_pattern.')
+        'file_random_seed, file_parallelism, num_batcher_threads, and '
+        'requires a single file_pattern. file_buffer_size only bounds the '
+        'records read ahead with sequential_num_readers.')
     p.Define(
         'repeat_count', -1,
         'Number of repetitions of a dataset before throwing OutOfRange error '
         'when using require_sequential_order. Must only be set if '
         'require_sequential_order is True.')
+    p.Define(
+        'sequential_num_readers', 1,
+        'With require_sequential_order, if greater than 1, this many threads '
+        'read the next files ahead, buffering up to file_buffer_size records '
+        'in total, and the records are still yielded in order.')
     # TODO(b/139345706) when file_pattern is deleted use_within_batch_mixing
     # will be specified by passing a WithinBatchMixingDataSource to
     # p.file_datasource and this param should be deleted as well.
@@ -500,6 +587,22 @@ class BaseInputGeneratorFromFiles(BaseInputGenerator):
         'file_random_seed': p.file_random_seed,
         'file_buffer_size': p.file_buffer_size,
         'file_parallelism': p.file_parallelism,
+        'file_readahead_blocks': p.file_readahead_blocks,
+        'file_list_max_age_secs': p.file_list_max_age_secs,
+        'input_state_file': p.input_state_file,
+        'memory_budget_bytes': p.memory_budget_bytes,
+        'file_cache_dir': p.file_cache_dir,
+        'file_cache_max_bytes': p.file_cache_max_bytes,
+        'in_memory_cache_max_bytes': p.in_memory_cache_max_bytes,
+        'file_global_shuffle': p.file_global_shuffle,
+        'file_interleave_cycle_length': p.file_interleave_cycle_length,
+        'file_interleave_block_length': p.file_interleave_block_length,
+        'input_stats_name': p.input_stats_name,
+        'file_parallelism_max': p.file_parallelism_max,
+        'num_threads_max': p.num_batcher_threads_max,
+        'input_source_weights_name': p.input_source_weights_name,
+        'input_source_max_deficit': p.input_source_max_deficit,
+        'sequential_num_readers': p.sequential_num_readers,
         'file_buffer_size_in_seconds': p.file_buffer_size_in_seconds,
         'bucket_adjust_every_n': p.bucket_adjust_every_n,
         'flush_every_n': p.flush_every_n,
@@ -511,6 +614,45 @@ class BaseInputGeneratorFromFiles(BaseInputGenerator):
     args.update(self._InputOpBucketingArgs())
     return args
 
+  def SaveInputState(self):
+    """Returns an op saving the reading position to `p.input_state_file`.
+
+    Typically run whenever a checkpoint is saved, so that a restarted job
+    resumes reading close to where the checkpoint was taken.
+    """
+    p = self.params
+    assert p.input_state_file, 'p.input_state_file must be set.'
+    return ops.save_input_state(
+        state_file=p.input_state_file,
+        max_buffered_records=p.input_state_max_buffered_records)
+
+  def InputPipelineStats(self):
+    """Returns the stats of the input op as a serialized `Summary` proto.
+
+    It holds the counters and histograms added by the input ops with
+    `p.input_stats_name`, e.g., to write with a summary `FileWriter` and
+    compare file_parallelism or num_batcher_threads settings in TensorBoard.
+    """
+    p = self.params
+    assert p.input_stats_name, 'p.input_stats_name must be set.'
+    return ops.input_pipeline_stats(stats_name=p.input_stats_name)
+
+  def SetInputSourceWeights(self, weights):
+    """Returns an op replacing the input source weights of the input op.
+
+    The input op must mix several input sources with `input_source_weights`
+    and have `p.input_source_weights_name`. The input sources keep their
+    buffers, and the records yielded after the op has run follow `weights`.
+
+    Args:
+      weights: A float vector with a weight per input source.
+    """
+    p = self.params
+    assert p.input_source_weights_name, (
+        'p.input_source_weights_name must be set.')
+    return ops.set_input_source_weights(
+        weights=weights, weights_name=p.input_source_weights_name)
+
   def _InputOpBucketingArgs(self):
     return {
         'bucket_upper_bound': [1000000000],
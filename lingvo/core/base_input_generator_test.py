@@ -24,6 +24,8 @@ import shutil
 import tempfile
 import lingvo.compat as tf
 from lingvo.core import base_input_generator
+from lingvo.core import generic_input
+from lingvo.core import py_utils
 from lingvo.core import test_utils
 import mock
 import numpy as np
@@ -47,12 +49,44 @@ def _CreateFakeTFRecordFiles(record_count=10):
   return tmpdir, data_path
 
 
+def _CreateTaggedTFRecordFiles(tags, record_count=100):
+  """Writes a file of records '<tag>:<i>' per tag, returns their patterns."""
+  tmpdir = tempfile.mkdtemp()
+  file_patterns = []
+  for tag in tags:
+    data_path = os.path.join(tmpdir, tag)
+    with tf.io.TFRecordWriter(data_path) as w:
+      for i in range(record_count):
+        w.write(('%s:%08d' % (tag, i)).encode('utf-8'))
+    file_patterns.append('tfrecord:' + data_path)
+  return tmpdir, file_patterns
+
+
 class ToyInputGenerator(base_input_generator.BaseDataExampleInputGenerator):
 
   def GetFeatureSpec(self):
     return {'audio': tf.FixedLenFeature([48000], tf.float32)}
 
 
+class ToyFilesInputGenerator(base_input_generator.BaseInputGeneratorFromFiles):
+  """Yields the records of the files with their source ids."""
+
+  def _DataSourceFromFilePattern(self, file_pattern, input_source_weights=None):
+
+    def _Process(source_id, record):
+      return py_utils.NestedMap(source_id=source_id, record=record), 1
+
+    batch, _ = generic_input.GenericInput(
+        processor=_Process,
+        file_pattern=file_pattern,
+        input_source_weights=input_source_weights or [],
+        **self.CommonInputOpArgs())
+    return batch
+
+  def _InputBatch(self):
+    return self._BuildDataSource()
+
+
 class BaseExampleInputGeneratorTest(test_utils.TestCase):
 
   def setUp(self):
@@ -130,5 +164,56 @@ class BaseExampleInputGeneratorTest(test_utils.TestCase):
     mock_method.assert_called()
 
 
+class BaseInputGeneratorFromFilesTest(test_utils.TestCase):
+
+  def setUp(self):
+    super(BaseInputGeneratorFromFilesTest, self).setUp()
+    tf.reset_default_graph()
+
+  def tearDown(self):
+    super(BaseInputGeneratorFromFilesTest, self).tearDown()
+    if hasattr(self, '_tmpdir'):
+      shutil.rmtree(self._tmpdir)
+
+  def testInputPipelineStats(self):
+    p = ToyFilesInputGenerator.Params()
+    p.batch_size = 8
+    self._tmpdir, file_patterns = _CreateTaggedTFRecordFiles(['a'])
+    p.file_pattern = file_patterns[0]
+    p.input_stats_name = 'toy_input_stats'
+    ig = p.Instantiate()
+    with self.session(graph=tf.get_default_graph()) as sess:
+      batch = ig.GetPreprocessedInputBatch()
+      stats = ig.InputPipelineStats()
+      for _ in range(5):
+        sess.run(batch)
+      summary = tf.Summary.FromString(sess.run(stats))
+    values = {v.tag: v for v in summary.value}
+    self.assertGreater(values['toy_input_stats/source_0/records'].simple_value,
+                       0)
+    self.assertGreater(values['toy_input_stats/batch_wait_usecs'].histo.num,
+                       0)
+
+  def testSetInputSourceWeights(self):
+    p = ToyFilesInputGenerator.Params()
+    p.batch_size = 8
+    self._tmpdir, file_patterns = _CreateTaggedTFRecordFiles(['a', 'b'])
+    p.file_pattern = [(file_patterns[0], 0.5), (file_patterns[1], 0.5)]
+    p.use_within_batch_mixing = True
+    p.input_source_weights_name = 'toy_input_weights'
+    ig = p.Instantiate()
+    with self.session(graph=tf.get_default_graph()) as sess:
+      batch = ig.GetPreprocessedInputBatch()
+      set_weights = ig.SetInputSourceWeights([0.0, 1.0])
+      # The input op registers its weights once it runs.
+      sess.run(batch)
+      sess.run(set_weights)
+      # Flushes the records mixed before the weights were set.
+      for _ in range(20):
+        sess.run(batch)
+      for _ in range(10):
+        self.assertAllEqual(sess.run(batch).source_id, [1] * p.batch_size)
+
+
 if __name__ == '__main__':
   tf.test.main()
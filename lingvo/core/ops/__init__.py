@@ -41,6 +41,10 @@ random_permutation_sequence = gen_x_ops.random_permutation_sequence
 
 best_step = gen_x_ops.best_step
 
+save_input_state = gen_x_ops.save_input_state
+input_pipeline_stats = gen_x_ops.input_pipeline_stats
+set_input_source_weights = gen_x_ops.set_input_source_weights
+
 beam_search_step = gen_x_ops.beam_search_step
 top_k_terminated_hyps = gen_x_ops.top_k_terminated_hyps
 unpack_hyp = gen_x_ops.unpack_hyp
@@ -17,23 +17,36 @@ limitations under the License.
 
 #include <algorithm>
 
+#include "lingvo/core/ops/yielder_state.pb.h"
+
 namespace tensorflow {
 namespace lingvo {
 
 ChainRecordYielder::ChainRecordYielder(
-    const std::vector<BasicRecordYielder::Options>& yielder_options)
-    : current_yielder_idx_(0),
+    const std::vector<BasicRecordYielder::Options>& yielder_options,
+    int first_yielder_idx)
+    : current_yielder_idx_(first_yielder_idx),
       current_yielder_(nullptr),
+      next_started_(this, &ChainRecordYielder::NextStarted),
       yielder_options_(yielder_options) {
   if (yielder_options.empty()) {
     LOG(FATAL) << "There should be at least one set of options provided.";
   }
-  current_yielder_ = BasicRecordYielder::New(yielder_options_.front());
+  IoExecutor* executor = yielder_options_[0].io_executor;
+  if (executor == nullptr) executor = IoExecutor::Get();
+  close_queue_ = executor->NewQueue();
+  // The next epoch of a child would never be yielded, so it is not read.
+  for (auto& opts : yielder_options_) opts.single_epoch = true;
+  current_yielder_ =
+      BasicRecordYielder::New(yielder_options_.at(current_yielder_idx_));
+  // A saved state is only resumed once.
+  for (auto& opts : yielder_options_) opts.initial_state.reset();
 }
 
 ChainRecordYielder* ChainRecordYielder::New(
-    const std::vector<BasicRecordYielder::Options>& yielder_options) {
-  return new ChainRecordYielder(yielder_options);
+    const std::vector<BasicRecordYielder::Options>& yielder_options,
+    int first_yielder_idx) {
+  return new ChainRecordYielder(yielder_options, first_yielder_idx);
 }
 
 ChainRecordYielder::~ChainRecordYielder() {}
@@ -44,34 +57,95 @@ void ChainRecordYielder::Close() {
     if (current_yielder_) {
       current_yielder_->Close();
     }
+    if (next_yielder_) {
+      next_yielder_->Close();
+    }
   }
+  // Waits for the child yielders being closed.
+  close_queue_.reset();
   LOG(INFO) << this << "Chain record yielder exit";
   delete this;
 }
 
-Status ChainRecordYielder::Yield(Record* record) {
-  MutexLock l(&mu_);
-
-  if (current_yielder_->current_epoch() > 1) {
-    int new_idx = (current_yielder_idx_ + 1) % yielder_options_.size();
-    if (current_yielder_) {
-      current_yielder_->Close();
+void ChainRecordYielder::MaybeSwitchYielder() {
+  while (true) {
+    const bool yielded = current_yielder_->current_epoch() > 1;
+    if (next_yielder_ == nullptr && !starting_next_ &&
+        (yielded || current_yielder_->complete_epoch() >= 1)) {
+      // The current yielder is drained from now on, and the next one globs
+      // its files and fills its buffer meanwhile.
+      StartNextYielder();
+      // Another consumer may have switched meanwhile.
+      continue;
     }
-    current_yielder_idx_ = new_idx;
-    current_yielder_ = BasicRecordYielder::New(yielder_options_.at(new_idx));
+    if (!yielded) return;
+    if (next_yielder_ == nullptr) {
+      // Another consumer is constructing it.
+      mu_.Await(next_started_);
+      continue;
+    }
+    BasicRecordYielder* done = current_yielder_;
+    close_queue_->ScheduleBlocking([done]() { done->Close(); });
+    current_yielder_idx_ = (current_yielder_idx_ + 1) % yielder_options_.size();
+    current_yielder_ = next_yielder_;
+    next_yielder_ = nullptr;
+    return;
   }
+}
+
+void ChainRecordYielder::StartNextYielder() {
+  const int next_idx = (current_yielder_idx_ + 1) % yielder_options_.size();
+  starting_next_ = true;
+  mu_.Unlock();
+  LOG(INFO) << this << " Starts child yielder " << next_idx;
+  BasicRecordYielder* next =
+      BasicRecordYielder::New(yielder_options_.at(next_idx));
+  mu_.Lock();
+  starting_next_ = false;
+  next_yielder_ = next;
+}
+
+Status ChainRecordYielder::Yield(Record* record) {
+  MutexLock l(&mu_);
   while (true) {
+    // The current yielder may have moved on to its next epoch since the last
+    // try.
+    MaybeSwitchYielder();
     // Retry indefinitely until we get an Ok status from the specific yielder.
     // This will stall the training if there is any unrecoverable error with
     // the child yielder.
     Status s = current_yielder_->Yield(record);
     if (!s.ok()) {
-      LOG(WARNING) << s;
+      // OutOfRange once the current yielder has yielded its epoch.
+      if (!errors::IsOutOfRange(s)) LOG(WARNING) << s;
       continue;
     }
     return s;
   }
 }
 
+Status ChainRecordYielder::YieldBatch(int n, std::vector<Record>* out) {
+  MutexLock l(&mu_);
+  // A batch of a BasicRecordYielder does not span two epochs, so it is all
+  // from the first epoch of the current yielder, which is checked again
+  // before every try.
+  const size_t begin = out->size();
+  while (out->size() == begin) {
+    MaybeSwitchYielder();
+    Status s = current_yielder_->YieldBatch(n, out);
+    if (!s.ok() && !errors::IsOutOfRange(s)) LOG(WARNING) << s;
+  }
+  return Status::OK();
+}
+
+Status ChainRecordYielder::GetState(int64 max_buffered_records,
+                                    YielderState* state) {
+  state->Clear();
+  MutexLock l(&mu_);
+  state->set_current_child(current_yielder_idx_);
+  return current_yielder_->GetState(max_buffered_records,
+                                    state->add_children());
+}
+
 }  // namespace lingvo
 }  // namespace tensorflow
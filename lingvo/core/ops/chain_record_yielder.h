@@ -15,6 +15,9 @@ limitations under the License.
 #ifndef LINGVO_CORE_OPS_CHAIN_RECORD_YIELDER_H_
 #define LINGVO_CORE_OPS_CHAIN_RECORD_YIELDER_H_
 
+#include <memory>
+
+#include "lingvo/core/ops/io_executor.h"
 #include "lingvo/core/ops/record_yielder.h"
 
 namespace tensorflow {
@@ -43,28 +46,64 @@ namespace lingvo {
 //   }
 //   yielder->Close();
 //
+// Each child yielder reads a single epoch. The child yielder of the next
+// options is started as soon as the current one has read all records of its
+// epoch, so that its buffer is filled while the current one is drained.
+//
 // ChainRecordYielder can be accessed by multiple threads concurrently.
 class ChainRecordYielder : public RecordYielder {
  public:
   ~ChainRecordYielder() override;
   void Close() override;
   Status Yield(Record* record) override;
+  Status YieldBatch(int n, std::vector<Record>* out) override;
+
+  // Saves the index and the state of the current child yielder.
+  Status GetState(int64 max_buffered_records, YielderState* state) override;
 
   // Creates new ChainRecordYielder that will be creating child yielders using
   // options provided. Caller is responsible for closing the ChainRecordYielder
   // returned by this function. Caller should not delete the yielder as it will
   // be handled internally.
+  //
+  // The chain starts with the child yielder of 'first_yielder_idx', e.g., to
+  // resume from a saved state.
   static ChainRecordYielder* New(
-      const std::vector<BasicRecordYielder::Options>& yielder_options);
+      const std::vector<BasicRecordYielder::Options>& yielder_options,
+      int first_yielder_idx = 0);
 
  protected:
   ChainRecordYielder(
-      const std::vector<BasicRecordYielder::Options>& yielder_options);
+      const std::vector<BasicRecordYielder::Options>& yielder_options,
+      int first_yielder_idx);
 
  private:
+  // Moves on to the next child yielder once the current one has yielded
+  // its epoch, and starts the one after it once the current one has read
+  // its epoch.
+  void MaybeSwitchYielder() EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Constructs the child yielder after the current one into next_yielder_.
+  // Releases mu_ meanwhile, so that other consumers are not held up.
+  void StartNextYielder() EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
   mutable Mutex mu_;
   int current_yielder_idx_ GUARDED_BY(mu_);
   BasicRecordYielder* current_yielder_ GUARDED_BY(mu_);
+  // The child yielder which comes after the current one, if started, and
+  // whether a consumer is constructing it.
+  BasicRecordYielder* next_yielder_ GUARDED_BY(mu_) = nullptr;
+  bool starting_next_ GUARDED_BY(mu_) = false;
+
+  Condition next_started_;
+  bool NextStarted() const SHARED_LOCKS_REQUIRED(mu_) {
+    return !starting_next_;
+  }
+
+  // Closes the child yielders switched from, which may take a while, as
+  // blocking tasks on the IoExecutor of the children, without holding up the
+  // consumers.
+  std::unique_ptr<IoExecutor::Queue> close_queue_;
 
   std::vector<BasicRecordYielder::Options> yielder_options_;
 };
@@ -16,6 +16,7 @@ limitations under the License.
 #include "lingvo/core/ops/chain_record_yielder.h"
 
 #include <error.h>
+#include <algorithm>
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
@@ -86,6 +87,45 @@ TEST(RecordYielderTest, ChainBasicTest) {
   yielder->Close();
 }
 
+TEST(RecordYielderTest, ChainPrefetch) {
+  const int N = 4;
+  const int M = 500;
+  std::vector<BasicRecordYielder::Options> yielder_options(3);
+  for (int i = 0; i < yielder_options.size(); ++i) {
+    const string name = strings::StrCat("chain_prefetch", i);
+    GeneratePlainTextTestData(name, N, M);
+    BasicRecordYielder::Options& opts = yielder_options[i];
+    opts.file_pattern =
+        strings::StrCat("text:", io::JoinPath("/tmp", name + ".*"));
+    opts.seed = 301;
+    opts.bufsize = 500;
+    opts.parallelism = 2;
+  }
+  ChainRecordYielder* yielder = ChainRecordYielder::New(yielder_options);
+
+  // Each source is yielded entirely, although the next one is started
+  // while it is drained, and the closed ones are started again.
+  std::vector<Record> batch;
+  for (int i = 0; i < 2 * yielder_options.size(); ++i) {
+    std::vector<string> vals;
+    while (vals.size() < N * M) {
+      batch.clear();
+      TF_CHECK_OK(yielder->YieldBatch(
+          std::min<int>(64, N * M - vals.size()), &batch));
+      for (const Record& record : batch) {
+        vals.emplace_back(string(record.value));
+      }
+    }
+    const string name =
+        strings::StrCat("chain_prefetch", i % yielder_options.size());
+    ASSERT_NEAR(ComputeInputSourceDistribution(vals)[name], 1.0, 0.001);
+    std::sort(vals.begin(), vals.end());
+    EXPECT_TRUE(std::unique(vals.begin(), vals.end()) == vals.end());
+  }
+
+  yielder->Close();
+}
+
 TEST(RecordYielderDeathTest, ChainNoYielders) {
   ASSERT_DEATH(ChainRecordYielder::New({}),
                "There should be at least one set of options provided");
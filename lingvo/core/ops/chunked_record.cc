@@ -0,0 +1,381 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/chunked_record.h"
+
+#include <cstring>
+
+#include "tensorflow/core/lib/core/coding.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/hash/crc32c.h"
+#include "tensorflow/core/lib/io/compression.h"
+#include "tensorflow/core/lib/io/random_inputstream.h"
+#include "tensorflow/core/lib/io/zlib_compression_options.h"
+#include "tensorflow/core/lib/io/zlib_inputstream.h"
+#include "tensorflow/core/lib/io/zlib_outputbuffer.h"
+#include "tensorflow/core/lib/strings/stringprintf.h"
+#include "tensorflow/core/platform/env.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+namespace {
+
+constexpr uint64 kMagic = 0x314b4e4843564c4cULL;  // "LLVCHNK1"
+constexpr size_t kIndexEntrySize = 4 * sizeof(uint64) + sizeof(uint32);
+constexpr size_t kFooterSize = 3 * sizeof(uint64) + 2 * sizeof(uint32);
+
+enum Compression : uint32 { kNoCompression = 0, kZlibCompression = 1 };
+
+// Number of chunks of a file being decompressed ahead of the reader.
+const int kMaxChunksInFlight = 4;
+
+// A WritableFile appending to a string.
+class StringWritableFile : public WritableFile {
+ public:
+  explicit StringWritableFile(string* dst) : dst_(dst) {}
+
+  Status Append(StringPiece data) override {
+    dst_->append(data.data(), data.size());
+    return Status::OK();
+  }
+  Status Close() override { return Status::OK(); }
+  Status Flush() override { return Status::OK(); }
+  Status Sync() override { return Status::OK(); }
+
+ private:
+  string* const dst_;
+};
+
+// A RandomAccessFile reading from a string.
+class StringPieceFile : public RandomAccessFile {
+ public:
+  explicit StringPieceFile(StringPiece data) : data_(data) {}
+
+  Status Read(uint64 offset, size_t n, StringPiece* result,
+              char* scratch) const override {
+    if (offset >= data_.size()) {
+      *result = StringPiece();
+    } else {
+      *result = data_.substr(offset, n);
+    }
+    if (result->size() < n) {
+      return errors::OutOfRange("Read past the end of the chunk");
+    }
+    return Status::OK();
+  }
+
+ private:
+  const StringPiece data_;
+};
+
+}  // namespace
+
+ChunkedRecordWriter::ChunkedRecordWriter(WritableFile* file,
+                                         const Options& opts)
+    : file_(file), opts_(opts) {
+  CHECK(opts_.compression_type == io::compression::kNone ||
+        opts_.compression_type == io::compression::kZlib)
+      << "Unsupported compression: " << opts_.compression_type;
+  compressed_ = opts_.compression_type == io::compression::kZlib;
+}
+
+ChunkedRecordWriter::~ChunkedRecordWriter() {
+  if (!closed_) {
+    Status s = Close();
+    if (!s.ok()) LOG(ERROR) << "Could not finish writing file: " << s;
+  }
+}
+
+Status ChunkedRecordWriter::WriteRecord(StringPiece record) {
+  if (closed_) return errors::FailedPrecondition("Writer is closed.");
+  core::PutVarint64(&chunk_, record.size());
+  chunk_.append(record.data(), record.size());
+  ++num_records_;
+  if (chunk_.size() >= opts_.chunk_size) return FlushChunk();
+  return Status::OK();
+}
+
+Status ChunkedRecordWriter::FlushChunk() {
+  if (num_records_ == 0) return Status::OK();
+  ChunkInfo info;
+  info.offset = offset_;
+  info.raw_size = chunk_.size();
+  info.num_records = num_records_;
+  string stored;
+  if (compressed_) {
+    StringWritableFile dst(&stored);
+    const io::ZlibCompressionOptions zopts =
+        io::ZlibCompressionOptions::DEFAULT();
+    io::ZlibOutputBuffer zlib(&dst, zopts.input_buffer_size,
+                              zopts.output_buffer_size, zopts);
+    TF_RETURN_IF_ERROR(zlib.Init());
+    TF_RETURN_IF_ERROR(zlib.Append(chunk_));
+    TF_RETURN_IF_ERROR(zlib.Close());
+  } else {
+    stored.swap(chunk_);
+  }
+  info.size = stored.size();
+  info.masked_crc = crc32c::Mask(crc32c::Value(stored.data(), stored.size()));
+  TF_RETURN_IF_ERROR(file_->Append(stored));
+  offset_ += stored.size();
+  chunks_.push_back(info);
+  chunk_.clear();
+  num_records_ = 0;
+  return Status::OK();
+}
+
+Status ChunkedRecordWriter::Close() {
+  if (closed_) return Status::OK();
+  TF_RETURN_IF_ERROR(FlushChunk());
+  closed_ = true;
+  string index;
+  for (const ChunkInfo& info : chunks_) {
+    core::PutFixed64(&index, info.offset);
+    core::PutFixed64(&index, info.size);
+    core::PutFixed64(&index, info.raw_size);
+    core::PutFixed64(&index, info.num_records);
+    core::PutFixed32(&index, info.masked_crc);
+  }
+  string footer;
+  core::PutFixed64(&footer, offset_);
+  core::PutFixed64(&footer, chunks_.size());
+  core::PutFixed32(&footer, compressed_ ? kZlibCompression : kNoCompression);
+  core::PutFixed32(&footer,
+                   crc32c::Mask(crc32c::Value(index.data(), index.size())));
+  core::PutFixed64(&footer, kMagic);
+  TF_RETURN_IF_ERROR(file_->Append(index));
+  return file_->Append(footer);
+}
+
+Status ChunkedRecordReader::Open(const string& filename, RandomAccessFile* file,
+                                 std::unique_ptr<ChunkedRecordReader>* reader) {
+  std::unique_ptr<ChunkedRecordReader> r(new ChunkedRecordReader);
+  r->filename_ = filename;
+  r->file_.reset(file);
+  uint64 file_size = 0;
+  TF_RETURN_IF_ERROR(Env::Default()->GetFileSize(filename, &file_size));
+  if (file_size < kFooterSize) {
+    return errors::DataLoss("Truncated chunked record file: ", filename);
+  }
+
+  char footer[kFooterSize];
+  StringPiece data;
+  TF_RETURN_IF_ERROR(
+      r->file_->Read(file_size - kFooterSize, kFooterSize, &data, footer));
+  const char* p = data.data();
+  const uint64 index_offset = core::DecodeFixed64(p);
+  const uint64 num_chunks = core::DecodeFixed64(p + 8);
+  const uint32 compression = core::DecodeFixed32(p + 16);
+  const uint32 index_crc = crc32c::Unmask(core::DecodeFixed32(p + 20));
+  if (core::DecodeFixed64(p + 24) != kMagic) {
+    return errors::DataLoss("Not a chunked record file: ", filename);
+  }
+  if (compression != kNoCompression && compression != kZlibCompression) {
+    return errors::DataLoss("Unknown compression ", compression, " in ",
+                            filename);
+  }
+  r->compressed_ = compression == kZlibCompression;
+  // Bounded before adding and multiplying, so that a corrupt footer can not
+  // overflow.
+  const uint64 max_index_bytes = file_size - kFooterSize;
+  if (index_offset > max_index_bytes ||
+      num_chunks > max_index_bytes / kIndexEntrySize ||
+      index_offset + num_chunks * kIndexEntrySize != max_index_bytes) {
+    return errors::DataLoss("Corrupted chunk index in ", filename);
+  }
+
+  string index(num_chunks * kIndexEntrySize, '\0');
+  if (!index.empty()) {
+    TF_RETURN_IF_ERROR(
+        r->file_->Read(index_offset, index.size(), &data, &index[0]));
+    if (crc32c::Value(data.data(), data.size()) != index_crc) {
+      return errors::DataLoss("Corrupted chunk index in ", filename);
+    }
+    p = data.data();
+  }
+  r->chunks_.resize(num_chunks);
+  for (ChunkInfo& info : r->chunks_) {
+    info.offset = core::DecodeFixed64(p);
+    info.size = core::DecodeFixed64(p + 8);
+    info.raw_size = core::DecodeFixed64(p + 16);
+    info.num_records = core::DecodeFixed64(p + 24);
+    info.masked_crc = core::DecodeFixed32(p + 32);
+    if (info.size > index_offset || info.offset > index_offset - info.size) {
+      return errors::DataLoss("Corrupted chunk index in ", filename);
+    }
+    p += kIndexEntrySize;
+  }
+  *reader = std::move(r);
+  return Status::OK();
+}
+
+Status ChunkedRecordReader::ReadChunk(int i, tstring* stored) const {
+  const ChunkInfo& info = chunks_[i];
+  stored->resize(info.size);
+  StringPiece data;
+  TF_RETURN_IF_ERROR(file_->Read(info.offset, info.size, &data, &(*stored)[0]));
+  if (crc32c::Unmask(info.masked_crc) !=
+      crc32c::Value(data.data(), data.size())) {
+    return errors::DataLoss("Corrupted chunk ", i, " in ", filename_);
+  }
+  if (data.data() != stored->data()) {
+    memmove(&(*stored)[0], data.data(), data.size());
+  }
+  return Status::OK();
+}
+
+Status ChunkedRecordReader::DecompressChunk(int i, tstring* chunk) const {
+  if (!compressed_) return Status::OK();
+  const ChunkInfo& info = chunks_[i];
+  StringPieceFile file(*chunk);
+  io::RandomAccessInputStream input(&file);
+  const io::ZlibCompressionOptions zopts =
+      io::ZlibCompressionOptions::DEFAULT();
+  io::ZlibInputStream zlib(&input, zopts.input_buffer_size,
+                           zopts.output_buffer_size, zopts);
+  tstring raw;
+  Status s = zlib.ReadNBytes(info.raw_size, &raw);
+  if (!s.ok()) {
+    return errors::DataLoss("Could not decompress chunk ", i, " in ",
+                            filename_, ": ", s.error_message());
+  }
+  *chunk = std::move(raw);
+  return Status::OK();
+}
+
+Status ChunkedRecordReader::ParseChunk(
+    int i, StringPiece raw, std::vector<StringPiece>* records) const {
+  const ChunkInfo& info = chunks_[i];
+  records->clear();
+  records->reserve(info.num_records);
+  while (!raw.empty()) {
+    uint64 len = 0;
+    if (!core::GetVarint64(&raw, &len) || len > raw.size()) {
+      return errors::DataLoss("Corrupted record in chunk ", i, " in ",
+                              filename_);
+    }
+    records->push_back(raw.substr(0, len));
+    raw.remove_prefix(len);
+  }
+  if (records->size() != info.num_records) {
+    return errors::DataLoss("Chunk ", i, " in ", filename_, " has ",
+                            records->size(), " records, expected ",
+                            info.num_records);
+  }
+  return Status::OK();
+}
+
+ChunkedRecordIterator::ChunkedRecordIterator(const FileSplit& split,
+                                             RandomAccessFile* file,
+                                             IoExecutor::Queue* queue)
+    : filename_(split.filename), queue_(queue) {
+  Status s = ChunkedRecordReader::Open(filename_, file, &reader_);
+  if (!s.ok()) {
+    LOG(WARNING) << "Skipping " << filename_ << ": " << s;
+    reader_.reset();
+    return;
+  }
+  // Chunks are sorted by offset.
+  const int n = reader_->num_chunks();
+  while (next_chunk_ < n && reader_->chunk(next_chunk_).offset < split.offset) {
+    ++next_chunk_;
+  }
+  end_chunk_ = next_chunk_;
+  while (end_chunk_ < n && reader_->chunk(end_chunk_).offset < split.end()) {
+    ++end_chunk_;
+  }
+}
+
+ChunkedRecordIterator::~ChunkedRecordIterator() { ClearPending(); }
+
+void ChunkedRecordIterator::Decompress(const ChunkedRecordReader* reader,
+                                       PendingChunk* pending) {
+  if (pending->claimed.exchange(true)) return;
+  pending->status =
+      reader->DecompressChunk(pending->index, pending->data.get());
+  pending->done.Notify();
+}
+
+void ChunkedRecordIterator::ScheduleChunks() {
+  while (pending_.size() < kMaxChunksInFlight &&
+         next_chunk_ < end_chunk_) {
+    auto pending = std::make_shared<PendingChunk>();
+    pending->index = next_chunk_++;
+    pending->data = std::make_shared<tstring>();
+    // Reads happen in file order on this thread, which plays well with
+    // readahead. Only the decompression is done by the tasks.
+    pending->status = reader_->ReadChunk(pending->index, pending->data.get());
+    if (!pending->status.ok()) {
+      pending->claimed = true;
+      pending->done.Notify();
+    } else if (queue_ != nullptr) {
+      // The reader outlives the task unless the chunk is claimed first.
+      const ChunkedRecordReader* reader = reader_.get();
+      queue_->ScheduleBlocking(
+          [pending, reader]() { Decompress(reader, pending.get()); });
+    }
+    pending_.push_back(std::move(pending));
+  }
+}
+
+void ChunkedRecordIterator::ClearPending() {
+  for (const auto& pending : pending_) {
+    if (pending->claimed.exchange(true)) pending->done.WaitForNotification();
+  }
+  pending_.clear();
+}
+
+bool ChunkedRecordIterator::NextChunk() {
+  records_.clear();
+  next_record_ = 0;
+  chunk_.reset();
+  ScheduleChunks();
+  if (pending_.empty()) return false;
+  std::shared_ptr<PendingChunk> pending = std::move(pending_.front());
+  pending_.pop_front();
+  ScheduleChunks();
+  Decompress(reader_.get(), pending.get());
+  pending->done.WaitForNotification();
+  Status s = pending->status;
+  if (s.ok()) {
+    s = reader_->ParseChunk(pending->index, *pending->data, &records_);
+  }
+  if (!s.ok()) {
+    LOG(WARNING) << s;
+    records_.clear();
+    // Stops reading this file.
+    ClearPending();
+    next_chunk_ = end_chunk_;
+    return false;
+  }
+  chunk_ = std::move(pending->data);
+  return true;
+}
+
+bool ChunkedRecordIterator::Next(string* key, Rope* value) {
+  if (!reader_) return false;
+  while (next_record_ >= records_.size()) {
+    if (!NextChunk()) return false;
+  }
+  *key = strings::Printf("%08lld", static_cast<long long>(num_++));
+  // The record accounts for its whole chunk, so that it is copied once it is
+  // buffered for long (see Rope::RetainedBytes()).
+  *value = Rope::View(records_[next_record_++], chunk_, chunk_->size());
+  return true;
+}
+
+}  // namespace lingvo
+}  // namespace tensorflow
@@ -0,0 +1,201 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef LINGVO_CORE_OPS_CHUNKED_RECORD_H_
+#define LINGVO_CORE_OPS_CHUNKED_RECORD_H_
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lingvo/core/ops/io_executor.h"
+#include "lingvo/core/ops/mutex.h"
+#include "lingvo/core/ops/record_yielder.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/stringpiece.h"
+#include "tensorflow/core/platform/file_system.h"
+#include "tensorflow/core/platform/macros.h"
+#include "tensorflow/core/platform/tstring.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+// A chunked record file stores records in chunks which are compressed
+// independently of each other, so that they can be decompressed in parallel.
+// The file layout is:
+//
+//   chunk[0] ... chunk[n - 1]
+//   index: n entries of
+//     uint64  offset of the chunk in the file
+//     uint64  size of the chunk in the file
+//     uint64  size of the uncompressed chunk
+//     uint64  number of records in the chunk
+//     uint32  masked crc32c of the chunk as stored in the file
+//   footer:
+//     uint64  offset of the index
+//     uint64  number of chunks
+//     uint32  compression (0: none, 1: zlib)
+//     uint32  masked crc32c of the index
+//     uint64  magic number
+//
+// An uncompressed chunk is a sequence of records, each stored as its varint64
+// encoded length followed by its bytes. All integers are little endian.
+struct ChunkInfo {
+  uint64 offset = 0;
+  uint64 size = 0;
+  uint64 raw_size = 0;
+  uint64 num_records = 0;
+  uint32 masked_crc = 0;
+};
+
+// Writes records to a chunked record file.
+class ChunkedRecordWriter {
+ public:
+  struct Options {
+    // io::compression::kNone or io::compression::kZlib.
+    string compression_type = "ZLIB";
+
+    // A chunk is compressed and written out once its uncompressed size
+    // reaches this many bytes.
+    uint64 chunk_size = 1 << 20;
+  };
+
+  // Does not take the ownership of 'file', which must outlive this writer.
+  ChunkedRecordWriter(WritableFile* file, const Options& opts);
+  ~ChunkedRecordWriter();
+
+  Status WriteRecord(StringPiece record);
+
+  // Writes the pending chunk, the index and the footer. Does not close the
+  // underlying file.
+  Status Close();
+
+ private:
+  Status FlushChunk();
+
+  WritableFile* const file_;
+  const Options opts_;
+  bool compressed_;
+  bool closed_ = false;
+  uint64 offset_ = 0;
+  string chunk_;
+  uint64 num_records_ = 0;
+  std::vector<ChunkInfo> chunks_;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(ChunkedRecordWriter);
+};
+
+// Reads the index and the chunks of a chunked record file. Thread-safe.
+class ChunkedRecordReader {
+ public:
+  // Opens 'filename' and reads its index. Takes ownership of 'file'.
+  static Status Open(const string& filename, RandomAccessFile* file,
+                     std::unique_ptr<ChunkedRecordReader>* reader);
+
+  const string& filename() const { return filename_; }
+  int num_chunks() const { return chunks_.size(); }
+  const ChunkInfo& chunk(int i) const { return chunks_[i]; }
+
+  // Reads the i-th chunk as stored in the file into 'stored' and verifies its
+  // checksum.
+  Status ReadChunk(int i, tstring* stored) const;
+
+  // Decompresses in place the i-th chunk read by ReadChunk.
+  Status DecompressChunk(int i, tstring* chunk) const;
+
+  // Splits the uncompressed i-th chunk 'raw' into 'records', which point
+  // into 'raw'.
+  Status ParseChunk(int i, StringPiece raw,
+                    std::vector<StringPiece>* records) const;
+
+ private:
+  ChunkedRecordReader() {}
+
+  string filename_;
+  std::unique_ptr<RandomAccessFile> file_;
+  bool compressed_ = false;
+  std::vector<ChunkInfo> chunks_;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(ChunkedRecordReader);
+};
+
+// Iterates through the records of a chunked record file split. A split
+// contains the chunks starting within its byte range. Chunks are read in
+// order on the calling thread and decompressed ahead of time as blocking
+// tasks of 'queue', so that a few chunks per file are decompressed
+// concurrently. A chunk no task has started decompressing when it is needed
+// is decompressed on the calling thread, which thus never waits for a thread
+// of the IoExecutor. Records returned by Next() point into the decompressed
+// chunk.
+class ChunkedRecordIterator : public RecordIterator {
+ public:
+  // Takes ownership of 'file', which holds the content of 'split.filename'.
+  // If 'queue' is null, chunks are decompressed on the calling thread when
+  // they are needed. Otherwise, it must outlive the iterator.
+  ChunkedRecordIterator(const FileSplit& split, RandomAccessFile* file,
+                        IoExecutor::Queue* queue = nullptr);
+  ~ChunkedRecordIterator() override;
+
+  bool Next(string* key, Rope* value) override;
+
+ private:
+  // Shared with the decompression task, which may start after the chunk is
+  // no longer needed.
+  struct PendingChunk {
+    int index;
+    std::shared_ptr<tstring> data;
+    Status status;
+    // Set by whoever decompresses the chunk first: the task, or the iterator
+    // if the task has not started when the chunk is needed.
+    std::atomic<bool> claimed{false};
+    Notification done;
+  };
+
+  // Decompresses 'pending' unless it is claimed already.
+  static void Decompress(const ChunkedRecordReader* reader,
+                         PendingChunk* pending);
+
+  // Schedules the decompression of more chunks, up to kMaxChunksInFlight.
+  void ScheduleChunks();
+
+  // Drops the pending chunks. Waits for those being decompressed.
+  void ClearPending();
+
+  // Makes the next decompressed chunk current. Returns false at the end of
+  // the file or on error.
+  bool NextChunk();
+
+  const string filename_;
+  IoExecutor::Queue* const queue_;
+  std::unique_ptr<ChunkedRecordReader> reader_;
+  int next_chunk_ = 0;
+  int end_chunk_ = 0;
+  std::deque<std::shared_ptr<PendingChunk>> pending_;
+
+  // The decompressed chunk records are currently returned from.
+  std::shared_ptr<tstring> chunk_;
+  std::vector<StringPiece> records_;
+  size_t next_record_ = 0;
+  int64 num_ = 0;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(ChunkedRecordIterator);
+};
+
+}  // namespace lingvo
+}  // namespace tensorflow
+
+#endif  // LINGVO_CORE_OPS_CHUNKED_RECORD_H_
@@ -0,0 +1,194 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/chunked_record.h"
+
+#include <gtest/gtest.h>
+#include "lingvo/core/ops/io_executor.h"
+#include "lingvo/core/ops/record_yielder.h"
+#include "tensorflow/core/lib/core/coding.h"
+#include "tensorflow/core/lib/io/compression.h"
+#include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+#include "tensorflow/core/lib/strings/stringprintf.h"
+#include "tensorflow/core/platform/env.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+void GenerateChunkedTestData(const string& prefix, int n, int m,
+                             const string& compression_type) {
+  for (int i = 0; i < n; ++i) {
+    std::unique_ptr<WritableFile> file;
+    TF_CHECK_OK(Env::Default()->NewWritableFile(
+        io::JoinPath("/tmp", strings::StrCat(prefix, ".", i)), &file));
+    ChunkedRecordWriter::Options opts;
+    opts.compression_type = compression_type;
+    opts.chunk_size = 100;  // ~9 records per chunk.
+    ChunkedRecordWriter writer(file.get(), opts);
+    for (int j = 0; j < m; ++j) {
+      TF_CHECK_OK(writer.WriteRecord(strings::Printf("%010d", m * i + j)));
+    }
+    TF_CHECK_OK(writer.Close());
+    TF_CHECK_OK(file->Close());
+  }
+}
+
+class ChunkedRecordTest : public ::testing::TestWithParam<string> {};
+
+TEST_P(ChunkedRecordTest, Iterator) {
+  const int M = 1000;
+  GenerateChunkedTestData("chunked_iter", 1, M, GetParam());
+  std::unique_ptr<RecordIterator> iter(
+      RecordIterator::New("chunked", "/tmp/chunked_iter.0"));
+  string key;
+  Rope value;
+  for (int i = 0; i < M; ++i) {
+    ASSERT_TRUE(iter->Next(&key, &value));
+    EXPECT_EQ(strings::Printf("%08d", i), key);
+    EXPECT_EQ(strings::Printf("%010d", i), string(value));
+  }
+  EXPECT_FALSE(iter->Next(&key, &value));
+}
+
+TEST_P(ChunkedRecordTest, IteratorOnQueue) {
+  const int M = 1000;
+  GenerateChunkedTestData("chunked_queue", 1, M, GetParam());
+  const string filename = "/tmp/chunked_queue.0";
+  IoExecutor executor(1, 2);
+  std::unique_ptr<IoExecutor::Queue> queue = executor.NewQueue();
+  // Chunks are decompressed by the tasks of 'queue' or, when the tasks are
+  // late, by the iterator. Dropping the iterator in the middle of the file
+  // drops the chunks in flight.
+  for (int num_records : {M, M / 2}) {
+    std::unique_ptr<RandomAccessFile> file;
+    TF_CHECK_OK(Env::Default()->NewRandomAccessFile(filename, &file));
+    ChunkedRecordIterator iter(FileSplit(filename), file.release(),
+                               queue.get());
+    string key;
+    Rope value;
+    for (int i = 0; i < num_records; ++i) {
+      ASSERT_TRUE(iter.Next(&key, &value));
+      EXPECT_EQ(strings::Printf("%010d", i), string(value));
+    }
+    if (num_records == M) EXPECT_FALSE(iter.Next(&key, &value));
+  }
+}
+
+TEST_P(ChunkedRecordTest, Yielder) {
+  const int N = 4;
+  const int M = 500;
+  GenerateChunkedTestData("chunked_yielder", N, M, GetParam());
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "chunked:/tmp/chunked_yielder.*";
+  opts.seed = 301;
+  opts.bufsize = M;
+  opts.parallelism = 2;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  std::vector<string> vals;
+  Record record;
+  record.source_id = kDefaultSourceId;
+  for (int i = 0; i < N * M; ++i) {
+    TF_CHECK_OK(yielder->Yield(&record));
+    vals.emplace_back(string(record.value));
+  }
+  std::sort(vals.begin(), vals.end());
+  for (int i = 0; i < N * M; ++i) {
+    EXPECT_EQ(strings::Printf("%010d", i), vals[i]);
+  }
+  yielder->Close();
+}
+
+TEST_P(ChunkedRecordTest, Splits) {
+  const int M = 1000;
+  GenerateChunkedTestData("chunked_splits", 1, M, GetParam());
+  std::vector<FileSplit> splits;
+  TF_CHECK_OK(RecordIterator::ParsePatternIntoSplits(
+      "chunked", "/tmp/chunked_splits.*", 7, 1, &splits));
+  EXPECT_EQ(7, splits.size());
+  std::vector<string> vals;
+  for (const FileSplit& split : splits) {
+    std::unique_ptr<RecordIterator> iter(RecordIterator::New("chunked", split));
+    string key;
+    Rope value;
+    while (iter->Next(&key, &value)) vals.emplace_back(string(value));
+  }
+  ASSERT_EQ(M, vals.size());
+  for (int i = 0; i < M; ++i) {
+    EXPECT_EQ(strings::Printf("%010d", i), vals[i]);
+  }
+}
+
+INSTANTIATE_TEST_CASE_P(All, ChunkedRecordTest,
+                        ::testing::Values(io::compression::kNone,
+                                          io::compression::kZlib));
+
+TEST(ChunkedRecord, EmptyAndCorruptedFiles) {
+  // A file without records.
+  GenerateChunkedTestData("chunked_empty", 1, 0, io::compression::kZlib);
+  std::unique_ptr<RecordIterator> iter(
+      RecordIterator::New("chunked", "/tmp/chunked_empty.0"));
+  string key;
+  Rope value;
+  EXPECT_FALSE(iter->Next(&key, &value));
+
+  // A file which is not a chunked record file is skipped.
+  TF_CHECK_OK(WriteStringToFile(Env::Default(), "/tmp/chunked_bad",
+                                string(100, 'x')));
+  iter.reset(RecordIterator::New("chunked", "/tmp/chunked_bad"));
+  EXPECT_FALSE(iter->Next(&key, &value));
+
+  // A corrupted chunk ends the file.
+  GenerateChunkedTestData("chunked_corrupted", 1, 100, io::compression::kNone);
+  string content;
+  TF_CHECK_OK(ReadFileToString(Env::Default(), "/tmp/chunked_corrupted.0",
+                               &content));
+  content[150] ^= 1;  // In the second chunk.
+  TF_CHECK_OK(WriteStringToFile(Env::Default(), "/tmp/chunked_corrupted.0",
+                                content));
+  iter.reset(RecordIterator::New("chunked", "/tmp/chunked_corrupted.0"));
+  int n = 0;
+  while (iter->Next(&key, &value)) ++n;
+  EXPECT_GT(n, 0);
+  EXPECT_LT(n, 100);
+
+  // A number of chunks in the footer whose index size overflows to the
+  // right one is rejected.
+  GenerateChunkedTestData("chunked_overflow", 1, 100, io::compression::kNone);
+  TF_CHECK_OK(ReadFileToString(Env::Default(), "/tmp/chunked_overflow.0",
+                               &content));
+  char* num_chunks = &content[content.size() - 24];
+  core::EncodeFixed64(num_chunks,
+                      core::DecodeFixed64(num_chunks) + (uint64{1} << 61));
+  TF_CHECK_OK(WriteStringToFile(Env::Default(), "/tmp/chunked_overflow.0",
+                                content));
+  iter.reset(RecordIterator::New("chunked", "/tmp/chunked_overflow.0"));
+  EXPECT_FALSE(iter->Next(&key, &value));
+}
+
+TEST(ChunkedRecord, RecordsRetainTheirChunk) {
+  GenerateChunkedTestData("chunked_retain", 1, 100, io::compression::kZlib);
+  std::unique_ptr<RecordIterator> iter(
+      RecordIterator::New("chunked", "/tmp/chunked_retain.0"));
+  string key;
+  Rope value;
+  ASSERT_TRUE(iter->Next(&key, &value));
+  EXPECT_EQ(strings::Printf("%010d", 0), string(value));
+  // ~9 records with their lengths per chunk.
+  EXPECT_GT(value.RetainedBytes(), 5 * value.size());
+}
+
+}  // namespace lingvo
+}  // namespace tensorflow
@@ -15,45 +15,48 @@ limitations under the License.
 
 #include "lingvo/core/ops/input_common.h"
 
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+
+#include "lingvo/core/ops/mutex.h"
 #include "lingvo/core/ops/sequential_record_yielder.h"
 #include "lingvo/core/ops/chain_record_yielder.h"
 #include "lingvo/core/ops/weighted_mix_record_yielder.h"
+#include "tensorflow/core/lib/strings/strcat.h"
 
 namespace tensorflow {
 namespace lingvo {
 
-RecordYielder* ConstructYielder(const string& file_pattern,
-                                const std::vector<float>& input_source_weights,
-                                int64 file_random_seed, int64 file_buffer_size,
-                                int64 file_buffer_size_in_seconds,
-                                int64 file_parallelism,
-                                bool require_sequential_order,
-                                int64 repeat_count, bool use_chaining) {
+RecordYielder* ConstructYielder(const YielderConfig& config) {
+  const int64 file_random_seed = config.yielder.seed;
   std::vector<string> file_patterns;
-  if (input_source_weights.empty()) {
+  if (config.input_source_weights.empty()) {
     LOG(INFO) << "Input source weights are empty, fall back to legacy "
               << "behavior.";
-    file_patterns.push_back(file_pattern);
+    file_patterns.push_back(config.file_pattern);
   } else {
-    file_patterns = str_util::Split(file_pattern, ',');
-    CHECK_EQ(file_patterns.size(), input_source_weights.size())
+    file_patterns = str_util::Split(config.file_pattern, ',');
+    CHECK_EQ(file_patterns.size(), config.input_source_weights.size())
         << "There should be exactly one "
         << "input_source_weight per coma-separated value "
         << "in file_pattern.";
   }
-  if (require_sequential_order) {
+  if (config.require_sequential_order) {
     CHECK_EQ(file_patterns.size(), 1)
         << "require_sequential_order does not support record mixing or "
         << "chaining.";
-    return SequentialRecordYielder::New(file_patterns.front(), repeat_count);
+    return SequentialRecordYielder::New(
+        file_patterns.front(), config.repeat_count,
+        config.sequential_num_readers, config.yielder.bufsize);
   } else {
-    CHECK_EQ(repeat_count, -1) << "Repeat count must not be set unless "
-                                  "require_sequential_order is true.";
+    CHECK_EQ(config.repeat_count, -1) << "Repeat count must not be set unless "
+                                         "require_sequential_order is true.";
   }
   std::vector<BasicRecordYielder::Options> yielder_options;
 
   for (int i = 0; i < file_patterns.size(); ++i) {
-    BasicRecordYielder::Options yopts;
+    BasicRecordYielder::Options yopts = config.yielder;
     yopts.file_pattern = file_patterns[i];
     if (file_random_seed == 0) {
       yopts.seed = 0;  // Let the yielder pick a random seed.
@@ -65,31 +68,152 @@ RecordYielder* ConstructYielder(const string& file_pattern,
         ++yopts.seed;
       }
     }
-    yopts.bufsize = file_buffer_size;
-    yopts.bufsize_in_seconds = file_buffer_size_in_seconds;
-    yopts.parallelism = file_parallelism;
+    yopts.initial_state = nullptr;
     yopts.source_id = i;
     yielder_options.push_back(yopts);
   }
 
+  int first_yielder_idx = 0;
+  const YielderState* initial_state = config.initial_state;
+  if (initial_state != nullptr) {
+    auto child_state = [initial_state](int i) {
+      return std::make_shared<YielderState>(initial_state->children(i));
+    };
+    if (yielder_options.size() == 1) {
+      yielder_options[0].initial_state =
+          std::make_shared<YielderState>(*initial_state);
+    } else if (config.use_chaining) {
+      first_yielder_idx = initial_state->current_child();
+      if (first_yielder_idx < 0 ||
+          first_yielder_idx >= yielder_options.size()) {
+        LOG(WARNING) << "Ignores the state of child " << first_yielder_idx;
+        first_yielder_idx = 0;
+      } else if (initial_state->children_size() > 0) {
+        yielder_options[first_yielder_idx].initial_state = child_state(0);
+      }
+    } else {
+      for (int i = 0; i < yielder_options.size() &&
+                      i < initial_state->children_size();
+           ++i) {
+        yielder_options[i].initial_state = child_state(i);
+      }
+    }
+  }
+
   RecordYielder* yielder = nullptr;
   if (yielder_options.size() == 1) {
     yielder = BasicRecordYielder::New(yielder_options.front());
-  } else if (use_chaining) {
-    yielder = ChainRecordYielder::New(yielder_options);
+  } else if (config.use_chaining) {
+    yielder = ChainRecordYielder::New(yielder_options, first_yielder_idx);
   } else {
     std::vector<RecordYielder*> yielders;
     yielders.reserve(yielder_options.size());
     for (const auto& yopts : yielder_options) {
       yielders.push_back(BasicRecordYielder::New(yopts));
     }
-    yielder = WeightedMixRecordYielder::New(
-        file_random_seed,
-        yielders,
-        input_source_weights);
+    yielder = WeightedMixRecordYielder::New(file_random_seed, yielders,
+                                            config.input_source_weights,
+                                            config.input_source_max_deficit);
   }
   return yielder;
 }
 
+namespace {
+
+// The yielders whose states are saved, keyed by state file, and those whose
+// weights are set, keyed by name.
+struct YielderRegistry {
+  Mutex mu;
+  std::unordered_map<string, RecordYielder*> yielders GUARDED_BY(mu);
+  std::unordered_map<string, std::vector<WeightedMixRecordYielder*>> mixers
+      GUARDED_BY(mu);
+};
+
+YielderRegistry* GetYielderRegistry() {
+  static YielderRegistry* registry = new YielderRegistry;
+  return registry;
+}
+
+}  // namespace
+
+Status RegisterYielderForState(const string& state_file,
+                               RecordYielder* yielder) {
+  YielderRegistry* registry = GetYielderRegistry();
+  MutexLock l(&registry->mu);
+  if (!registry->yielders.emplace(state_file, yielder).second) {
+    return errors::AlreadyExists("Another input op saves its state to ",
+                                 state_file);
+  }
+  return Status::OK();
+}
+
+void UnregisterYielderForState(const string& state_file,
+                               RecordYielder* yielder) {
+  YielderRegistry* registry = GetYielderRegistry();
+  MutexLock l(&registry->mu);
+  auto iter = registry->yielders.find(state_file);
+  if (iter != registry->yielders.end() && iter->second == yielder) {
+    registry->yielders.erase(iter);
+  }
+}
+
+Status SaveYielderState(const string& state_file,
+                        int64 max_buffered_records) {
+  YielderState state;
+  {
+    // The yielder can not be closed while its state is being saved.
+    YielderRegistry* registry = GetYielderRegistry();
+    MutexLock l(&registry->mu);
+    auto iter = registry->yielders.find(state_file);
+    if (iter == registry->yielders.end()) {
+      return errors::NotFound("No input op resumes from ", state_file);
+    }
+    TF_RETURN_IF_ERROR(iter->second->GetState(max_buffered_records, &state));
+  }
+  // Replaces the state file atomically.
+  const string tmp_file = strings::StrCat(state_file, ".tmp");
+  TF_RETURN_IF_ERROR(WriteBinaryProto(Env::Default(), tmp_file, state));
+  return Env::Default()->RenameFile(tmp_file, state_file);
+}
+
+void RegisterYielderForWeights(const string& name,
+                               WeightedMixRecordYielder* yielder) {
+  YielderRegistry* registry = GetYielderRegistry();
+  MutexLock l(&registry->mu);
+  registry->mixers[name].push_back(yielder);
+}
+
+void UnregisterYielderForWeights(const string& name,
+                                 WeightedMixRecordYielder* yielder) {
+  YielderRegistry* registry = GetYielderRegistry();
+  MutexLock l(&registry->mu);
+  auto iter = registry->mixers.find(name);
+  if (iter == registry->mixers.end()) return;
+  std::vector<WeightedMixRecordYielder*>* mixers = &iter->second;
+  mixers->erase(std::remove(mixers->begin(), mixers->end(), yielder),
+                mixers->end());
+  if (mixers->empty()) registry->mixers.erase(iter);
+}
+
+Status SetYielderWeights(const string& name,
+                         const std::vector<float>& weights) {
+  // The yielders can not be closed while their weights are being set.
+  YielderRegistry* registry = GetYielderRegistry();
+  MutexLock l(&registry->mu);
+  auto iter = registry->mixers.find(name);
+  if (iter == registry->mixers.end()) {
+    return errors::NotFound("No input op has input_source_weights_name ",
+                            name);
+  }
+  // Either all yielders take the weights or none does.
+  for (WeightedMixRecordYielder* yielder : iter->second) {
+    TF_RETURN_IF_ERROR(yielder->CheckWeights(weights));
+  }
+  for (WeightedMixRecordYielder* yielder : iter->second) {
+    TF_CHECK_OK(yielder->SetWeights(weights));
+  }
+  return Status::OK();
+}
+
 }  // namespace lingvo
 }  // namespace tensorflow
@@ -18,22 +18,83 @@ limitations under the License.
 
 #include <limits>
 
+#include "lingvo/core/ops/input_stats.h"
+#include "lingvo/core/ops/memory_budget.h"
 #include "lingvo/core/ops/record_batcher.h"
 #include "lingvo/core/ops/record_yielder.h"
+#include "lingvo/core/ops/weighted_mix_record_yielder.h"
+#include "lingvo/core/ops/yielder_state.pb.h"
 #include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/platform/env.h"
 
 namespace tensorflow {
 namespace lingvo {
 
+// Configures ConstructYielder().
+struct YielderConfig {
+  // A single file pattern, or one per input source separated by commas.
+  string file_pattern;
+
+  // The weight of each input source. If empty, 'file_pattern' is a single
+  // input source.
+  std::vector<float> input_source_weights;
+
+  // The options of the BasicRecordYielder of each input source, except for
+  // its file_pattern, source_id and initial_state. A non-zero seed is offset
+  // by the index of the input source, and also seeds the mixing of the
+  // sources.
+  BasicRecordYielder::Options yielder;
+
+  // If true, the records of the single file pattern are yielded in order by
+  // a SequentialRecordYielder, 'repeat_count' times (forever if -1), and the
+  // other options are ignored. If 'sequential_num_readers' is greater than 1,
+  // as many threads read the next files ahead, buffering up to
+  // yielder.bufsize records in total.
+  bool require_sequential_order = false;
+  int64 repeat_count = -1;
+  int sequential_num_readers = 1;
+
+  // If true, the input sources are yielded one after the other rather than
+  // mixed with weights.
+  bool use_chaining = false;
+
+  // If positive, mixed input sources are not waited for while others have
+  // records. See WeightedMixRecordYielder::New().
+  int64 input_source_max_deficit = 0;
+
+  // If not null, the yielders resume from this state. Not owned.
+  const YielderState* initial_state = nullptr;
+};
+
 // Constructs single Yielder for a given file pattern or mixes multiple yielders
-// with weights.
-RecordYielder* ConstructYielder(const string& file_pattern,
-                                const std::vector<float>& input_source_weights,
-                                int64 file_random_seed, int64 file_buffer_size,
-                                int64 file_buffer_size_in_seconds,
-                                int64 file_parallelism,
-                                bool require_sequential_order,
-                                int64 repeat_count, bool use_chaining);
+// with weights, as configured by 'config'.
+RecordYielder* ConstructYielder(const YielderConfig& config);
+
+// Lets SaveYielderState() save the state of 'yielder' into 'state_file'
+// until it is unregistered. Fails if another yielder is registered for
+// 'state_file', since their states would overwrite each other.
+Status RegisterYielderForState(const string& state_file,
+                               RecordYielder* yielder);
+void UnregisterYielderForState(const string& state_file,
+                               RecordYielder* yielder);
+
+// Saves the state of the yielder registered for 'state_file' into it,
+// including at most 'max_buffered_records' records buffered by the yielder.
+// Records already yielded to the batcher but not yet in a batch are not
+// saved.
+Status SaveYielderState(const string& state_file, int64 max_buffered_records);
+
+// Lets SetYielderWeights() change the input source weights of 'yielder'
+// until it is unregistered. Several yielders may be registered for a name.
+void RegisterYielderForWeights(const string& name,
+                               WeightedMixRecordYielder* yielder);
+void UnregisterYielderForWeights(const string& name,
+                                 WeightedMixRecordYielder* yielder);
+
+// Sets the input source weights of the yielders registered for 'name'. If
+// they are invalid for any of them, returns the error and changes none.
+Status SetYielderWeights(const string& name,
+                         const std::vector<float>& weights);
 
 // Base class for op kernels that emit training examples.
 template <class RecordProcessorClass>
@@ -63,20 +124,100 @@ class InputOp : public OpKernel {
     GETATTR(bool, require_sequential_order);
     GETATTR(int64, repeat_count);
     GETATTR(bool, use_chaining);
+    GETATTR(int64, file_readahead_blocks);
+    GETATTR(int64, file_list_max_age_secs);
+    GETATTR(string, input_state_file);
+    GETATTR(int64, memory_budget_bytes);
+    GETATTR(string, file_cache_dir);
+    GETATTR(int64, file_cache_max_bytes);
+    GETATTR(int64, in_memory_cache_max_bytes);
+    GETATTR(bool, file_global_shuffle);
+    GETATTR(int64, file_interleave_cycle_length);
+    GETATTR(int64, file_interleave_block_length);
+    GETATTR(string, input_stats_name);
+    GETATTR(int64, file_parallelism_max);
+    GETATTR(int64, num_threads_max);
+    GETATTR(string, input_source_weights_name);
+    GETATTR(int64, input_source_max_deficit);
+    GETATTR(int64, sequential_num_readers);
 #undef GETATTR
     OP_REQUIRES(
         ctx,
         std::is_sorted(bucket_upper_bound.begin(), bucket_upper_bound.end()),
         errors::InvalidArgument("Bucket_upper_bound is not sorted"));
+    // Only then does ConstructYielder() return a WeightedMixRecordYielder.
+    OP_REQUIRES(ctx,
+                input_source_weights_name.empty() ||
+                    (input_source_weights.size() > 1 && !use_chaining &&
+                     !require_sequential_order),
+                errors::InvalidArgument(
+                    "input_source_weights_name requires input_source_weights "
+                    "for several file patterns, without use_chaining."));
     if (require_sequential_order) {
       num_threads = 1;
+      num_threads_max = 0;
+    }
+    YielderState initial_state;
+    bool resume = false;
+    if (!input_state_file.empty() &&
+        ctx->env()->FileExists(input_state_file).ok()) {
+      LOG(INFO) << "Resume input from " << input_state_file;
+      OP_REQUIRES_OK(ctx, ReadBinaryProto(ctx->env(), input_state_file,
+                                          &initial_state));
+      resume = true;
     }
     LOG(INFO) << "Create RecordProcessor";
     processor_ = new RecordProcessorClass(ctx);
-    RecordYielder* yielder = CHECK_NOTNULL(ConstructYielder(
-        file_pattern, input_source_weights, file_random_seed, file_buffer_size,
-        file_buffer_size_in_seconds, file_parallelism, require_sequential_order,
-        repeat_count, use_chaining));
+    std::shared_ptr<MemoryBudget> memory_budget;
+    if (memory_budget_bytes > 0) {
+      memory_budget = std::make_shared<MemoryBudget>(memory_budget_bytes);
+    }
+    InputStats* stats = nullptr;
+    if (!input_stats_name.empty()) {
+      stats = InputStats::Get(input_stats_name);
+    }
+    YielderConfig config;
+    config.file_pattern = file_pattern;
+    config.input_source_weights = input_source_weights;
+    config.yielder.seed = file_random_seed;
+    config.yielder.bufsize = file_buffer_size;
+    config.yielder.bufsize_in_seconds = file_buffer_size_in_seconds;
+    config.yielder.parallelism = file_parallelism;
+    config.yielder.max_parallelism = file_parallelism_max;
+    config.yielder.readahead_blocks = file_readahead_blocks;
+    config.yielder.file_list_max_age_secs = file_list_max_age_secs;
+    config.yielder.memory_budget = memory_budget;
+    config.yielder.cache_dir = file_cache_dir;
+    config.yielder.cache_max_bytes = file_cache_max_bytes;
+    config.yielder.in_memory_max_bytes = in_memory_cache_max_bytes;
+    config.yielder.global_shuffle = file_global_shuffle;
+    config.yielder.interleave_cycle_length = file_interleave_cycle_length;
+    config.yielder.interleave_block_length = file_interleave_block_length;
+    config.yielder.stats = stats;
+    config.require_sequential_order = require_sequential_order;
+    config.repeat_count = repeat_count;
+    config.sequential_num_readers = sequential_num_readers;
+    config.use_chaining = use_chaining;
+    config.input_source_max_deficit = input_source_max_deficit;
+    if (resume) config.initial_state = &initial_state;
+    RecordYielder* yielder = CHECK_NOTNULL(ConstructYielder(config));
+    if (!input_state_file.empty()) {
+      Status s = RegisterYielderForState(input_state_file, yielder);
+      if (!s.ok()) {
+        yielder->Close();
+        delete processor_;
+        processor_ = nullptr;
+        ctx->CtxFailure(s);
+        return;
+      }
+      input_state_file_ = input_state_file;
+      yielder_ = yielder;
+    }
+    if (!input_source_weights_name.empty()) {
+      input_source_weights_name_ = input_source_weights_name;
+      mixer_ = static_cast<WeightedMixRecordYielder*>(yielder);
+      RegisterYielderForWeights(input_source_weights_name_, mixer_);
+    }
     LOG(INFO) << "Create batcher";
     RecordBatcher::Options bopts;
     bopts.bucket_upper_bound = bucket_upper_bound;
@@ -84,10 +225,21 @@ class InputOp : public OpKernel {
     bopts.bucket_adjust_every_n = bucket_adjust_every_n;
     bopts.flush_every_n = flush_every_n;
     bopts.num_threads = num_threads;
+    bopts.max_num_threads = num_threads_max;
+    bopts.memory_budget = memory_budget;
+    bopts.stats = stats;
     batcher_ = new RecordBatcher(bopts, yielder, processor_);
   }
 
-  ~InputOp() override { delete batcher_; }
+  ~InputOp() override {
+    if (yielder_ != nullptr) {
+      UnregisterYielderForState(input_state_file_, yielder_);
+    }
+    if (mixer_ != nullptr) {
+      UnregisterYielderForWeights(input_source_weights_name_, mixer_);
+    }
+    delete batcher_;
+  }
 
   void Compute(OpKernelContext* ctx) override {
     int64 bucket_id;
@@ -108,6 +260,15 @@ class InputOp : public OpKernel {
  private:
   // Owned.
   RecordBatcher* batcher_ = nullptr;
+
+  // The yielder owned by batcher_, if its state is saved to
+  // input_state_file_.
+  string input_state_file_;
+  RecordYielder* yielder_ = nullptr;
+
+  // The same, if its weights are set by input_source_weights_name_.
+  string input_source_weights_name_;
+  WeightedMixRecordYielder* mixer_ = nullptr;
 };
 
 }  // namespace lingvo
@@ -0,0 +1,45 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/input_common.h"
+#include "tensorflow/core/framework/op_kernel.h"
+
+namespace tensorflow {
+namespace lingvo {
+namespace {
+
+class SaveInputStateOp : public OpKernel {
+ public:
+  explicit SaveInputStateOp(OpKernelConstruction* ctx) : OpKernel(ctx) {
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("state_file", &state_file_));
+    OP_REQUIRES_OK(
+        ctx, ctx->GetAttr("max_buffered_records", &max_buffered_records_));
+  }
+
+  void Compute(OpKernelContext* ctx) override {
+    OP_REQUIRES_OK(ctx, SaveYielderState(state_file_, max_buffered_records_));
+  }
+
+ private:
+  string state_file_;
+  int64 max_buffered_records_;
+};
+
+REGISTER_KERNEL_BUILDER(Name("SaveInputState").Device(DEVICE_CPU),
+                        SaveInputStateOp);
+
+}  // namespace
+}  // namespace lingvo
+}  // namespace tensorflow
@@ -0,0 +1,149 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/input_stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+
+#include "tensorflow/core/lib/core/bits.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+StatsHistogram::StatsHistogram() : min_(kint64max), max_(0) {
+  for (auto& bucket : buckets_) bucket = 0;
+}
+
+int StatsHistogram::BucketIndex(int64 value) {
+  if (value <= 0) return 0;
+  const int k = Log2Floor64(value);
+  // The kSubBucketBits bits after the leading one.
+  const int sub = k >= kSubBucketBits
+                      ? (value >> (k - kSubBucketBits))
+                      : (value << (kSubBucketBits - k));
+  return 1 + (k << kSubBucketBits) + (sub & ((1 << kSubBucketBits) - 1));
+}
+
+double StatsHistogram::BucketLimit(int index) {
+  if (index == 0) return 1;
+  const int k = (index - 1) >> kSubBucketBits;
+  const int sub = (index - 1) & ((1 << kSubBucketBits) - 1);
+  return std::ldexp((1 << kSubBucketBits) + sub + 1, k - kSubBucketBits);
+}
+
+void StatsHistogram::Add(int64 value) {
+  value = std::max<int64>(0, value);
+  ++buckets_[BucketIndex(value)];
+  ++num_;
+  sum_ += value;
+  const double square = static_cast<double>(value) * value;
+  double old_sum_squares = sum_squares_;
+  while (!sum_squares_.compare_exchange_weak(old_sum_squares,
+                                             old_sum_squares + square)) {
+  }
+  int64 old_min = min_;
+  while (value < old_min && !min_.compare_exchange_weak(old_min, value)) {
+  }
+  int64 old_max = max_;
+  while (value > old_max && !max_.compare_exchange_weak(old_max, value)) {
+  }
+}
+
+void StatsHistogram::EncodeToProto(HistogramProto* proto) const {
+  proto->Clear();
+  const int64 num = num_;
+  proto->set_num(num);
+  proto->set_sum(sum_);
+  proto->set_sum_squares(sum_squares_);
+  proto->set_min(num == 0 ? 0 : min_.load());
+  proto->set_max(max_);
+  int first = kNumBuckets;
+  int last = -1;
+  int64 counts[kNumBuckets];
+  for (int i = 0; i < kNumBuckets; ++i) {
+    counts[i] = buckets_[i];
+    if (counts[i] > 0) {
+      first = std::min(first, i);
+      last = i;
+    }
+  }
+  for (int i = first; i <= last; ++i) {
+    // An empty bucket followed by another one is merged into it.
+    if (counts[i] == 0 && counts[i + 1] == 0) continue;
+    proto->add_bucket_limit(BucketLimit(i));
+    proto->add_bucket(counts[i]);
+  }
+}
+
+InputStats* InputStats::Get(const string& name) {
+  static Mutex mu;
+  static auto* stats = new std::unordered_map<string, InputStats*>;
+  MutexLock l(&mu);
+  InputStats*& s = (*stats)[name];
+  if (s == nullptr) s = new InputStats(name);
+  return s;
+}
+
+std::atomic<int64>* InputStats::Counter(const string& name) {
+  MutexLock l(&mu_);
+  std::unique_ptr<std::atomic<int64>>& counter = counters_[name];
+  if (counter == nullptr) counter.reset(new std::atomic<int64>(0));
+  return counter.get();
+}
+
+StatsHistogram* InputStats::Histogram(const string& name) {
+  MutexLock l(&mu_);
+  std::unique_ptr<StatsHistogram>& histogram = histograms_[name];
+  if (histogram == nullptr) histogram.reset(new StatsHistogram);
+  return histogram.get();
+}
+
+void InputStats::AddRatio(const string& name, const string& numerator,
+                          const string& denominator) {
+  MutexLock l(&mu_);
+  ratios_[name] = {numerator, denominator};
+}
+
+void InputStats::Summarize(Summary* summary) {
+  MutexLock l(&mu_);
+  for (const auto& it : counters_) {
+    Summary::Value* value = summary->add_value();
+    value->set_tag(strings::StrCat(name_, "/", it.first));
+    value->set_simple_value(*it.second);
+  }
+  for (const auto& it : ratios_) {
+    int64 numerator = 0;
+    int64 denominator = 0;
+    auto counter = counters_.find(it.second.first);
+    if (counter != counters_.end()) numerator = *counter->second;
+    counter = counters_.find(it.second.second);
+    if (counter != counters_.end()) denominator = *counter->second;
+    Summary::Value* value = summary->add_value();
+    value->set_tag(strings::StrCat(name_, "/", it.first));
+    value->set_simple_value(
+        denominator == 0 ? 0 : static_cast<double>(numerator) / denominator);
+  }
+  for (const auto& it : histograms_) {
+    Summary::Value* value = summary->add_value();
+    value->set_tag(strings::StrCat(name_, "/", it.first));
+    it.second->EncodeToProto(value->mutable_histo());
+  }
+}
+
+}  // namespace lingvo
+}  // namespace tensorflow
@@ -0,0 +1,121 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef LINGVO_CORE_OPS_INPUT_STATS_H_
+#define LINGVO_CORE_OPS_INPUT_STATS_H_
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "lingvo/core/ops/mutex.h"
+#include "tensorflow/core/framework/summary.pb.h"
+#include "tensorflow/core/platform/macros.h"
+#include "tensorflow/core/platform/thread_annotations.h"
+#include "tensorflow/core/platform/types.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+// A histogram of non-negative integers, e.g., latencies in microseconds,
+// which many threads can add values to without a lock. Each power of two
+// [2^k, 2^(k+1)) is split into 4 buckets of equal width, so that a value is
+// known within 25%.
+class StatsHistogram {
+ public:
+  StatsHistogram();
+
+  // Adds 'value'. Negative values are added as 0.
+  void Add(int64 value);
+
+  int64 num() const { return num_; }
+  int64 sum() const { return sum_; }
+
+  // Fills in 'proto' with a snapshot of the histogram. Runs of empty buckets
+  // are merged into one.
+  void EncodeToProto(HistogramProto* proto) const;
+
+ private:
+  static constexpr int kSubBucketBits = 2;
+  // Bucket 0 holds 0, the others the 63 powers of two an int64 spans.
+  static constexpr int kNumBuckets = 1 + (63 << kSubBucketBits);
+
+  static int BucketIndex(int64 value);
+
+  // Returns the exclusive upper limit of the values in bucket 'index'.
+  static double BucketLimit(int index);
+
+  std::atomic<int64> num_{0};
+  std::atomic<int64> sum_{0};
+  std::atomic<double> sum_squares_{0};
+  std::atomic<int64> min_;
+  std::atomic<int64> max_;
+  std::atomic<int64> buckets_[kNumBuckets];
+
+  TF_DISALLOW_COPY_AND_ASSIGN(StatsHistogram);
+};
+
+// InputStats is a named set of counters and histograms which the yielders and
+// the batcher of input ops update as they go, and which the
+// InputPipelineStats op returns as a Summary, e.g., to tune file_parallelism
+// and num_batcher_threads.
+//
+// The stats of a name are process-wide and cumulative: input ops sharing a
+// name add to the same counters. Counters and histograms are created on first
+// use and never deleted, so that callers look them up once and then update
+// them without a lock. Thread-safe.
+class InputStats {
+ public:
+  // Returns the stats named 'name', creating them on first use. Never
+  // deleted.
+  static InputStats* Get(const string& name);
+
+  const string& name() const { return name_; }
+
+  // Returns the counter or the histogram named 'name', creating it on first
+  // use. Names may contain '/' to group them in TensorBoard.
+  std::atomic<int64>* Counter(const string& name);
+  StatsHistogram* Histogram(const string& name);
+
+  // Lets Summarize() add the value 'name', the ratio of the counters
+  // 'numerator' and 'denominator', or 0 while the latter is 0.
+  void AddRatio(const string& name, const string& numerator,
+                const string& denominator);
+
+  // Adds all counters, ratios and histograms to 'summary', tagged
+  // '<name()>/<name>'.
+  void Summarize(Summary* summary);
+
+ private:
+  explicit InputStats(const string& name) : name_(name) {}
+
+  const string name_;
+
+  Mutex mu_;
+  std::map<string, std::unique_ptr<std::atomic<int64>>> counters_
+      GUARDED_BY(mu_);
+  std::map<string, std::unique_ptr<StatsHistogram>> histograms_
+      GUARDED_BY(mu_);
+  std::map<string, std::pair<string, string>> ratios_ GUARDED_BY(mu_);
+
+  TF_DISALLOW_COPY_AND_ASSIGN(InputStats);
+};
+
+}  // namespace lingvo
+}  // namespace tensorflow
+
+#endif  // LINGVO_CORE_OPS_INPUT_STATS_H_
@@ -0,0 +1,49 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/input_stats.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/summary.pb.h"
+
+namespace tensorflow {
+namespace lingvo {
+namespace {
+
+class InputPipelineStatsOp : public OpKernel {
+ public:
+  explicit InputPipelineStatsOp(OpKernelConstruction* ctx) : OpKernel(ctx) {
+    string stats_name;
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("stats_name", &stats_name));
+    stats_ = InputStats::Get(stats_name);
+  }
+
+  void Compute(OpKernelContext* ctx) override {
+    Summary summary;
+    stats_->Summarize(&summary);
+    Tensor* out = nullptr;
+    OP_REQUIRES_OK(ctx, ctx->allocate_output(0, TensorShape({}), &out));
+    out->scalar<tstring>()() = summary.SerializeAsString();
+  }
+
+ private:
+  InputStats* stats_ = nullptr;  // Not owned.
+};
+
+REGISTER_KERNEL_BUILDER(Name("InputPipelineStats").Device(DEVICE_CPU),
+                        InputPipelineStatsOp);
+
+}  // namespace
+}  // namespace lingvo
+}  // namespace tensorflow
@@ -0,0 +1,193 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/input_stats.h"
+
+#include <gtest/gtest.h>
+#include "lingvo/core/ops/record_batcher.h"
+#include "lingvo/core/ops/yielder_test_helper.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/strings/numbers.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+
+namespace tensorflow {
+namespace lingvo {
+namespace {
+
+// Returns the value tagged 'tag' in 'summary', or null.
+const Summary::Value* Find(const Summary& summary, const string& tag) {
+  for (int i = 0; i < summary.value_size(); ++i) {
+    if (summary.value(i).tag() == tag) return &summary.value(i);
+  }
+  return nullptr;
+}
+
+TEST(StatsHistogram, Buckets) {
+  StatsHistogram histogram;
+  HistogramProto proto;
+  histogram.EncodeToProto(&proto);
+  EXPECT_EQ(0, proto.num());
+  EXPECT_EQ(0, proto.bucket_size());
+
+  for (int64 value : {0, 1, 5, 5, 7, 1000, -3}) histogram.Add(value);
+  histogram.EncodeToProto(&proto);
+  EXPECT_EQ(7, proto.num());
+  EXPECT_EQ(1018, proto.sum());
+  EXPECT_EQ(1000100, proto.sum_squares());
+  EXPECT_EQ(0, proto.min());
+  EXPECT_EQ(1000, proto.max());
+  ASSERT_EQ(proto.bucket_size(), proto.bucket_limit_size());
+  // Every value is below the limit of its bucket and at least the limit of
+  // the previous one.
+  std::vector<int64> values = {0, 0, 1, 5, 5, 7, 1000};
+  int64 num = 0;
+  int v = 0;
+  for (int i = 0; i < proto.bucket_size(); ++i) {
+    num += proto.bucket(i);
+    const double lower = i > 0 ? proto.bucket_limit(i - 1) : -1;
+    EXPECT_LT(lower, proto.bucket_limit(i));
+    for (int j = 0; j < proto.bucket(i); ++j, ++v) {
+      EXPECT_LE(lower, values[v]);
+      EXPECT_LT(values[v], proto.bucket_limit(i));
+    }
+  }
+  EXPECT_EQ(7, num);
+  // 0, 1, 5 and 7 fall into buckets of their own, and 1000 into [896, 1024).
+  EXPECT_EQ(1024, proto.bucket_limit(proto.bucket_size() - 1));
+  EXPECT_EQ(1, proto.bucket(proto.bucket_size() - 1));
+  EXPECT_LE(proto.bucket_limit(proto.bucket_size() - 2), 896);
+}
+
+TEST(InputStats, Summarize) {
+  InputStats* stats = InputStats::Get("input_stats_summarize");
+  EXPECT_EQ(stats, InputStats::Get("input_stats_summarize"));
+  EXPECT_EQ("input_stats_summarize", stats->name());
+  EXPECT_EQ(stats->Counter("a/b"), stats->Counter("a/b"));
+  *stats->Counter("a/b") += 3;
+  stats->AddRatio("ratio", "a/b", "c");
+  stats->Histogram("h")->Add(10);
+
+  Summary summary;
+  stats->Summarize(&summary);
+  EXPECT_EQ(3, summary.value_size());
+  ASSERT_NE(nullptr, Find(summary, "input_stats_summarize/a/b"));
+  EXPECT_EQ(3, Find(summary, "input_stats_summarize/a/b")->simple_value());
+  // The denominator is missing.
+  ASSERT_NE(nullptr, Find(summary, "input_stats_summarize/ratio"));
+  EXPECT_EQ(0, Find(summary, "input_stats_summarize/ratio")->simple_value());
+  ASSERT_NE(nullptr, Find(summary, "input_stats_summarize/h"));
+  EXPECT_EQ(1, Find(summary, "input_stats_summarize/h")->histo().num());
+
+  *stats->Counter("c") += 4;
+  summary = Summary();
+  stats->Summarize(&summary);
+  EXPECT_EQ(0.75, Find(summary, "input_stats_summarize/ratio")->simple_value());
+}
+
+// Uses the number on each line modulo 12, plus 1, as its bucket key, and
+// filters out the multiples of 50.
+class NumberProcessor : public RecordProcessor {
+ public:
+  Status Process(const Record& record, int64* bucket_key,
+                 TensorVec* sample) override {
+    const string value(record.value);
+    int64 number = 0;
+    CHECK(strings::safe_strto64(value.substr(value.find(':') + 1), &number));
+    if (number % 50 == 0) return errors::Cancelled("Filtered");
+    *bucket_key = number % 12 + 1;
+    Tensor t(DT_INT64, {});
+    t.scalar<int64>()() = number;
+    sample->clear();
+    sample->push_back(std::move(t));
+    return Status::OK();
+  }
+
+  Status Merge(int64 bucket_size, const std::vector<TensorVec>& samples,
+               TensorVec* batch) override {
+    Tensor t(DT_INT64, {static_cast<int64>(samples.size())});
+    for (int i = 0; i < samples.size(); ++i) {
+      t.flat<int64>()(i) = samples[i][0].scalar<int64>()();
+    }
+    batch->clear();
+    batch->push_back(std::move(t));
+    return Status::OK();
+  }
+};
+
+TEST(InputStats, Pipeline) {
+  const int N = 4;
+  const int M = 600;
+  GeneratePlainTextTestData("input_stats", N, M);
+  InputStats* stats = InputStats::Get("input_stats_pipeline");
+  BasicRecordYielder::Options yopts;
+  yopts.file_pattern = "text:/tmp/input_stats.*";
+  yopts.seed = 301;
+  yopts.bufsize = 100;
+  yopts.parallelism = 2;
+  yopts.stats = stats;
+  RecordBatcher::Options bopts;
+  bopts.bucket_upper_bound = {5, 10};
+  bopts.bucket_batch_limit = {4, 8};
+  bopts.stats = stats;
+  int64 num_samples = 0;
+  {
+    RecordBatcher batcher(bopts, BasicRecordYielder::New(yopts),
+                          new NumberProcessor);
+    int64 bucket_id;
+    TensorVec batch;
+    for (int i = 0; i < 200; ++i) {
+      TF_CHECK_OK(batcher.GetNext(&bucket_id, &batch));
+      num_samples += batch[0].NumElements();
+    }
+  }
+
+  Summary summary;
+  stats->Summarize(&summary);
+  auto value = [&summary](const string& name) {
+    const Summary::Value* value =
+        Find(summary, strings::StrCat("input_stats_pipeline/", name));
+    CHECK(value != nullptr) << name;
+    return value;
+  };
+  auto counter = [&value](const string& name) {
+    return static_cast<int64>(value(name)->simple_value());
+  };
+  // The records processed, and more in the buffer.
+  const int64 num_records = counter("source_0/records");
+  EXPECT_LT(num_samples, num_records);
+  EXPECT_LT(10 * num_records, counter("source_0/bytes"));
+  EXPECT_LT(0, counter("records_failed"));
+  EXPECT_LT(0, counter("records_skipped"));
+  EXPECT_LE(num_samples,
+            counter("bucket_0/samples") + counter("bucket_1/samples"));
+  EXPECT_LE(200, counter("bucket_0/batches") + counter("bucket_1/batches"));
+  EXPECT_EQ(counter("bucket_0/batches"),
+            value("bucket_0/fill_percent")->histo().num());
+  EXPECT_EQ(100, value("bucket_1/fill_percent")->histo().max());
+  // Keys 1 to 5 padded to 5 and 6 to 10 padded to 10.
+  const float efficiency = value("padding/efficiency")->simple_value();
+  EXPECT_LT(0.65, efficiency);
+  EXPECT_GT(0.8, efficiency);
+  EXPECT_LT(0, value("read_usecs")->histo().num());
+  EXPECT_LT(0, value("buffer_fill_percent")->histo().num());
+  EXPECT_LT(0, value("process_usecs")->histo().num());
+  EXPECT_LT(0, value("merge_usecs")->histo().num());
+  EXPECT_EQ(200, value("batch_wait_usecs")->histo().num());
+  EXPECT_NE(nullptr, Find(summary, "input_stats_pipeline/yield_wait_usecs"));
+}
+
+}  // namespace
+}  // namespace lingvo
+}  // namespace tensorflow
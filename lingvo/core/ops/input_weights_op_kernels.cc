@@ -0,0 +1,51 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/input_common.h"
+#include "tensorflow/core/framework/op_kernel.h"
+
+namespace tensorflow {
+namespace lingvo {
+namespace {
+
+class SetInputSourceWeightsOp : public OpKernel {
+ public:
+  explicit SetInputSourceWeightsOp(OpKernelConstruction* ctx)
+      : OpKernel(ctx) {
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("weights_name", &weights_name_));
+  }
+
+  void Compute(OpKernelContext* ctx) override {
+    const Tensor& weights = ctx->input(0);
+    OP_REQUIRES(ctx, TensorShapeUtils::IsVector(weights.shape()),
+                errors::InvalidArgument("weights must be a vector: ",
+                                        weights.shape().DebugString()));
+    const auto flat = weights.flat<float>();
+    OP_REQUIRES_OK(ctx,
+                   SetYielderWeights(weights_name_, std::vector<float>(
+                                                flat.data(),
+                                                flat.data() + flat.size())));
+  }
+
+ private:
+  string weights_name_;
+};
+
+REGISTER_KERNEL_BUILDER(Name("SetInputSourceWeights").Device(DEVICE_CPU),
+                        SetInputSourceWeightsOp);
+
+}  // namespace
+}  // namespace lingvo
+}  // namespace tensorflow
@@ -0,0 +1,230 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/io_executor.h"
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+
+#include "tensorflow/core/platform/cpu_info.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/logging.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+IoExecutor* IoExecutor::Get() {
+  // Blocking tasks mostly wait for reads, so there are more threads for them
+  // than cores.
+  const int num_cpus = port::NumSchedulableCPUs();
+  static IoExecutor* executor =
+      new IoExecutor(num_cpus, std::max(64, 2 * num_cpus));
+  return executor;
+}
+
+IoExecutor::IoExecutor(int num_threads, int num_blocking_threads,
+                       int64 periodic_micros)
+    : num_threads_(num_threads),
+      num_blocking_threads_(num_blocking_threads),
+      periodic_micros_(periodic_micros),
+      blocking_runnable_(this, &IoExecutor::BlockingRunnable),
+      pool_(new thread::ThreadPool(Env::Default(), ThreadOptions(),
+                                   "io_executor", num_threads,
+                                   /* low_latency_hint */ false)),
+      blocking_pool_(new thread::ThreadPool(Env::Default(), ThreadOptions(),
+                                            "io_executor_blocking",
+                                            num_blocking_threads,
+                                            /* low_latency_hint */ false)) {
+  for (int i = 0; i < num_blocking_threads; ++i) {
+    blocking_pool_->Schedule([this]() { BlockingLoop(); });
+  }
+  if (periodic_micros_ > 0) {
+    periodic_thread_.reset(new thread::ThreadPool(
+        Env::Default(), ThreadOptions(), "io_executor_periodic", 1,
+        /* low_latency_hint */ false));
+    periodic_thread_->Schedule([this]() { PeriodicLoop(); });
+  }
+}
+
+IoExecutor::~IoExecutor() {
+  {
+    MutexLock l(&periodic_mu_);
+    stop_ = true;
+  }
+  {
+    MutexLock l(&blocking_mu_);
+    blocking_stop_ = true;
+  }
+  periodic_thread_.reset();
+  blocking_pool_.reset();
+  pool_.reset();
+  {
+    MutexLock l(&blocking_mu_);
+    CHECK(blocking_ready_.empty());
+  }
+  MutexLock l(&mu_);
+  CHECK(ready_.empty());
+}
+
+IoExecutor::Queue::~Queue() {
+  {
+    MutexLock l(&executor_->blocking_mu_);
+    // The blocking task which notified the owner may still be returning.
+    executor_->blocking_mu_.Await(blocking_done_);
+  }
+  MutexLock l(&executor_->mu_);
+  CHECK(tasks_.empty());
+}
+
+void IoExecutor::Queue::Schedule(std::function<void()> fn) {
+  {
+    MutexLock l(&executor_->mu_);
+    tasks_.push_back(std::move(fn));
+    if (!ready_) {
+      ready_ = true;
+      executor_->ready_.push_back(this);
+    }
+  }
+  // Each call to RunOne() runs one task, though maybe of another queue.
+  executor_->pool_->Schedule([executor = executor_]() { executor->RunOne(); });
+}
+
+void IoExecutor::Queue::ScheduleBlocking(std::function<void()> fn) {
+  MutexLock l(&executor_->blocking_mu_);
+  if (blocking_tasks_.empty() && num_blocking_running_ == 0) {
+    ++executor_->num_blocking_clients_;
+  }
+  blocking_tasks_.push_back(std::move(fn));
+  if (!blocking_ready_) {
+    blocking_ready_ = true;
+    executor_->blocking_ready_.push_back(this);
+  }
+}
+
+void IoExecutor::Queue::BlockingParallelFor(int n,
+                                            std::function<void(int)> fn) {
+  if (n <= 0) return;
+  // Shared with the tasks, which may start after this returns.
+  struct State {
+    std::function<void(int)> fn;
+    std::atomic<int> next{0};
+    std::atomic<int> num_done{0};
+    Notification done;
+  };
+  auto state = std::make_shared<State>();
+  state->fn = std::move(fn);
+  auto run = [state, n]() {
+    for (int i = state->next++; i < n; i = state->next++) {
+      state->fn(i);
+      if (++state->num_done == n) state->done.Notify();
+    }
+  };
+  for (int i = 1; i < n; ++i) ScheduleBlocking(run);
+  run();
+  state->done.WaitForNotification();
+}
+
+std::unique_ptr<IoExecutor::Queue> IoExecutor::NewQueue() {
+  return std::unique_ptr<Queue>(new Queue(this));
+}
+
+void IoExecutor::RunOne() {
+  std::function<void()> fn;
+  {
+    MutexLock l(&mu_);
+    CHECK(!ready_.empty());
+    Queue* queue = ready_.front();
+    ready_.pop_front();
+    fn = std::move(queue->tasks_.front());
+    queue->tasks_.pop_front();
+    // Goes to the back of the line for its next task.
+    if (queue->tasks_.empty()) {
+      queue->ready_ = false;
+    } else {
+      ready_.push_back(queue);
+    }
+  }
+  // The queue may be deleted by the task or as soon as it is done.
+  fn();
+}
+
+IoExecutor::Queue* IoExecutor::NextBlocking() const {
+  const int share = BlockingShare();
+  for (Queue* queue : blocking_ready_) {
+    if (queue->num_blocking_running_ < share) return queue;
+  }
+  return nullptr;
+}
+
+void IoExecutor::BlockingLoop() {
+  while (true) {
+    std::function<void()> fn;
+    Queue* queue;
+    {
+      MutexLock l(&blocking_mu_);
+      blocking_mu_.Await(blocking_runnable_);
+      if (blocking_stop_) return;
+      // Queues at their share keep their turn for when they fall below it.
+      queue = NextBlocking();
+      blocking_ready_.erase(
+          std::find(blocking_ready_.begin(), blocking_ready_.end(), queue));
+      fn = std::move(queue->blocking_tasks_.front());
+      queue->blocking_tasks_.pop_front();
+      ++queue->num_blocking_running_;
+      if (queue->blocking_tasks_.empty()) {
+        queue->blocking_ready_ = false;
+      } else {
+        blocking_ready_.push_back(queue);
+      }
+    }
+    fn();
+    MutexLock l(&blocking_mu_);
+    // The queue may be deleted as soon as this is released.
+    if (--queue->num_blocking_running_ == 0 &&
+        queue->blocking_tasks_.empty()) {
+      --num_blocking_clients_;
+    }
+  }
+}
+
+int64 IoExecutor::AddPeriodic(std::function<void()> fn) {
+  MutexLock l(&periodic_mu_);
+  const int64 id = next_periodic_id_++;
+  periodic_[id] = std::move(fn);
+  return id;
+}
+
+void IoExecutor::RemovePeriodic(int64 id) {
+  MutexLock l(&periodic_mu_);
+  periodic_.erase(id);
+}
+
+void IoExecutor::RunPeriodic() {
+  MutexLock l(&periodic_mu_);
+  for (const auto& it : periodic_) it.second();
+}
+
+void IoExecutor::PeriodicLoop() {
+  while (true) {
+    Env::Default()->SleepForMicroseconds(periodic_micros_);
+    MutexLock l(&periodic_mu_);
+    if (stop_) break;
+    for (const auto& it : periodic_) it.second();
+  }
+}
+
+}  // namespace lingvo
+}  // namespace tensorflow
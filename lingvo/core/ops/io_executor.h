@@ -0,0 +1,174 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef LINGVO_CORE_OPS_IO_EXECUTOR_H_
+#define LINGVO_CORE_OPS_IO_EXECUTOR_H_
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+
+#include "lingvo/core/ops/mutex.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/macros.h"
+#include "tensorflow/core/platform/thread_annotations.h"
+#include "tensorflow/core/platform/types.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+// IoExecutor runs the tasks of many clients, e.g., the file iterators of all
+// the yielders of a process, on a bounded number of threads. Each client
+// schedules its tasks on its own Queue, and the queues with pending tasks take
+// turns, so that a client with many tasks does not starve the others.
+//
+// Tasks must be short and must not wait for other tasks or for the consumers
+// of their client: a task with more work to do schedules its continuation,
+// and one which would wait is scheduled again when it can go on. Tasks which
+// wait for I/O, e.g., open, read or list files, are scheduled with
+// ScheduleBlocking() and run on a separate pool, on which each client holds
+// only a share of the threads. Clients stalled on slow reads thus leave
+// threads for the others.
+//
+// IoExecutor also calls functions periodically, every second by default, on a
+// single shared thread, e.g., to adjust buffer sizes. Thread-safe.
+class IoExecutor {
+ public:
+  // Returns the executor shared by the process. Never deleted.
+  static IoExecutor* Get();
+
+  // Calls the periodic functions every 'periodic_micros', or only when
+  // RunPeriodic() is called if it is 0, e.g., in tests.
+  IoExecutor(int num_threads, int num_blocking_threads,
+             int64 periodic_micros = 1000000);
+  ~IoExecutor();
+
+  int num_threads() const { return num_threads_; }
+  int num_blocking_threads() const { return num_blocking_threads_; }
+
+  // The tasks of one client. All of them must have been scheduled when it is
+  // deleted. Waits for the blocking tasks still returning, so it must not be
+  // deleted by its own tasks.
+  class Queue {
+   public:
+    ~Queue();
+
+    void Schedule(std::function<void()> fn);
+
+    // Schedules 'fn', which may wait for I/O, on the blocking pool.
+    void ScheduleBlocking(std::function<void()> fn);
+
+    // Calls fn(0), ..., fn(n - 1) concurrently as blocking tasks and returns
+    // once all calls are done. The calling thread makes the calls no task
+    // has started yet itself, so that it never waits for a thread of the
+    // blocking pool, even when it runs as a blocking task of this queue.
+    void BlockingParallelFor(int n, std::function<void(int)> fn);
+
+   private:
+    friend class IoExecutor;
+    explicit Queue(IoExecutor* executor)
+        : executor_(executor), blocking_done_(this, &Queue::BlockingDone) {}
+
+    bool BlockingDone() const SHARED_LOCKS_REQUIRED(executor_->blocking_mu_) {
+      return blocking_tasks_.empty() && num_blocking_running_ == 0;
+    }
+
+    IoExecutor* const executor_;
+    std::deque<std::function<void()>> tasks_ GUARDED_BY(executor_->mu_);
+    // Whether the queue is in executor_->ready_.
+    bool ready_ GUARDED_BY(executor_->mu_) = false;
+
+    std::deque<std::function<void()>> blocking_tasks_
+        GUARDED_BY(executor_->blocking_mu_);
+    int num_blocking_running_ GUARDED_BY(executor_->blocking_mu_) = 0;
+    // Whether the queue is in executor_->blocking_ready_.
+    bool blocking_ready_ GUARDED_BY(executor_->blocking_mu_) = false;
+    Condition blocking_done_;
+
+    TF_DISALLOW_COPY_AND_ASSIGN(Queue);
+  };
+
+  std::unique_ptr<Queue> NewQueue();
+
+  // Calls 'fn' periodically until RemovePeriodic() is called with the
+  // returned id.
+  int64 AddPeriodic(std::function<void()> fn);
+
+  // Stops calling the function 'id'. Waits for the call in progress, if any,
+  // so it must not be called by the function itself.
+  void RemovePeriodic(int64 id);
+
+  // Calls the periodic functions once, on the calling thread.
+  void RunPeriodic();
+
+ private:
+  // Runs the next task of the queue whose turn it is.
+  void RunOne();
+
+  // Runs the blocking tasks of the queues whose turn it is until stopped.
+  void BlockingLoop();
+
+  // The number of blocking threads a queue may hold: at most an equal share
+  // with one more client, so that a client starting to read always finds a
+  // thread while num_blocking_threads_ allows.
+  int BlockingShare() const SHARED_LOCKS_REQUIRED(blocking_mu_) {
+    return std::max(1, num_blocking_threads_ / (num_blocking_clients_ + 1));
+  }
+
+  // Returns the first queue in blocking_ready_ below its share, or null.
+  Queue* NextBlocking() const SHARED_LOCKS_REQUIRED(blocking_mu_);
+  bool BlockingRunnable() const SHARED_LOCKS_REQUIRED(blocking_mu_) {
+    return blocking_stop_ || NextBlocking() != nullptr;
+  }
+
+  void PeriodicLoop();
+
+  const int num_threads_;
+  const int num_blocking_threads_;
+  const int64 periodic_micros_;
+
+  Mutex mu_;
+  // The queues with pending tasks, in the order they take turns.
+  std::deque<Queue*> ready_ GUARDED_BY(mu_);
+
+  Mutex blocking_mu_;
+  // The queues with pending blocking tasks, in the order they take turns,
+  // and the number of queues with blocking tasks pending or running.
+  std::deque<Queue*> blocking_ready_ GUARDED_BY(blocking_mu_);
+  int num_blocking_clients_ GUARDED_BY(blocking_mu_) = 0;
+  bool blocking_stop_ GUARDED_BY(blocking_mu_) = false;
+  Condition blocking_runnable_;
+
+  // Held while the periodic functions are called.
+  Mutex periodic_mu_;
+  std::map<int64, std::function<void()>> periodic_ GUARDED_BY(periodic_mu_);
+  int64 next_periodic_id_ GUARDED_BY(periodic_mu_) = 0;
+  bool stop_ GUARDED_BY(periodic_mu_) = false;
+
+  // Declared last, so that the threads are joined first. periodic_thread_
+  // is null if periodic_micros_ is 0.
+  std::unique_ptr<thread::ThreadPool> pool_;
+  std::unique_ptr<thread::ThreadPool> blocking_pool_;
+  std::unique_ptr<thread::ThreadPool> periodic_thread_;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(IoExecutor);
+};
+
+}  // namespace lingvo
+}  // namespace tensorflow
+
+#endif  // LINGVO_CORE_OPS_IO_EXECUTOR_H_
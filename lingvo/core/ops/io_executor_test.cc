@@ -0,0 +1,164 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/io_executor.h"
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <vector>
+
+#include "tensorflow/core/platform/env.h"
+
+namespace tensorflow {
+namespace lingvo {
+namespace {
+
+TEST(IoExecutor, QueuesTakeTurns) {
+  IoExecutor executor(1, 1);
+  std::unique_ptr<IoExecutor::Queue> a = executor.NewQueue();
+  std::unique_ptr<IoExecutor::Queue> b = executor.NewQueue();
+  // Holds the only thread while the tasks are scheduled.
+  Notification started;
+  Notification start;
+  a->Schedule([&started, &start]() {
+    started.Notify();
+    start.WaitForNotification();
+  });
+  started.WaitForNotification();
+  Mutex mu;
+  std::vector<char> order;
+  Notification done;
+  for (int i = 0; i < 4; ++i) {
+    a->Schedule([&mu, &order]() {
+      MutexLock l(&mu);
+      order.push_back('a');
+    });
+  }
+  for (int i = 0; i < 2; ++i) {
+    b->Schedule([&mu, &order]() {
+      MutexLock l(&mu);
+      order.push_back('b');
+    });
+  }
+  a->Schedule([&done]() { done.Notify(); });
+  start.Notify();
+  done.WaitForNotification();
+  MutexLock l(&mu);
+  EXPECT_EQ(string("ababaa"), string(order.begin(), order.end()));
+}
+
+TEST(IoExecutor, ManyTasks) {
+  IoExecutor executor(4, 1);
+  std::vector<std::unique_ptr<IoExecutor::Queue>> queues;
+  for (int i = 0; i < 8; ++i) queues.push_back(executor.NewQueue());
+  std::atomic<int> num_run{0};
+  Notification done;
+  const int kNumTasks = 1000;
+  // Each task schedules its continuation on its queue.
+  std::function<void(int, int)> task = [&](int q, int n) {
+    if (++num_run == kNumTasks) done.Notify();
+    if (n > 1) queues[q]->Schedule([&task, q, n]() { task(q, n - 1); });
+  };
+  for (int q = 0; q < queues.size(); ++q) {
+    queues[q]->Schedule(
+        [&task, q, &queues]() { task(q, kNumTasks / queues.size()); });
+  }
+  done.WaitForNotification();
+  EXPECT_EQ(kNumTasks, num_run);
+}
+
+TEST(IoExecutor, BlockingTasksLeaveThreads) {
+  IoExecutor executor(1, 4);
+  std::unique_ptr<IoExecutor::Queue> a = executor.NewQueue();
+  std::unique_ptr<IoExecutor::Queue> b = executor.NewQueue();
+  // The tasks of 'a' stall, as on a slow read, but hold only half of the
+  // threads while alone.
+  std::atomic<int> num_started{0};
+  std::atomic<int> num_running{0};
+  Notification unstall;
+  for (int i = 0; i < 8; ++i) {
+    a->ScheduleBlocking([&]() {
+      ++num_started;
+      EXPECT_GE(2, ++num_running);
+      unstall.WaitForNotification();
+      --num_running;
+    });
+  }
+  Env::Default()->SleepForMicroseconds(100000);
+  EXPECT_EQ(2, num_started);
+  // Those of 'b' still run, and so do the short tasks of 'a'.
+  Notification b_done;
+  Notification short_done;
+  b->ScheduleBlocking([&b_done]() { b_done.Notify(); });
+  a->Schedule([&short_done]() { short_done.Notify(); });
+  b_done.WaitForNotification();
+  short_done.WaitForNotification();
+  unstall.Notify();
+  while (num_started < 8) Env::Default()->SleepForMicroseconds(1000);
+  // The queues wait for their last tasks to return.
+  a.reset();
+  b.reset();
+}
+
+TEST(IoExecutor, BlockingParallelFor) {
+  IoExecutor executor(1, 1);
+  std::unique_ptr<IoExecutor::Queue> queue = executor.NewQueue();
+  // Called from a blocking task holding the only blocking thread, the calls
+  // are made by the task itself.
+  std::vector<int> calls(10);
+  Notification done;
+  queue->ScheduleBlocking([&]() {
+    queue->BlockingParallelFor(calls.size(), [&calls](int i) { ++calls[i]; });
+    done.Notify();
+  });
+  done.WaitForNotification();
+  for (int i = 0; i < calls.size(); ++i) EXPECT_EQ(1, calls[i]);
+  std::atomic<int> sum{0};
+  queue->BlockingParallelFor(100, [&sum](int i) { sum += i; });
+  EXPECT_EQ(4950, sum);
+}
+
+TEST(IoExecutor, Periodic) {
+  // The periodic functions are only called by RunPeriodic().
+  IoExecutor executor(1, 1, /* periodic_micros */ 0);
+  std::atomic<int> a{0};
+  std::atomic<int> b{0};
+  const int64 id = executor.AddPeriodic([&a]() { ++a; });
+  executor.AddPeriodic([&b]() { ++b; });
+  executor.RunPeriodic();
+  executor.RunPeriodic();
+  executor.RemovePeriodic(id);
+  executor.RunPeriodic();
+  EXPECT_EQ(2, a);
+  EXPECT_EQ(3, b);
+}
+
+TEST(IoExecutor, PeriodicThread) {
+  IoExecutor executor(1, 1, /* periodic_micros */ 1000);
+  Notification called;
+  std::atomic<int> num_calls{0};
+  const int64 id = executor.AddPeriodic([&]() {
+    if (++num_calls == 3) called.Notify();
+  });
+  called.WaitForNotification();
+  executor.RemovePeriodic(id);
+  const int n = num_calls;
+  executor.RunPeriodic();
+  EXPECT_EQ(n, num_calls);
+}
+
+}  // namespace
+}  // namespace lingvo
+}  // namespace tensorflow
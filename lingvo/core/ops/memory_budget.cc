@@ -0,0 +1,36 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/memory_budget.h"
+
+#include "tensorflow/core/lib/strings/strcat.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+void MemoryBudget::Charge(int64 bytes) {
+  const int64 usage = usage_ += bytes;
+  int64 peak = peak_;
+  while (usage > peak && !peak_.compare_exchange_weak(peak, usage)) {
+  }
+}
+
+string MemoryBudget::DebugString() const {
+  return strings::StrCat("Memory usage: ", usage(), " bytes, peak: ", peak(),
+                         " bytes, limit: ", limit(), " bytes");
+}
+
+}  // namespace lingvo
+}  // namespace tensorflow
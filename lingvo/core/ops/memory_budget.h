@@ -0,0 +1,68 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef LINGVO_CORE_OPS_MEMORY_BUDGET_H_
+#define LINGVO_CORE_OPS_MEMORY_BUDGET_H_
+
+#include <atomic>
+#include <string>
+
+#include "tensorflow/core/platform/macros.h"
+#include "tensorflow/core/platform/types.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+// MemoryBudget accounts for the bytes held by the stages of an input
+// pipeline sharing it, e.g., the randomization buffers of the record
+// yielders and the buckets and batches of the record batcher. Thread-safe.
+//
+// Charges never block. The budget is enforced by the stages whose size is
+// elastic: BasicRecordYielder shrinks its randomization buffer so that the
+// total usage stays within limit(), and its iterators wait for room, which
+// backpressures reading until the records are consumed downstream.
+class MemoryBudget {
+ public:
+  explicit MemoryBudget(int64 limit_bytes) : limit_(limit_bytes) {}
+
+  int64 limit() const { return limit_; }
+
+  // Bytes held by all stages.
+  int64 usage() const { return usage_; }
+
+  // The maximum usage so far.
+  int64 peak() const { return peak_; }
+
+  // Bytes which can still be charged without exceeding the limit. Negative if
+  // the limit is exceeded.
+  int64 available() const { return limit_ - usage_; }
+
+  void Charge(int64 bytes);
+  void Release(int64 bytes) { usage_ -= bytes; }
+
+  string DebugString() const;
+
+ private:
+  const int64 limit_;
+  std::atomic<int64> usage_{0};
+  std::atomic<int64> peak_{0};
+
+  TF_DISALLOW_COPY_AND_ASSIGN(MemoryBudget);
+};
+
+}  // namespace lingvo
+}  // namespace tensorflow
+
+#endif  // LINGVO_CORE_OPS_MEMORY_BUDGET_H_
@@ -62,6 +62,10 @@ class Mutex {
 
   void Unlock() UNLOCK_FUNCTION() { nsync_mu_unlock(&mu_); }
 
+  void ReaderLock() SHARED_LOCK_FUNCTION() { nsync_mu_rlock(&mu_); }
+
+  void ReaderUnlock() UNLOCK_FUNCTION() { nsync_mu_runlock(&mu_); }
+
   void Await(const Condition& cond) {
     nsync_mu_rassert_held(&mu_);
     cond.Await(&mu_);
@@ -87,6 +91,20 @@ class SCOPED_LOCKABLE MutexLock {
   TF_DISALLOW_COPY_AND_ASSIGN(MutexLock);
 };
 
+class SCOPED_LOCKABLE ReaderMutexLock {
+ public:
+  explicit ReaderMutexLock(Mutex* mu) SHARED_LOCK_FUNCTION(mu) : mu_(mu) {
+    mu_->ReaderLock();
+  }
+
+  ~ReaderMutexLock() UNLOCK_FUNCTION() { mu_->ReaderUnlock(); }
+
+ private:
+  Mutex* const mu_;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(ReaderMutexLock);
+};
+
 class Notification {
  public:
   Notification()
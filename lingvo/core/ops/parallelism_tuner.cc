@@ -0,0 +1,59 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/parallelism_tuner.h"
+
+#include <algorithm>
+
+#include "tensorflow/core/platform/logging.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+ParallelismTuner::ParallelismTuner(const Options& opts)
+    : opts_(opts), parallelism_(std::max(1, opts.min_parallelism)) {
+  CHECK_LE(opts_.min_parallelism, opts_.max_parallelism);
+}
+
+int ParallelismTuner::Update(int64 interval_usecs, int64 wait_usecs,
+                             int64 idle_usecs) {
+  if (interval_usecs <= 0) return parallelism_;
+  const double wait = static_cast<double>(wait_usecs) / interval_usecs;
+  const double idle =
+      static_cast<double>(idle_usecs) / (interval_usecs * parallelism_);
+  if (wait > opts_.grow_wait_fraction && idle < opts_.idle_fraction) {
+    ++num_grow_;
+    num_shrink_ = 0;
+  } else if (wait < opts_.shrink_wait_fraction && idle > opts_.idle_fraction) {
+    ++num_shrink_;
+    num_grow_ = 0;
+  } else {
+    num_grow_ = 0;
+    num_shrink_ = 0;
+  }
+  if (num_grow_ >= opts_.grow_intervals &&
+      parallelism_ < opts_.max_parallelism) {
+    ++parallelism_;
+    num_grow_ = 0;
+  } else if (num_shrink_ >= opts_.shrink_intervals &&
+             parallelism_ > std::max(1, opts_.min_parallelism)) {
+    --parallelism_;
+    num_shrink_ = 0;
+  }
+  return parallelism_;
+}
+
+}  // namespace lingvo
+}  // namespace tensorflow
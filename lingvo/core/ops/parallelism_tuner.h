@@ -0,0 +1,73 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef LINGVO_CORE_OPS_PARALLELISM_TUNER_H_
+#define LINGVO_CORE_OPS_PARALLELISM_TUNER_H_
+
+#include "tensorflow/core/platform/types.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+// ParallelismTuner decides how many threads of a stage of the input pipeline,
+// e.g., the file iterators of a yielder or the processor threads of a
+// batcher, are active. It is updated periodically with how long the consumers
+// of the stage waited for it and how long its active threads were idle,
+// e.g., waiting for room in the next stage or for the previous one:
+//
+// * If the consumers waited for more than 'grow_wait_fraction' of the
+//   interval while the threads were busy, for 'grow_intervals' intervals in a
+//   row, one more thread is activated.
+// * If the consumers waited for less than 'shrink_wait_fraction' while the
+//   threads were idle for more than 'idle_fraction' of the time, for
+//   'shrink_intervals' intervals in a row, one thread is paused.
+//
+// The gap between the thresholds and the longer wait before shrinking keep
+// the stage from oscillating. Not thread-safe.
+class ParallelismTuner {
+ public:
+  struct Options {
+    // The bounds of the parallelism, which starts at 'min_parallelism'.
+    int min_parallelism = 1;
+    int max_parallelism = 1;
+
+    double grow_wait_fraction = 0.05;
+    int grow_intervals = 3;
+    double shrink_wait_fraction = 0.01;
+    int shrink_intervals = 10;
+    double idle_fraction = 0.5;
+  };
+
+  explicit ParallelismTuner(const Options& opts);
+
+  int parallelism() const { return parallelism_; }
+
+  // Takes the microseconds the consumers waited and the microseconds the
+  // active threads were idle, summed over them, in the last 'interval_usecs'.
+  // Returns the new parallelism.
+  int Update(int64 interval_usecs, int64 wait_usecs, int64 idle_usecs);
+
+ private:
+  const Options opts_;
+  int parallelism_;
+  // The number of intervals in a row which called for growing or shrinking.
+  int num_grow_ = 0;
+  int num_shrink_ = 0;
+};
+
+}  // namespace lingvo
+}  // namespace tensorflow
+
+#endif  // LINGVO_CORE_OPS_PARALLELISM_TUNER_H_
@@ -0,0 +1,84 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/parallelism_tuner.h"
+
+#include <gtest/gtest.h>
+
+namespace tensorflow {
+namespace lingvo {
+namespace {
+
+constexpr int64 kInterval = 1000000;
+
+ParallelismTuner::Options TunerOptions(int min_parallelism,
+                                       int max_parallelism) {
+  ParallelismTuner::Options opts;
+  opts.min_parallelism = min_parallelism;
+  opts.max_parallelism = max_parallelism;
+  return opts;
+}
+
+TEST(ParallelismTuner, GrowsWhileConsumersWait) {
+  ParallelismTuner tuner(TunerOptions(2, 4));
+  EXPECT_EQ(2, tuner.parallelism());
+  // The consumers wait 10% of the time while the threads are busy.
+  EXPECT_EQ(2, tuner.Update(kInterval, kInterval / 10, 0));
+  EXPECT_EQ(2, tuner.Update(kInterval, kInterval / 10, 0));
+  EXPECT_EQ(3, tuner.Update(kInterval, kInterval / 10, 0));
+  // Another streak is needed to grow again.
+  EXPECT_EQ(3, tuner.Update(kInterval, kInterval / 10, 0));
+  EXPECT_EQ(3, tuner.Update(kInterval, kInterval / 10, 0));
+  EXPECT_EQ(4, tuner.Update(kInterval, kInterval / 10, 0));
+  // Up to the maximum.
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(4, tuner.Update(kInterval, kInterval / 10, 0));
+  }
+}
+
+TEST(ParallelismTuner, Hysteresis) {
+  ParallelismTuner tuner(TunerOptions(1, 8));
+  // A streak is broken by an interval in between the thresholds.
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(1, tuner.Update(kInterval, kInterval / 10, 0));
+    EXPECT_EQ(1, tuner.Update(kInterval, kInterval / 10, 0));
+    EXPECT_EQ(1, tuner.Update(kInterval, kInterval / 50, 0));
+  }
+  // Waiting consumers do not grow a stage whose threads are idle, e.g.,
+  // because they wait for the previous stage.
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(1, tuner.Update(kInterval, kInterval / 10, kInterval * 3 / 4));
+  }
+  // Nor does an empty interval change anything.
+  EXPECT_EQ(1, tuner.Update(0, kInterval, 0));
+}
+
+TEST(ParallelismTuner, ShrinksWhileIdle) {
+  ParallelismTuner tuner(TunerOptions(2, 4));
+  for (int i = 0; i < 6; ++i) tuner.Update(kInterval, kInterval / 10, 0);
+  EXPECT_EQ(4, tuner.parallelism());
+  // The 4 threads are idle 3/4 of the time.
+  for (int i = 0; i < 9; ++i) {
+    EXPECT_EQ(4, tuner.Update(kInterval, 0, kInterval * 3));
+  }
+  EXPECT_EQ(3, tuner.Update(kInterval, 0, kInterval * 3));
+  // Down to the minimum.
+  for (int i = 0; i < 30; ++i) tuner.Update(kInterval, 0, kInterval * 3);
+  EXPECT_EQ(2, tuner.parallelism());
+}
+
+}  // namespace
+}  // namespace lingvo
+}  // namespace tensorflow
@@ -0,0 +1,254 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/readahead_file.h"
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+
+#include "lingvo/core/ops/mutex.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/thread_annotations.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+constexpr size_t ReadaheadFile::kDefaultBlockSize;
+
+struct ReadaheadFile::State : public std::enable_shared_from_this<State> {
+  typedef State ME;
+
+  struct Block {
+    uint64 offset;
+    string data;
+  };
+
+  State(const string& filename, uint64 offset, int max_blocks,
+        size_t block_size, IoExecutor::Queue* queue)
+      : filename(filename),
+        max_blocks(std::max(1, max_blocks)),
+        block_size(block_size),
+        queue(queue),
+        next_offset(offset),
+        opened_cond(this, &ME::Opened),
+        block_ready(this, &ME::BlockReady),
+        fill_done(this, &ME::FillDone) {}
+
+  // Schedules a task filling blocks if there is none scheduled or filling
+  // and there is still room and data to read.
+  void MaybeScheduleFill() EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Opens the file if it is not opened yet, and reads blocks until there are
+  // 'num_blocks' of them, the end of the file or an error. Releases mu while
+  // it opens and reads.
+  void Fill(int num_blocks) EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  const string filename;
+  const int max_blocks;
+  const size_t block_size;
+  IoExecutor::Queue* const queue;
+
+  Mutex mu;
+
+  // Set once before opened turns true. Never changes afterwards.
+  std::unique_ptr<RandomAccessFile> file;
+  bool opened GUARDED_BY(mu) = false;
+
+  // Blocks read ahead, ordered by offset.
+  std::deque<Block> blocks GUARDED_BY(mu);
+
+  // Offset of the next block to read in the background.
+  uint64 next_offset GUARDED_BY(mu);
+
+  // True iff a fill task is scheduled and has not started yet.
+  bool fill_scheduled GUARDED_BY(mu) = false;
+
+  // True iff a task or the reader is in Fill().
+  bool filling GUARDED_BY(mu) = false;
+
+  // True once the reads hit the end of the file or an error, in which case
+  // 'status' is set to the error.
+  bool done GUARDED_BY(mu) = false;
+  Status status GUARDED_BY(mu);
+
+  // True when the reader goes away.
+  bool cancelled GUARDED_BY(mu) = false;
+
+  Condition opened_cond;
+  bool Opened() const SHARED_LOCKS_REQUIRED(mu) { return opened; }
+
+  // Also true when nobody is filling, in which case the reader reads the
+  // next block itself.
+  Condition block_ready;
+  bool BlockReady() const SHARED_LOCKS_REQUIRED(mu) {
+    return !blocks.empty() || done || !filling;
+  }
+
+  Condition fill_done;
+  bool FillDone() const SHARED_LOCKS_REQUIRED(mu) { return !filling; }
+};
+
+void ReadaheadFile::State::MaybeScheduleFill() {
+  if (fill_scheduled || filling || done || cancelled ||
+      (opened && static_cast<int>(blocks.size()) >= max_blocks)) {
+    return;
+  }
+  fill_scheduled = true;
+  std::shared_ptr<State> state = shared_from_this();
+  queue->ScheduleBlocking([state]() {
+    MutexLock l(&state->mu);
+    state->fill_scheduled = false;
+    // The reader may have gone away, or be filling itself.
+    if (!state->cancelled && !state->filling) {
+      state->Fill(state->max_blocks);
+    }
+  });
+}
+
+void ReadaheadFile::State::Fill(int num_blocks) {
+  filling = true;
+  if (!opened) {
+    mu.Unlock();
+    std::unique_ptr<RandomAccessFile> f;
+    const Status s = Env::Default()->NewRandomAccessFile(filename, &f);
+    mu.Lock();
+    file = std::move(f);
+    opened = true;
+    if (!s.ok()) {
+      status = s;
+      done = true;
+    }
+  }
+  while (!cancelled && !done && static_cast<int>(blocks.size()) < num_blocks) {
+    Block block;
+    block.offset = next_offset;
+    mu.Unlock();
+    block.data.resize(block_size);
+    StringPiece result;
+    const Status s =
+        file->Read(block.offset, block_size, &result, &block.data[0]);
+    mu.Lock();
+    if (!s.ok() && !errors::IsOutOfRange(s)) {
+      status = s;
+      done = true;
+      break;
+    }
+    if (result.data() != block.data.data()) {
+      block.data.assign(result.data(), result.size());
+    } else {
+      block.data.resize(result.size());
+    }
+    next_offset += block.data.size();
+    // A short read means we hit the end of the file.
+    if (!s.ok() || block.data.size() < block_size) done = true;
+    if (!block.data.empty()) blocks.push_back(std::move(block));
+  }
+  filling = false;
+}
+
+ReadaheadFile::ReadaheadFile(const string& filename, uint64 offset,
+                             int max_blocks, size_t block_size,
+                             IoExecutor::Queue* queue)
+    : state_(std::make_shared<State>(filename, offset, max_blocks, block_size,
+                                     queue)) {
+  MutexLock l(&state_->mu);
+  state_->MaybeScheduleFill();
+}
+
+ReadaheadFile::~ReadaheadFile() {
+  MutexLock l(&state_->mu);
+  state_->cancelled = true;
+  // A task not started yet finds the file cancelled.
+  state_->mu.Await(state_->fill_done);
+}
+
+const string& ReadaheadFile::filename() const { return state_->filename; }
+
+Status ReadaheadFile::WaitForOpen() const {
+  State* state = state_.get();
+  MutexLock l(&state->mu);
+  if (!state->opened && !state->filling) state->Fill(0);
+  state->mu.Await(state->opened_cond);
+  return state->file ? Status::OK() : state->status;
+}
+
+Status ReadaheadFile::Read(uint64 offset, size_t n, StringPiece* result,
+                           char* scratch) const {
+  TF_RETURN_IF_ERROR(WaitForOpen());
+  State* state = state_.get();
+  size_t copied = 0;
+  {
+    MutexLock l(&state->mu);
+    while (copied < n) {
+      const uint64 pos = offset + copied;
+      // Reads behind the readahead window, or more than one block past it,
+      // go to the file directly.
+      const uint64 window_begin = state->blocks.empty()
+                                      ? state->next_offset
+                                      : state->blocks.front().offset;
+      if (pos < window_begin || pos >= state->next_offset + state->block_size) {
+        break;
+      }
+      // Drops blocks the reader has moved past.
+      while (!state->blocks.empty() &&
+             state->blocks.front().offset + state->blocks.front().data.size() <=
+                 pos) {
+        state->blocks.pop_front();
+        state->MaybeScheduleFill();
+      }
+      if (!state->blocks.empty()) {
+        const State::Block& block = state->blocks.front();
+        const size_t skip = pos - block.offset;
+        const size_t len = std::min(n - copied, block.data.size() - skip);
+        memcpy(scratch + copied, block.data.data() + skip, len);
+        copied += len;
+        continue;
+      }
+      if (!state->done) {
+        if (state->filling) {
+          state->mu.Await(state->block_ready);
+        } else {
+          // No task has started reading the block yet.
+          state->Fill(1);
+          state->MaybeScheduleFill();
+        }
+        continue;
+      }
+      // The reads reached the end of the file or failed.
+      *result = StringPiece(scratch, copied);
+      if (!state->status.ok()) return state->status;
+      return errors::OutOfRange("EOF reached, ", copied,
+                                " bytes were read out of ", n,
+                                " bytes requested.");
+    }
+  }
+  if (copied == n) {
+    *result = StringPiece(scratch, n);
+    return Status::OK();
+  }
+  StringPiece rest;
+  const Status s =
+      state->file->Read(offset + copied, n - copied, &rest, scratch + copied);
+  if (rest.data() != scratch + copied) {
+    memmove(scratch + copied, rest.data(), rest.size());
+  }
+  *result = StringPiece(scratch, copied + rest.size());
+  return s;
+}
+
+}  // namespace lingvo
+}  // namespace tensorflow
@@ -0,0 +1,72 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef LINGVO_CORE_OPS_READAHEAD_FILE_H_
+#define LINGVO_CORE_OPS_READAHEAD_FILE_H_
+
+#include <memory>
+#include <string>
+
+#include "lingvo/core/ops/io_executor.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/platform/file_system.h"
+#include "tensorflow/core/platform/macros.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+// ReadaheadFile is a RandomAccessFile which opens 'filename' and reads it
+// sequentially from 'offset' in the background, keeping at most 'max_blocks'
+// blocks of 'block_size' bytes ahead of the reader.
+//
+// It is meant for readers which mostly consume a file front to back (e.g.,
+// record iterators): the open and the first reads happen while the previous
+// file is still being parsed. Reads behind the readahead window fall back to
+// reading the underlying file directly.
+//
+// Background reads run as blocking tasks of 'queue', which must outlive this
+// object. A task only runs while there is room in the block queue, so an idle
+// reader never holds a thread. A reader which needs a block no task has
+// started reading yet reads it itself, so that it never waits for a thread
+// of the IoExecutor, even when it runs as a blocking task of 'queue' itself.
+class ReadaheadFile : public RandomAccessFile {
+ public:
+  static constexpr size_t kDefaultBlockSize = 2 << 20;
+
+  ReadaheadFile(const string& filename, uint64 offset, int max_blocks,
+                size_t block_size, IoExecutor::Queue* queue);
+  ~ReadaheadFile() override;
+
+  const string& filename() const;
+
+  // Blocks until the file is opened and returns the status of the open.
+  Status WaitForOpen() const;
+
+  Status Read(uint64 offset, size_t n, StringPiece* result,
+              char* scratch) const override;
+
+ private:
+  // The blocks and the file, shared with the scheduled tasks, which may
+  // start after this object is deleted.
+  struct State;
+  const std::shared_ptr<State> state_;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(ReadaheadFile);
+};
+
+}  // namespace lingvo
+}  // namespace tensorflow
+
+#endif  // LINGVO_CORE_OPS_READAHEAD_FILE_H_
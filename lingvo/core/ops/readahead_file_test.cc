@@ -0,0 +1,120 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/readahead_file.h"
+
+#include <gtest/gtest.h>
+#include "lingvo/core/ops/io_executor.h"
+#include "lingvo/core/ops/mutex.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/platform/env.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+string WriteTestFile(const string& name, int size) {
+  const string filename = io::JoinPath("/tmp", name);
+  string content;
+  for (int i = 0; i < size; ++i) content.push_back('a' + i % 26);
+  TF_CHECK_OK(WriteStringToFile(Env::Default(), filename, content));
+  return filename;
+}
+
+TEST(ReadaheadFile, SequentialReads) {
+  const int kSize = 1000;
+  const string filename = WriteTestFile("readahead_seq", kSize);
+  IoExecutor executor(1, 2);
+  std::unique_ptr<IoExecutor::Queue> queue = executor.NewQueue();
+  // Blocks of 7 bytes read in chunks of 10 bytes exercise reads spanning
+  // multiple blocks.
+  ReadaheadFile file(filename, 0, 3, 7, queue.get());
+  TF_CHECK_OK(file.WaitForOpen());
+  char scratch[10];
+  StringPiece result;
+  uint64 offset = 0;
+  while (offset < kSize) {
+    Status s = file.Read(offset, sizeof(scratch), &result, scratch);
+    for (int i = 0; i < result.size(); ++i) {
+      ASSERT_EQ('a' + (offset + i) % 26, result[i]);
+    }
+    offset += result.size();
+    if (!s.ok()) {
+      EXPECT_TRUE(errors::IsOutOfRange(s));
+      break;
+    }
+  }
+  EXPECT_EQ(kSize, offset);
+  EXPECT_TRUE(
+      errors::IsOutOfRange(file.Read(kSize, 10, &result, scratch)));
+  EXPECT_TRUE(result.empty());
+}
+
+TEST(ReadaheadFile, NonSequentialReads) {
+  const int kSize = 1000;
+  const string filename = WriteTestFile("readahead_random", kSize);
+  IoExecutor executor(1, 2);
+  std::unique_ptr<IoExecutor::Queue> queue = executor.NewQueue();
+  ReadaheadFile file(filename, 0, 2, 16, queue.get());
+  char scratch[20];
+  StringPiece result;
+  for (uint64 offset : {500, 0, 990, 100, 3}) {
+    Status s = file.Read(offset, sizeof(scratch), &result, scratch);
+    EXPECT_EQ(std::min<uint64>(sizeof(scratch), kSize - offset),
+              result.size());
+    for (int i = 0; i < result.size(); ++i) {
+      ASSERT_EQ('a' + (offset + i) % 26, result[i]);
+    }
+  }
+}
+
+TEST(ReadaheadFile, MissingFile) {
+  IoExecutor executor(1, 1);
+  std::unique_ptr<IoExecutor::Queue> queue = executor.NewQueue();
+  ReadaheadFile file("/tmp/readahead_does_not_exist", 0, 2, 16, queue.get());
+  EXPECT_FALSE(file.WaitForOpen().ok());
+  char scratch[1];
+  StringPiece result;
+  EXPECT_FALSE(file.Read(0, 1, &result, scratch).ok());
+}
+
+TEST(ReadaheadFile, ReadsWithoutThreads) {
+  const int kSize = 100;
+  const string filename = WriteTestFile("readahead_no_threads", kSize);
+  IoExecutor executor(1, 1);
+  // Holds the only blocking thread of the executor until the file is read.
+  std::unique_ptr<IoExecutor::Queue> stalled = executor.NewQueue();
+  Notification started;
+  Notification unstall;
+  stalled->ScheduleBlocking([&]() {
+    started.Notify();
+    unstall.WaitForNotification();
+  });
+  started.WaitForNotification();
+  std::unique_ptr<IoExecutor::Queue> queue = executor.NewQueue();
+  {
+    // The reader opens the file and reads the blocks itself.
+    ReadaheadFile file(filename, 0, 2, 16, queue.get());
+    TF_CHECK_OK(file.WaitForOpen());
+    char scratch[kSize];
+    StringPiece result;
+    TF_CHECK_OK(file.Read(0, kSize, &result, scratch));
+    for (int i = 0; i < kSize; ++i) ASSERT_EQ('a' + i % 26, result[i]);
+  }
+  unstall.Notify();
+}
+
+}  // namespace lingvo
+}  // namespace tensorflow
@@ -20,7 +20,8 @@ limitations under the License.
 //
 // * Processor threads
 //
-//   * call the yielder to get a Record and process it into a TensorVec.
+//   * call the yielder to get a few Records at a time and process each of
+//     them into a TensorVec.
 //
 //   * Processed TensorVec are put into buckets according to the
 //     bucket key returned by processor->Process().
@@ -56,12 +57,18 @@ limitations under the License.
 //  is roughly
 //
 //    M * (file_buffer_size + sum(bucket_batch_limit) * 2 + B * 2)
+//
+//  With a memory budget shared by the yielder and the batcher, the bytes of
+//  the samples in buckets_ and to_flush_ and of the merged batches are charged
+//  to it, and the yielder buffer shrinks so that the total stays within the
+//  budget whatever M is.
 
 #include "lingvo/core/ops/record_batcher.h"
 
 #include <algorithm>
 #include <utility>
 
+#include "lingvo/core/ops/io_executor.h"
 #include "lingvo/core/ops/mutex.h"
 #include "tensorflow/core/lib/core/errors.h"
 #include "tensorflow/core/lib/strings/str_util.h"
@@ -71,6 +78,19 @@ limitations under the License.
 namespace tensorflow {
 namespace lingvo {
 
+namespace {
+
+// Number of records a processor thread takes from the yielder at once.
+constexpr int kRecordsPerYield = 16;
+
+int64 TotalBytes(const TensorVec& tensors) {
+  int64 bytes = 0;
+  for (const Tensor& t : tensors) bytes += t.TotalBytes();
+  return bytes;
+}
+
+}  // namespace
+
 RecordBatcher::RecordBatcher(const Options& opts, RecordYielder* yielder,
                              RecordProcessor* processor)
     : opts_(opts),
@@ -78,7 +98,8 @@ RecordBatcher::RecordBatcher(const Options& opts, RecordYielder* yielder,
       processor_(processor),
       processor_thread_(new thread::ThreadPool(
           Env::Default(), ThreadOptions(), "record_batcher_processor",
-          opts_.num_threads, /* low_latency_hint */ false)),
+          std::max(opts_.num_threads, opts_.max_num_threads),
+          /* low_latency_hint */ false)),
       merger_thread_(new thread::ThreadPool(Env::Default(), ThreadOptions(),
                                             "record_batcher_merger", 1,
                                             /* low_latency_hint */ false)),
@@ -90,15 +111,49 @@ RecordBatcher::RecordBatcher(const Options& opts, RecordYielder* yielder,
   CHECK_EQ(opts_.bucket_upper_bound.size(), opts_.bucket_batch_limit.size());
   buckets_.resize(opts_.bucket_upper_bound.size());
   length_histogram_.resize(opts_.bucket_upper_bound.back() + 1, 0);
+  if (opts_.stats != nullptr) {
+    InputStats* stats = opts_.stats;
+    for (int i = 0; i < buckets_.size(); ++i) {
+      const string bucket = strings::StrCat("bucket_", i, "/");
+      bucket_stats_.push_back(
+          {stats->Counter(strings::StrCat(bucket, "batches")),
+           stats->Counter(strings::StrCat(bucket, "samples")),
+           stats->Histogram(strings::StrCat(bucket, "fill_percent"))});
+    }
+    process_usecs_stat_ = stats->Histogram("process_usecs");
+    merge_usecs_stat_ = stats->Histogram("merge_usecs");
+    batch_wait_stat_ = stats->Histogram("batch_wait_usecs");
+    records_failed_stat_ = stats->Counter("records_failed");
+    records_skipped_stat_ = stats->Counter("records_skipped");
+    tokens_stat_ = stats->Counter("padding/tokens");
+    padded_tokens_stat_ = stats->Counter("padding/padded_tokens");
+    stats->AddRatio("padding/efficiency", "padding/tokens",
+                    "padding/padded_tokens");
+  }
   start_time_ = std::time(nullptr);
+  num_threads_ = std::max(opts_.num_threads, opts_.max_num_threads);
   {
     MutexLock l(&mu_);
     last_log_update_time_ = start_time_;
+    active_threads_ = opts_.num_threads;
+  }
+  if (num_threads_ > opts_.num_threads) {
+    ParallelismTuner::Options topts;
+    topts.min_parallelism = opts_.num_threads;
+    topts.max_parallelism = num_threads_;
+    tuner_.reset(new ParallelismTuner(topts));
+    {
+      MutexLock l(&mu_);
+      last_tune_micros_ = Env::Default()->NowMicros();
+    }
+    io_executor_ = opts_.io_executor != nullptr ? opts_.io_executor
+                                                : IoExecutor::Get();
+    tune_id_ = io_executor_->AddPeriodic([this]() { Tune(); });
   }
 
-  for (int i = 0; i < opts_.num_threads; i++) {
-    processor_thread_->Schedule([this]() {
-      ProcessorLoop();
+  for (int i = 0; i < num_threads_; i++) {
+    processor_thread_->Schedule([this, i]() {
+      ProcessorLoop(i);
       MutexLock l(&mu_);
       processor_loop_done_count_++;
     });
@@ -112,6 +167,7 @@ RecordBatcher::RecordBatcher(const Options& opts, RecordYielder* yielder,
 }
 
 RecordBatcher::~RecordBatcher() {
+  if (tuner_ != nullptr) io_executor_->RemovePeriodic(tune_id_);
   {
     MutexLock l(&mu_);
     stop_ = true;
@@ -119,6 +175,10 @@ RecordBatcher::~RecordBatcher() {
   delete processor_thread_;
   delete merger_thread_;
   yielder_->Close();
+  {
+    MutexLock l(&mu_);
+    ChargeBytes(-bytes_);
+  }
   delete processor_;
 }
 
@@ -126,7 +186,11 @@ Status RecordBatcher::GetNext(int64* bucket, TensorVec* batch) {
   MutexLock l(&mu_);
   // Wait for either curr to be non-empty, or for the merger thread to be
   // complete.
+  const uint64 start = Env::Default()->NowMicros();
   WaitForCurrNonEmpty();
+  const int64 wait_usecs = Env::Default()->NowMicros() - start;
+  consumer_wait_usecs_ += wait_usecs;
+  if (batch_wait_stat_ != nullptr) batch_wait_stat_->Add(wait_usecs);
 
   // If the buffer is still empty, it must be because the merger loop is done
   // due to an EoF.
@@ -137,12 +201,37 @@ Status RecordBatcher::GetNext(int64* bucket, TensorVec* batch) {
 
   *bucket = curr_bucket_;
   curr_bucket_ = -1;
+  ChargeBytes(-TotalBytes(curr_));
   using std::swap;
   swap(*(batch), curr_);
   curr_.clear();
   return Status::OK();
 }
 
+void RecordBatcher::ChargeBytes(int64 bytes) {
+  bytes_ += bytes;
+  if (opts_.memory_budget == nullptr) return;
+  if (bytes > 0) {
+    opts_.memory_budget->Charge(bytes);
+  } else {
+    opts_.memory_budget->Release(-bytes);
+  }
+}
+
+void RecordBatcher::AddBatchStats(int64 id, const Tensor& bucket_keys) {
+  if (bucket_stats_.empty()) return;
+  auto t_bucket_keys = bucket_keys.flat<int32>();
+  const int64 num = t_bucket_keys.size();
+  int64 tokens = 0;
+  for (int64 i = 0; i < num; ++i) tokens += t_bucket_keys(i);
+  const BucketStats& stats = bucket_stats_[id];
+  ++*stats.batches;
+  *stats.samples += num;
+  stats.fill_percent->Add(100 * num / opts_.bucket_batch_limit[id]);
+  *tokens_stat_ += tokens;
+  *padded_tokens_stat_ += num * bucket_upper_bound_[id];
+}
+
 void RecordBatcher::IncrementHistogram(int64 bucket) {
   if (bucket > bucket_upper_bound_.back()) return;
   length_histogram_[bucket]++;
@@ -278,116 +367,147 @@ void RecordBatcher::FlushAllBuckets() {
   }
 }
 
-void RecordBatcher::ProcessorLoop() {
+void RecordBatcher::ProcessorLoop(int index) {
   // Multiply next_status_update_duration_seconds_ by 2 every update.
   const int64 status_update_duration_multiplier = 2;
   std::vector<int64> out_of_range_buckets;
+  std::vector<Record> records;
+  std::vector<Processed> processed;
+  // Whether this thread may run, i.e., is active or should exit.
+  struct MayRun {
+    const RecordBatcher* batcher;
+    int index;
+    bool Eval() const {
+      return batcher->stop_ || index < batcher->active_threads_;
+    }
+  };
+  MayRun may_run{this, index};
+  Condition may_run_cond(&may_run, &MayRun::Eval);
   while (true) {
     {
       MutexLock l(&mu_);
+      if (index >= active_threads_) mu_.Await(may_run_cond);
       if (stop_) {
         return;
       }
     }
 
-    // Get the next record.
-    Record record;
-    record.source_id = kDefaultSourceId;
-    Status s = yielder_->Yield(&record);
-    // If yielder returns OutOfRange, set
-    // the out status appropriately and return.
-    if (errors::IsOutOfRange(s)) {
-      MutexLock l(&mu_);
-      stop_status_ = s;
-      stop_ = true;
-      return;
-    }
-
-    if (!s.ok()) {
-      LOG(WARNING) << s;
-      continue;
+    // Get the next few records. Records yielded before an error are still
+    // processed.
+    records.clear();
+    const uint64 start = Env::Default()->NowMicros();
+    const Status yield_status =
+        yielder_->YieldBatch(kRecordsPerYield, &records);
+    producer_idle_usecs_ += Env::Default()->NowMicros() - start;
+    if (!yield_status.ok() && !errors::IsOutOfRange(yield_status)) {
+      LOG(WARNING) << yield_status;
     }
 
-    // Parse the record.
-    int64 bucket;
-    TensorVec sample;
-    s = processor_->Process(record, &bucket, &sample);
-    if (!s.ok()) {
-      // Print error message. Some example processors use CANCELLED for data
-      // that are filtered out. Print only first 10 such errors.
-      if (errors::IsCancelled(s)) {
-        // The counter incrementing is not thread-safe. But we don't really
-        // care.
-        static int log_counter = 0;
-        if (log_counter < 10) {
-          log_counter++;
+    // Parse the records.
+    processed.clear();
+    for (const Record& record : records) {
+      int64 bucket;
+      TensorVec sample;
+      const uint64 start =
+          process_usecs_stat_ != nullptr ? Env::Default()->NowMicros() : 0;
+      Status s = processor_->Process(record, &bucket, &sample);
+      if (process_usecs_stat_ != nullptr) {
+        process_usecs_stat_->Add(Env::Default()->NowMicros() - start);
+        if (!s.ok()) ++*records_failed_stat_;
+      }
+      if (!s.ok()) {
+        // Print error message. Some example processors use CANCELLED for data
+        // that are filtered out. Print only first 10 such errors.
+        if (errors::IsCancelled(s)) {
+          // The counter incrementing is not thread-safe. But we don't really
+          // care.
+          static int log_counter = 0;
+          if (log_counter < 10) {
+            log_counter++;
+            LOG(WARNING) << s;
+          }
+        } else if (errors::IsNotFound(s)) {
+          // Terminates program if an unregistered custome op is used by
+          // the processor.
+          //
+          // Consider setting *out_status with s and returning, instead
+          // of killing program?
+          LOG(FATAL) << s;
+        } else {
           LOG(WARNING) << s;
         }
-      } else if (errors::IsNotFound(s)) {
-        // Terminates program if an unregistered custome op is used by
-        // the processor.
-        //
-        // Consider setting *out_status with s and returning, instead
-        // of killing program?
-        LOG(FATAL) << s;
-      } else {
-        LOG(WARNING) << s;
+        continue;
       }
-      continue;
+      processed.push_back({bucket, std::move(sample)});
     }
 
     MutexLock l(&mu_);
 
-    if (opts_.bucket_adjust_every_n > 0) {
-      const int64 records_processed =
-          total_records_yielded_ + total_records_skipped_;
-      if (records_processed % opts_.bucket_adjust_every_n == 0 &&
-          total_records_yielded_ > 0) {
-        AdjustBuckets();
+    for (Processed& p : processed) {
+      const int64 bucket = p.bucket_key;
+      if (opts_.bucket_adjust_every_n > 0) {
+        const int64 records_processed =
+            total_records_yielded_ + total_records_skipped_;
+        if (records_processed % opts_.bucket_adjust_every_n == 0 &&
+            total_records_yielded_ > 0) {
+          AdjustBuckets();
+        }
+        IncrementHistogram(bucket);
       }
-      IncrementHistogram(bucket);
-    }
 
-    // Figure out which bucket it belongs to.
-    auto iter = std::lower_bound(bucket_upper_bound_.begin(),
-                                 bucket_upper_bound_.end(), bucket);
+      // Figure out which bucket it belongs to.
+      auto iter = std::lower_bound(bucket_upper_bound_.begin(),
+                                   bucket_upper_bound_.end(), bucket);
 
-    if (iter == bucket_upper_bound_.end()) {
-      VLOG(1) << "Skip. bucket out-of-range " << bucket;
-      if (out_of_range_buckets.size() < 10) {
-        out_of_range_buckets.push_back(bucket);
-      }
-      ++total_records_skipped_;
-    } else {
-      // Figure out which buckets we should return to the consumer.
-      // A bucket (id-th) is full.
-      const int id = iter - bucket_upper_bound_.begin();
-      const int64 batch_limit = opts_.bucket_batch_limit[id];
-      if (buckets_[id].size() + 1 == batch_limit) {
-        WaitForToFlushEmpty();
-        if (stop_) {
-          return;
+      if (iter == bucket_upper_bound_.end()) {
+        VLOG(1) << "Skip. bucket out-of-range " << bucket;
+        if (out_of_range_buckets.size() < 10) {
+          out_of_range_buckets.push_back(bucket);
         }
-      }
-      // Invariant is either we don't need to flush this bucket after adding a
-      // new element to it, or to_flush_ is empty and we can flush this bucket.
-      CHECK(buckets_[id].size() + 1 < batch_limit || to_flush_.empty());
-      buckets_[id].push_back({bucket, std::move(sample)});
-      if (buckets_[id].size() == batch_limit) {
-        to_flush_.push_back({id, std::move(buckets_[id])});
-        buckets_[id].clear();
-      }
-      CHECK_LT(buckets_[id].size(), batch_limit);  // invariant.
+        ++total_records_skipped_;
+        if (records_skipped_stat_ != nullptr) ++*records_skipped_stat_;
+      } else {
+        // Figure out which buckets we should return to the consumer.
+        // A bucket (id-th) is full.
+        const int id = iter - bucket_upper_bound_.begin();
+        const int64 batch_limit = opts_.bucket_batch_limit[id];
+        if (buckets_[id].size() + 1 == batch_limit) {
+          WaitForToFlushEmpty();
+          if (stop_) {
+            return;
+          }
+        }
+        // Invariant is either we don't need to flush this bucket after adding
+        // a new element to it, or to_flush_ is empty and we can flush this
+        // bucket.
+        CHECK(buckets_[id].size() + 1 < batch_limit || to_flush_.empty());
+        ChargeBytes(TotalBytes(p.sample));
+        buckets_[id].push_back(std::move(p));
+        if (buckets_[id].size() == batch_limit) {
+          to_flush_.push_back({id, std::move(buckets_[id])});
+          buckets_[id].clear();
+        }
+        CHECK_LT(buckets_[id].size(), batch_limit);  // invariant.
 
-      ++records_yielded_;
-      ++total_records_yielded_;
+        ++records_yielded_;
+        ++total_records_yielded_;
 
-      if (opts_.flush_every_n > 0 && records_yielded_ >= opts_.flush_every_n) {
-        FlushAllBuckets();
-        records_yielded_ = 0;
+        if (opts_.flush_every_n > 0 &&
+            records_yielded_ >= opts_.flush_every_n) {
+          FlushAllBuckets();
+          records_yielded_ = 0;
+        }
       }
     }
 
+    // If yielder returns OutOfRange, set
+    // the out status appropriately and return.
+    if (errors::IsOutOfRange(yield_status)) {
+      stop_status_ = yield_status;
+      stop_ = true;
+      return;
+    }
+
     std::time_t current_time = std::time(nullptr);
     if (current_time - last_log_update_time_ >
         next_status_update_duration_seconds_) {
@@ -395,6 +515,10 @@ void RecordBatcher::ProcessorLoop() {
                 << " total seconds passed. Total records yielded: "
                 << total_records_yielded_
                 << ". Total records skipped: " << total_records_skipped_;
+      if (opts_.memory_budget != nullptr) {
+        LOG(INFO) << "Batcher holds " << bytes_ << " bytes. "
+                  << opts_.memory_budget->DebugString();
+      }
       for (auto bucket : out_of_range_buckets) {
         LOG(INFO) << "Out-of-range sample: " << bucket;
       }
@@ -407,6 +531,22 @@ void RecordBatcher::ProcessorLoop() {
   }
 }
 
+void RecordBatcher::Tune() {
+  MutexLock l(&mu_);
+  if (stop_) return;
+  const uint64 now = Env::Default()->NowMicros();
+  const int num_threads =
+      tuner_->Update(now - last_tune_micros_, consumer_wait_usecs_,
+                     producer_idle_usecs_.exchange(0));
+  consumer_wait_usecs_ = 0;
+  last_tune_micros_ = now;
+  if (num_threads != active_threads_) {
+    // Paused threads see the change when mu_ is released.
+    LOG(INFO) << "Processes records with " << num_threads << " threads";
+    active_threads_ = num_threads;
+  }
+}
+
 void RecordBatcher::MergerLoop() {
   FlushList to_flush;
   std::vector<TensorVec> samples;
@@ -438,19 +578,32 @@ void RecordBatcher::MergerLoop() {
       const int32 num = p.second.size();
       Tensor bucket_keys(DT_INT32, {num});
       auto t_bucket_keys = bucket_keys.flat<int32>();
+      int64 sample_bytes = 0;
       for (int i = 0; i < num; ++i) {
         auto processed = p.second[i];
         t_bucket_keys(i) = processed.bucket_key;
+        sample_bytes += TotalBytes(processed.sample);
         samples.push_back(std::move(processed.sample));
       }
       merged.clear();
+      const uint64 start = Env::Default()->NowMicros();
       Status s = processor_->Merge(bucket_upper_bound_[id], samples, &merged);
+      if (merge_usecs_stat_ != nullptr) {
+        merge_usecs_stat_->Add(Env::Default()->NowMicros() - start);
+      }
       samples.clear();
+      p.second.clear();
       if (!s.ok()) {
         LOG(WARNING) << "Failed to create a batch: " << s;
+        MutexLock l(&mu_);
+        ChargeBytes(-sample_bytes);
       } else {
         merged.push_back(bucket_keys);
+        AddBatchStats(id, bucket_keys);
+        const int64 merged_bytes = TotalBytes(merged);
         MutexLock l(&mu_);
+        // The merged batch replaces its samples.
+        ChargeBytes(merged_bytes - sample_bytes);
         WaitForCurrEmpty();
 
         // If stopped due to destructor, just exit, since there should be no
@@ -16,10 +16,16 @@ limitations under the License.
 #ifndef LINGVO_CORE_OPS_RECORD_BATCHER_H_
 #define LINGVO_CORE_OPS_RECORD_BATCHER_H_
 
+#include <atomic>
 #include <cstddef>
+#include <memory>
 #include <vector>
 
+#include "lingvo/core/ops/input_stats.h"
+#include "lingvo/core/ops/io_executor.h"
+#include "lingvo/core/ops/memory_budget.h"
 #include "lingvo/core/ops/mutex.h"
+#include "lingvo/core/ops/parallelism_tuner.h"
 #include "lingvo/core/ops/record_yielder.h"
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/lib/core/errors.h"
@@ -87,6 +93,27 @@ class RecordBatcher {
     // Number of threads to use for record batcher, each thread
     // fills separate batches based on bucket limits.
     int64 num_threads = 1;
+
+    // If greater than num_threads, up to this many threads are started, of
+    // which between num_threads and max_num_threads are active, tuned every
+    // second by a ParallelismTuner from how long GetNext() waits for batches
+    // and how long the active threads wait for records or for the merger.
+    int64 max_num_threads = 0;
+
+    // If set, the bytes of the samples and batches held by the batcher are
+    // charged to this budget. Typically shared with the yielder, whose buffer
+    // makes room for them.
+    std::shared_ptr<MemoryBudget> memory_budget;
+
+    // If set, the batcher adds the latencies of Process() and Merge(), the
+    // time GetNext() waits for a batch, how full the batches of each bucket
+    // are and how much of them is padding to these stats. The padding
+    // assumes the bucket keys are lengths. Not owned.
+    InputStats* stats = nullptr;
+
+    // If set, Tune() is called periodically by this executor rather than by
+    // IoExecutor::Get(), e.g., in tests. Not owned.
+    IoExecutor* io_executor = nullptr;
   };
   RecordBatcher(const Options& opts, RecordYielder* yielder,
                 RecordProcessor* processor);
@@ -97,6 +124,12 @@ class RecordBatcher {
   // from 'bucket_id'-th bucket.
   Status GetNext(int64* bucket_id, TensorVec* batch);
 
+  // Returns the number of processor threads currently active.
+  int64 active_threads() {
+    MutexLock l(&mu_);
+    return active_threads_;
+  }
+
  private:
   typedef RecordBatcher ME;
   struct Processed {
@@ -134,6 +167,21 @@ class RecordBatcher {
   int64 total_records_skipped_ GUARDED_BY(mu_) = 0;
   std::vector<Batch> buckets_ GUARDED_BY(mu_);
   int64 processor_loop_done_count_ GUARDED_BY(mu_) = 0;
+
+  // The number of processor threads started, and the number of them active,
+  // tuned by tuner_ if opts_.max_num_threads > opts_.num_threads.
+  int64 num_threads_ = 1;
+  int64 active_threads_ GUARDED_BY(mu_) = 1;
+  std::unique_ptr<ParallelismTuner> tuner_;
+  // The executor calling Tune() and the id of Tune() on it, if tuner_ is set.
+  IoExecutor* io_executor_ = nullptr;
+  int64 tune_id_ = -1;
+  uint64 last_tune_micros_ GUARDED_BY(mu_) = 0;
+
+  // Microseconds GetNext() waited for batches and the processor threads
+  // waited for records or for to_flush_, since tuner_ was last updated.
+  int64 consumer_wait_usecs_ GUARDED_BY(mu_) = 0;
+  std::atomic<int64> producer_idle_usecs_{0};
   FlushList to_flush_ GUARDED_BY(mu_);
   Condition to_flush_empty_;
   Condition to_flush_non_empty_;
@@ -141,9 +189,31 @@ class RecordBatcher {
   std::time_t last_log_update_time_ GUARDED_BY(mu_);
   int64 next_status_update_duration_seconds_ GUARDED_BY(mu_) = 60;
 
+  // Bytes of the samples and batches held, i.e., charged to
+  // opts_.memory_budget if set.
+  int64 bytes_ GUARDED_BY(mu_) = 0;
+
   std::vector<int64> length_histogram_;
   std::vector<int64> bucket_upper_bound_;
 
+  // The stats of opts_.stats, or null.
+  struct BucketStats {
+    std::atomic<int64>* batches;
+    std::atomic<int64>* samples;
+    StatsHistogram* fill_percent;
+  };
+  std::vector<BucketStats> bucket_stats_;
+  StatsHistogram* process_usecs_stat_ = nullptr;
+  StatsHistogram* merge_usecs_stat_ = nullptr;
+  StatsHistogram* batch_wait_stat_ = nullptr;
+  std::atomic<int64>* records_failed_stat_ = nullptr;
+  std::atomic<int64>* records_skipped_stat_ = nullptr;
+  std::atomic<int64>* tokens_stat_ = nullptr;
+  std::atomic<int64>* padded_tokens_stat_ = nullptr;
+
+  // Adds the stats of a merged batch of the bucket 'id' with 'bucket_keys'.
+  void AddBatchStats(int64 id, const Tensor& bucket_keys);
+
   // Conditions.
   bool CurrEmpty() const SHARED_LOCKS_REQUIRED(mu_) {
     return ((stop_ && stop_status_.ok()) ||  // The object is being destroyed
@@ -166,13 +236,19 @@ class RecordBatcher {
   }
 
   bool ProcessorsDone() const SHARED_LOCKS_REQUIRED(mu_) {
-    return processor_loop_done_count_ == opts_.num_threads;
+    return processor_loop_done_count_ == num_threads_;
   }
 
-  void ProcessorLoop();
+  // The loop of the 'index'-th processor thread, which pauses while 'index'
+  // is not below active_threads_.
+  void ProcessorLoop(int index);
   void MergerLoop();
 
+  // Updates tuner_. Called periodically by io_executor_.
+  void Tune();
+
   void AdjustBuckets() EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void ChargeBytes(int64 bytes) EXCLUSIVE_LOCKS_REQUIRED(mu_);
   void FlushAllBuckets() EXCLUSIVE_LOCKS_REQUIRED(mu_);
   void IncrementHistogram(int64 bucket) EXCLUSIVE_LOCKS_REQUIRED(mu_);
 
@@ -17,6 +17,7 @@ limitations under the License.
 
 #include <gtest/gtest.h>
 #include "lingvo/core/ops/input_common.h"
+#include "lingvo/core/ops/io_executor.h"
 #include "lingvo/core/ops/sequential_record_yielder.h"
 #include "tensorflow/core/lib/core/errors.h"
 #include "tensorflow/core/lib/io/path.h"
@@ -252,6 +253,110 @@ TEST(RecordBatcher, FullEpoch) {
   }
 }
 
+TEST(RecordBatcher, MemoryBudget) {
+  const int N = 1000;
+  const string filename = io::JoinPath("/tmp", "memory_budget");
+  GenerateTestData(filename, N, false /* random_value */);
+  auto budget = std::make_shared<MemoryBudget>(64 << 10);
+
+  BasicRecordYielder::Options yopts;
+  yopts.file_pattern = strings::StrCat("tfrecord:", filename);
+  yopts.seed = 301;
+  yopts.bufsize = N;
+  yopts.parallelism = 1;
+  yopts.memory_budget = budget;
+
+  RecordBatcher::Options bopts;
+  bopts.bucket_upper_bound = {20};
+  bopts.bucket_batch_limit = {8};
+  bopts.flush_every_n = N;
+  bopts.memory_budget = budget;
+
+  {
+    RecordBatcher batcher(bopts, BasicRecordYielder::New(yopts),
+                          new TestRP());
+    int64 bucket_id;
+    TensorVec batch;
+    std::vector<string> records;
+    while (records.size() < N) {
+      TF_CHECK_OK(batcher.GetNext(&bucket_id, &batch));
+      const Tensor& t = batch[0];
+      for (int j = 0; j < t.dim_size(0); ++j) {
+        records.push_back(t.vec<tstring>()(j));
+      }
+    }
+    std::sort(records.begin(), records.end());
+    for (int i = 0; i < N; ++i) {
+      EXPECT_EQ(strings::Printf("%010d", i), records[i]);
+    }
+    EXPECT_LT(0, budget->usage());
+  }
+  // Everything held by the yielder and the batcher is released.
+  EXPECT_EQ(0, budget->usage());
+  EXPECT_LT(0, budget->peak());
+}
+
+// A processor which takes 'usecs' per record.
+class SlowRP : public TestRP {
+ public:
+  explicit SlowRP(int64 usecs) : usecs_(usecs) {}
+
+  Status Process(const Record& record, int64* bucket_key,
+                 TensorVec* sample) override {
+    Env::Default()->SleepForMicroseconds(usecs_);
+    return TestRP::Process(record, bucket_key, sample);
+  }
+
+ private:
+  const int64 usecs_;
+};
+
+TEST(RecordBatcher, TunedThreads) {
+  const int N = 800;
+  const string filename = io::JoinPath("/tmp", "tuned_threads");
+  GenerateTestData(filename, N, false /* random_value */);
+
+  BasicRecordYielder::Options yopts;
+  yopts.file_pattern = strings::StrCat("tfrecord:", filename);
+  yopts.seed = 301;
+  yopts.bufsize = 100;
+  yopts.parallelism = 1;
+
+  RecordBatcher::Options bopts;
+  bopts.bucket_upper_bound = {20};
+  bopts.bucket_batch_limit = {8};
+  bopts.flush_every_n = N;
+  bopts.num_threads = 1;
+  bopts.max_num_threads = 4;
+  // Tune() only runs when the test calls RunPeriodic().
+  IoExecutor executor(1, 1, /* periodic_micros */ 0);
+  bopts.io_executor = &executor;
+
+  // The single thread is the bottleneck, so that GetNext() waits for most of
+  // every interval, which activates more of them. No record is lost or
+  // repeated on the way.
+  RecordBatcher batcher(bopts, BasicRecordYielder::New(yopts),
+                        new SlowRP(2000));
+  EXPECT_EQ(1, batcher.active_threads());
+  int64 bucket_id;
+  TensorVec batch;
+  std::vector<string> records;
+  while (records.size() < N) {
+    TF_CHECK_OK(batcher.GetNext(&bucket_id, &batch));
+    const Tensor& t = batch[0];
+    for (int j = 0; j < t.dim_size(0); ++j) {
+      records.push_back(t.vec<tstring>()(j));
+    }
+    executor.RunPeriodic();
+  }
+  EXPECT_LT(1, batcher.active_threads());
+  ASSERT_EQ(N, records.size());
+  std::sort(records.begin(), records.end());
+  for (int i = 0; i < N; ++i) {
+    EXPECT_EQ(strings::Printf("%010d", i), records[i]);
+  }
+}
+
 TEST(RecordBatcher, CaptureYielderStatus) {
   const int N = 50;
   const string filename = io::JoinPath("/tmp", "full_epoch");
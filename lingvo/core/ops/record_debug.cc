@@ -24,9 +24,11 @@ namespace lingvo {
 void BasicRecordYielder::WaitForBufEnough() {
   if (!BufEnough()) {
     auto start = Env::Default()->NowMicros();
-    mu_.Await(buf_enough_);
-    VLOG(1) << "Wait for buf containing enough records: "
-            << (Env::Default()->NowMicros() - start) * 1e-6
+    Await(buf_enough_);
+    const int64 usecs = Env::Default()->NowMicros() - start;
+    consumer_wait_usecs_ += usecs;
+    if (yield_wait_stat_ != nullptr) yield_wait_stat_->Add(usecs);
+    VLOG(1) << "Wait for buf containing enough records: " << usecs * 1e-6
             << " Hint: Check network condition (e.g., are files in the same "
             << "data center) and/or increase file_parallelism.";
   }
@@ -57,8 +59,9 @@ void RecordBatcher::WaitForToFlushEmpty() {
   if (!ToFlushEmpty()) {
     auto start = Env::Default()->NowMicros();
     mu_.Await(to_flush_empty_);
-    VLOG(3) << "Wait for to_flush empty: "
-            << (Env::Default()->NowMicros() - start) * 1e-6
+    const int64 usecs = Env::Default()->NowMicros() - start;
+    producer_idle_usecs_ += usecs;
+    VLOG(3) << "Wait for to_flush empty: " << usecs * 1e-6
             << " Hint: Expected to be the common case.";
   }
 }
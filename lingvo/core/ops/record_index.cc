@@ -0,0 +1,216 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/record_index.h"
+
+#include <memory>
+#include <random>
+
+#include "tensorflow/core/lib/core/coding.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/hash/crc32c.h"
+#include "tensorflow/core/lib/hash/hash.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+#include "tensorflow/core/lib/strings/stringprintf.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/logging.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+namespace {
+
+// See tensorflow/core/lib/io/record_writer.h for the format:
+//   uint64    length
+//   uint32    masked crc of length
+//   byte      data[length]
+//   uint32    masked crc of data
+constexpr size_t kHeaderSize = sizeof(uint64) + sizeof(uint32);
+constexpr size_t kFooterSize = sizeof(uint32);
+
+// An index is written into <file>.idx.tmp.<random> first.
+constexpr char kTmpInfix[] = ".tmp.";
+
+// Record headers are scanned in blocks of this many bytes.
+constexpr size_t kScanBlockSize = 1 << 20;
+
+Status ParseHeader(const char* header, uint64* length) {
+  *length = core::DecodeFixed64(header);
+  if (crc32c::Unmask(core::DecodeFixed32(header + sizeof(uint64))) !=
+      crc32c::Value(header, sizeof(uint64))) {
+    return errors::DataLoss("Corrupted record header");
+  }
+  return Status::OK();
+}
+
+// The finalizer of SplitMix64. Used as the round function of the Feistel
+// network.
+uint64 Mix64(uint64 x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+}  // namespace
+
+bool IsTFRecordIndexFile(const string& filename) {
+  return str_util::EndsWith(filename, kTFRecordIndexSuffix) ||
+         filename.find(strings::StrCat(kTFRecordIndexSuffix, kTmpInfix)) !=
+             string::npos;
+}
+
+Status BuildTFRecordIndex(const string& filename,
+                          std::vector<uint64>* offsets) {
+  offsets->clear();
+  Env* env = Env::Default();
+  uint64 file_size = 0;
+  TF_RETURN_IF_ERROR(env->GetFileSize(filename, &file_size));
+  std::unique_ptr<RandomAccessFile> file;
+  TF_RETURN_IF_ERROR(env->NewRandomAccessFile(filename, &file));
+  std::unique_ptr<char[]> scratch(new char[kScanBlockSize]);
+  // The bytes of the file read last, starting at 'block_offset'.
+  StringPiece block;
+  uint64 block_offset = 0;
+  uint64 pos = 0;
+  while (pos < file_size) {
+    if (pos + kHeaderSize > block_offset + block.size()) {
+      // Reads the block starting at the next header. Records larger than a
+      // block are skipped without reading their data.
+      block_offset = pos;
+      Status s = file->Read(pos, kScanBlockSize, &block, scratch.get());
+      if (!s.ok() && !errors::IsOutOfRange(s)) return s;
+      if (block.size() < kHeaderSize) {
+        return errors::DataLoss("Truncated record header at ", pos, " in ",
+                                filename);
+      }
+    }
+    uint64 length = 0;
+    Status s = ParseHeader(block.data() + (pos - block_offset), &length);
+    if (!s.ok()) {
+      return errors::DataLoss(s.error_message(), " at ", pos, " in ",
+                              filename);
+    }
+    offsets->push_back(pos);
+    if (length > file_size - pos) {
+      return errors::DataLoss("Truncated record at ", pos, " in ", filename);
+    }
+    pos += kHeaderSize + length + kFooterSize;
+  }
+  if (pos != file_size) {
+    return errors::DataLoss("Truncated record at ", offsets->back(), " in ",
+                            filename);
+  }
+  offsets->push_back(file_size);
+  return Status::OK();
+}
+
+Status WriteTFRecordIndex(const string& filename,
+                          const std::vector<uint64>& offsets) {
+  string content;
+  content.reserve(offsets.size() * sizeof(uint64));
+  for (uint64 offset : offsets) core::PutFixed64(&content, offset);
+  // Readers never see a partial index, even if several processes write it.
+  Env* env = Env::Default();
+  const string path = strings::StrCat(filename, kTFRecordIndexSuffix);
+  const uint64 suffix = Hash64Combine(env->NowMicros(), std::random_device{}());
+  const string tmp_path = strings::StrCat(
+      path, kTmpInfix,
+      strings::Printf("%016llx", static_cast<unsigned long long>(suffix)));
+  Status s = WriteStringToFile(env, tmp_path, content);
+  if (s.ok()) s = env->RenameFile(tmp_path, path);
+  if (!s.ok()) env->DeleteFile(tmp_path).IgnoreError();
+  return s;
+}
+
+Status LoadTFRecordIndex(const string& filename,
+                         std::vector<uint64>* offsets) {
+  Env* env = Env::Default();
+  uint64 file_size = 0;
+  TF_RETURN_IF_ERROR(env->GetFileSize(filename, &file_size));
+  const string path = strings::StrCat(filename, kTFRecordIndexSuffix);
+  string content;
+  if (env->FileExists(path).ok() &&
+      ReadFileToString(env, path, &content).ok() && !content.empty() &&
+      content.size() % sizeof(uint64) == 0) {
+    offsets->resize(content.size() / sizeof(uint64));
+    bool valid = true;
+    for (size_t i = 0; i < offsets->size(); ++i) {
+      (*offsets)[i] = core::DecodeFixed64(content.data() + i * sizeof(uint64));
+      valid = valid && (i == 0 ? (*offsets)[i] == 0
+                               : (*offsets)[i] >= (*offsets)[i - 1] +
+                                                      kHeaderSize +
+                                                      kFooterSize);
+    }
+    if (valid && offsets->back() == file_size) return Status::OK();
+    LOG(WARNING) << "Rebuilds the stale index " << path;
+  }
+  TF_RETURN_IF_ERROR(BuildTFRecordIndex(filename, offsets));
+  Status s = WriteTFRecordIndex(filename, *offsets);
+  if (!s.ok()) VLOG(1) << "Failed to write " << path << ": " << s;
+  return Status::OK();
+}
+
+Status ParseTFRecord(StringPiece framed, StringPiece* record) {
+  uint64 length = 0;
+  if (framed.size() < kHeaderSize + kFooterSize) {
+    return errors::DataLoss("Truncated record");
+  }
+  TF_RETURN_IF_ERROR(ParseHeader(framed.data(), &length));
+  if (framed.size() != kHeaderSize + length + kFooterSize) {
+    return errors::DataLoss("Record of ", length, " bytes in ", framed.size(),
+                            " bytes");
+  }
+  const char* data = framed.data() + kHeaderSize;
+  if (crc32c::Unmask(core::DecodeFixed32(data + length)) !=
+      crc32c::Value(data, length)) {
+    return errors::DataLoss("Corrupted record");
+  }
+  *record = StringPiece(data, length);
+  return Status::OK();
+}
+
+RandomPermutation::RandomPermutation(uint64 n, uint64 seed) : n_(n) {
+  while (half_bits_ < 32 && (uint64{1} << (2 * half_bits_)) < n) {
+    ++half_bits_;
+  }
+  half_mask_ = (uint64{1} << half_bits_) - 1;
+  for (int r = 0; r < kNumRounds; ++r) {
+    keys_[r] = Mix64(Hash64Combine(seed, r));
+  }
+}
+
+uint64 RandomPermutation::operator()(uint64 i) const {
+  // The domain has fewer than 4 * n_ elements, so that a few rounds of cycle
+  // walking are expected.
+  uint64 x = i;
+  do {
+    uint64 left = x >> half_bits_;
+    uint64 right = x & half_mask_;
+    for (int r = 0; r < kNumRounds; ++r) {
+      const uint64 next = left ^ (Mix64(keys_[r] ^ right) & half_mask_);
+      left = right;
+      right = next;
+    }
+    x = (left << half_bits_) | right;
+  } while (x >= n_);
+  return x;
+}
+
+}  // namespace lingvo
+}  // namespace tensorflow
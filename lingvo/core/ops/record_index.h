@@ -0,0 +1,80 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef LINGVO_CORE_OPS_RECORD_INDEX_H_
+#define LINGVO_CORE_OPS_RECORD_INDEX_H_
+
+#include <string>
+#include <vector>
+
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/stringpiece.h"
+#include "tensorflow/core/platform/types.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+// The index of an uncompressed TFRecord file <file> is stored next to it in
+// <file>.idx, as the little-endian fixed64 offsets of its records followed by
+// the length of the file, so that record i is the bytes
+// [offsets[i], offsets[i + 1]) of the file.
+constexpr char kTFRecordIndexSuffix[] = ".idx";
+
+// Returns true if 'filename' is an index file, or a temporary one being
+// written.
+bool IsTFRecordIndexFile(const string& filename);
+
+// Scans the record headers of the TFRecord file 'filename' and fills in
+// 'offsets' as described above.
+Status BuildTFRecordIndex(const string& filename, std::vector<uint64>* offsets);
+
+// Writes 'offsets' into the index file of 'filename'.
+Status WriteTFRecordIndex(const string& filename,
+                          const std::vector<uint64>& offsets);
+
+// Reads the index of 'filename' from its index file. If there is none, or it
+// does not match the length of 'filename', builds the index and tries to
+// write the index file for the next time.
+Status LoadTFRecordIndex(const string& filename, std::vector<uint64>* offsets);
+
+// Verifies the framing of the single TFRecord 'framed', i.e., the bytes
+// between two offsets of an index, and sets 'record' to its data.
+Status ParseTFRecord(StringPiece framed, StringPiece* record);
+
+// A pseudo-random permutation of [0, n) computed on the fly by a Feistel
+// network over the smallest domain of 4^k >= n elements, which cycle-walks
+// past the values >= n. Shuffling n items this way takes no memory.
+class RandomPermutation {
+ public:
+  RandomPermutation(uint64 n, uint64 seed);
+
+  uint64 size() const { return n_; }
+
+  // Returns the position of 'i' < size() in the permutation.
+  uint64 operator()(uint64 i) const;
+
+ private:
+  static constexpr int kNumRounds = 4;
+
+  uint64 n_;
+  int half_bits_ = 1;
+  uint64 half_mask_ = 1;
+  uint64 keys_[kNumRounds];
+};
+
+}  // namespace lingvo
+}  // namespace tensorflow
+
+#endif  // LINGVO_CORE_OPS_RECORD_INDEX_H_
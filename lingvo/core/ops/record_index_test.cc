@@ -0,0 +1,130 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/record_index.h"
+
+#include <gtest/gtest.h>
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/lib/io/record_writer.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+#include "tensorflow/core/platform/env.h"
+
+namespace tensorflow {
+namespace lingvo {
+namespace {
+
+// Writes a TFRecord file with records of 'sizes' bytes and returns its name.
+string WriteRecords(const string& name, const std::vector<int>& sizes) {
+  const string filename = io::JoinPath("/tmp", name);
+  std::unique_ptr<WritableFile> file;
+  TF_CHECK_OK(Env::Default()->NewWritableFile(filename, &file));
+  io::RecordWriter writer(file.get());
+  for (int i = 0; i < sizes.size(); ++i) {
+    TF_CHECK_OK(writer.WriteRecord(string(sizes[i], 'a' + i % 26)));
+  }
+  TF_CHECK_OK(writer.Close());
+  TF_CHECK_OK(file->Close());
+  Env::Default()->DeleteFile(filename + kTFRecordIndexSuffix).IgnoreError();
+  return filename;
+}
+
+TEST(RecordIndex, Build) {
+  // Some records larger than the blocks the headers are scanned in.
+  const std::vector<int> sizes = {0, 10, 3 << 20, 100, 0, 2 << 20, 7};
+  const string filename = WriteRecords("record_index_build", sizes);
+  std::vector<uint64> offsets;
+  TF_CHECK_OK(BuildTFRecordIndex(filename, &offsets));
+  ASSERT_EQ(sizes.size() + 1, offsets.size());
+  string content;
+  TF_CHECK_OK(ReadFileToString(Env::Default(), filename, &content));
+  EXPECT_EQ(content.size(), offsets.back());
+  for (int i = 0; i < sizes.size(); ++i) {
+    StringPiece record;
+    TF_CHECK_OK(ParseTFRecord(
+        StringPiece(content).substr(offsets[i], offsets[i + 1] - offsets[i]),
+        &record));
+    EXPECT_EQ(string(sizes[i], 'a' + i % 26), record);
+  }
+
+  // A corrupted record is detected when it is read.
+  content[offsets[1] + 12] ^= 1;
+  StringPiece record;
+  EXPECT_TRUE(errors::IsDataLoss(ParseTFRecord(
+      StringPiece(content).substr(offsets[1], offsets[2] - offsets[1]),
+      &record)));
+
+  // A truncated file has no index.
+  TF_CHECK_OK(WriteStringToFile(Env::Default(), filename,
+                                content.substr(0, offsets[3] + 20)));
+  EXPECT_TRUE(errors::IsDataLoss(BuildTFRecordIndex(filename, &offsets)));
+}
+
+TEST(RecordIndex, Load) {
+  const string filename = WriteRecords("record_index_load", {5, 6, 7});
+  const string index_filename = filename + kTFRecordIndexSuffix;
+  EXPECT_TRUE(IsTFRecordIndexFile(index_filename));
+  EXPECT_FALSE(IsTFRecordIndexFile(filename));
+  std::vector<uint64> offsets;
+  TF_CHECK_OK(LoadTFRecordIndex(filename, &offsets));
+  EXPECT_EQ(4, offsets.size());
+  // The index was written for the next time.
+  TF_CHECK_OK(Env::Default()->FileExists(index_filename));
+  std::vector<uint64> loaded;
+  TF_CHECK_OK(LoadTFRecordIndex(filename, &loaded));
+  EXPECT_EQ(offsets, loaded);
+
+  // A stale index is rebuilt.
+  WriteRecords("record_index_load", {5, 6, 7, 8});
+  TF_CHECK_OK(WriteTFRecordIndex(filename, offsets));
+  TF_CHECK_OK(LoadTFRecordIndex(filename, &loaded));
+  EXPECT_EQ(5, loaded.size());
+}
+
+TEST(RandomPermutation, IsPermutation) {
+  for (uint64 n : {1, 2, 3, 5, 16, 17, 1000, 4097}) {
+    RandomPermutation permutation(n, 301);
+    std::vector<bool> seen(n);
+    for (uint64 i = 0; i < n; ++i) {
+      const uint64 j = permutation(i);
+      ASSERT_LT(j, n);
+      EXPECT_FALSE(seen[j]) << n << " " << i;
+      seen[j] = true;
+    }
+  }
+}
+
+TEST(RandomPermutation, Shuffles) {
+  const int n = 10000;
+  RandomPermutation a(n, 1);
+  RandomPermutation b(n, 2);
+  int num_fixed = 0;
+  int num_same = 0;
+  int64 displacement = 0;
+  for (int i = 0; i < n; ++i) {
+    num_fixed += a(i) == i;
+    num_same += a(i) == b(i);
+    displacement += std::abs(static_cast<int64>(a(i)) - i);
+  }
+  // About 1 for random permutations.
+  EXPECT_GT(10, num_fixed);
+  EXPECT_GT(10, num_same);
+  // About n / 3 on average.
+  EXPECT_LT(n / 4, displacement / n);
+}
+
+}  // namespace
+}  // namespace lingvo
+}  // namespace tensorflow
@@ -15,20 +15,26 @@ limitations under the License.
 
 #include "lingvo/core/ops/record_yielder.h"
 
-#include <chrono>  // NOLINT(build/c++11)
+#include <algorithm>
+#include <cstring>
 #include <memory>
+#include <numeric>
 #include <string>
-#include <thread>  // NOLINT(build/c++11)
 #include <unordered_map>
 
+#include "lingvo/core/ops/chunked_record.h"
 #include "lingvo/core/ops/mutex.h"
+#include "lingvo/core/ops/readahead_file.h"
+#include "lingvo/core/ops/record_index.h"
+#include "lingvo/core/ops/shard_cache.h"
 #include "lingvo/core/ops/versioned_file_set.pb.h"
+#include "lingvo/core/ops/yielder_state.pb.h"
+#include "tensorflow/core/lib/core/coding.h"
 #include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/hash/crc32c.h"
 #include "tensorflow/core/lib/hash/hash.h"
-#include "tensorflow/core/lib/io/buffered_inputstream.h"
 #include "tensorflow/core/lib/io/compression.h"
 #include "tensorflow/core/lib/io/path.h"
-#include "tensorflow/core/lib/io/random_inputstream.h"
 #include "tensorflow/core/lib/io/record_reader.h"
 #include "tensorflow/core/lib/strings/numbers.h"
 #include "tensorflow/core/lib/strings/str_util.h"
@@ -36,6 +42,10 @@ limitations under the License.
 #include "tensorflow/core/lib/strings/stringprintf.h"
 #include "tensorflow/core/platform/env.h"
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 namespace tensorflow {
 namespace lingvo {
 
@@ -44,9 +54,34 @@ namespace {
 // Number of records to batch for a single call to Add.
 const int kRecordsPerAdd = 16;
 
+// With global shuffling, each shard reads the records of this many
+// consecutive positions of the permutation at a time, sorted by file and
+// offset.
+const int kShuffleWindow = 256;
+
+// The files kept open by each shard with global shuffling.
+const int kMaxOpenFiles = 64;
+
+// A record entering the buffer which keeps more than this many times its
+// size alive, e.g., a short line viewing a whole block of a file, is copied,
+// so that the buffer does not hold on to mostly yielded blocks.
+const size_t kMaxRetainedRatio = 2;
+
+// Returns the room in a buffer of 'capacity' records that a shard which found
+// it full waits for, so that it adds a few batches each time it runs. At most
+// half the capacity, since consumers only wait while the buffer is less than
+// half full.
+int64 RoomToResume(int64 capacity) {
+  return std::max<int64>(
+      1, std::min<int64>(capacity / 2,
+                         std::max<int64>(kRecordsPerAdd, capacity / 8)));
+}
+
 struct Factory {
   Mutex mu;
   std::unordered_map<string, RecordIterator::FactoryMethod> creators;
+  std::unordered_map<string, RecordIterator::SplitFactoryMethod>
+      split_creators;
   std::unordered_map<string, RecordIterator::PatternParserMethod>
       pattern_parsers;
 };
@@ -89,6 +124,34 @@ Status MaybeExpandShardedFilePattern(const string& file_pattern,
   }
 }
 
+// Matches a file pattern, which may be a sharded one. A sharded file pattern
+// with a known number of shards, e.g., /path/name@100, is enumerated directly
+// rather than globbed, which is much faster on directories with many files.
+// Its shards are then expected to all exist.
+Status MatchShardedFilePattern(const string& file_pattern,
+                               std::vector<string>* filenames) {
+  const auto pos = file_pattern.find('@');
+  if (pos != string::npos) {
+    const string prefix = file_pattern.substr(0, pos);
+    uint32 num_shards = 0;
+    if (prefix.find_first_of("*?[\\") == string::npos &&
+        strings::safe_strtou32(file_pattern.substr(pos + 1), &num_shards) &&
+        num_shards <= 99999) {
+      filenames->clear();
+      filenames->reserve(num_shards);
+      for (uint32 i = 0; i < num_shards; ++i) {
+        filenames->push_back(strings::Printf("%s-%05u-of-%05u", prefix.c_str(),
+                                             i, num_shards));
+      }
+      return Status::OK();
+    }
+  }
+  string expanded_file_pattern;
+  TF_RETURN_IF_ERROR(
+      MaybeExpandShardedFilePattern(file_pattern, &expanded_file_pattern));
+  return Env::Default()->GetMatchingPaths(expanded_file_pattern, filenames);
+}
+
 // ParallelFilePatterns look like this
 //  <path1>/a-*-of-10;<path2>/b-*-of-10,<path3>/c-*-of-10;<path4>/d-*-of-10
 // Each "," separated pattern is a parallel file pattern.
@@ -102,12 +165,9 @@ Status MatchParallelFilePattern(const string& parallel_file_pattern,
                                 std::vector<string>* filenames) {
   std::vector<string> parallel_filenames;
   for (const auto& file_pattern : str_util::Split(parallel_file_pattern, ';')) {
-    string expanded_file_pattern;
-    TF_RETURN_IF_ERROR(
-        MaybeExpandShardedFilePattern(file_pattern, &expanded_file_pattern));
     std::vector<string> filenames_per_pattern;
-    TF_RETURN_IF_ERROR(Env::Default()->GetMatchingPaths(
-        expanded_file_pattern, &filenames_per_pattern));
+    TF_RETURN_IF_ERROR(
+        MatchShardedFilePattern(file_pattern, &filenames_per_pattern));
     if (parallel_filenames.empty()) {
       parallel_filenames.swap(filenames_per_pattern);
       continue;
@@ -153,8 +213,23 @@ Status GetFilePatternsFromCkptFile(const string& fileset_file,
   return Status::OK();
 }
 
+// Shards take turns on the IoExecutor after running for this long.
+constexpr uint64 kShardSliceMicros = 10000;
+
 }  // end namespace
 
+bool RecordIterator::NextBatch(int max, std::vector<Rope>* values,
+                               std::vector<string>* keys_or_null) {
+  string key;
+  Rope value;
+  int n = 0;
+  for (; n < max && Next(&key, &value); ++n) {
+    values->push_back(std::move(value));
+    if (keys_or_null != nullptr) keys_or_null->push_back(std::move(key));
+  }
+  return n > 0;
+}
+
 bool RecordIterator::Register(const string& type_name, FactoryMethod method) {
   return RegisterWithPatternParser(type_name, std::move(method),
                                    RecordIterator::PatternParserMethod());
@@ -173,6 +248,38 @@ bool RecordIterator::RegisterWithPatternParser(
   return ret;
 }
 
+bool RecordIterator::RegisterSplittable(const string& type_name,
+                                        SplitFactoryMethod method,
+                                        PatternParserMethod parser_method) {
+  const bool ret = RegisterWithPatternParser(
+      type_name,
+      [method](const string& filename) {
+        return method(FileSplit(filename));
+      },
+      std::move(parser_method));
+  Factory* factory = GetFactory();
+  MutexLock l(&factory->mu);
+  factory->split_creators.insert({type_name, std::move(method)});
+  return ret;
+}
+
+RecordIterator* RecordIterator::New(const string& type_name,
+                                    const FileSplit& split) {
+  if (split.offset == 0 && split.length == kuint64max) {
+    return New(type_name, split.filename);
+  }
+  Factory* factory = GetFactory();
+  RecordIterator::SplitFactoryMethod method;
+  {
+    MutexLock l(&factory->mu);
+    const auto iter = factory->split_creators.find(type_name);
+    CHECK(iter != factory->split_creators.end())
+        << "Format \"" << type_name << "\" does not support file splits";
+    method = iter->second;
+  }
+  return method(split);
+}
+
 RecordIterator* RecordIterator::New(const string& type_name,
                                     const string& filename) {
   Factory* factory = GetFactory();
@@ -204,7 +311,8 @@ string RecordIterator::GetFilePatternPrefix(const string& file_pattern) {
 
 Status RecordIterator::ParsePattern(const string& type_name,
                                     const string& file_pattern_list,
-                                    std::vector<string>* filenames) {
+                                    std::vector<string>* filenames,
+                                    IoExecutor::Queue* queue) {
   Factory* factory = GetFactory();
   RecordIterator::PatternParserMethod parser_method;
   {
@@ -217,44 +325,381 @@ Status RecordIterator::ParsePattern(const string& type_name,
   if (parser_method) {
     return parser_method(file_pattern_list, filenames);
   }
-  for (const auto& file_pattern : str_util::Split(file_pattern_list, ',')) {
-    std::vector<string> files_per_glob;
+  const std::vector<string> file_patterns =
+      str_util::Split(file_pattern_list, ',');
+  const int num_patterns = file_patterns.size();
+  std::vector<std::vector<string>> files_per_glob(num_patterns);
+  std::vector<Status> status(num_patterns);
+  if (num_patterns == 1) {
+    status[0] = MatchParallelFilePattern(file_patterns[0], &files_per_glob[0]);
+  } else {
+    std::unique_ptr<IoExecutor::Queue> own_queue;
+    if (queue == nullptr) {
+      own_queue = IoExecutor::Get()->NewQueue();
+      queue = own_queue.get();
+    }
+    queue->BlockingParallelFor(num_patterns, [&](int i) {
+      status[i] =
+          MatchParallelFilePattern(file_patterns[i], &files_per_glob[i]);
+    });
+  }
+  for (int i = 0; i < num_patterns; ++i) {
+    TF_RETURN_IF_ERROR(status[i]);
+    filenames->insert(filenames->end(),
+                      std::make_move_iterator(files_per_glob[i].begin()),
+                      std::make_move_iterator(files_per_glob[i].end()));
+  }
+  return Status::OK();
+}
+
+namespace {
+
+// Caches the file lists returned by ParsePattern across epochs and yielders.
+// A stale list is still returned while a fresh one is being listed in the
+// background, so that listing never delays the start of an epoch.
+class FileListCache {
+ public:
+  static FileListCache* Get() {
+    static FileListCache* cache = new FileListCache;
+    return cache;
+  }
+
+  // Lists the files not cached yet with 'queue', see ParsePattern().
+  Status Lookup(const string& type_name, const string& file_pattern_list,
+                int64 max_age_secs, std::vector<string>* filenames,
+                IoExecutor::Queue* queue) {
+    const string key = strings::StrCat(type_name, ":", file_pattern_list);
+    {
+      MutexLock l(&mu_);
+      auto iter = entries_.find(key);
+      if (iter != entries_.end()) {
+        Entry* entry = &iter->second;
+        if (max_age_secs > 0 && !entry->refreshing &&
+            Env::Default()->NowSeconds() - entry->list_time_secs >=
+                max_age_secs) {
+          entry->refreshing = true;
+          queue_->ScheduleBlocking(
+              [this, key, type_name, file_pattern_list]() {
+                Refresh(key, type_name, file_pattern_list);
+              });
+        }
+        *filenames = entry->filenames;
+        return Status::OK();
+      }
+    }
+    std::vector<string> listed;
+    TF_RETURN_IF_ERROR(RecordIterator::ParsePattern(
+        type_name, file_pattern_list, &listed, queue));
+    MutexLock l(&mu_);
+    Entry* entry = &entries_[key];
+    entry->filenames = listed;
+    entry->list_time_secs = Env::Default()->NowSeconds();
+    *filenames = std::move(listed);
+    return Status::OK();
+  }
+
+ private:
+  struct Entry {
+    std::vector<string> filenames;
+    uint64 list_time_secs = 0;
+    bool refreshing = false;
+  };
+
+  FileListCache() : queue_(IoExecutor::Get()->NewQueue()) {}
+
+  void Refresh(const string& key, const string& type_name,
+               const string& file_pattern_list) {
+    std::vector<string> listed;
+    Status s = RecordIterator::ParsePattern(type_name, file_pattern_list,
+                                            &listed, queue_.get());
+    if (!s.ok()) LOG(WARNING) << "Keeps the old files of " << key << ": " << s;
+    MutexLock l(&mu_);
+    Entry* entry = &entries_[key];
+    if (s.ok()) {
+      VLOG(1) << "Refreshed " << key << ": " << entry->filenames.size()
+              << " -> " << listed.size() << " files";
+      entry->filenames = std::move(listed);
+    }
+    entry->list_time_secs = Env::Default()->NowSeconds();
+    entry->refreshing = false;
+  }
+
+  // The refreshes, which wait for listing, run as blocking tasks on the
+  // IoExecutor.
+  std::unique_ptr<IoExecutor::Queue> queue_;
+  Mutex mu_;
+  std::unordered_map<string, Entry> entries_ GUARDED_BY(mu_);
+};
+
+}  // namespace
+
+namespace {
+
+// A file BasicRecordYielder::ShardLoop started reading ahead for the iterator
+// being constructed on this thread. Taken over by OpenOrDie.
+thread_local ReadaheadFile* prefetched_file = nullptr;
+
+// The cache of the BasicRecordYielder constructing an iterator on this
+// thread, if any. Used by OpenOrDie.
+thread_local ShardCache* shard_cache = nullptr;
+
+// The IoExecutor queue of the BasicRecordYielder constructing an iterator on
+// this thread, if any. The iterators which do work in the background, e.g.,
+// decompress chunks, schedule it there.
+thread_local IoExecutor::Queue* shard_queue = nullptr;
+
+}  // namespace
+
+Status RecordIterator::ParsePatternIntoSplits(const string& type_name,
+                                              const string& file_pattern_list,
+                                              int num_splits_hint,
+                                              int64 min_split_bytes,
+                                              std::vector<FileSplit>* splits,
+                                              int64 file_list_max_age_secs,
+                                              IoExecutor::Queue* queue) {
+  std::vector<string> filenames;
+  if (file_list_max_age_secs == 0) {
     TF_RETURN_IF_ERROR(
-        MatchParallelFilePattern(file_pattern, &files_per_glob));
-    filenames->insert(filenames->end(), files_per_glob.begin(),
-                      files_per_glob.end());
+        ParsePattern(type_name, file_pattern_list, &filenames, queue));
+  } else {
+    TF_RETURN_IF_ERROR(FileListCache::Get()->Lookup(type_name,
+                                                    file_pattern_list,
+                                                    file_list_max_age_secs,
+                                                    &filenames, queue));
+  }
+  bool splittable = false;
+  {
+    Factory* factory = GetFactory();
+    MutexLock l(&factory->mu);
+    splittable = factory->split_creators.count(type_name) > 0;
+  }
+  if (!splittable || filenames.size() >= num_splits_hint) {
+    for (const string& filename : filenames) splits->emplace_back(filename);
+    return Status::OK();
+  }
+
+  std::vector<uint64> sizes(filenames.size());
+  uint64 total_size = 0;
+  for (int i = 0; i < filenames.size(); ++i) {
+    TF_RETURN_IF_ERROR(Env::Default()->GetFileSize(filenames[i], &sizes[i]));
+    total_size += sizes[i];
+  }
+  const uint64 split_size = std::max<uint64>(
+      std::max<int64>(1, min_split_bytes),
+      (total_size + num_splits_hint - 1) / num_splits_hint);
+  for (int i = 0; i < filenames.size(); ++i) {
+    if (sizes[i] <= split_size) {
+      splits->emplace_back(filenames[i]);
+      continue;
+    }
+    for (uint64 offset = 0; offset < sizes[i]; offset += split_size) {
+      // The last split extends to the end of the file, in case it grows.
+      const uint64 length =
+          offset + split_size < sizes[i] ? split_size : kuint64max;
+      splits->emplace_back(filenames[i], offset, length);
+    }
   }
   return Status::OK();
 }
 
+// Opens 'filename' from its copy in 'cache' if there is one, or else the file
+// read ahead for it on this thread, if any, or the file itself, which 'cache'
+// then copies. 'cache' may be null.
+Status OpenRecordFile(const string& filename, ShardCache* cache,
+                      std::unique_ptr<RandomAccessFile>* file) {
+  if (cache != nullptr && cache->OpenCopy(filename, file)) {
+    return Status::OK();
+  }
+  if (prefetched_file != nullptr && prefetched_file->filename() == filename) {
+    file->reset(prefetched_file);
+    prefetched_file = nullptr;
+    TF_RETURN_IF_ERROR(
+        static_cast<ReadaheadFile*>(file->get())->WaitForOpen());
+  } else {
+    TF_RETURN_IF_ERROR(Env::Default()->NewRandomAccessFile(filename, file));
+  }
+  if (cache != nullptr) file->reset(cache->Tee(filename, file->release()));
+  return Status::OK();
+}
+
 RandomAccessFile* OpenOrDie(const string& filename) {
   std::unique_ptr<RandomAccessFile> file;
-  TF_CHECK_OK(Env::Default()->NewRandomAccessFile(filename, &file));
+  TF_CHECK_OK(OpenRecordFile(filename, shard_cache, &file));
   return file.release();
 }
 
+// The key of the 'num'-th record of a file.
+string RecordKey(int64 num) {
+  return strings::Printf("%08lld", static_cast<long long>(num));
+}
+
+// Implements RecordIterator::NextBatch() with 'next_value', which reads the
+// next record into its argument and returns false at EOF. 'num' counts the
+// records read, from which the keys are formatted if requested.
+template <typename NextValue>
+bool NextBatchOfValues(int max, std::vector<Rope>* values,
+                       std::vector<string>* keys_or_null, int64* num,
+                       NextValue next_value) {
+  int n = 0;
+  for (; n < max; ++n) {
+    values->emplace_back();
+    if (!next_value(&values->back())) {
+      values->pop_back();
+      break;
+    }
+    if (keys_or_null != nullptr) keys_or_null->push_back(RecordKey(*num));
+    ++*num;
+  }
+  return n > 0;
+}
+
+// Returns the first newline in [begin, end), or end if there is none.
+const char* FindNewline(const char* begin, const char* end) {
+#ifdef __AVX2__
+  // Compares 32 bytes at a time. Most lines are longer than a few words, so
+  // this beats calling memchr() once per line.
+  const __m256i newline = _mm256_set1_epi8('\n');
+  for (; end - begin >= 32; begin += 32) {
+    const __m256i bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+    const uint32 mask = static_cast<uint32>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, newline)));
+    if (mask != 0) return begin + __builtin_ctz(mask);
+  }
+#endif
+  const void* found = memchr(begin, '\n', end - begin);
+  return found == nullptr ? end : static_cast<const char*>(found);
+}
+
+// Iterates through the lines of a plain text file split. The file is read in
+// blocks aligned to kBlockSize and lines are returned as views into the
+// blocks, so the bytes of a line are only copied when it spans two blocks.
+// The views account for their whole block (see Rope::RetainedBytes()), so
+// that the short lines are copied once they are buffered for long.
 class PlainTextIterator : public RecordIterator {
  public:
-  PlainTextIterator(const string& filename)
-      : file_(OpenOrDie(filename)),
-        stream_(file_.get()),
-        buf_(&stream_, 2 << 20) {}
+  static constexpr size_t kBlockSize = 1 << 20;
+
+  explicit PlainTextIterator(const FileSplit& split)
+      : file_(OpenOrDie(split.filename)),
+        end_(split.end()),
+        block_(std::make_shared<string>()),
+        block_offset_(split.offset),
+        read_offset_(split.offset) {
+    if (split.offset > 0) {
+      // The line overlapping the start of the split belongs to the previous
+      // split, unless the split starts right after a newline.
+      char c;
+      StringPiece prev;
+      TF_CHECK_OK(file_->Read(split.offset - 1, 1, &prev, &c));
+      if (prev[0] != '\n') {
+        Rope line;
+        NextLine(&line);
+      }
+    }
+  }
 
   bool Next(string* key, Rope* value) override {
-    Status s = buf_.ReadLine(&line_);
-    if (errors::IsOutOfRange(s)) return false;
-    TF_CHECK_OK(s);
-    *key = strings::Printf("%08lld", static_cast<long long>(num_++));
-    *value = line_;
+    if (!NextLine(value)) return false;
+    *key = RecordKey(num_++);
     return true;
   }
 
+  bool NextBatch(int max, std::vector<Rope>* values,
+                 std::vector<string>* keys_or_null) override {
+    return NextBatchOfValues(max, values, keys_or_null, &num_,
+                             [this](Rope* line) { return NextLine(line); });
+  }
+
  private:
+  // Sets 'line' to the next line starting within the split, without its
+  // newline and carriage returns.
+  bool NextLine(Rope* line) {
+    // Only lines starting within the split belong to it.
+    if (block_offset_ + pos_ >= end_) return false;
+    size_t scanned = 0;
+    while (true) {
+      const char* data = block_->data();
+      const char* begin = data + pos_;
+      const char* end = data + block_->size();
+      const char* newline = FindNewline(begin + scanned, end);
+      if (newline != end) {
+        SetLine(StringPiece(begin, newline - begin), line);
+        pos_ = newline + 1 - data;
+        return true;
+      }
+      if (eof_) {
+        // The last line may lack a newline.
+        if (begin == end) return false;
+        SetLine(StringPiece(begin, end - begin), line);
+        pos_ = block_->size();
+        return true;
+      }
+      // The line continues in the next block.
+      scanned = end - begin;
+      ReadBlock();
+    }
+  }
+
+  // Sets 'line' to 'text', a line in the current block, without its '\r's
+  // like BufferedInputStream::ReadLine(). A trailing '\r' (CRLF files) only
+  // shortens the view; other '\r's are rare and the line is copied.
+  void SetLine(StringPiece text, Rope* line) {
+    if (!text.empty() && text.back() == '\r') text.remove_suffix(1);
+    if (memchr(text.data(), '\r', text.size()) == nullptr) {
+      *line = Rope::View(text, block_, block_->size());
+      return;
+    }
+    string copy;
+    copy.reserve(text.size());
+    for (char c : text) {
+      if (c != '\r') copy.push_back(c);
+    }
+    *line = Rope(std::move(copy));
+  }
+
+  // Reads the next block into a new buffer, after the unread bytes of the
+  // current one. The lines returned so far keep the current buffer alive.
+  // While a line does not fit, the buffer at least doubles each time, so
+  // that the bytes of a long line are copied a constant number of times.
+  void ReadBlock() {
+    const size_t num_unread = block_->size() - pos_;
+    size_t n = kBlockSize - read_offset_ % kBlockSize;
+    while (n < num_unread) n += kBlockSize;
+    auto block = std::make_shared<string>();
+    block->resize(num_unread + n);
+    memcpy(&(*block)[0], block_->data() + pos_, num_unread);
+    char* scratch = &(*block)[num_unread];
+    StringPiece result;
+    Status s = file_->Read(read_offset_, n, &result, scratch);
+    if (errors::IsOutOfRange(s)) {
+      eof_ = true;
+    } else {
+      TF_CHECK_OK(s);
+    }
+    if (result.data() != scratch) {
+      memmove(scratch, result.data(), result.size());
+    }
+    block->resize(num_unread + result.size());
+    read_offset_ += result.size();
+    block_offset_ += pos_;
+    pos_ = 0;
+    block_ = std::move(block);
+  }
+
   std::unique_ptr<RandomAccessFile> file_;
-  io::RandomAccessInputStream stream_;
-  io::BufferedInputStream buf_;
+  const uint64 end_;
   int64 num_ = 0;
-  string line_;
+
+  // The current block, which starts at block_offset_ in the file. Lines are
+  // returned from block_[pos_].
+  std::shared_ptr<string> block_;
+  uint64 block_offset_;
+  size_t pos_ = 0;
+
+  // The file offset the next block is read from.
+  uint64 read_offset_;
+  bool eof_ = false;
 };
 
 class TFRecordIterator : public RecordIterator {
@@ -264,14 +709,25 @@ class TFRecordIterator : public RecordIterator {
         reader_(file_.get(), ReaderOptions(compression_type)) {}
 
   bool Next(string* key, Rope* value) override {
+    if (!NextValue(value)) return false;
+    *key = RecordKey(num_++);
+    return true;
+  }
+
+  bool NextBatch(int max, std::vector<Rope>* values,
+                 std::vector<string>* keys_or_null) override {
+    return NextBatchOfValues(max, values, keys_or_null, &num_,
+                             [this](Rope* value) { return NextValue(value); });
+  }
+
+ private:
+  bool NextValue(Rope* value) {
     Status s = reader_.ReadRecord(&record_);
     if (errors::IsOutOfRange(s)) return false;
-    *key = strings::Printf("%08lld", static_cast<long long>(num_++));
-    *value = record_;
+    *value = Rope(std::move(record_));
     return true;
   }
 
- private:
   std::unique_ptr<RandomAccessFile> file_;
   io::SequentialRecordReader reader_;
   int64 num_ = 0;
@@ -285,6 +741,101 @@ class TFRecordIterator : public RecordIterator {
   }
 };
 
+// An iterator over an uncompressed TFRecord file which is memory-mapped
+// instead of being read through io::SequentialRecordReader. Records are
+// parsed directly out of the mapping, which saves the intermediate tstring
+// copy. Only works for files on a file system supporting
+// NewReadOnlyMemoryRegionFromFile (i.e., local files).
+class MmapTFRecordIterator : public RecordIterator {
+ public:
+  explicit MmapTFRecordIterator(const string& filename) : filename_(filename) {
+    uint64 file_size = 0;
+    TF_CHECK_OK(Env::Default()->GetFileSize(filename, &file_size));
+    if (file_size > 0) {
+      // mmap() of an empty file fails, so we only map non-empty ones.
+      std::unique_ptr<ReadOnlyMemoryRegion> region;
+      TF_CHECK_OK(
+          Env::Default()->NewReadOnlyMemoryRegionFromFile(filename, &region));
+      region_ = std::move(region);
+      data_ = static_cast<const char*>(region_->data());
+      size_ = region_->length();
+    }
+  }
+
+  bool Next(string* key, Rope* value) override {
+    if (!NextValue(value)) return false;
+    *key = RecordKey(num_++);
+    return true;
+  }
+
+  bool NextBatch(int max, std::vector<Rope>* values,
+                 std::vector<string>* keys_or_null) override {
+    return NextBatchOfValues(max, values, keys_or_null, &num_,
+                             [this](Rope* value) { return NextValue(value); });
+  }
+
+ private:
+  bool NextValue(Rope* value) {
+    StringPiece record;
+    if (!ReadRecord(&record)) return false;
+    // The returned value refers to the mapped region, which stays mapped as
+    // long as any record from it is alive.
+    *value = Rope::View(record, region_, size_);
+    return true;
+  }
+
+  // See tensorflow/core/lib/io/record_writer.h for the format:
+  //   uint64    length
+  //   uint32    masked crc of length
+  //   byte      data[length]
+  //   uint32    masked crc of data
+  static constexpr size_t kHeaderSize = sizeof(uint64) + sizeof(uint32);
+  static constexpr size_t kFooterSize = sizeof(uint32);
+
+  bool ReadRecord(StringPiece* record) {
+    if (pos_ >= size_) return false;
+    if (size_ - pos_ < kHeaderSize) {
+      LOG(WARNING) << "Truncated record header at " << pos_ << " in "
+                   << filename_;
+      pos_ = size_;
+      return false;
+    }
+    const char* header = data_ + pos_;
+    const uint64 length = core::DecodeFixed64(header);
+    if (crc32c::Unmask(core::DecodeFixed32(header + sizeof(uint64))) !=
+        crc32c::Value(header, sizeof(uint64))) {
+      LOG(WARNING) << "Corrupted record header at " << pos_ << " in "
+                   << filename_;
+      pos_ = size_;
+      return false;
+    }
+    // Written so that a corrupt 'length' near 2^64 can not overflow.
+    if (size_ - pos_ < kHeaderSize + kFooterSize ||
+        length > size_ - pos_ - kHeaderSize - kFooterSize) {
+      LOG(WARNING) << "Truncated record at " << pos_ << " in " << filename_;
+      pos_ = size_;
+      return false;
+    }
+    const char* data = header + kHeaderSize;
+    if (crc32c::Unmask(core::DecodeFixed32(data + length)) !=
+        crc32c::Value(data, length)) {
+      LOG(WARNING) << "Corrupted record at " << pos_ << " in " << filename_;
+      pos_ = size_;
+      return false;
+    }
+    *record = StringPiece(data, length);
+    pos_ += kHeaderSize + length + kFooterSize;
+    return true;
+  }
+
+  const string filename_;
+  std::shared_ptr<ReadOnlyMemoryRegion> region_;
+  const char* data_ = nullptr;
+  uint64 size_ = 0;
+  uint64 pos_ = 0;
+  int64 num_ = 0;
+};
+
 // An iterator generates [0 .. max_).
 class IotaIterator : public RecordIterator {
  public:
@@ -303,6 +854,17 @@ class IotaIterator : public RecordIterator {
     return true;
   }
 
+  bool NextBatch(int max, std::vector<Rope>* values,
+                 std::vector<string>* keys_or_null) override {
+    const int n = std::min<int64>(max, max_ - num_);
+    for (int i = 0; i < n; ++i) {
+      string key = strings::Printf("%010lld", static_cast<long long>(num_++));
+      if (keys_or_null != nullptr) keys_or_null->push_back(key);
+      values->emplace_back(std::move(key));
+    }
+    return n > 0;
+  }
+
  private:
   int64 max_ = kint64max;
   int64 num_ = 0;
@@ -310,23 +872,22 @@ class IotaIterator : public RecordIterator {
 
 namespace {
 
-bool register_text_iterator = RecordIterator::Register(
+bool register_text_iterator = RecordIterator::RegisterSplittable(
     "text",
-    [](const string& filename) { return new PlainTextIterator(filename); });
+    [](const FileSplit& split) { return new PlainTextIterator(split); });
 
 // Iterator for plain text files that checks indirect "ckpt" file for latest
 // pointer to data files.
 // For example, if filename is .../checkpoint, the pattern parser will open the
 // checkpoint file and read file-patterns that it points to. If empty, it will
 // return error and die.
-bool register_indirect_text_iterator =
-    RecordIterator::RegisterWithPatternParser(
-        "text_indirect",
-        [](const string& filename) { return new PlainTextIterator(filename); },
-        [](const string& pattern, std::vector<string>* outs) {
-          TF_RETURN_IF_ERROR(GetFilePatternsFromCkptFile(pattern, outs));
-          return Status::OK();
-        });
+bool register_indirect_text_iterator = RecordIterator::RegisterSplittable(
+    "text_indirect",
+    [](const FileSplit& split) { return new PlainTextIterator(split); },
+    [](const string& pattern, std::vector<string>* outs) {
+      TF_RETURN_IF_ERROR(GetFilePatternsFromCkptFile(pattern, outs));
+      return Status::OK();
+    });
 
 bool register_tf_record_iterator =
     RecordIterator::Register("tfrecord", [](const string& filename) {
@@ -338,6 +899,17 @@ bool register_tf_record_gzip_iterator =
       return new TFRecordIterator(filename, io::compression::kGzip);
     });
 
+bool register_tf_record_mmap_iterator =
+    RecordIterator::Register("tfrecord_mmap", [](const string& filename) {
+      return new MmapTFRecordIterator(filename);
+    });
+
+bool register_chunked_record_iterator =
+    RecordIterator::RegisterSplittable("chunked", [](const FileSplit& split) {
+      return new ChunkedRecordIterator(split, OpenOrDie(split.filename),
+                                       shard_queue);
+    });
+
 bool register_iota_iterator = RecordIterator::RegisterWithPatternParser(
     "iota", [](const string& filename) { return new IotaIterator(filename); },
     [](const string& pattern, std::vector<string>* outs) {
@@ -350,6 +922,81 @@ bool register_iota_iterator = RecordIterator::RegisterWithPatternParser(
 
 RecordYielder::~RecordYielder() {}
 
+Status RecordYielder::YieldBatch(int n, std::vector<Record>* out) {
+  for (int i = 0; i < n; ++i) {
+    out->emplace_back();
+    out->back().source_id = kDefaultSourceId;
+    Status s = Yield(&out->back());
+    if (!s.ok()) {
+      out->pop_back();
+      return s;
+    }
+  }
+  return Status::OK();
+}
+
+Status RecordYielder::TryYieldBatch(int n, std::vector<Record>* out) {
+  return YieldBatch(n, out);
+}
+
+bool RecordYielder::SetReadyNotifier(ReadyNotifier* notifier) {
+  return false;
+}
+
+void ReadyNotifier::WaitForChange(int64 count) {
+  struct Changed {
+    const ReadyNotifier* notifier;
+    int64 count;
+    bool Eval() const { return notifier->count_ != count; }
+  };
+  Changed changed{this, count};
+  ++num_waiters_;
+  {
+    MutexLock l(&mu_);
+    mu_.Await(Condition(&changed, &Changed::Eval));
+  }
+  --num_waiters_;
+}
+
+Status RecordYielder::GetState(int64 max_buffered_records,
+                               YielderState* state) {
+  return errors::Unimplemented("This record yielder can not save its state.");
+}
+
+struct BasicRecordYielder::ShuffledEpoch {
+  std::vector<string> filenames;
+  std::vector<std::shared_ptr<const std::vector<uint64>>> indices;
+  // The position of the first record of each file among all records.
+  std::vector<uint64> starts;
+  uint64 seed = 0;
+  std::unique_ptr<RandomPermutation> permutation;
+  // The ranges [begin, end) of positions of the permutation left to read, in
+  // the order they are read. Taken under a reader lock of progress_mu_.
+  Mutex mu;
+  std::deque<std::pair<uint64, uint64>> ranges GUARDED_BY(mu);
+};
+
+// The epoch being read by the main loop.
+struct BasicRecordYielder::EpochRead {
+  int64 epoch = 0;
+  // The state the epoch is restored from, if any.
+  std::shared_ptr<const YielderState> state;
+  // Whether the shards keep the records of the epoch for arena_.
+  bool collect = false;
+  std::unique_ptr<SplitQueue> queue;
+  std::unique_ptr<ShuffledEpoch> shuffled;
+  std::vector<Shard> shards;
+  // The shards not done yet. The last one to finish calls FinishEpoch().
+  std::atomic<int> num_running{0};
+  // With global shuffling, the files of 'shuffled' whose index is loaded by
+  // LoadIndex() tasks, the status of each load, the next one to load and the
+  // number of tasks still loading.
+  std::vector<int> missing;
+  std::vector<Status> statuses;
+  std::atomic<size_t> next_missing{0};
+  std::atomic<int> num_loaders{0};
+};
+
 BasicRecordYielder* BasicRecordYielder::New(Options opts) {
   auto yielder = new BasicRecordYielder(opts);
   yielder->Start();
@@ -358,13 +1005,11 @@ BasicRecordYielder* BasicRecordYielder::New(Options opts) {
 
 BasicRecordYielder::BasicRecordYielder(const Options& opts)
     : opts_(opts),
-      thread_(new thread::ThreadPool(Env::Default(), ThreadOptions(),
-                                     "record_yielder", 2 + opts.parallelism,
-                                     /* low_latency_hint */ false)),
-      epoch_(1),
+      io_executor_(opts.io_executor != nullptr ? opts.io_executor
+                                               : IoExecutor::Get()),
+      io_queue_(io_executor_->NewQueue()),
       rnd_(opts.seed),
-      yields_(0),
-      buf_empty_(this, &ME::BufEmpty),
+      buf_free_(this, &ME::BufFree),
       buf_not_full_(this, &ME::BufNotFull),
       buf_enough_(this, &ME::BufEnough) {
   LOG(INFO) << this << " Record yielder start";
@@ -376,118 +1021,425 @@ BasicRecordYielder::BasicRecordYielder(const Options& opts)
   if (!file_type_.empty()) {
     opts_.file_pattern.erase(0, file_type_.size() + 1);
   }
+  if (!opts_.cache_dir.empty()) {
+    cache_ = ShardCache::Get(opts_.cache_dir, opts_.cache_max_bytes);
+  }
+  num_shards_ = std::max(opts_.parallelism, opts_.max_parallelism);
+  active_parallelism_ = opts_.parallelism;
+  {
+    MutexLock l(&mu_);
+    last_tune_micros_ = Env::Default()->NowMicros();
+  }
+  if (opts_.max_parallelism > opts_.parallelism) {
+    ParallelismTuner::Options topts;
+    topts.min_parallelism = opts_.parallelism;
+    topts.max_parallelism = opts_.max_parallelism;
+    tuner_.reset(new ParallelismTuner(topts));
+  }
   if (opts_.bufsize_in_seconds > 0) {
     bufsize_ = kRecordsPerAdd * opts_.parallelism;
   } else {
     bufsize_ = opts_.bufsize;
   }
+  capacity_ = static_cast<int64>(bufsize_);
+  const int num_buf_shards =
+      std::max(1, opts_.buffer_shards > 0 ? opts_.buffer_shards
+                                          : opts_.parallelism);
+  for (int i = 0; i < 2 * num_buf_shards; ++i) {
+    buf_[i % 2].shards.emplace_back(new BufShard);
+    BufShard* shard = buf_[i % 2].shards.back().get();
+    MutexLock l(&shard->mu);
+    shard->rnd.seed(opts_.seed == 0 ? std::random_device{}()
+                                    : Hash64Combine(opts_.seed, i));
+  }
+  if (opts_.stats != nullptr) {
+    const string source = strings::StrCat("source_", opts_.source_id, "/");
+    records_stat_ = opts_.stats->Counter(strings::StrCat(source, "records"));
+    bytes_stat_ = opts_.stats->Counter(strings::StrCat(source, "bytes"));
+    read_usecs_stat_ = opts_.stats->Histogram("read_usecs");
+    buffer_fill_stat_ = opts_.stats->Histogram("buffer_fill_percent");
+    yield_wait_stat_ = opts_.stats->Histogram("yield_wait_usecs");
+  }
+  const YielderState* state = opts_.initial_state.get();
+  if (state != nullptr && state->file_pattern() != opts_.file_pattern) {
+    LOG(WARNING) << "Ignores the state saved for " << state->file_pattern();
+    opts_.initial_state.reset();
+    state = nullptr;
+  }
+  if (state != nullptr) {
+    LOG(INFO) << "Resumes epoch " << state->epoch() << " with "
+              << state->splits_size() << " splits and "
+              << state->buffered_records_size() << " buffered records";
+    MutexLock l(&mu_);
+    epoch_ = std::max<int64>(1, state->epoch());
+    fill_epoch_ = epoch_;
+    // The buffered records are put back before any record is read.
+    EpochBuf* epoch_buf = &buf_[epoch_ % 2];
+    const int64 n = state->buffered_records_size();
+    int64 bytes = 0;
+    for (int64 i = 0; i < n; ++i) {
+      BufShard* shard =
+          epoch_buf->shards[i % epoch_buf->shards.size()].get();
+      MutexLock sl(&shard->mu);
+      shard->buf.emplace_back(state->buffered_records(i));
+      bytes += shard->buf.back().size();
+    }
+    if (n > 0) {
+      ChargeBuffer(bytes);
+      avg_record_bytes_ = std::max<int64>(1, bytes / n);
+    }
+    for (const auto& shard : epoch_buf->shards) {
+      MutexLock sl(&shard->mu);
+      std::shuffle(shard->buf.begin(), shard->buf.end(), shard->rnd);
+    }
+    epoch_buf->num_buffered = n;
+    epoch_buf->state = (epoch_ << kEpochShift) | n;
+  }
 }
 
 BasicRecordYielder::BasicRecordYielder()
-    : buf_empty_(this, &ME::BufEmpty),
+    : buf_free_(this, &ME::BufFree),
       buf_not_full_(this, &ME::BufNotFull),
       buf_enough_(this, &ME::BufEnough) {}  // USED ONLY FOR TESTS.
-BasicRecordYielder::~BasicRecordYielder() {}
+BasicRecordYielder::~BasicRecordYielder() {
+  // The records left in buf_ are freed with this yielder.
+  ChargeBuffer(-buf_bytes_);
+}
 
 void BasicRecordYielder::Start() {
-  thread_->Schedule([this]() { MainLoop(); });
+  io_queue_->ScheduleBlocking([this]() { StartEpoch(); });
+  adjust_id_ = io_executor_->AddPeriodic([this]() { AdjustBufferSize(); });
 }
 
 void BasicRecordYielder::Close() {
   {
     MutexLock l(&mu_);
     stop_ = true;
+    UpdateFastYield();
+    // The parked shards finish.
+    ResumeParked();
   }
+  io_executor_->RemovePeriodic(adjust_id_);
   main_loop_done_.WaitForNotification();
-  delete thread_;
-  thread_ = nullptr;
+  // All tasks of the main loop and the shards have run.
+  io_queue_.reset();
   LOG(INFO) << this << "Basic record yielder exit";
   delete this;
 }
 
 Status BasicRecordYielder::Yield(Record* record) {
-  MutexLock l(&mu_);
-  WaitForBufEnough();
-  ++yields_;
+  int64 num_yielded;
+  return YieldRecords(1, record, &num_yielded);
+}
+
+Status BasicRecordYielder::YieldBatch(int n, std::vector<Record>* out) {
+  const size_t begin = out->size();
+  out->resize(begin + n);
+  int64 num_yielded = 0;
+  Status s = YieldRecords(n, out->data() + begin, &num_yielded);
+  out->resize(begin + num_yielded);
+  return s;
+}
+
+Status BasicRecordYielder::TryYieldBatch(int n, std::vector<Record>* out) {
+  const size_t begin = out->size();
+  out->resize(begin + n);
+  int64 num_yielded = 0;
+  Status s = YieldRecords(n, out->data() + begin, &num_yielded,
+                          /* wait */ false);
+  out->resize(begin + num_yielded);
+  return s;
+}
+
+bool BasicRecordYielder::SetReadyNotifier(ReadyNotifier* notifier) {
+  ready_notifier_ = notifier;
+  return true;
+}
+
+Status BasicRecordYielder::YieldRecords(int64 n, Record* records,
+                                        int64* num_yielded, bool wait) {
+  *num_yielded = 0;
+  if (buffer_fill_stat_ != nullptr) {
+    buffer_fill_stat_->Add(100 * TotalBufSize() /
+                           std::max<int64>(1, Capacity()));
+  }
+  while (*num_yielded < n) {
+    const int64 num_wanted = n - *num_yielded;
+    int64 epoch;
+    int64 num_claimed = TryClaimRecords(num_wanted, &epoch);
+    bool epoch_done = false;
+    if (num_claimed == 0) {
+      // Only waits for the first record.
+      if (*num_yielded > 0) break;
+      MutexLock l(&mu_);
+      do {
+        if (!wait && !BufEnough()) return Status::OK();
+        WaitForBufEnough();
+        if (!status_.ok()) return status_;
+        CHECK(!stop_);
+        if (Exhausted()) {
+          return errors::OutOfRange("All records of ", opts_.file_pattern,
+                                    " were yielded");
+        }
+        epoch = epoch_;
+        num_claimed = ClaimRecords(num_wanted);
+      } while (num_claimed == 0);
+      AdvanceEpoch();
+      ResumeParked();
+      epoch_done = epoch != epoch_;
+    }
+    ExtractValues(epoch, num_claimed, records + *num_yielded);
+    *num_yielded += num_claimed;
+    yields_ += num_claimed;
+    num_records_yielded_in_epoch_ += num_claimed;
+    // Does not mix records of two epochs in one batch.
+    if (epoch_done) break;
+  }
+  return Status::OK();
+}
+
+int64 BasicRecordYielder::TryClaimRecords(int64 n, int64* epoch) {
+  if (!fast_yield_) return 0;
+  *epoch = epoch_;
+  std::atomic<int64>* state = &buf_[*epoch % 2].state;
+  const int64 capacity = Capacity();
+  const int64 enough = std::max<int64>(2, capacity / 2);
+  int64 old_state = *state;
+  while ((old_state >> kEpochShift) == *epoch) {
+    const int64 size = old_state & kSizeMask;
+    if (size < enough) break;
+    const int64 num_claimed = std::min(n, size - enough + 1);
+    if (state->compare_exchange_weak(old_state, old_state - num_claimed)) {
+      // Producers wait for room for a few batches rather than for every
+      // record.
+      if (capacity - TotalBufSize() >= RoomToResume(capacity)) {
+        WakeUpWaiters();
+      }
+      return num_claimed;
+    }
+  }
+  return 0;
+}
 
-  if (status_.ok()) {
-    CHECK(!stop_ && !buf_.empty());
-    ExtractValue(&record->value);
-    if (epoch_end_ && buf_.empty()) {
-      ++epoch_;
+int64 BasicRecordYielder::ClaimRecords(int64 n) {
+  const int64 enough = EpochEnd() ? 1 : std::max<int64>(1, Capacity() / 2);
+  std::atomic<int64>* state = &buf_[epoch_ % 2].state;
+  int64 old_state = *state;
+  while ((old_state >> kEpochShift) == epoch_) {
+    const int64 size = old_state & kSizeMask;
+    if (size < enough) break;
+    const int64 num_claimed = std::min(n, size - enough + 1);
+    if (state->compare_exchange_weak(old_state, old_state - num_claimed)) {
+      return num_claimed;
     }
-    record->source_id = static_cast<int>(opts_.source_id);
-    ++num_records_yielded_in_epoch_;
   }
-  return status_;
+  return 0;
+}
+
+void BasicRecordYielder::ExtractValues(int64 epoch, int64 n,
+                                       Record* records) {
+  const int64 num_records = n;
+  EpochBuf* epoch_buf = &buf_[epoch % 2];
+  thread_local std::mt19937 rnd(std::random_device{}());
+  const int num_shards = epoch_buf->shards.size();
+  int64 bytes = 0;
+  // The claimed records are in some shards but maybe not the first ones
+  // tried.
+  for (int i = rnd() % num_shards; n > 0; i = (i + 1) % num_shards) {
+    BufShard* shard = epoch_buf->shards[i].get();
+    MutexLock l(&shard->mu);
+    std::vector<Rope>& buf = shard->buf;
+    for (; n > 0 && !buf.empty(); --n, ++records) {
+      if (opts_.seed == 0) {
+        // Randomize at the consumer side as well.
+        const auto index = shard->rnd() % buf.size();
+        records->value = std::move(buf[index]);
+        if (index != buf.size() - 1) {
+          buf[index] = std::move(buf.back());
+        }
+      } else {
+        records->value = std::move(buf.back());
+      }
+      buf.pop_back();
+      bytes += records->value.RetainedBytes();
+      records->source_id = static_cast<int>(opts_.source_id);
+    }
+  }
+  ChargeBuffer(-bytes);
+  if (epoch_buf->num_buffered.fetch_sub(num_records) == num_records) {
+    WakeUpWaiters();
+  }
+}
+
+void BasicRecordYielder::WakeUpWaiters() {
+  if (num_waiters_ > 0 || num_parked_ > 0) {
+    MutexLock l(&mu_);
+    ResumeParked();
+  }
+}
+
+void BasicRecordYielder::Await(const Condition& cond) {
+  // The parked shards may be waited for. Like waiters, they see the changes
+  // made under mu_ so far.
+  ResumeParked();
+  ++num_waiters_;
+  mu_.Await(cond);
+  --num_waiters_;
+}
+
+void BasicRecordYielder::AdvanceEpoch() {
+  while (EpochEnd() && BufSize(epoch_) == 0) {
+    LOG(INFO) << "Epoch " << epoch_ << ": total records "
+              << num_records_yielded_in_epoch_.exchange(0);
+    ++epoch_;
+  }
+  UpdateFastYield();
 }
 
 bool BasicRecordYielder::ShouldFinish(const Status& s) {
   MutexLock l(&mu_);
   status_.Update(s);
+  UpdateFastYield();
   return stop_ || !status_.ok();
 }
 
-void BasicRecordYielder::AdjustBufferSizeLoop() {
-  if (opts_.bufsize_in_seconds == 0) {
-    // Nothing to do for a fixed buffer size.
-    return;
-  }
+int64 BasicRecordYielder::Capacity() const {
+  const int64 capacity = capacity_;
+  const MemoryBudget* budget = opts_.memory_budget.get();
+  const int64 record_bytes = avg_record_bytes_;
+  if (budget == nullptr || record_bytes == 0) return capacity;
+  // The records in buf_ are already charged to the budget.
+  const int64 num_records = (budget->available() + buf_bytes_) / record_bytes;
+  // Keeps room for one Add per iterator, so that records keep flowing even if
+  // the rest of the pipeline holds the whole budget.
+  const int64 min_capacity =
+      std::min<int64>(capacity, active_parallelism_ * kRecordsPerAdd);
+  return std::max(min_capacity, std::min(capacity, num_records));
+}
 
-  // Wake up each second and adjust the buffer size.
-  while (true) {
-    {
-      MutexLock l(&mu_);
+void BasicRecordYielder::ChargeBuffer(int64 bytes) {
+  if (bytes == 0) return;
+  buf_bytes_ += bytes;
+  if (opts_.memory_budget != nullptr) {
+    if (bytes > 0) {
+      opts_.memory_budget->Charge(bytes);
+    } else {
+      opts_.memory_budget->Release(-bytes);
+    }
+  }
+}
 
-      // Quit if requested.
-      if (stop_) break;
-
-      // Smoothed bufsize_ estimate based on current yields_ requests.
-      // With this set of parameters, the contribution of the current buffer
-      // size decays as follows:
-      //    10 seconds -> 90% (.99^10)
-      //      1 minute -> 50% (.99^60)
-      //     5 minutes ->  5% (.99^300)
-      bufsize_ = 0.99 * static_cast<double>(bufsize_) +
-                 0.01 * yields_ * opts_.bufsize_in_seconds;
-
-      // Make sure the buffer is large enough to hold one batch of Add records
-      // per thread.
-      bufsize_ = std::max<int64>(opts_.parallelism * kRecordsPerAdd, bufsize_);
-
-      // Make sure the buffer is not larger than the bufsize parameter in the
-      // options.
-      if (opts_.bufsize > 0) {
-        bufsize_ = std::min<double>(opts_.bufsize, bufsize_);
-      }
-      VLOG(1) << "Yields:" << yields_ << " Bufsize:" << bufsize_
-              << " Pattern:" << opts_.file_pattern;
+void BasicRecordYielder::AdjustBufferSize() {
+  MutexLock l(&mu_);
+  if (stop_) return;
+
+  if (tuner_ != nullptr) {
+    const uint64 now = Env::Default()->NowMicros();
+    const int parallelism = tuner_->Update(now - last_tune_micros_,
+                                           consumer_wait_usecs_.exchange(0),
+                                           producer_idle_usecs_.exchange(0));
+    last_tune_micros_ = now;
+    if (parallelism != active_parallelism_) {
+      LOG(INFO) << "Reads " << opts_.file_pattern << " with " << parallelism
+                << " iterators";
+      active_parallelism_ = parallelism;
+    }
+  }
 
-      // Reset yields_ to zero to count another second of requests.
-      yields_ = 0;
+  if (opts_.bufsize_in_seconds > 0) {
+    // Smoothed bufsize_ estimate based on current yields_ requests.
+    // With this set of parameters, the contribution of the current buffer
+    // size decays as follows:
+    //    10 seconds -> 90% (.99^10)
+    //      1 minute -> 50% (.99^60)
+    //     5 minutes ->  5% (.99^300)
+    bufsize_ = 0.99 * static_cast<double>(bufsize_) +
+               0.01 * yields_ * opts_.bufsize_in_seconds;
+
+    // Make sure the buffer is large enough to hold one batch of Add
+    // records per thread.
+    bufsize_ = std::max<int64>(active_parallelism_ * kRecordsPerAdd, bufsize_);
+
+    // Make sure the buffer is not larger than the bufsize parameter in the
+    // options.
+    if (opts_.bufsize > 0) {
+      bufsize_ = std::min<double>(opts_.bufsize, bufsize_);
     }
-    std::this_thread::sleep_for(std::chrono::seconds(1));
+    capacity_ = static_cast<int64>(bufsize_);
+    VLOG(1) << "Yields:" << yields_ << " Bufsize:" << bufsize_
+            << " Pattern:" << opts_.file_pattern;
+
+    // Reset yields_ to zero to count another second of requests.
+    yields_ = 0;
   }
-}
 
-void BasicRecordYielder::MainLoop() {
-  Notification adjust_done;
-  thread_->Schedule([this, &adjust_done]() {
-    AdjustBufferSizeLoop();
-    adjust_done.Notify();
-  });
+  if (opts_.memory_budget != nullptr) {
+    VLOG(1) << "Capacity:" << Capacity() << " Pattern:" << opts_.file_pattern
+            << " " << opts_.memory_budget->DebugString();
+  }
 
-  while (true) {
-    num_records_yielded_in_epoch_ = 0;
-    LOG(INFO) << "Epoch " << current_epoch() << " " << opts_.file_pattern;
+  // Other users of the memory budget may have released some of it, and
+  // shards may have been activated. Waiters see it when mu_ is released.
+  ResumeParked();
+}
 
-    // Finds all files.
-    std::vector<string> filenames;
-    Status s = RecordIterator::ParsePattern(file_type_, opts_.file_pattern,
-                                            &filenames);
-    if (ShouldFinish(s)) break;
+void BasicRecordYielder::StartEpoch() {
+  // The buffered records of a restored epoch are already in buf_.
+  std::shared_ptr<const YielderState> state = std::move(opts_.initial_state);
+  const bool restored = state != nullptr;
+  int64 epoch;
+  bool finish;
+  {
+    MutexLock l(&mu_);
+    epoch = fill_epoch_;
+    finish = stop_ || !status_.ok();
+    if (!finish && !restored) buf_[epoch % 2].state = epoch << kEpochShift;
+  }
+  if (finish) {
+    main_loop_done_.Notify();
+    return;
+  }
+  LOG(INFO) << "Epoch " << epoch << " " << opts_.file_pattern;
+
+  reading_.reset(new EpochRead);
+  EpochRead* read = reading_.get();
+  read->epoch = epoch;
+  read->state = state;
+  // A restored epoch which was read entirely, or from files, resumes from
+  // its splits.
+  const bool resume_splits =
+      restored && (state->epoch_read() || state->splits_size() > 0);
+  if (arena_ != nullptr) {
+    StartArenaEpoch();
+    return;
+  }
+  if (opts_.global_shuffle && !resume_splits) {
+    StartShuffledEpoch();
+    return;
+  }
+
+  std::vector<FileSplit> splits;
+  if (resume_splits) {
+    // Resumes from the splits not read yet.
+    MutexLock l(&mu_);
+    for (const FileSplitState& split : state->splits()) {
+      splits.emplace_back(split.filename(), split.offset(), split.length());
+      if (split.num_records_read() > 0) {
+        num_records_to_skip_[SplitKey(splits.back())] =
+            split.num_records_read();
+      }
+    }
+  } else {
+    // Finds all files, split into byte ranges if there are too few of them.
+    Status s = RecordIterator::ParsePatternIntoSplits(
+        file_type_, opts_.file_pattern, num_shards_, opts_.min_split_bytes,
+        &splits, opts_.file_list_max_age_secs, io_queue_.get());
+    if (ShouldFinish(s)) {
+      FinishEpoch(s);
+      return;
+    }
 
-    if (filenames.empty()) {
+    if (splits.empty()) {
       LOG(FATAL) << "Found no files at " << opts_.file_pattern;
     }
 
@@ -498,83 +1450,942 @@ void BasicRecordYielder::MainLoop() {
     }
 
     // Shuffles these files according to the epoch # and random seed.
-    std::mt19937_64 shuffle_rnd(Hash64Combine(current_epoch(), shuffle_seed));
-    std::shuffle(filenames.begin(), filenames.end(), shuffle_rnd);
-
-    // Shards files and use one thread to go through each shard.
-    const int N = opts_.parallelism;
-    std::vector<Shard> shards(N);
-    for (int i = 0; i < N; ++i) {
-      Shard* shard = &shards[i];
-      shard->index = i;
-      for (int j = i; j < filenames.size(); j += N) {
-        shard->filenames.push_back(filenames[j]);
+    std::mt19937_64 shuffle_rnd(Hash64Combine(epoch, shuffle_seed));
+    std::shuffle(splits.begin(), splits.end(), shuffle_rnd);
+  }
+
+  // Keeps the records of the first complete epoch in memory if asked to.
+  read->collect = opts_.in_memory_max_bytes > 0 && !restored && !arena_full_;
+  if (read->collect) {
+    arena_buf_.reset(new char[opts_.in_memory_max_bytes],
+                     std::default_delete<char[]>());
+  }
+  // Uses N shards to go through the files. Shards pull files dynamically so
+  // that no shard is left with a long tail of work.
+  const int N = num_shards_;
+  read->queue.reset(new SplitQueue(std::move(splits), N, opts_.work_stealing));
+  read->shards = std::vector<Shard>(N);
+  for (int i = 0; i < N; ++i) {
+    Shard* shard = &read->shards[i];
+    shard->index = i;
+    shard->epoch = epoch;
+    shard->queue = read->queue.get();
+    shard->collect = read->collect;
+  }
+  {
+    MutexLock l(&progress_mu_);
+    read_epoch_ = epoch;
+    queue_ = read->queue.get();
+    shards_ = &read->shards;
+  }
+  ScheduleShards();
+}
+
+void BasicRecordYielder::ScheduleShards() {
+  EpochRead* read = reading_.get();
+  const int n = read->shards.size();
+  Shard* shards = read->shards.data();
+  read->num_running = n;
+  // reading_ is deleted once the last shard is done, maybe before this
+  // returns.
+  for (int i = 0; i < n; ++i) ScheduleShard(&shards[i]);
+}
+
+void BasicRecordYielder::FinishEpoch(Status s) {
+  EpochRead* read = reading_.get();
+  for (const Shard& shard : read->shards) s.Update(shard.status);
+  if (read->collect && s.ok() && !stop_ && !arena_full_) {
+    BuildArena(&read->shards);
+  }
+  // No shard writes to it anymore.
+  arena_buf_.reset();
+
+  // The epoch is usually advanced by the Yield call which claims its last
+  // record, unless they were all claimed before we got here.
+  const int64 epoch = read->epoch;
+  {
+    MutexLock pl(&progress_mu_);
+    read_epoch_ = 0;
+    queue_ = nullptr;
+    shards_ = nullptr;
+    shuffled_ = nullptr;
+    arena_epoch_ = false;
+    MutexLock l(&mu_);
+    status_.Update(s);
+    UpdateFastYield();
+    if (!stop_ && status_.ok()) {
+      complete_epoch_ = epoch;
+      if (opts_.single_epoch) last_epoch_ = epoch;
+      AdvanceEpoch();
+    }
+  }
+  reading_.reset();
+  // The rest of the epoch may be yielded, or an error returned.
+  NotifyReady();
+  if (opts_.single_epoch) {
+    main_loop_done_.Notify();
+    return;
+  }
+
+  // The next epoch is started by ResumeParked() once buf_ is free for it,
+  // which it always is once we stop.
+  MutexLock l(&mu_);
+  fill_epoch_ = epoch + 1;
+  epoch_pending_ = true;
+  ++num_parked_;
+  ResumeParked();
+}
+
+BasicRecordYielder::Progress BasicRecordYielder::TryAdd(
+    Shard* shard, std::vector<Rope>* values, int64* num_added) {
+  // The records of the arena view it as a whole, which is kept anyway.
+  if (!shard->arena) {
+    for (Rope& value : *values) value.Compact(kMaxRetainedRatio);
+  }
+  if (opts_.memory_budget != nullptr && !values->empty()) {
+    // A moving average, so that the capacity follows the size of the records.
+    int64 bytes = 0;
+    for (const Rope& value : *values) bytes += value.RetainedBytes();
+    const int64 avg = std::max<int64>(1, bytes / values->size());
+    const int64 old_avg = avg_record_bytes_;
+    avg_record_bytes_ = old_avg == 0 ? avg : (7 * old_avg + avg) / 8;
+  }
+  if (stop_) {
+    // The records would never be yielded.
+    values->clear();
+    return Progress::kDone;
+  }
+  const int64 room = Capacity() - TotalBufSize();
+  if (room <= 0) return Progress::kBufferFull;
+  EpochBuf* epoch_buf = &buf_[shard->epoch % 2];
+  thread_local std::mt19937 rnd(std::random_device{}());
+  BufShard* buf_shard =
+      epoch_buf->shards[rnd() % epoch_buf->shards.size()].get();
+  {
+    ReaderMutexLock pl(&progress_mu_);
+    // Adds the values in the order they were read, so that the records of a
+    // split added so far are always its first shard->num_added ones.
+    const int64 n = std::min<int64>(room, values->size());
+    int64 bytes = 0;
+    int64 retained_bytes = 0;
+    {
+      MutexLock l(&buf_shard->mu);
+      std::vector<Rope>& buf = buf_shard->buf;
+      for (int64 i = 0; i < n; ++i) {
+        bytes += (*values)[i].size();
+        retained_bytes += (*values)[i].RetainedBytes();
+        // Adds (*values)[i]. Swaps its position with another random element.
+        auto index = buf_shard->rnd() % (buf.size() + 1);
+        if (index == buf.size()) {
+          buf.push_back(std::move((*values)[i]));
+        } else {
+          buf.push_back(std::move(buf[index]));
+          buf[index] = std::move((*values)[i]);
+        }
       }
-      thread_->Schedule([this, shard]() { ShardLoop(shard); });
     }
-    for (int i = 0; i < N; ++i) {
-      shards[i].done.WaitForNotification();
-      s.Update(shards[i].status);
+    values->erase(values->begin(), values->begin() + n);
+    ChargeBuffer(retained_bytes);
+    if (records_stat_ != nullptr) {
+      *records_stat_ += n;
+      *bytes_stat_ += bytes;
     }
-    if (ShouldFinish(s)) break;
+    *(num_added != nullptr ? num_added : &shard->num_added) += n;
+    epoch_buf->num_buffered += n;
+    epoch_buf->state += n;
+  }
+  WakeUpWaiters();
+  NotifyReady();
+  return stop_ ? Progress::kDone : Progress::kMore;
+}
 
-    // Do not start the next epoch until all buffered records are consumed.
-    {
+void BasicRecordYielder::Collect(Shard* shard, const std::vector<Rope>& values,
+                                 size_t begin) {
+  int64 bytes = 0;
+  for (size_t i = begin; i < values.size(); ++i) bytes += values[i].size();
+  const int64 end = arena_full_ ? 0 : (arena_bytes_ += bytes);
+  if (arena_full_ || end > opts_.in_memory_max_bytes) {
+    if (!arena_full_.exchange(true)) {
+      LOG(INFO) << "Records of " << opts_.file_pattern << " exceed "
+                << opts_.in_memory_max_bytes
+                << " bytes and are not kept in memory";
+    }
+    shard->collect = false;
+    std::vector<uint64>().swap(shard->arena_begins);
+    return;
+  }
+  // No other shard writes to [end - bytes, end).
+  uint64 offset = end - bytes;
+  for (size_t i = begin; i < values.size(); ++i) {
+    shard->arena_begins.push_back(offset);
+    const Rope& value = values[i];
+    for (int j = 0; j < value.num_chunks(); ++j) {
+      const StringPiece chunk = value.chunk(j);
+      memcpy(arena_buf_.get() + offset, chunk.data(), chunk.size());
+      offset += chunk.size();
+    }
+  }
+}
+
+void BasicRecordYielder::BuildArena(std::vector<Shard>* shards) {
+  const uint64 num_bytes = arena_bytes_;
+  size_t num_records = 0;
+  for (const Shard& shard : *shards) num_records += shard.arena_begins.size();
+  // The records fill arena_buf_[0, num_bytes) without gaps, so that each
+  // ends where the next one by offset begins. Of records with the same
+  // offset all but one are empty, so their order does not matter.
+  arena_offsets_.reserve(num_records + 1);
+  for (Shard& shard : *shards) {
+    arena_offsets_.insert(arena_offsets_.end(), shard.arena_begins.begin(),
+                          shard.arena_begins.end());
+    std::vector<uint64>().swap(shard.arena_begins);
+  }
+  std::sort(arena_offsets_.begin(), arena_offsets_.end());
+  arena_offsets_.push_back(num_bytes);
+  arena_order_.resize(num_records);
+  std::iota(arena_order_.begin(), arena_order_.end(), 0);
+  arena_ = arena_buf_;
+  LOG(INFO) << "Keeps " << num_records << " records (" << num_bytes
+            << " bytes) of " << opts_.file_pattern << " in memory";
+}
+
+void BasicRecordYielder::StartArenaEpoch() {
+  EpochRead* read = reading_.get();
+  int64 shuffle_seed = opts_.seed;
+  if (opts_.seed == 0) {
+    MutexLock l(&mu_);
+    shuffle_seed = rnd_();
+  }
+  std::mt19937_64 shuffle_rnd(Hash64Combine(read->epoch, shuffle_seed));
+  std::shuffle(arena_order_.begin(), arena_order_.end(), shuffle_rnd);
+
+  read->shards = std::vector<Shard>(1);
+  Shard* shard = &read->shards[0];
+  shard->index = 0;
+  shard->epoch = read->epoch;
+  shard->arena = true;
+  {
+    MutexLock pl(&progress_mu_);
+    read_epoch_ = read->epoch;
+    arena_epoch_ = true;
+  }
+  ScheduleShards();
+}
+
+BasicRecordYielder::Progress BasicRecordYielder::ArenaShardStep(Shard* shard) {
+  // The records are views of arena_, so that no record is copied or
+  // allocated.
+  std::vector<Rope>* values = &shard->values;
+  const char* data = arena_.get();
+  while (values->size() < kRecordsPerAdd &&
+         shard->arena_next < arena_order_.size()) {
+    const uint64 i = arena_order_[shard->arena_next++];
+    values->push_back(Rope::View(
+        StringPiece(data + arena_offsets_[i],
+                    arena_offsets_[i + 1] - arena_offsets_[i]),
+        arena_));
+  }
+  if (values->empty()) return Progress::kDone;
+  const Progress progress = TryAdd(shard, values);
+  if (progress == Progress::kDone) shard->status = errors::Aborted("stopped");
+  return progress;
+}
+
+void BasicRecordYielder::StartShuffledEpoch() {
+  EpochRead* read = reading_.get();
+  if (file_type_ != "tfrecord" && file_type_ != "tfrecord_mmap") {
+    FinishEpoch(errors::InvalidArgument(
+        "Global shuffling requires uncompressed TFRecord files: ",
+        opts_.file_pattern));
+    return;
+  }
+  std::vector<FileSplit> splits;
+  Status s = RecordIterator::ParsePatternIntoSplits(
+      file_type_, opts_.file_pattern, /* num_splits_hint */ 0,
+      opts_.min_split_bytes, &splits, opts_.file_list_max_age_secs,
+      io_queue_.get());
+  if (!s.ok()) {
+    FinishEpoch(s);
+    return;
+  }
+  // Skips the index files, in case the pattern matches them too.
+  splits.erase(std::remove_if(splits.begin(), splits.end(),
+                              [](const FileSplit& split) {
+                                return IsTFRecordIndexFile(split.filename);
+                              }),
+               splits.end());
+  if (splits.empty()) {
+    LOG(FATAL) << "Found no files at " << opts_.file_pattern;
+  }
+
+  // Loads the indices of the files new to this epoch in parallel.
+  read->shuffled.reset(new ShuffledEpoch);
+  ShuffledEpoch* shuffled = read->shuffled.get();
+  for (const FileSplit& split : splits) {
+    shuffled->filenames.push_back(split.filename);
+    auto iter = record_indices_.find(split.filename);
+    if (iter != record_indices_.end()) {
+      shuffled->indices.push_back(iter->second);
+    } else {
+      read->missing.push_back(shuffled->indices.size());
+      shuffled->indices.emplace_back();
+    }
+  }
+  if (read->missing.empty()) {
+    StartShuffledShards();
+    return;
+  }
+  read->statuses.resize(read->missing.size());
+  const int n = std::min<size_t>(opts_.parallelism, read->missing.size());
+  read->num_loaders = n;
+  // reading_ is deleted once the epoch is done, maybe before this returns.
+  for (int i = 0; i < n; ++i) {
+    io_queue_->ScheduleBlocking([this, read]() { LoadIndex(read); });
+  }
+}
+
+void BasicRecordYielder::LoadIndex(EpochRead* read) {
+  const size_t i = read->next_missing++;
+  if (i < read->missing.size()) {
+    const int file = read->missing[i];
+    auto index = std::make_shared<std::vector<uint64>>();
+    read->statuses[i] =
+        LoadTFRecordIndex(read->shuffled->filenames[file], index.get());
+    read->shuffled->indices[file] = std::move(index);
+    io_queue_->ScheduleBlocking([this, read]() { LoadIndex(read); });
+    return;
+  }
+  if (--read->num_loaders == 0) StartShuffledShards();
+}
+
+void BasicRecordYielder::StartShuffledShards() {
+  EpochRead* read = reading_.get();
+  for (const Status& s : read->statuses) {
+    if (!s.ok()) {
+      FinishEpoch(s);
+      return;
+    }
+  }
+  ShuffledEpoch* shuffled = read->shuffled.get();
+  // Forgets the files which no longer match.
+  record_indices_.clear();
+  uint64 num_records = 0;
+  for (size_t i = 0; i < shuffled->filenames.size(); ++i) {
+    record_indices_[shuffled->filenames[i]] = shuffled->indices[i];
+    shuffled->starts.push_back(num_records);
+    num_records += shuffled->indices[i]->size() - 1;
+  }
+  const int64 epoch = read->epoch;
+  const YielderState* state = read->state.get();
+  if (state != nullptr && state->num_shuffled_records() == 0) {
+    // The epoch was saved before it started.
+    state = nullptr;
+  } else if (state != nullptr &&
+             state->num_shuffled_records() != num_records) {
+    LOG(WARNING) << "Rereads epoch " << epoch << " of " << opts_.file_pattern
+                 << ", since its files have " << num_records
+                 << " records instead of " << state->num_shuffled_records();
+    state = nullptr;
+  }
+  if (state != nullptr) {
+    shuffled->seed = state->shuffle_seed();
+    MutexLock l(&shuffled->mu);
+    for (const PermutationRange& range : state->shuffle_ranges()) {
+      shuffled->ranges.emplace_back(range.begin(), range.end());
+    }
+  } else {
+    int64 shuffle_seed = opts_.seed;
+    if (opts_.seed == 0) {
       MutexLock l(&mu_);
-      epoch_end_ = true;
-      mu_.Await(buf_empty_);
-      epoch_end_ = false;
+      shuffle_seed = rnd_();
     }
+    shuffled->seed = Hash64Combine(epoch, shuffle_seed);
+    MutexLock l(&shuffled->mu);
+    shuffled->ranges.emplace_back(0, num_records);
+  }
+  shuffled->permutation.reset(
+      new RandomPermutation(num_records, shuffled->seed));
+  VLOG(1) << "Shuffles " << num_records << " records of "
+          << shuffled->filenames.size() << " files";
+
+  const int N = opts_.parallelism;
+  read->shards = std::vector<Shard>(N);
+  for (int i = 0; i < N; ++i) {
+    Shard* shard = &read->shards[i];
+    shard->index = i;
+    shard->epoch = epoch;
+    shard->shuffled = shuffled;
+  }
+  {
+    MutexLock pl(&progress_mu_);
+    read_epoch_ = epoch;
+    shards_ = &read->shards;
+    shuffled_ = shuffled;
+  }
+  ScheduleShards();
+}
 
-    LOG(INFO) << "Epoch " << current_epoch() << ": total records "
-              << num_records_yielded_in_epoch_;
+BasicRecordYielder::Progress BasicRecordYielder::ShuffledShardStep(
+    Shard* shard) {
+  std::vector<Rope>* values = &shard->values;
+  // Adds the records of the last window in the order of the permutation.
+  if (!values->empty()) {
+    const Progress progress = TryAdd(shard, values);
+    if (progress == Progress::kDone) shard->status = errors::Aborted("stopped");
+    return progress;
+  }
+  if (ShouldFinish(Status::OK())) return Progress::kDone;
+
+  struct Fetch {
+    int file;
+    uint64 record;  // Within the file.
+    int slot;       // Within the window.
+  };
+  ShuffledEpoch* shuffled = shard->shuffled;
+  const std::vector<uint64>& starts = shuffled->starts;
+  uint64 begin;
+  uint64 end;
+  {
+    // Takes the next window, so that GetState() sees it either left to read
+    // or being read by this shard.
+    ReaderMutexLock pl(&progress_mu_);
+    MutexLock l(&shuffled->mu);
+    shard->reading = false;
+    if (shuffled->ranges.empty()) return Progress::kDone;
+    std::pair<uint64, uint64>* range = &shuffled->ranges.front();
+    begin = range->first;
+    end = std::min<uint64>(range->second, begin + kShuffleWindow);
+    range->first = end;
+    if (range->first >= range->second) shuffled->ranges.pop_front();
+    shard->reading = true;
+    shard->window_begin = begin;
+    shard->window_end = end;
+    shard->num_added = 0;
   }
+  std::vector<Fetch> fetches;
+  for (uint64 i = begin; i < end; ++i) {
+    const uint64 pos = (*shuffled->permutation)(i);
+    const int file = std::upper_bound(starts.begin(), starts.end(), pos) -
+                     starts.begin() - 1;
+    fetches.push_back({file, pos - starts[file], static_cast<int>(i - begin)});
+  }
+  // Reads the records of the window in the order of the files, each run of
+  // consecutive records in one read.
+  std::sort(fetches.begin(), fetches.end(),
+            [](const Fetch& a, const Fetch& b) {
+              return a.file < b.file ||
+                     (a.file == b.file && a.record < b.record);
+            });
+  values->resize(end - begin);
+  Status s;
+  for (size_t i = 0; i < fetches.size() && s.ok();) {
+    const int file = fetches[i].file;
+    size_t j = i + 1;
+    while (j < fetches.size() && fetches[j].file == file &&
+           fetches[j].record == fetches[j - 1].record + 1) {
+      ++j;
+    }
+    const string& filename = shuffled->filenames[file];
+    const std::vector<uint64>& offsets = *shuffled->indices[file];
+    const uint64 offset = offsets[fetches[i].record];
+    const uint64 size = offsets[fetches[j - 1].record + 1] - offset;
+    RandomAccessFile* f = nullptr;
+    s = OpenShuffledFile(shard, file, &f);
+    if (!s.ok()) break;
+    auto buf = std::make_shared<string>();
+    buf->resize(size);
+    StringPiece data;
+    const uint64 start = Env::Default()->NowMicros();
+    s = f->Read(offset, size, &data, &(*buf)[0]);
+    if (read_usecs_stat_ != nullptr) {
+      read_usecs_stat_->Add(Env::Default()->NowMicros() - start);
+    }
+    if (s.ok() && data.size() != size) {
+      s = errors::DataLoss("Read ", data.size(), " of ", size, " bytes");
+    }
+    if (!s.ok()) {
+      s = errors::DataLoss("Failed to read ", filename, " @", offset, ": ",
+                           s.error_message());
+      break;
+    }
+    if (data.data() != buf->data()) buf->assign(data.data(), data.size());
+    for (; i < j && s.ok(); ++i) {
+      const uint64 record_offset = offsets[fetches[i].record];
+      StringPiece record;
+      s = ParseTFRecord(
+          StringPiece(buf->data() + record_offset - offset,
+                      offsets[fetches[i].record + 1] - record_offset),
+          &record);
+      if (!s.ok()) {
+        s = errors::DataLoss(s.error_message(), " in ", filename, " @",
+                             record_offset);
+      }
+      (*values)[fetches[i].slot] = Rope::View(record, buf, buf->size());
+    }
+  }
+  // Read errors fail the yielder.
+  if (ShouldFinish(s)) {
+    values->clear();
+    return Progress::kDone;
+  }
+  return Progress::kMore;
+}
+
+Status BasicRecordYielder::OpenShuffledFile(Shard* shard, int file,
+                                            RandomAccessFile** f) {
+  auto iter = shard->files.find(file);
+  if (iter != shard->files.end()) {
+    shard->file_lru.splice(shard->file_lru.end(), shard->file_lru,
+                           iter->second.lru);
+    *f = iter->second.file.get();
+    return Status::OK();
+  }
+  if (shard->files.size() >= kMaxOpenFiles) {
+    // Closes the least recently read file.
+    shard->files.erase(shard->file_lru.front());
+    shard->file_lru.pop_front();
+  }
+  // Opened like the files of the iterators, from the shard cache if there is
+  // a copy. The records are read at random offsets, which reading ahead
+  // would not help.
+  std::unique_ptr<RandomAccessFile> opened;
+  TF_RETURN_IF_ERROR(
+      OpenRecordFile(shard->shuffled->filenames[file], cache_, &opened));
+  Shard::OpenFile* open_file = &shard->files[file];
+  open_file->file = std::move(opened);
+  open_file->lru = shard->file_lru.insert(shard->file_lru.end(), file);
+  *f = open_file->file.get();
+  return Status::OK();
+}
 
-  adjust_done.WaitForNotification();
-  main_loop_done_.Notify();
+std::unique_ptr<ReadaheadFile> BasicRecordYielder::ReadAhead(
+    const FileSplit& split) {
+  if (opts_.readahead_blocks <= 0) return nullptr;
+  // A cached file is read from the local disk.
+  if (cache_ != nullptr && cache_->Contains(split.filename)) return nullptr;
+  return std::unique_ptr<ReadaheadFile>(new ReadaheadFile(
+      split.filename, split.offset, opts_.readahead_blocks,
+      ReadaheadFile::kDefaultBlockSize, io_queue_.get()));
 }
 
-bool BasicRecordYielder::Add(std::vector<Rope>* values) {
+SplitQueue::SplitQueue(std::vector<FileSplit> splits, int num_shards,
+                       bool work_stealing) {
+  if (!work_stealing) {
+    queues_.resize(1);
+    queues_[0].assign(std::make_move_iterator(splits.begin()),
+                      std::make_move_iterator(splits.end()));
+    return;
+  }
+  queues_.resize(num_shards);
+  for (int i = 0; i < splits.size(); ++i) {
+    queues_[i % num_shards].push_back(std::move(splits[i]));
+  }
+}
+
+std::vector<FileSplit> SplitQueue::Remaining() const {
+  MutexLock l(&mu_);
+  std::vector<FileSplit> splits;
+  for (const auto& queue : queues_) {
+    splits.insert(splits.end(), queue.begin(), queue.end());
+  }
+  return splits;
+}
+
+bool SplitQueue::Empty() const {
   MutexLock l(&mu_);
-  mu_.Await(buf_not_full_);
-  while (BufNotFull() && !values->empty()) {
-    // Adds values->back(). Swaps its position with another random
-    // element.
-    auto index = rnd_() % (buf_.size() + 1);
-    if (index == buf_.size()) {
-      buf_.push_back(std::move(values->back()));
+  for (const auto& queue : queues_) {
+    if (!queue.empty()) return false;
+  }
+  return true;
+}
+
+bool SplitQueue::Next(int shard, FileSplit* split) {
+  MutexLock l(&mu_);
+  auto* queue = &queues_[queues_.size() == 1 ? 0 : shard];
+  if (!queue->empty()) {
+    *split = std::move(queue->front());
+    queue->pop_front();
+    return true;
+  }
+  // Steals the last split of the shard with the most remaining work.
+  auto* victim = &*std::max_element(
+      queues_.begin(), queues_.end(),
+      [](const std::deque<FileSplit>& a, const std::deque<FileSplit>& b) {
+        return a.size() < b.size();
+      });
+  if (victim->empty()) return false;
+  *split = std::move(victim->back());
+  victim->pop_back();
+  return true;
+}
+
+string BasicRecordYielder::SplitKey(const FileSplit& split) {
+  return strings::StrCat(split.filename, "@", split.offset);
+}
+
+bool BasicRecordYielder::ReadBatch(RecordIterator* iter, int max,
+                                   std::vector<Rope>* values) {
+  if (read_usecs_stat_ == nullptr) return iter->NextBatch(max, values, nullptr);
+  const uint64 start = Env::Default()->NowMicros();
+  const bool ok = iter->NextBatch(max, values, nullptr);
+  read_usecs_stat_->Add(Env::Default()->NowMicros() - start);
+  return ok;
+}
+
+bool BasicRecordYielder::NextSplit(Shard* shard, FileSplit* split) {
+  bool has_split;
+  {
+    ReaderMutexLock l(&progress_mu_);
+    has_split = shard->queue->Next(shard->index, split);
+    if (has_split) shard->claimed.push_back(*split);
+  }
+  // Paused shards finish their epoch once no split is left.
+  if (tuner_ != nullptr && shard->queue->Empty()) WakeUpWaiters();
+  return has_split;
+}
+
+void BasicRecordYielder::ScheduleShard(Shard* shard) {
+  // Only the records kept in memory are read without waiting for I/O.
+  if (shard->arena) {
+    io_queue_->Schedule([this, shard]() { RunShard(shard); });
+  } else {
+    io_queue_->ScheduleBlocking([this, shard]() { RunShard(shard); });
+  }
+}
+
+void BasicRecordYielder::RunShard(Shard* shard) {
+  const uint64 deadline = Env::Default()->NowMicros() + kShardSliceMicros;
+  Progress progress;
+  do {
+    if (shard->arena) {
+      progress = ArenaShardStep(shard);
+    } else if (shard->shuffled != nullptr) {
+      progress = ShuffledShardStep(shard);
+    } else if (opts_.interleave_cycle_length > 1) {
+      progress = InterleaveShardStep(shard);
+    } else {
+      progress = ShardStep(shard);
+    }
+  } while (progress == Progress::kMore &&
+           Env::Default()->NowMicros() < deadline);
+  switch (progress) {
+    case Progress::kMore:
+      // Lets the shards of other yielders run first.
+      ScheduleShard(shard);
+      return;
+    case Progress::kBufferFull:
+    case Progress::kPaused:
+      shard->parked_for = progress;
+      Park(shard);
+      return;
+    case Progress::kDone:
+      shard->iter.reset();
+      shard->next_file.reset();
+      shard->iters.clear();
+      shard->files.clear();
+      shard->file_lru.clear();
+      if (--reading_->num_running == 0) FinishEpoch(Status::OK());
+      return;
+  }
+}
+
+void BasicRecordYielder::Park(Shard* shard) {
+  shard->parked_micros = Env::Default()->NowMicros();
+  // Counted first, so that a consumer making room after MayResume() is
+  // evaluated below sees the shard and resumes it.
+  ++num_parked_;
+  MutexLock l(&mu_);
+  parked_.push_back(shard);
+  ResumeParked();
+}
+
+void BasicRecordYielder::ResumeParked() {
+  if (epoch_pending_ && BufFree()) {
+    epoch_pending_ = false;
+    --num_parked_;
+    io_queue_->ScheduleBlocking([this]() { StartEpoch(); });
+  }
+  if (parked_.empty()) return;
+  const uint64 now = Env::Default()->NowMicros();
+  for (size_t i = 0; i < parked_.size();) {
+    Shard* shard = parked_[i];
+    if (!MayResume(shard)) {
+      ++i;
+      continue;
+    }
+    parked_[i] = parked_.back();
+    parked_.pop_back();
+    --num_parked_;
+    if (shard->parked_for == Progress::kBufferFull) {
+      producer_idle_usecs_ += now - shard->parked_micros;
     } else {
-      buf_.push_back(std::move(buf_[index]));
-      buf_[index] = std::move(values->back());
+      VLOG(1) << "Shard " << shard->index << " resumes";
+    }
+    ScheduleShard(shard);
+  }
+}
+
+bool BasicRecordYielder::MayResume(const Shard* shard) const {
+  if (stop_) return true;
+  if (shard->parked_for == Progress::kPaused) return !MustPause(shard);
+  const int64 capacity = Capacity();
+  return capacity - TotalBufSize() >= RoomToResume(capacity);
+}
+
+int64 BasicRecordYielder::StartSplit(Shard* shard, const FileSplit& split) {
+  ReaderMutexLock pl(&progress_mu_);
+  int64 num_to_skip = 0;
+  {
+    MutexLock l(&mu_);
+    if (!num_records_to_skip_.empty()) {
+      auto iter = num_records_to_skip_.find(SplitKey(split));
+      if (iter != num_records_to_skip_.end()) {
+        num_to_skip = iter->second;
+        num_records_to_skip_.erase(iter);
+      }
+    }
+  }
+  // Splits are started in the order they are claimed.
+  shard->claimed.erase(shard->claimed.begin());
+  if (opts_.interleave_cycle_length > 1) {
+    shard->interleaved.push_back({split, num_to_skip});
+    return num_to_skip;
+  }
+  shard->reading = true;
+  shard->split = split;
+  shard->num_added = num_to_skip;
+  return num_to_skip;
+}
+
+Status BasicRecordYielder::GetState(int64 max_buffered_records,
+                                    YielderState* state) {
+  state->Clear();
+  MutexLock pl(&progress_mu_);
+  MutexLock l(&mu_);
+  TF_RETURN_IF_ERROR(status_);
+  const int64 epoch = epoch_;
+  state->set_file_pattern(opts_.file_pattern);
+  state->set_epoch(epoch);
+  if (complete_epoch_ >= epoch) {
+    state->set_epoch_read(true);
+  } else if (read_epoch_ == epoch && arena_epoch_) {
+    return errors::Unimplemented(
+        "Can not save the state of an epoch served from memory: ",
+        opts_.file_pattern);
+  } else if (read_epoch_ == epoch && shuffled_ != nullptr) {
+    state->set_shuffle_seed(shuffled_->seed);
+    state->set_num_shuffled_records(shuffled_->permutation->size());
+    auto add_range = [state](uint64 begin, uint64 end) {
+      if (begin >= end) return;
+      PermutationRange* range = state->add_shuffle_ranges();
+      range->set_begin(begin);
+      range->set_end(end);
+    };
+    for (const Shard& shard : *shards_) {
+      if (shard.reading) {
+        add_range(shard.window_begin + shard.num_added, shard.window_end);
+      }
+    }
+    MutexLock sl(&shuffled_->mu);
+    for (const auto& range : shuffled_->ranges) {
+      add_range(range.first, range.second);
+    }
+    state->set_epoch_read(state->shuffle_ranges_size() == 0);
+  } else if (read_epoch_ == epoch) {
+    auto add_split = [this, state](const FileSplit& split, int64 num_read) {
+      FileSplitState* split_state = state->add_splits();
+      split_state->set_filename(split.filename);
+      split_state->set_offset(split.offset);
+      split_state->set_length(split.length);
+      if (num_read == 0 && !num_records_to_skip_.empty()) {
+        // Not started since the yielder was restored.
+        auto iter = num_records_to_skip_.find(SplitKey(split));
+        if (iter != num_records_to_skip_.end()) num_read = iter->second;
+      }
+      split_state->set_num_records_read(num_read);
+    };
+    for (const Shard& shard : *shards_) {
+      if (shard.reading) add_split(shard.split, shard.num_added);
+      for (const Shard::InterleavedSplit& interleaved : shard.interleaved) {
+        add_split(interleaved.split, interleaved.num_added);
+      }
+    }
+    for (const Shard& shard : *shards_) {
+      for (const FileSplit& split : shard.claimed) add_split(split, 0);
+    }
+    for (const FileSplit& split : queue_->Remaining()) add_split(split, 0);
+    state->set_epoch_read(state->splits_size() == 0);
+  }
+  // Otherwise, the files of the epoch are being listed.
+
+  // Samples the buffered records uniformly.
+  EpochBuf* epoch_buf = &buf_[epoch % 2];
+  if ((epoch_buf->state >> kEpochShift) != epoch) return Status::OK();
+  std::vector<string> sample;
+  int64 num_seen = 0;
+  for (const auto& shard : epoch_buf->shards) {
+    MutexLock sl(&shard->mu);
+    for (const Rope& value : shard->buf) {
+      ++num_seen;
+      if (num_seen <= max_buffered_records) {
+        sample.push_back(string(value));
+      } else if (max_buffered_records > 0) {
+        const int64 index = rnd_() % num_seen;
+        if (index < max_buffered_records) sample[index] = string(value);
+      }
     }
-    values->pop_back();
   }
-  return stop_;
+  for (string& value : sample) state->add_buffered_records(std::move(value));
+  state->set_num_dropped_records(num_seen - sample.size());
+  return Status::OK();
 }
 
+BasicRecordYielder::Progress BasicRecordYielder::ShardStep(Shard* shard) {
+  std::vector<Rope>* values = &shard->values;
+  // Adds the records read once there are enough of them, and the remaining
+  // ones of a finished split before the next one is started, so that
+  // shard->num_added counts all of its records read so far.
+  if (!values->empty() &&
+      (shard->iter == nullptr || values->size() >= kRecordsPerAdd)) {
+    const Progress progress = TryAdd(shard, values);
+    if (progress == Progress::kDone) shard->status = errors::Aborted("stopped");
+    return progress;
+  }
+  if (stop_) return Progress::kDone;
+
+  if (shard->iter == nullptr) {
+    {
+      ReaderMutexLock l(&progress_mu_);
+      shard->reading = false;
+    }
+    FileSplit split;
+    std::unique_ptr<ReadaheadFile> file;
+    if (shard->has_next_split) {
+      split = std::move(shard->next_split);
+      file = std::move(shard->next_file);
+      shard->has_next_split = false;
+    } else {
+      if (MustPause(shard)) return Progress::kPaused;
+      if (!NextSplit(shard, &split)) return Progress::kDone;
+      file = ReadAhead(split);
+    }
+    if (ShouldFinish(Status::OK())) return Progress::kDone;
+    VLOG(1) << "Shard " << shard->index << " " << split.filename << " @"
+            << split.offset;
+    shard->num_to_skip = StartSplit(shard, split);
+    // With readahead, claims the next split right away so that it is read
+    // while this one is being parsed, unless the shard is paused.
+    if (opts_.readahead_blocks > 0 && IsActive(shard)) {
+      shard->has_next_split = NextSplit(shard, &shard->next_split);
+      if (shard->has_next_split) {
+        shard->next_file = ReadAhead(shard->next_split);
+      }
+    }
+    prefetched_file = file.release();
+    shard_cache = cache_;
+    shard_queue = io_queue_.get();
+    shard->iter.reset(RecordIterator::New(file_type_, split));
+    // Non-null iff the iterator did not open the file through OpenOrDie.
+    delete prefetched_file;
+    prefetched_file = nullptr;
+    shard_cache = nullptr;
+    shard_queue = nullptr;
+    return Progress::kMore;
+  }
+
+  // Reads the records straight into values, without their keys. values may
+  // keep a few records TryAdd() had no room for.
+  const size_t num_old = values->size();
+  if (!ReadBatch(shard->iter.get(),
+                 std::max<int>(1, kRecordsPerAdd - static_cast<int>(num_old)),
+                 values)) {
+    shard->iter.reset();
+    return Progress::kMore;
+  }
+  if (shard->num_to_skip > 0) {
+    const int64 n = std::min<int64>(shard->num_to_skip, values->size());
+    values->erase(values->begin(), values->begin() + n);
+    shard->num_to_skip -= n;
+  }
+  // No record is skipped in a collected epoch.
+  if (shard->collect) Collect(shard, *values, num_old);
+  return Progress::kMore;
+}
 
-void BasicRecordYielder::ShardLoop(Shard* shard) {
-  std::vector<Rope> values;
-  for (const string& filename : shard->filenames) {
-    if (ShouldFinish(Status::OK())) break;
-    VLOG(1) << "Shard " << shard->index << " " << filename;
-    std::unique_ptr<RecordIterator> iter(
-        RecordIterator::New(file_type_, filename));
-    string key;
-    Rope val;
-    while (iter->Next(&key, &val)) {
-      values.emplace_back(val);
-      if (values.size() >= kRecordsPerAdd && Add(&values)) {
+BasicRecordYielder::Progress BasicRecordYielder::InterleaveShardStep(
+    Shard* shard) {
+  const int cycle_length = opts_.interleave_cycle_length;
+  const int block_length = std::max(1, opts_.interleave_block_length);
+  std::vector<Rope>* values = &shard->values;
+  const size_t next = shard->next;
+  // Adds the whole block read last, so that shard->interleaved counts all
+  // records read so far.
+  if (shard->block_read) {
+    if (!values->empty()) {
+      const Progress progress =
+          TryAdd(shard, values, &shard->interleaved[next].num_added);
+      if (progress == Progress::kDone) {
         shard->status = errors::Aborted("stopped");
-        break;
       }
+      if (progress != Progress::kMore || !values->empty()) return progress;
+    }
+    shard->block_read = false;
+    if (shard->block_eof) {
+      ReaderMutexLock l(&progress_mu_);
+      shard->interleaved.erase(shard->interleaved.begin() + next);
+      shard->iters.erase(shard->iters.begin() + next);
+      shard->iters_num_to_skip.erase(shard->iters_num_to_skip.begin() + next);
+    } else {
+      ++shard->next;
     }
+    return Progress::kMore;
   }
-  // Adds the remaining values of this shard to buf_.
-  while (!values.empty()) {
-    Add(&values);
+  if (stop_) return Progress::kDone;
+
+  // Keeps cycle_length splits open.
+  std::vector<std::unique_ptr<RecordIterator>>& iters = shard->iters;
+  while (shard->more_splits && iters.size() < cycle_length) {
+    // A paused shard reads the splits it has open, but no new one.
+    if (!IsActive(shard) && !iters.empty()) break;
+    if (iters.empty() && MustPause(shard)) return Progress::kPaused;
+    FileSplit split;
+    shard->more_splits = NextSplit(shard, &split);
+    if (!shard->more_splits) break;
+    VLOG(1) << "Shard " << shard->index << " " << split.filename << " @"
+            << split.offset;
+    if (shard->interleaved.capacity() < cycle_length) {
+      ReaderMutexLock l(&progress_mu_);
+      shard->interleaved.reserve(cycle_length);
+    }
+    shard->iters_num_to_skip.push_back(StartSplit(shard, split));
+    shard_cache = cache_;
+    shard_queue = io_queue_.get();
+    iters.emplace_back(RecordIterator::New(file_type_, split));
+    shard_cache = nullptr;
+    shard_queue = nullptr;
+  }
+  if (iters.empty()) return Progress::kDone;
+  if (shard->next >= iters.size()) shard->next = 0;
+
+  // Reads a block of the next split.
+  const size_t i = shard->next;
+  int64* num_to_skip = &shard->iters_num_to_skip[i];
+  shard->block_read = true;
+  shard->block_eof = false;
+  while (values->size() < block_length) {
+    const size_t num_old = values->size();
+    if (!ReadBatch(iters[i].get(), block_length - num_old, values)) {
+      shard->block_eof = true;
+      break;
+    }
+    if (*num_to_skip > 0) {
+      const int64 n = std::min<int64>(*num_to_skip, values->size());
+      values->erase(values->begin(), values->begin() + n);
+      *num_to_skip -= n;
+    }
+    if (shard->collect) Collect(shard, *values, num_old);
   }
-  shard->done.Notify();
+  return Progress::kMore;
 }
 
 }  // namespace lingvo
@@ -18,23 +18,35 @@ limitations under the License.
 
 #include <algorithm>
 #include <atomic>
+#include <deque>
+#include <list>
 #include <memory>
 #include <random>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "lingvo/core/ops/input_stats.h"
+#include "lingvo/core/ops/io_executor.h"
+#include "lingvo/core/ops/memory_budget.h"
 #include "lingvo/core/ops/mutex.h"
+#include "lingvo/core/ops/parallelism_tuner.h"
+#include "lingvo/core/ops/readahead_file.h"
 #include "lingvo/core/ops/rope.h"
 #include "tensorflow/core/lib/core/errors.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/lib/core/threadpool.h"
 #include "tensorflow/core/platform/macros.h"
 #include "tensorflow/core/platform/thread_annotations.h"
+#include "tensorflow/core/platform/types.h"
 
 namespace tensorflow {
 namespace lingvo {
 
+class ShardCache;
+class YielderState;
+
 // TODO(oday): Separate some constants and Record to other file.
 // TODO(oday): Change "source_id" to another appropriate name, because this is
 // one of the typically used symbols in some tasks (e.g., NMTExample has such
@@ -56,6 +68,24 @@ struct Record {
   int source_id;
 };
 
+// A byte range of a file. A RecordIterator over a split yields the records
+// starting within [offset, offset + length).
+struct FileSplit {
+  string filename;
+  uint64 offset = 0;
+  uint64 length = kuint64max;  // Up to the end of the file.
+
+  FileSplit() {}
+  explicit FileSplit(const string& filename) : filename(filename) {}
+  FileSplit(const string& filename, uint64 offset, uint64 length)
+      : filename(filename), offset(offset), length(length) {}
+
+  // Returns the end offset of the split.
+  uint64 end() const {
+    return length > kuint64max - offset ? kuint64max : offset + length;
+  }
+};
+
 // An interface to iterate sequentially a set of record (Rope).
 class RecordIterator {
  public:
@@ -65,6 +95,13 @@ class RecordIterator {
   // fills in 'key' and 'value'.
   virtual bool Next(string* key, Rope* value) = 0;
 
+  // Appends up to 'max' records to 'values' and, if 'keys_or_null' is not
+  // null, their keys to it. Returns false iff no record is appended, i.e., at
+  // EOF. The default implementation calls Next(). Iterators override it to
+  // avoid a virtual call per record and formatting keys nobody reads.
+  virtual bool NextBatch(int max, std::vector<Rope>* values,
+                         std::vector<string>* keys_or_null);
+
   // Register a method to create a RecordIterator for the 'type_name'.
   typedef std::function<RecordIterator*(const string&)> FactoryMethod;
   static bool Register(const string& type_name, FactoryMethod method);
@@ -77,17 +114,106 @@ class RecordIterator {
                                         FactoryMethod method,
                                         PatternParserMethod parser_method);
 
+  // As Register, but 'method' creates iterators over FileSplits. This lets
+  // several shards read different byte ranges of a large file concurrently.
+  typedef std::function<RecordIterator*(const FileSplit&)> SplitFactoryMethod;
+  static bool RegisterSplittable(
+      const string& type_name, SplitFactoryMethod method,
+      PatternParserMethod parser_method = PatternParserMethod());
+
   // Returns a record iterator for 'filename' of 'type_name'.
   static RecordIterator* New(const string& type_name, const string& filename);
 
+  // Returns a record iterator for 'split' of 'type_name'. The type must be
+  // splittable unless 'split' covers the whole file.
+  static RecordIterator* New(const string& type_name, const FileSplit& split);
+
   // Returns the prefix in a file pattern, or an empty string if not exist.
   // Example: "tfrecord:data_dir/data.tfrecord" => "tfrecord"
   static string GetFilePatternPrefix(const string& file_pattern);
 
-  // Parse a file pattern into a list of matching files.
+  // Parse a file pattern into a list of matching files. Comma separated
+  // patterns are matched concurrently as blocking tasks of 'queue', or of a
+  // queue of IoExecutor::Get() if it is null.
   static Status ParsePattern(const string& type_name,
                              const string& file_pattern_list,
-                             std::vector<string>* filenames);
+                             std::vector<string>* filenames,
+                             IoExecutor::Queue* queue = nullptr);
+
+  // Parse a file pattern into a list of work units. If 'type_name' is
+  // splittable and there are fewer matching files than 'num_splits_hint',
+  // files are split into byte ranges of at least 'min_split_bytes' bytes so
+  // that there are about 'num_splits_hint' of them. Otherwise, each file is a
+  // work unit on its own.
+  //
+  // If 'file_list_max_age_secs' is non-zero, the list of matching files is
+  // cached across calls. A cached list older than 'file_list_max_age_secs'
+  // seconds is still returned while it is refreshed in the background. If
+  // negative, the cached list is never refreshed.
+  //
+  // Patterns are matched as by ParsePattern() with 'queue'.
+  static Status ParsePatternIntoSplits(const string& type_name,
+                                       const string& file_pattern_list,
+                                       int num_splits_hint,
+                                       int64 min_split_bytes,
+                                       std::vector<FileSplit>* splits,
+                                       int64 file_list_max_age_secs = 0,
+                                       IoExecutor::Queue* queue = nullptr);
+};
+
+// SplitQueue hands out the FileSplits of an epoch to the shards reading them.
+// By default, all shards pull from a single queue in the given order. With
+// 'work_stealing', splits are assigned to shards round-robin, and a shard
+// which runs out of splits steals the last split of the shard with the most
+// remaining ones. Thread-safe.
+class SplitQueue {
+ public:
+  SplitQueue(std::vector<FileSplit> splits, int num_shards,
+             bool work_stealing);
+
+  // Returns false if there is no split left. Otherwise, returns true and
+  // fills in 'split' with the next split for 'shard'.
+  bool Next(int shard, FileSplit* split);
+
+  // Returns the splits not handed out yet.
+  std::vector<FileSplit> Remaining() const;
+
+  // Returns true if there is no split left.
+  bool Empty() const;
+
+ private:
+  mutable Mutex mu_;
+  std::vector<std::deque<FileSplit>> queues_ GUARDED_BY(mu_);
+
+  TF_DISALLOW_COPY_AND_ASSIGN(SplitQueue);
+};
+
+// ReadyNotifier lets a consumer of several record yielders wait until any of
+// them may have records ready for TryYieldBatch(), rather than poll them.
+// Thread-safe.
+class ReadyNotifier {
+ public:
+  // Called by the yielders whenever records may have become ready. Cheap
+  // unless a consumer waits.
+  void Notify() {
+    ++count_;
+    if (num_waiters_ > 0) {
+      // Waiters re-evaluate their conditions when mu_ is released.
+      MutexLock l(&mu_);
+    }
+  }
+
+  // The number of Notify() calls so far. Read before trying the yielders,
+  // so that no notification is missed.
+  int64 count() const { return count_; }
+
+  // Waits until count() differs from 'count'.
+  void WaitForChange(int64 count);
+
+ private:
+  std::atomic<int64> count_{0};
+  std::atomic<int> num_waiters_{0};
+  Mutex mu_;
 };
 
 // RecordYielder defines an interface that should be used for producing value
@@ -123,6 +249,37 @@ class RecordYielder {
   // indicate some characteristics of the data source.
   virtual Status Yield(Record* record) = 0;
 
+  // Yields up to 'n' records and appends them to 'out'. Blocks until at least
+  // one record is available, but may return fewer than 'n' records rather
+  // than wait for more. On error, the records appended to 'out' before the
+  // error are still valid.
+  //
+  // The default implementation calls Yield() 'n' times. Subclasses override
+  // it to amortize their synchronization over the whole batch.
+  virtual Status YieldBatch(int n, std::vector<Record>* out);
+
+  // Like YieldBatch(), but returns at once with no records rather than wait
+  // for some, e.g., while they are read from slow storage.
+  //
+  // The default implementation calls YieldBatch(), i.e., may wait.
+  virtual Status TryYieldBatch(int n, std::vector<Record>* out);
+
+  // Has 'notifier' notified whenever records may have become ready for
+  // TryYieldBatch(). Not owned, and must outlive this yielder. Returns false
+  // if this yielder never notifies, in which case a consumer waiting for its
+  // records polls it.
+  //
+  // The default implementation returns false.
+  virtual bool SetReadyNotifier(ReadyNotifier* notifier);
+
+  // Fills in 'state' with the position of this yielder, from which a new
+  // yielder resumes yielding records, including at most
+  // 'max_buffered_records' records read but not yet yielded. Records
+  // yielded concurrently may be yielded again after resuming.
+  //
+  // The default implementation returns Unimplemented.
+  virtual Status GetState(int64 max_buffered_records, YielderState* state);
+
   // Stop this yielder and then delete it.
   virtual void Close() = 0;
 };
@@ -136,7 +293,8 @@ class RecordYielder {
 //   2) each record is yielded only once within every epoch;
 //   3) the order in which records are yielded are highly randomized.
 //   4) the peak memory usage is roughly avg record size *
-//      (opts.bufsize + opts.parellelism * 16).
+//      (opts.bufsize + opts.parellelism * 16), unless the buffer is limited
+//      by opts.memory_budget.
 class BasicRecordYielder : public RecordYielder {
  public:
   struct Options {
@@ -157,9 +315,111 @@ class BasicRecordYielder : public RecordYielder {
     // randomization buffer. The buffer size will never exceed bufsize.
     int64 bufsize_in_seconds = 0;
 
-    // Uses this many concurrent iterators to iterate through files.
+    // Uses this many concurrent iterators to iterate through files. They run
+    // as blocking tasks on the IoExecutor shared by all yielders of the
+    // process, which may run fewer of them at once if other yielders read
+    // too.
     int32 parallelism = 1;
 
+    // If greater than 'parallelism', up to this many iterators are started,
+    // of which between 'parallelism' and 'max_parallelism' are active, tuned
+    // every second by a ParallelismTuner from how long the consumers wait
+    // for records and how long the active iterators wait for room in the
+    // buffer. The others pause before their next file. Not used for the
+    // reads of global_shuffle epochs.
+    int32 max_parallelism = 0;
+
+    // If greater than 1, each iterator reads this many files at a time and
+    // takes 'interleave_block_length' records from each in turn, so that the
+    // records of many files are mixed even with a small bufsize. Readahead
+    // is not used then.
+    int32 interleave_cycle_length = 0;
+    int32 interleave_block_length = 1;
+
+    // The randomization buffer is split into this many shards, each with its
+    // own lock, so that iterators and consumers rarely contend. If 0, uses
+    // 'parallelism' shards.
+    int32 buffer_shards = 0;
+
+    // If there are fewer files than 'parallelism' and the file type supports
+    // it (e.g., text), files are split into byte ranges of at least these
+    // many bytes, which are read concurrently.
+    int64 min_split_bytes = 16 << 20;
+
+    // If false, iterators take files from a queue shared by all of them, in
+    // the shuffled order of the epoch. If true, files are assigned to
+    // iterators round-robin and an iterator done with its files steals
+    // files from the one with the most files left.
+    bool work_stealing = false;
+
+    // If positive, each iterator opens its next file and reads up to this many
+    // 2MB blocks of it in the background while the current file is parsed.
+    // Only the built-in text and tfrecord iterators make use of it.
+    int32 readahead_blocks = 0;
+
+    // If non-zero, the files matching 'file_pattern' are listed once and
+    // cached for later epochs. A list older than this many seconds is
+    // refreshed in the background, so that new files are picked up by a later
+    // epoch. If negative, the list is never refreshed.
+    int64 file_list_max_age_secs = 0;
+
+    // If set, resumes from this state saved by GetState() rather than from
+    // the beginning of the first epoch. Ignored if it was saved for another
+    // file pattern.
+    std::shared_ptr<const YielderState> initial_state;
+
+    // If set, the bytes the buffered records keep alive are charged to this
+    // budget, which may be shared with other yielders and the batcher. The
+    // buffer then holds fewer than bufsize records whenever more would exceed
+    // the limit of the budget, given the average size of the records.
+    std::shared_ptr<MemoryBudget> memory_budget;
+
+    // If not empty, the files are copied into this local directory while
+    // they are read, and later epochs read the copies. See ShardCache for
+    // which files can be copied. The directory may be shared by several
+    // yielders and processes.
+    string cache_dir;
+
+    // If positive, the least recently used copies are deleted to keep
+    // cache_dir within this many bytes.
+    int64 cache_max_bytes = 0;
+
+    // If positive, the records of the first epoch are kept in memory, in a
+    // single arena of this many bytes allocated up front, as long as they
+    // fit. The pages of the arena left unused are never written to. Later
+    // epochs then yield them in a new random order without reading the files
+    // again, so that new files matching 'file_pattern' are not picked up.
+    // GetState() fails with Unimplemented while the records of such an epoch
+    // are added to the buffer, as their order can not be found again after a
+    // restart.
+    int64 in_memory_max_bytes = 0;
+
+    // If true, every epoch yields the records of all files in a random
+    // permutation, reading them by their offsets, so that the records are
+    // well shuffled even with a small bufsize. The offsets come from the
+    // index of each file (see record_index.h), which is built and written on
+    // first read if there is none. Only supported for uncompressed TFRecord
+    // files. A state saved by GetState() during such an epoch resumes it at
+    // the same position of the same permutation, unless the number of
+    // records of the files changed in between.
+    bool global_shuffle = false;
+
+    // If true, only the first epoch is read, or the one 'initial_state'
+    // resumes, rather than the next one starting while it is drained. Once
+    // all of its records are yielded, Yield() returns OutOfRange.
+    bool single_epoch = false;
+
+    // If set, the yielder adds the records and bytes it reads from files of
+    // source 'source_id', the latencies of its reads, the occupancy of its
+    // buffer and the time its consumers wait for records to these stats.
+    // Not owned.
+    InputStats* stats = nullptr;
+
+    // If set, the iterators and the periodic adjustments of the buffer size
+    // run on this executor rather than on IoExecutor::Get(), e.g., in tests.
+    // Not owned.
+    IoExecutor* io_executor = nullptr;
+
     // Source id to be supplied with yield.
     int32 source_id = 0;
   };
@@ -172,21 +432,37 @@ class BasicRecordYielder : public RecordYielder {
   // Yields one 'record' from which the value was read.
   Status Yield(Record* record) override;
 
+  // Records of a batch all come from the same epoch.
+  Status YieldBatch(int n, std::vector<Record>* out) override;
+
+  // Yields no records while too few are buffered to be yielded, e.g., while
+  // the next epoch is read.
+  Status TryYieldBatch(int n, std::vector<Record>* out) override;
+
+  // Notifies 'notifier' whenever records are added to the buffer or an
+  // epoch is complete.
+  bool SetReadyNotifier(ReadyNotifier* notifier) override;
+
+  // Saves the current epoch, the splits of it not read yet with how many
+  // records of each were read, and a random sample of the buffered records
+  // of the epoch.
+  Status GetState(int64 max_buffered_records, YielderState* state) override;
+
   // Stop this yielder and then delete it.
   void Close() override;
 
   // Returns the current epoch number. Epoch number starts from 1 and reflects
   // the epoch number of the record returned by the next Yield() call.
-  virtual int64 current_epoch() const {
-    // TODO(tilarids): Use ReaderMutexLock here.
-    MutexLock l(&mu_);
-    return epoch_;
-  }
+  virtual int64 current_epoch() const { return epoch_; }
+
+  // Returns the last epoch whose records have all been read, or 0. Once it
+  // reaches current_epoch(), the consumers drain the rest of the epoch.
+  int64 complete_epoch() const { return complete_epoch_; }
 
   // Returns the current buffer size.
   int64 bufsize() const {
     MutexLock l(&mu_);
-    return bufsize_;
+    return std::min<int64>(bufsize_, Capacity());
   }
 
  protected:
@@ -195,21 +471,158 @@ class BasicRecordYielder : public RecordYielder {
 
   ~BasicRecordYielder() override;
 
-  // Subclass should implement ShardLoop which processes all records
-  // in the 'shard'.
+  // What a step of a shard did, or why it cannot go on.
+  enum class Progress {
+    kMore,        // The shard has more to do.
+    kBufferFull,  // The shard waits for room in buf_.
+    kPaused,      // The shard waits to be activated by the tuner.
+    kDone,        // The shard is done with the epoch.
+  };
+
+  // The files and the record permutation of a global_shuffle epoch.
+  struct ShuffledEpoch;
+
+  // The epoch being read by the main loop: its splits, shards and
+  // permutation.
+  struct EpochRead;
+
+  // An iterator through the files of an epoch. It runs as a series of tasks
+  // on the IoExecutor, each of which takes steps for a time slice. Those
+  // which read files are blocking tasks. A shard which cannot go on is
+  // parked until it can, rather than holding a thread.
   struct Shard {
     int index;                      // Shard index.
-    std::vector<string> filenames;  // File names given to this shard.
-    Notification done;              // Notified when this shard is done.
+    int64 epoch;                    // Epoch the shard reads records for.
+    SplitQueue* queue;              // Where this shard takes splits from.
     Status status;                  // Shard status.
+
+    // The progress of the shard saved by GetState(). Only written by the
+    // shard under a reader lock of progress_mu_.
+    bool reading = false;           // Whether 'split' is being read.
+    FileSplit split;                // The split being read.
+    int64 num_added = 0;            // Records of 'split' added to buf_.
+    std::vector<FileSplit> claimed;  // Splits taken but not started yet.
+
+    // With global shuffling, the positions [window_begin, window_end) of the
+    // permutation are being read instead of 'split', of which the first
+    // 'num_added' were added to buf_.
+    uint64 window_begin = 0;
+    uint64 window_end = 0;
+
+    // With interleaving, the splits being read instead of 'split', and the
+    // number of records of each added to buf_.
+    struct InterleavedSplit {
+      FileSplit split;
+      int64 num_added = 0;
+    };
+    std::vector<InterleavedSplit> interleaved;
+
+    // Whether the records read by the shard are kept for the in-memory
+    // arena, and the offsets in arena_buf_ of the records kept so far.
+    bool collect = false;
+    std::vector<uint64> arena_begins;
+
+    // The state of the shard between its steps.
+    std::vector<Rope> values;  // Records read but not added to buf_ yet.
+    Progress parked_for = Progress::kMore;  // Why the shard is parked.
+    uint64 parked_micros = 0;  // When the shard was parked.
+
+    // Used by ShardStep(). The iterator over 'split' and the number of its
+    // records left to skip, and the next split claimed with readahead.
+    std::unique_ptr<RecordIterator> iter;
+    int64 num_to_skip = 0;
+    bool has_next_split = false;
+    FileSplit next_split;
+    std::unique_ptr<ReadaheadFile> next_file;
+
+    // Used by InterleaveShardStep(). The iterators over 'interleaved' and
+    // the records to skip in each, the one to read a block from next, and
+    // whether the block in 'values' was read and ended its split.
+    std::vector<std::unique_ptr<RecordIterator>> iters;
+    std::vector<int64> iters_num_to_skip;
+    size_t next = 0;
+    bool more_splits = true;
+    bool block_read = false;
+    bool block_eof = false;
+
+    // Used by ShuffledShardStep(). The epoch read, and the files opened by
+    // their index in it, the least recently read first in 'file_lru'.
+    ShuffledEpoch* shuffled = nullptr;
+    struct OpenFile {
+      std::unique_ptr<RandomAccessFile> file;
+      std::list<int>::iterator lru;
+    };
+    std::unordered_map<int, OpenFile> files;
+    std::list<int> file_lru;
+
+    // Used by ArenaShardStep(). Whether the shard adds the records of arena_,
+    // and the position in arena_order_ of the next one.
+    bool arena = false;
+    size_t arena_next = 0;
   };
-  void ShardLoop(Shard* shard);
+
+  // Runs steps of 'shard' for a time slice, then schedules its next task or
+  // parks it. The last shard of the epoch to be done calls FinishEpoch().
+  void RunShard(Shard* shard);
+  void ScheduleShard(Shard* shard);
+
+  // Reads the records of the splits of shard->queue, one after the other.
+  Progress ShardStep(Shard* shard);
+
+  // ShardStep() with opts_.interleave_cycle_length > 1.
+  Progress InterleaveShardStep(Shard* shard);
+
+  // Parks 'shard', which cannot go on for shard->parked_for, until it can.
+  void Park(Shard* shard);
+
+  // Schedules the parked shards which can go on, and the next epoch once
+  // buf_ is free for it.
+  void ResumeParked() EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  bool MayResume(const Shard* shard) const SHARED_LOCKS_REQUIRED(mu_);
+
+  // Takes the next split of 'shard' from its queue.
+  bool NextSplit(Shard* shard, FileSplit* split);
+
+  // Returns true if 'shard' is one of the active iterators. An inactive one
+  // pauses before its next split, until it is activated or its queue runs
+  // out of splits.
+  bool IsActive(const Shard* shard) const {
+    return shard->index < active_parallelism_;
+  }
+  bool MustPause(const Shard* shard) const {
+    return !IsActive(shard) && !shard->queue->Empty();
+  }
+
+  // Calls iter->NextBatch(max, values) and adds its latency to the stats.
+  bool ReadBatch(RecordIterator* iter, int max, std::vector<Rope>* values);
+
+  // Marks 'split', taken by NextSplit(), as being read by 'shard', or adds
+  // it to shard->interleaved when interleaving. Returns the number of its
+  // records to skip because they were read before the yielder was restored.
+  int64 StartSplit(Shard* shard, const FileSplit& split);
+
+  // Returns the file of 'split' opened with background readahead starting at
+  // the split, or nullptr if readahead is disabled.
+  std::unique_ptr<ReadaheadFile> ReadAhead(const FileSplit& split);
 
   // Returns true iff 's' indicates the yielder should stop.
   bool ShouldFinish(const Status& s);
 
-  // Adds 'values' into the random shuffling buffer buf_.
-  bool Add(std::vector<Rope>* values);
+  // Adds as many of 'values' read by 'shard' as there is room for into the
+  // random shuffling buffer buf_ and counts them in '*num_added',
+  // shard->num_added if null. Returns kBufferFull if there was no room, and
+  // kDone if the yielder stops.
+  Progress TryAdd(Shard* shard, std::vector<Rope>* values,
+                  int64* num_added = nullptr);
+
+  // Copies values[begin:] into a range of arena_buf_ reserved for them,
+  // unless the records kept in memory so far exceed
+  // opts_.in_memory_max_bytes.
+  void Collect(Shard* shard, const std::vector<Rope>& values, size_t begin);
+
+  // Waits for 'cond' while letting lock-free Add and Yield calls know that
+  // they need to wake up waiters.
+  void Await(const Condition& cond) EXCLUSIVE_LOCKS_REQUIRED(mu_);
 
  private:
   typedef BasicRecordYielder ME;
@@ -217,75 +630,292 @@ class BasicRecordYielder : public RecordYielder {
   Options opts_;
   string file_type_;
 
-  // Background threads. Owned.
-  thread::ThreadPool* thread_;
+  // The cache in opts_.cache_dir, if any. Not owned.
+  ShardCache* cache_ = nullptr;
+
+  // The buffer of opts_.in_memory_max_bytes the shards of the first epoch
+  // copy their records into, each into the range it reserved by adding to
+  // arena_bytes_. Allocated once, without being initialized, so that only
+  // the pages written to are backed by memory.
+  std::shared_ptr<char> arena_buf_;
+
+  // The records of the first epoch if they are kept in memory: record i is
+  // the bytes [arena_offsets_[i], arena_offsets_[i + 1]) of arena_, which is
+  // arena_buf_ once it is complete. Only written by the main loop.
+  std::shared_ptr<const char> arena_;
+  std::vector<uint64> arena_offsets_;
+  // The order in which the records of arena_ are yielded, reshuffled every
+  // epoch.
+  std::vector<uint64> arena_order_;
+
+  // The record indices of the files read with opts_.global_shuffle, by file
+  // name. Only accessed by the main loop.
+  std::unordered_map<string, std::shared_ptr<const std::vector<uint64>>>
+      record_indices_;
+
+  // The bytes collected by the shards of the first epoch so far, and whether
+  // they exceeded opts_.in_memory_max_bytes.
+  std::atomic<int64> arena_bytes_{0};
+  std::atomic<bool> arena_full_{false};
+
+  // The tasks of the main loop and the shards on io_executor_, and the id
+  // of AdjustBufferSize() called by it.
+  IoExecutor* io_executor_ = nullptr;
+  std::unique_ptr<IoExecutor::Queue> io_queue_;
+  int64 adjust_id_ = -1;
+
+  // The number of iterators started every epoch, and the number of them
+  // active, tuned by tuner_ if opts_.max_parallelism > opts_.parallelism.
+  // active_parallelism_ is only written under mu_.
+  int32 num_shards_ = 1;
+  std::atomic<int32> active_parallelism_{1};
+  std::unique_ptr<ParallelismTuner> tuner_;
+  uint64 last_tune_micros_ GUARDED_BY(mu_) = 0;
+
+  // Microseconds consumers waited for records in WaitForBufEnough() and
+  // iterators waited for room in buf_, since tuner_ was last updated.
+  std::atomic<int64> consumer_wait_usecs_{0};
+  std::atomic<int64> producer_idle_usecs_{0};
 
   mutable Mutex mu_;
 
-  // Epoch number.
-  int64 epoch_ GUARDED_BY(mu_);
+  // Epoch number of the records being yielded. Only written under mu_.
+  std::atomic<int64> epoch_{1};
+
+  // The last epoch whose records have all been added to buf_. Only written
+  // under mu_.
+  std::atomic<int64> complete_epoch_{0};
+
+  // The epoch the main loop reads records for, or is about to.
+  int64 fill_epoch_ GUARDED_BY(mu_) = 1;
+
+  // The epoch being read. Only accessed by the tasks of the main loop, which
+  // run one after the other, and by the shards of the epoch.
+  std::unique_ptr<EpochRead> reading_;
+
+  // With opts_.single_epoch, the epoch read once it is complete. No more
+  // records are yielded after it.
+  int64 last_epoch_ GUARDED_BY(mu_) = 0;
+  bool Exhausted() const SHARED_LOCKS_REQUIRED(mu_) {
+    return last_epoch_ > 0 && epoch_ > last_epoch_;
+  }
+
+  // True while fill_epoch_ waits for buf_ to be free before it is read.
+  // Counted in num_parked_ meanwhile, so that the consumers freeing buf_
+  // call ResumeParked().
+  bool epoch_pending_ GUARDED_BY(mu_) = false;
 
-  // Turned to true when the yielder is deleted.
-  bool stop_ GUARDED_BY(mu_) = false;
+  // Turned to true when the yielder is deleted. Only written under mu_.
+  std::atomic<bool> stop_{false};
   Status status_ GUARDED_BY(mu_);
 
   // PRG used for randomization.
   std::mt19937_64 rnd_ GUARDED_BY(mu_);
 
-  // Randomization buffer.
-  std::vector<Rope> buf_ GUARDED_BY(mu_);
+  // Taken exclusively by GetState() so that no record moves from a split
+  // into buf_ and no split leaves the queue while the state is saved. Taken
+  // before mu_.
+  Mutex progress_mu_;
+
+  // The queue and the shards of the epoch being read, if any.
+  int64 read_epoch_ GUARDED_BY(progress_mu_) = 0;
+  SplitQueue* queue_ GUARDED_BY(progress_mu_) = nullptr;
+  std::vector<Shard>* shards_ GUARDED_BY(progress_mu_) = nullptr;
+  // The permutation of the epoch being read with global shuffling, if any,
+  // and whether the epoch being read is served from arena_.
+  ShuffledEpoch* shuffled_ GUARDED_BY(progress_mu_) = nullptr;
+  bool arena_epoch_ GUARDED_BY(progress_mu_) = false;
+
+  // The number of records to skip in the splits of a restored epoch, keyed
+  // by SplitKey().
+  std::unordered_map<string, int64> num_records_to_skip_ GUARDED_BY(mu_);
+  static string SplitKey(const FileSplit& split);
+
+  // Randomization buffer. The records of the next epoch are read while the
+  // records of the current one are still being yielded, so buf_ holds the
+  // records of up to two epochs, epoch e in buf_[e % 2]. Each is split into
+  // shards. Records are added at random positions of a random shard and
+  // consumed from a random shard.
+  struct BufShard {
+    Mutex mu;
+    std::mt19937_64 rnd GUARDED_BY(mu);
+    std::vector<Rope> buf GUARDED_BY(mu);
+  };
+  struct EpochBuf {
+    std::vector<std::unique_ptr<BufShard>> shards;
+
+    // The epoch of the records in the upper bits and the number of records
+    // not yet claimed by a Yield call in the lower kEpochShift bits, updated
+    // together so that a claim never picks records of the wrong epoch. The
+    // number of records is incremented after records are added to the shards
+    // and decremented before they are removed, so that the claimed records
+    // are always there.
+    std::atomic<int64> state{0};
+
+    // Number of records in the shards, including the claimed ones not yet
+    // removed.
+    std::atomic<int64> num_buffered{0};
+  };
+  static constexpr int kEpochShift = 40;
+  static constexpr int64 kSizeMask = (int64{1} << kEpochShift) - 1;
+  EpochBuf buf_[2];
+
+  // Returns the number of unclaimed records of 'epoch' in buf_.
+  int64 BufSize(int64 epoch) const {
+    const int64 state = buf_[epoch % 2].state;
+    return (state >> kEpochShift) == epoch ? state & kSizeMask : 0;
+  }
+
+  // Returns the number of unclaimed records in buf_.
+  int64 TotalBufSize() const {
+    return (buf_[0].state & kSizeMask) + (buf_[1].state & kSizeMask);
+  }
+
+  // True iff all records of the current epoch have been added to buf_.
+  bool EpochEnd() const SHARED_LOCKS_REQUIRED(mu_) {
+    return complete_epoch_ >= epoch_;
+  }
+
+  // True iff Yield may claim records without taking mu_, i.e., while we are
+  // not stopping, failing or draining an epoch. Only written under mu_.
+  std::atomic<bool> fast_yield_{true};
 
-  // True iff we are draining an epoch.
-  bool epoch_end_ GUARDED_BY(mu_) = false;
+  // Number of threads waiting on a condition of mu_.
+  std::atomic<int> num_waiters_{0};
 
-  int64 num_records_yielded_in_epoch_ = 0;
+  // Notified after records are added or an epoch is complete, if set. Not
+  // owned.
+  std::atomic<ReadyNotifier*> ready_notifier_{nullptr};
+  void NotifyReady() {
+    ReadyNotifier* notifier = ready_notifier_;
+    if (notifier != nullptr) notifier->Notify();
+  }
+
+  // The shards waiting for room in buf_ or to be activated, and their number,
+  // readable without mu_.
+  std::vector<Shard*> parked_ GUARDED_BY(mu_);
+  std::atomic<int> num_parked_{0};
+
+  std::atomic<int64> num_records_yielded_in_epoch_{0};
 
   // Dynamically adjusted buffer size.
   double bufsize_ GUARDED_BY(mu_);
 
+  // bufsize_ rounded down, readable without mu_.
+  std::atomic<int64> capacity_{1};
+
+  // Total and average bytes kept alive by the records in buf_ (see
+  // Rope::RetainedBytes()). The average is 0 until the first records are
+  // added.
+  std::atomic<int64> buf_bytes_{0};
+  std::atomic<int64> avg_record_bytes_{0};
+
+  // Returns capacity_ limited by the memory budget, if any. The number of
+  // records buf_ can hold.
+  int64 Capacity() const;
+
+  // Charges or releases 'bytes' of buffered records.
+  void ChargeBuffer(int64 bytes);
+
+  // The stats of opts_.stats, or null.
+  std::atomic<int64>* records_stat_ = nullptr;
+  std::atomic<int64>* bytes_stat_ = nullptr;
+  StatsHistogram* read_usecs_stat_ = nullptr;
+  StatsHistogram* buffer_fill_stat_ = nullptr;
+  StatsHistogram* yield_wait_stat_ = nullptr;
+
   // Number of Yield calls in the current adjustment interval.
-  int64 yields_ GUARDED_BY(mu_);
+  std::atomic<int64> yields_{0};
 
   // Trigger when the main loop has exited.
   Notification main_loop_done_;
 
   // Conditions.
-  Condition buf_empty_;
-  bool BufEmpty() const SHARED_LOCKS_REQUIRED(mu_) {
-    return stop_ || buf_.empty();
+  Condition buf_free_;
+  bool BufFree() const SHARED_LOCKS_REQUIRED(mu_) {
+    // The epoch which last used buf_[fill_epoch_ % 2] must be yielded, and
+    // its claimed records removed, before it receives the next epoch.
+    return stop_ || (epoch_ >= fill_epoch_ - 1 &&
+                     buf_[fill_epoch_ % 2].num_buffered == 0);
   }
 
   Condition buf_not_full_;
   bool BufNotFull() const SHARED_LOCKS_REQUIRED(mu_) {
-    return stop_ || static_cast<int64>(buf_.size()) < bufsize_;
+    return stop_ || TotalBufSize() < Capacity();
   }
 
   Condition buf_enough_;
   bool BufEnough() const SHARED_LOCKS_REQUIRED(mu_) {
     // NOTE: Unless we are finishing an epoch, we want to make sure
     // the buf_ contains enough randomized elements before yielding any.
-    return stop_ || !status_.ok() || (epoch_end_ && !buf_.empty()) ||
-           (!epoch_end_ && static_cast<int64>(buf_.size()) >=
-                               std::max<int64>(1, bufsize_ / 2));
+    const int64 size = BufSize(epoch_);
+    return stop_ || !status_.ok() || Exhausted() || (EpochEnd() && size > 0) ||
+           (!EpochEnd() && size >= std::max<int64>(1, Capacity() / 2));
   }
 
-  void ExtractValue(Rope* value) EXCLUSIVE_LOCKS_REQUIRED(mu_) {
-    if (opts_.seed == 0) {
-      // Randomize at the consumer side as well.
-      const auto index = rnd_() % buf_.size();
-      *value = std::move(buf_[index]);
-      if (index != buf_.size() - 1) {
-        buf_[index] = std::move(buf_.back());
-      }
-    } else {
-      *value = std::move(buf_.back());
-    }
-    buf_.pop_back();
+  // Yields up to 'n' records into 'records' and sets 'num_yielded'. Unless
+  // 'wait', yields none rather than wait for enough records in buf_.
+  Status YieldRecords(int64 n, Record* records, int64* num_yielded,
+                      bool wait = true);
+
+  // Claims up to 'n' records of the current epoch without taking mu_ and
+  // returns how many were claimed and sets 'epoch' to their epoch. Never
+  // claims the last record, so that the end of an epoch is always observed
+  // under mu_.
+  int64 TryClaimRecords(int64 n, int64* epoch);
+
+  // Claims up to 'n' records of the current epoch and returns how many were
+  // claimed. Requires BufEnough() and no error.
+  int64 ClaimRecords(int64 n) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Removes 'n' claimed records of 'epoch' from random shards of buf_.
+  void ExtractValues(int64 epoch, int64 n, Record* records);
+
+  // Wakes up the threads waiting on mu_ and resumes the parked shards after
+  // the size of buf_ changed.
+  void WakeUpWaiters();
+
+  // Recomputes fast_yield_ after stop_, status_ or the epochs changed.
+  void UpdateFastYield() EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    fast_yield_ = !stop_ && status_.ok() && !EpochEnd();
   }
 
+  // Moves on to the next epoch as long as the current one is complete and
+  // all its records are claimed.
+  void AdvanceEpoch() EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Makes arena_ of the records collected by 'shards' into arena_buf_.
+  void BuildArena(std::vector<Shard>* shards);
+
+  // The main loop, which reads one epoch after the other while the previous
+  // one is yielded. It runs as tasks on io_queue_ rather than on a thread of
+  // its own: StartEpoch() starts the shards of fill_epoch_, the last of which
+  // calls FinishEpoch(), and ResumeParked() starts the next epoch once buf_
+  // is free for it. main_loop_done_ is notified once it stops.
   void Start();
-  void MainLoop();
-  void AdjustBufferSizeLoop();
+  void StartEpoch();
+  void ScheduleShards();
+  void FinishEpoch(Status s);
+
+  // Starts an epoch which adds the records of arena_ to buf_ in a random
+  // order, through ArenaShardStep().
+  void StartArenaEpoch();
+  Progress ArenaShardStep(Shard* shard);
+
+  // Starts an epoch which adds the records of all files to buf_ in a random
+  // permutation, read by the shards through ShuffledShardStep(). The
+  // indices of the files new to the epoch are first loaded by LoadIndex()
+  // tasks. If reading_->state is not null, resumes the epoch from it.
+  void StartShuffledEpoch();
+  void LoadIndex(EpochRead* read);
+  void StartShuffledShards();
+  Progress ShuffledShardStep(Shard* shard);
+  // Sets 'f' to the file 'file' of shard->shuffled, opened by 'shard' unless
+  // it still has it open. Keeps kMaxOpenFiles files open per shard.
+  Status OpenShuffledFile(Shard* shard, int file, RandomAccessFile** f);
+
+  // Adjusts the buffer size and the parallelism. Called every second.
+  void AdjustBufferSize();
 
   // For performance debugging.
   void WaitForBufEnough() EXCLUSIVE_LOCKS_REQUIRED(mu_);
@@ -16,13 +16,18 @@ limitations under the License.
 #include "lingvo/core/ops/record_yielder.h"
 
 #include <chrono>  // NOLINT(build/c++11)
+#include <set>
 
 #include <gtest/gtest.h>
 #include "lingvo/core/ops/input_common.h"
+#include "lingvo/core/ops/input_stats.h"
+#include "lingvo/core/ops/io_executor.h"
 #include "lingvo/core/ops/sequential_record_yielder.h"
 #include "lingvo/core/ops/yielder_test_helper.h"
+#include "tensorflow/core/lib/core/coding.h"
 #include "tensorflow/core/lib/core/errors.h"
 #include "tensorflow/core/lib/core/stringpiece.h"
+#include "tensorflow/core/lib/hash/crc32c.h"
 #include "tensorflow/core/lib/io/compression.h"
 #include "tensorflow/core/lib/io/path.h"
 #include "tensorflow/core/lib/io/record_writer.h"
@@ -99,6 +104,26 @@ TEST(SequentialRecordYielderTest, SequentialRecordYielderBasicTest) {
   yielder->Close();
 }
 
+TEST(SequentialRecordYielderTest, YieldBatch) {
+  const int N = 3;
+  const int M = 10;
+  GeneratePlainTextTestData("sequential_batch", N, M);
+  SequentialRecordYielder* yielder =
+      SequentialRecordYielder::New("text:/tmp/sequential_batch.*", 1);
+  std::vector<Record> records;
+  TF_CHECK_OK(yielder->YieldBatch(12, &records));
+  EXPECT_EQ(12, records.size());
+  // The last batch is cut short by the end of the data.
+  Status s = yielder->YieldBatch(20, &records);
+  EXPECT_TRUE(errors::IsOutOfRange(s)) << s;
+  ASSERT_EQ(N * M, records.size());
+  for (int i = 0; i < N * M; ++i) {
+    EXPECT_EQ(strings::Printf("sequential_batch:%010d", i),
+              string(records[i].value));
+  }
+  yielder->Close();
+}
+
 TEST(SequentialRecordYielderTest, SequentialRecordYielderRepeatCount) {
   const int N = 10;
   const int M = 1000;
@@ -129,6 +154,55 @@ TEST(SequentialRecordYielderTest, SequentialRecordYielderRepeatCount) {
   yielder->Close();
 }
 
+TEST(SequentialRecordYielderTest, ParallelReaders) {
+  const int N = 10;
+  const int M = 500;
+  GeneratePlainTextTestData("sequential_parallel", N, M);
+  // An empty file, last in order.
+  GeneratePlainTextTestData("sequential_parallel.99", 1, 0);
+  const string file_pattern = "text:/tmp/sequential_parallel.*";
+
+  // 4 readers buffer up to 100 records each, and the records are yielded in
+  // order twice.
+  SequentialRecordYielder* yielder =
+      SequentialRecordYielder::New(file_pattern, 2, 4, 400);
+  Record record;
+  std::vector<Record> records;
+  for (int epoch = 0; epoch < 2; ++epoch) {
+    std::vector<string> vals;
+    while (vals.size() < N * M) {
+      if (vals.size() % 3 == 0) {
+        TF_CHECK_OK(yielder->Yield(&record));
+        vals.emplace_back(string(record.value));
+        continue;
+      }
+      records.clear();
+      TF_CHECK_OK(yielder->YieldBatch(
+          std::min<int>(37, N * M - vals.size()), &records));
+      for (const Record& r : records) vals.emplace_back(string(r.value));
+    }
+    for (int i = 0; i < N * M; ++i) {
+      ASSERT_EQ(strings::Printf("sequential_parallel:%010d", i), vals[i]);
+    }
+  }
+  Status s = yielder->Yield(&record);
+  EXPECT_TRUE(errors::IsOutOfRange(s)) << s;
+  records.clear();
+  s = yielder->YieldBatch(10, &records);
+  EXPECT_TRUE(errors::IsOutOfRange(s)) << s;
+  EXPECT_TRUE(records.empty());
+  yielder->Close();
+
+  // A yielder closed while its readers wait for room.
+  yielder = SequentialRecordYielder::New(file_pattern, -1, 4, 40);
+  record.source_id = 1;
+  TF_CHECK_OK(yielder->Yield(&record));
+  EXPECT_EQ(strings::Printf("sequential_parallel:%010d", 0),
+            string(record.value));
+  EXPECT_EQ(kDefaultSourceId, record.source_id);
+  yielder->Close();
+}
+
 void GenerateTfRecordTestData(const string& prefix, int n, int m,
                               const string& compression_type) {
   for (int i = 0; i < n; ++i) {
@@ -318,6 +392,665 @@ INSTANTIATE_TEST_CASE_P(All, TfRecordYielderTest,
                         testing::Values(io::compression::kNone,
                                         io::compression::kGzip));
 
+TEST(RecordYielder, MmapTfRecord) {
+  const int N = 4;
+  const int M = 100;
+  GenerateTfRecordTestData("mmap", N, M, io::compression::kNone);
+  // An empty file should not trip the mmap iterator.
+  std::unique_ptr<WritableFile> empty;
+  TF_CHECK_OK(Env::Default()->NewWritableFile(
+      io::JoinPath("/tmp", strings::StrCat("mmap.", N)), &empty));
+  TF_CHECK_OK(empty->Close());
+
+  BasicRecordYielder::Options opts;
+  opts.file_pattern =
+      strings::StrCat("tfrecord_mmap:", io::JoinPath("/tmp", "mmap.*"));
+  opts.seed = 301;
+  opts.bufsize = 2 * M;
+  opts.parallelism = 2;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  std::vector<string> vals;
+  Record record;
+  record.source_id = kDefaultSourceId;
+  for (int i = 0; i < N * M; ++i) {
+    TF_CHECK_OK(yielder->Yield(&record));
+    vals.emplace_back(string(record.value));
+  }
+  std::sort(vals.begin(), vals.end());
+  for (int i = 0; i < N * M; ++i) {
+    EXPECT_EQ(strings::Printf("%010d", i), vals[i]);
+  }
+  yielder->Close();
+}
+
+TEST(RecordYielder, MmapTfRecordCorruptLength) {
+  // A record followed by a header whose length, near 2^64, has a valid crc.
+  const string filename = io::JoinPath("/tmp", "mmap_corrupt");
+  GenerateTfRecordTestData("mmap_corrupt_src", 1, 1, io::compression::kNone);
+  string contents;
+  TF_CHECK_OK(ReadFileToString(Env::Default(), "/tmp/mmap_corrupt_src.0",
+                               &contents));
+  char header[sizeof(uint64) + sizeof(uint32)];
+  core::EncodeFixed64(header, kuint64max - 2);
+  core::EncodeFixed32(header + sizeof(uint64),
+                      crc32c::Mask(crc32c::Value(header, sizeof(uint64))));
+  contents.append(header, sizeof(header));
+  contents.append(16, 'x');
+  TF_CHECK_OK(WriteStringToFile(Env::Default(), filename, contents));
+
+  std::unique_ptr<RecordIterator> iter(
+      RecordIterator::New("tfrecord_mmap", filename));
+  string key;
+  Rope value;
+  ASSERT_TRUE(iter->Next(&key, &value));
+  EXPECT_EQ(strings::Printf("%010d", 0), string(value));
+  EXPECT_FALSE(iter->Next(&key, &value));
+}
+
+TEST(RecordYielder, Readahead) {
+  const int N = 8;
+  const int M = 100;
+  GeneratePlainTextTestData("readahead", N, M);
+  GenerateTfRecordTestData("readahead_tfrecord", N, M, io::compression::kNone);
+
+  const std::vector<std::pair<string, string>> patterns_and_prefixes = {
+      {"text:/tmp/readahead.*", "readahead:"},
+      {"tfrecord:/tmp/readahead_tfrecord.*", ""}};
+  for (const auto& pattern_and_prefix : patterns_and_prefixes) {
+    BasicRecordYielder::Options opts;
+    opts.file_pattern = pattern_and_prefix.first;
+    opts.seed = 301;
+    opts.bufsize = M;
+    opts.parallelism = 3;
+    opts.readahead_blocks = 2;
+    BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+    // Reads two epochs.
+    for (int epoch = 0; epoch < 2; ++epoch) {
+      std::vector<string> vals;
+      Record record;
+      record.source_id = kDefaultSourceId;
+      for (int i = 0; i < N * M; ++i) {
+        TF_CHECK_OK(yielder->Yield(&record));
+        vals.emplace_back(string(record.value));
+      }
+      std::sort(vals.begin(), vals.end());
+      for (int i = 0; i < N * M; ++i) {
+        EXPECT_EQ(strings::Printf("%s%010d", pattern_and_prefix.second.c_str(),
+                                  i),
+                  vals[i]);
+      }
+    }
+    yielder->Close();
+  }
+}
+
+TEST(RecordYielder, YieldBatch) {
+  const int N = 4;
+  const int M = 250;
+  GeneratePlainTextTestData("yield_batch", N, M);
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "text:/tmp/yield_batch.*";
+  opts.seed = 301;
+  opts.bufsize = 100;
+  opts.parallelism = 2;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  for (int epoch = 1; epoch <= 2; ++epoch) {
+    std::vector<string> vals;
+    std::vector<Record> records;
+    while (vals.size() < N * M) {
+      // Batches never span two epochs.
+      EXPECT_EQ(epoch, yielder->current_epoch());
+      records.clear();
+      TF_CHECK_OK(yielder->YieldBatch(7, &records));
+      ASSERT_GE(7, records.size());
+      ASSERT_LT(0, records.size());
+      for (const Record& record : records) {
+        vals.emplace_back(string(record.value));
+      }
+    }
+    std::sort(vals.begin(), vals.end());
+    ASSERT_EQ(N * M, vals.size());
+    for (int i = 0; i < N * M; ++i) {
+      EXPECT_EQ(strings::Printf("yield_batch:%010d", i), vals[i]);
+    }
+  }
+  yielder->Close();
+}
+
+TEST(RecordYielder, TryYieldBatch) {
+  const int N = 4;
+  const int M = 250;
+  GeneratePlainTextTestData("try_yield_batch", N, M);
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "text:/tmp/try_yield_batch.*";
+  opts.seed = 301;
+  opts.bufsize = 100;
+  opts.parallelism = 2;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  for (int epoch = 1; epoch <= 2; ++epoch) {
+    std::vector<string> vals;
+    std::vector<Record> records;
+    int num_empty = 0;
+    while (vals.size() < N * M) {
+      EXPECT_EQ(epoch, yielder->current_epoch());
+      records.clear();
+      // Yields nothing rather than wait for the files to be read.
+      TF_CHECK_OK(yielder->TryYieldBatch(7, &records));
+      ASSERT_GE(7, records.size());
+      if (records.empty()) {
+        ++num_empty;
+        Env::Default()->SleepForMicroseconds(1000);
+      }
+      for (const Record& record : records) {
+        vals.emplace_back(string(record.value));
+      }
+    }
+    VLOG(1) << "Epoch " << epoch << ": " << num_empty << " empty batches";
+    std::sort(vals.begin(), vals.end());
+    ASSERT_EQ(N * M, vals.size());
+    for (int i = 0; i < N * M; ++i) {
+      EXPECT_EQ(strings::Printf("try_yield_batch:%010d", i), vals[i]);
+    }
+  }
+  yielder->Close();
+}
+
+TEST(RecordYielder, OverlappedEpochs) {
+  const int N = 4;
+  const int M = 25;
+  GeneratePlainTextTestData("overlapped", N, M);
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "text:/tmp/overlapped.*";
+  opts.seed = 301;
+  // Large enough to hold the next epoch entirely while the current one is
+  // being yielded.
+  opts.bufsize = 1000;
+  opts.parallelism = 2;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  for (int epoch = 1; epoch <= 5; ++epoch) {
+    std::vector<string> vals;
+    Record record;
+    for (int i = 0; i < N * M; ++i) {
+      EXPECT_EQ(epoch, yielder->current_epoch());
+      TF_CHECK_OK(yielder->Yield(&record));
+      vals.emplace_back(string(record.value));
+    }
+    std::sort(vals.begin(), vals.end());
+    for (int i = 0; i < N * M; ++i) {
+      EXPECT_EQ(strings::Printf("overlapped:%010d", i), vals[i]);
+    }
+  }
+  yielder->Close();
+}
+
+TEST(RecordYielder, SingleEpoch) {
+  const int N = 4;
+  const int M = 25;
+  GeneratePlainTextTestData("single_epoch", N, M);
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "text:/tmp/single_epoch.*";
+  opts.seed = 301;
+  // Large enough to hold a second epoch, if it were read.
+  opts.bufsize = 1000;
+  opts.parallelism = 2;
+  opts.single_epoch = true;
+  opts.stats = InputStats::Get("single_epoch");
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  std::vector<string> vals;
+  Record record;
+  for (int i = 0; i < N * M; ++i) {
+    TF_CHECK_OK(yielder->Yield(&record));
+    vals.emplace_back(string(record.value));
+  }
+  std::sort(vals.begin(), vals.end());
+  for (int i = 0; i < N * M; ++i) {
+    EXPECT_EQ(strings::Printf("single_epoch:%010d", i), vals[i]);
+  }
+  EXPECT_TRUE(errors::IsOutOfRange(yielder->Yield(&record)));
+  std::vector<Record> records;
+  EXPECT_TRUE(errors::IsOutOfRange(yielder->YieldBatch(10, &records)));
+  EXPECT_TRUE(records.empty());
+  // No record of the next epoch was read.
+  EXPECT_EQ(N * M, *opts.stats->Counter("source_0/records"));
+  yielder->Close();
+}
+
+// Yields the records of the current epoch of 'yielder' until there are
+// 'n' of them in 'vals'.
+void YieldEpochRecords(RecordYielder* yielder, int64 epoch, int n,
+                       std::vector<string>* vals) {
+  std::vector<Record> records;
+  while (vals->size() < n) {
+    ASSERT_EQ(epoch,
+              static_cast<BasicRecordYielder*>(yielder)->current_epoch());
+    records.clear();
+    TF_CHECK_OK(yielder->YieldBatch(n - vals->size(), &records));
+    for (const Record& record : records) {
+      vals->emplace_back(string(record.value));
+    }
+  }
+}
+
+TEST(RecordYielder, SaveAndRestoreState) {
+  const int N = 8;
+  const int M = 300;
+  GeneratePlainTextTestData("yielder_state", N, M);
+  const string state_file = "/tmp/yielder_state_saved";
+  Env::Default()->DeleteFile(state_file).IgnoreError();
+  auto new_yielder = [](const YielderState* state) {
+    YielderConfig config;
+    config.file_pattern = "text:/tmp/yielder_state.*";
+    config.yielder.seed = 301;
+    config.yielder.bufsize = 200;
+    config.yielder.parallelism = 3;
+    config.initial_state = state;
+    return ConstructYielder(config);
+  };
+
+  // Yields the records of a whole epoch and then some.
+  RecordYielder* yielder = new_yielder(nullptr);
+  TF_CHECK_OK(RegisterYielderForState(state_file, yielder));
+  // A second yielder can not save its state into the same file.
+  RecordYielder* other = new_yielder(nullptr);
+  EXPECT_TRUE(
+      errors::IsAlreadyExists(RegisterYielderForState(state_file, other)));
+  UnregisterYielderForState(state_file, other);
+  other->Close();
+  std::vector<string> vals;
+  YieldEpochRecords(yielder, 1, N * M, &vals);
+  vals.clear();
+  YieldEpochRecords(yielder, 2, 1000, &vals);
+  TF_CHECK_OK(SaveYielderState(state_file, 1000));
+  UnregisterYielderForState(state_file, yielder);
+  yielder->Close();
+  EXPECT_TRUE(errors::IsNotFound(SaveYielderState(state_file, 1000)));
+
+  YielderState state;
+  TF_CHECK_OK(ReadBinaryProto(Env::Default(), state_file, &state));
+  EXPECT_EQ(2, state.epoch());
+  EXPECT_EQ(0, state.num_dropped_records());
+  EXPECT_GT(state.buffered_records_size(), 0);
+
+  // The restored yielder yields the rest of epoch 2.
+  yielder = new_yielder(&state);
+  YieldEpochRecords(yielder, 2, N * M, &vals);
+  std::sort(vals.begin(), vals.end());
+  for (int i = 0; i < N * M; ++i) {
+    ASSERT_EQ(strings::Printf("yielder_state:%010d", i), vals[i]);
+  }
+  // And then the next epochs.
+  vals.clear();
+  YieldEpochRecords(yielder, 3, N * M, &vals);
+  std::sort(vals.begin(), vals.end());
+  EXPECT_EQ(vals.end(), std::unique(vals.begin(), vals.end()));
+  yielder->Close();
+}
+
+TEST(RecordYielder, RestoreStateWithoutBufferedRecords) {
+  const int N = 4;
+  const int M = 500;
+  GeneratePlainTextTestData("yielder_state2", N, M);
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "text:/tmp/yielder_state2.*";
+  opts.seed = 301;
+  opts.bufsize = 300;
+  opts.parallelism = 2;
+  opts.readahead_blocks = 1;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  std::vector<string> vals;
+  YieldEpochRecords(yielder, 1, 700, &vals);
+  auto state = std::make_shared<YielderState>();
+  TF_CHECK_OK(yielder->GetState(0, state.get()));
+  yielder->Close();
+  EXPECT_EQ(1, state->epoch());
+  EXPECT_EQ(0, state->buffered_records_size());
+
+  // The records which were buffered are not yielded again in this epoch.
+  opts.initial_state = state;
+  yielder = BasicRecordYielder::New(opts);
+  YieldEpochRecords(yielder, 1, N * M - state->num_dropped_records(), &vals);
+  std::sort(vals.begin(), vals.end());
+  EXPECT_EQ(vals.end(), std::unique(vals.begin(), vals.end()));
+  std::vector<string> next_epoch;
+  YieldEpochRecords(yielder, 2, 1, &next_epoch);
+  yielder->Close();
+
+  // A state saved for other files is ignored.
+  opts.file_pattern = "text:/tmp/yielder_state.*";
+  yielder = BasicRecordYielder::New(opts);
+  EXPECT_EQ(1, yielder->current_epoch());
+  yielder->Close();
+}
+
+TEST(RecordYielder, Interleave) {
+  const int N = 8;
+  const int M = 100;
+  GeneratePlainTextTestData("interleave", N, M);
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "text:/tmp/interleave.*";
+  opts.seed = 301;
+  opts.bufsize = 8;
+  opts.parallelism = 1;
+  opts.interleave_cycle_length = 4;
+  opts.interleave_block_length = 2;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  std::vector<string> vals;
+  YieldEpochRecords(yielder, 1, 300, &vals);
+  // A single iterator with a small buffer still mixes the records of
+  // cycle_length files.
+  std::set<int> files;
+  for (int i = 0; i < 40; ++i) files.insert(std::stoi(vals[i].substr(11)) / M);
+  EXPECT_EQ(4, files.size());
+
+  // The interleaved files are resumed where they were left.
+  auto state = std::make_shared<YielderState>();
+  TF_CHECK_OK(yielder->GetState(N * M, state.get()));
+  yielder->Close();
+  EXPECT_EQ(0, state->num_dropped_records());
+  opts.initial_state = state;
+  yielder = BasicRecordYielder::New(opts);
+  YieldEpochRecords(yielder, 1, N * M, &vals);
+  std::sort(vals.begin(), vals.end());
+  for (int i = 0; i < N * M; ++i) {
+    ASSERT_EQ(strings::Printf("interleave:%010d", i), vals[i]);
+  }
+  vals.clear();
+  YieldEpochRecords(yielder, 2, N * M, &vals);
+  std::sort(vals.begin(), vals.end());
+  for (int i = 0; i < N * M; ++i) {
+    ASSERT_EQ(strings::Printf("interleave:%010d", i), vals[i]);
+  }
+  yielder->Close();
+}
+
+TEST(RecordYielder, SplitQueue) {
+  std::vector<FileSplit> splits;
+  for (int i = 0; i < 5; ++i) splits.emplace_back(strings::StrCat(i));
+  SplitQueue shared(splits, 2, /*work_stealing=*/false);
+  FileSplit split;
+  for (int i = 0; i < 5; ++i) {
+    ASSERT_TRUE(shared.Next(i % 2, &split));
+    EXPECT_EQ(strings::StrCat(i), split.filename);
+  }
+  EXPECT_FALSE(shared.Next(0, &split));
+
+  // Shard 0 owns splits 0, 2 and 4, shard 1 owns splits 1 and 3.
+  SplitQueue stealing(splits, 2, /*work_stealing=*/true);
+  std::vector<string> order;
+  for (int shard : {1, 1, 1, 0, 0}) {
+    ASSERT_TRUE(stealing.Next(shard, &split));
+    order.push_back(split.filename);
+  }
+  EXPECT_EQ(std::vector<string>({"1", "3", "4", "0", "2"}), order);
+  EXPECT_FALSE(stealing.Next(0, &split));
+  EXPECT_FALSE(stealing.Next(1, &split));
+}
+
+TEST(RecordYielder, SkewedFileSizes) {
+  // One large file and many small ones.
+  GeneratePlainTextTestData("skewed_large", 1, 2000);
+  GeneratePlainTextTestData("skewed_small", 20, 10);
+  std::vector<string> expected;
+  for (int i = 0; i < 2000; ++i) {
+    expected.push_back(strings::Printf("skewed_large:%010d", i));
+  }
+  for (int i = 0; i < 200; ++i) {
+    expected.push_back(strings::Printf("skewed_small:%010d", i));
+  }
+  std::sort(expected.begin(), expected.end());
+  for (bool work_stealing : {false, true}) {
+    for (int readahead_blocks : {0, 2}) {
+      BasicRecordYielder::Options opts;
+      opts.file_pattern = "text:/tmp/skewed_large.*,/tmp/skewed_small.*";
+      opts.seed = 301;
+      opts.bufsize = 100;
+      opts.parallelism = 4;
+      opts.work_stealing = work_stealing;
+      opts.readahead_blocks = readahead_blocks;
+      BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+      for (int epoch = 0; epoch < 2; ++epoch) {
+        std::vector<string> vals;
+        Record record;
+        record.source_id = kDefaultSourceId;
+        for (int i = 0; i < expected.size(); ++i) {
+          TF_CHECK_OK(yielder->Yield(&record));
+          vals.emplace_back(string(record.value));
+        }
+        std::sort(vals.begin(), vals.end());
+        EXPECT_EQ(expected, vals);
+      }
+      yielder->Close();
+    }
+  }
+}
+
+TEST(RecordYielder, ConcurrentYields) {
+  const int N = 8;
+  const int M = 1000;
+  GeneratePlainTextTestData("concurrent", N, M);
+  for (int buffer_shards : {1, 4}) {
+    BasicRecordYielder::Options opts;
+    opts.file_pattern = "text:/tmp/concurrent.*";
+    opts.seed = 301;
+    opts.bufsize = 500;
+    opts.parallelism = 4;
+    opts.buffer_shards = buffer_shards;
+    BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+    // Reads two epochs with several consumers.
+    const int kNumThreads = 8;
+    std::vector<std::vector<string>> vals(kNumThreads);
+    {
+      thread::ThreadPool pool(Env::Default(), "consumers", kNumThreads);
+      for (int t = 0; t < kNumThreads; ++t) {
+        pool.Schedule([yielder, t, &vals]() {
+          Record record;
+          record.source_id = kDefaultSourceId;
+          for (int i = 0; i < 2 * N * M / kNumThreads; ++i) {
+            TF_CHECK_OK(yielder->Yield(&record));
+            vals[t].emplace_back(string(record.value));
+          }
+        });
+      }
+    }
+    std::vector<string> all;
+    for (const auto& v : vals) all.insert(all.end(), v.begin(), v.end());
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(2 * N * M, all.size());
+    for (int i = 0; i < N * M; ++i) {
+      const string expected = strings::Printf("concurrent:%010d", i);
+      EXPECT_EQ(expected, all[2 * i]);
+      EXPECT_EQ(expected, all[2 * i + 1]);
+    }
+    yielder->Close();
+  }
+}
+
+TEST(RecordYielder, TextFileSplits) {
+  const int M = 1000;
+  GeneratePlainTextTestData("text_splits", 1, M);
+  const string filename = "/tmp/text_splits.0";
+  uint64 file_size = 0;
+  TF_CHECK_OK(Env::Default()->GetFileSize(filename, &file_size));
+  // Each line is 23 bytes long. Split sizes which are multiples of it make
+  // splits start right after a newline.
+  for (int split_size : {1, 22, 23, 24, 1000, 100000}) {
+    std::vector<string> vals;
+    for (uint64 offset = 0; offset < file_size; offset += split_size) {
+      std::unique_ptr<RecordIterator> iter(RecordIterator::New(
+          "text", FileSplit(filename, offset, split_size)));
+      string key;
+      Rope val;
+      while (iter->Next(&key, &val)) vals.emplace_back(string(val));
+    }
+    ASSERT_EQ(M, vals.size()) << split_size;
+    for (int i = 0; i < M; ++i) {
+      EXPECT_EQ(strings::Printf("text_splits:%010d", i), vals[i]);
+    }
+  }
+}
+
+TEST(RecordYielder, TextLinesAcrossBlocks) {
+  // Lines of all sizes, some longer than the 1MB blocks the text iterator
+  // reads, empty ones, and a last line without a newline.
+  std::vector<string> lines;
+  string content;
+  for (int i = 0; i < 200; ++i) {
+    const size_t len = i % 50 == 7 ? (3 << 20) + i : (i * 7919) % 40000;
+    lines.push_back(string(len, 'a' + i % 26));
+    content += lines.back();
+    if (i < 199) content += "\n";
+  }
+  const string filename = "/tmp/text_blocks";
+  TF_CHECK_OK(WriteStringToFile(Env::Default(), filename, content));
+  for (uint64 split_size : {uint64{1} << 20, uint64{3} << 20, kuint64max}) {
+    std::vector<string> vals;
+    for (uint64 offset = 0; offset < content.size(); offset += split_size) {
+      std::unique_ptr<RecordIterator> iter(RecordIterator::New(
+          "text", FileSplit(filename, offset, split_size)));
+      string key;
+      Rope val;
+      while (iter->Next(&key, &val)) vals.emplace_back(string(val));
+      if (split_size == kuint64max) break;
+    }
+    ASSERT_EQ(lines.size(), vals.size()) << split_size;
+    for (int i = 0; i < lines.size(); ++i) {
+      EXPECT_EQ(lines[i], vals[i]) << i;
+    }
+  }
+}
+
+TEST(RecordYielder, TextLinesRetainBlocks) {
+  // The lines view the block they were read from, and account for it.
+  GeneratePlainTextTestData("text_retain", 1, 1000);
+  uint64 file_size = 0;
+  TF_CHECK_OK(Env::Default()->GetFileSize("/tmp/text_retain.0", &file_size));
+  std::unique_ptr<RecordIterator> iter(
+      RecordIterator::New("text", "/tmp/text_retain.0"));
+  string key;
+  Rope val;
+  ASSERT_TRUE(iter->Next(&key, &val));
+  EXPECT_EQ(file_size, val.RetainedBytes());
+  EXPECT_TRUE(val.Compact(2));
+  EXPECT_EQ(val.size(), val.RetainedBytes());
+  EXPECT_EQ(strings::Printf("text_retain:%010d", 0), string(val));
+}
+
+TEST(RecordYielder, TextCrlfLines) {
+  // Carriage returns are dropped like BufferedInputStream::ReadLine() does,
+  // whether they end a line, sit inside one or end the file.
+  const string content = "a\r\nbc\r\n\r\nd\re\r\nf\r";
+  const string filename = "/tmp/text_crlf";
+  TF_CHECK_OK(WriteStringToFile(Env::Default(), filename, content));
+  const std::vector<string> expected = {"a", "bc", "", "de", "f"};
+  for (uint64 split_size : {uint64{1}, uint64{4}, kuint64max}) {
+    std::vector<string> vals;
+    for (uint64 offset = 0; offset < content.size(); offset += split_size) {
+      std::unique_ptr<RecordIterator> iter(RecordIterator::New(
+          "text", FileSplit(filename, offset, split_size)));
+      string key;
+      Rope val;
+      while (iter->Next(&key, &val)) vals.emplace_back(string(val));
+      if (split_size == kuint64max) break;
+    }
+    EXPECT_EQ(expected, vals) << split_size;
+  }
+}
+
+TEST(RecordYielder, NextBatch) {
+  GeneratePlainTextTestData("next_batch_text", 1, 100);
+  GenerateTfRecordTestData("next_batch_tfrecord", 1, 100,
+                           io::compression::kNone);
+  for (const auto& type_and_file :
+       std::vector<std::pair<string, string>>{
+           {"text", "/tmp/next_batch_text.0"},
+           {"tfrecord", "/tmp/next_batch_tfrecord.0"},
+           {"tfrecord_mmap", "/tmp/next_batch_tfrecord.0"},
+           {"iota", "100"}}) {
+    const string& type = type_and_file.first;
+    const string& filename = type_and_file.second;
+    std::vector<string> keys;
+    std::vector<string> vals;
+    std::unique_ptr<RecordIterator> iter(RecordIterator::New(type, filename));
+    string key;
+    Rope val;
+    while (iter->Next(&key, &val)) {
+      keys.push_back(key);
+      vals.emplace_back(string(val));
+    }
+    ASSERT_EQ(100, vals.size()) << type;
+
+    // Batches of records with their keys, then without.
+    iter.reset(RecordIterator::New(type, filename));
+    std::vector<Rope> batch_vals;
+    std::vector<string> batch_keys;
+    while (batch_vals.size() < 50) {
+      ASSERT_TRUE(iter->NextBatch(7, &batch_vals, &batch_keys)) << type;
+    }
+    ASSERT_EQ(56, batch_vals.size()) << type;
+    while (iter->NextBatch(7, &batch_vals, nullptr)) {
+    }
+    ASSERT_EQ(56, batch_keys.size()) << type;
+    ASSERT_EQ(100, batch_vals.size()) << type;
+    for (int i = 0; i < 100; ++i) {
+      EXPECT_EQ(vals[i], string(batch_vals[i])) << type;
+      if (i < 56) EXPECT_EQ(keys[i], batch_keys[i]) << type;
+    }
+  }
+}
+
+TEST(RecordYielder, ParsePatternIntoSplits) {
+  GeneratePlainTextTestData("parse_splits", 2, 1000);
+  std::vector<FileSplit> splits;
+  // Enough files.
+  TF_CHECK_OK(RecordIterator::ParsePatternIntoSplits(
+      "text", "/tmp/parse_splits.*", 2, 1000, &splits));
+  EXPECT_EQ(2, splits.size());
+  // Not splittable.
+  splits.clear();
+  TF_CHECK_OK(RecordIterator::ParsePatternIntoSplits(
+      "tfrecord", "/tmp/parse_splits.*", 8, 1000, &splits));
+  EXPECT_EQ(2, splits.size());
+  // 2 files of 24000 bytes split into 4 splits each.
+  splits.clear();
+  TF_CHECK_OK(RecordIterator::ParsePatternIntoSplits(
+      "text", "/tmp/parse_splits.*", 8, 1000, &splits));
+  ASSERT_EQ(8, splits.size());
+  EXPECT_EQ(0, splits[0].offset);
+  EXPECT_EQ(6000, splits[1].offset);
+  EXPECT_EQ(6000, splits[1].length);
+  EXPECT_EQ(kuint64max, splits[3].length);
+  // Splits are not smaller than min_split_bytes.
+  splits.clear();
+  TF_CHECK_OK(RecordIterator::ParsePatternIntoSplits(
+      "text", "/tmp/parse_splits.*", 8, 20000, &splits));
+  EXPECT_EQ(4, splits.size());
+}
+
+TEST(RecordYielder, SplitLargeTextFile) {
+  const int M = 10000;
+  GeneratePlainTextTestData("split_yielder", 1, M);
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "text:/tmp/split_yielder.*";
+  opts.seed = 301;
+  opts.bufsize = 1000;
+  opts.parallelism = 4;
+  opts.min_split_bytes = 1000;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  for (int epoch = 0; epoch < 2; ++epoch) {
+    std::vector<string> vals;
+    Record record;
+    for (int i = 0; i < M; ++i) {
+      TF_CHECK_OK(yielder->Yield(&record));
+      vals.emplace_back(string(record.value));
+    }
+    std::sort(vals.begin(), vals.end());
+    for (int i = 0; i < M; ++i) {
+      EXPECT_EQ(strings::Printf("split_yielder:%010d", i), vals[i]);
+    }
+  }
+  yielder->Close();
+}
+
 TEST(RecordYielder, MatchShardedFilePattern) {
   const int num_shards = 16;
   const int records_per_shard = 8;
@@ -381,6 +1114,55 @@ TEST(RecordYielder, MatchWildcardShardedFilePattern) {
   yielder->Close();
 }
 
+TEST(RecordYielder, ParseShardedFilePattern) {
+  // Sharded file patterns with a number of shards are enumerated without
+  // listing the directory.
+  std::vector<string> filenames;
+  TF_CHECK_OK(RecordIterator::ParsePattern(
+      "tfrecord", "/tmp/not_yet_generated@3", &filenames));
+  EXPECT_EQ(std::vector<string>({"/tmp/not_yet_generated-00000-of-00003",
+                                 "/tmp/not_yet_generated-00001-of-00003",
+                                 "/tmp/not_yet_generated-00002-of-00003"}),
+            filenames);
+
+  // Comma separated patterns are matched concurrently but keep their order.
+  GeneratePlainTextTestData("parse_comma_a", 2, 1);
+  GeneratePlainTextTestData("parse_comma_b", 1, 1);
+  filenames.clear();
+  TF_CHECK_OK(RecordIterator::ParsePattern(
+      "text", "/tmp/parse_comma_b.*,/tmp/parse_comma_a.*,/tmp/x@2",
+      &filenames));
+  EXPECT_EQ(std::vector<string>({"/tmp/parse_comma_b.0", "/tmp/parse_comma_a.0",
+                                 "/tmp/parse_comma_a.1",
+                                 "/tmp/x-00000-of-00002",
+                                 "/tmp/x-00001-of-00002"}),
+            filenames);
+}
+
+TEST(RecordYielder, CachedFileList) {
+  Env::Default()->DeleteFile("/tmp/cached_list.2").IgnoreError();
+  GeneratePlainTextTestData("cached_list", 2, 10);
+  std::vector<FileSplit> splits;
+  TF_CHECK_OK(RecordIterator::ParsePatternIntoSplits(
+      "text", "/tmp/cached_list.*", 1, 1000, &splits, 1));
+  EXPECT_EQ(2, splits.size());
+
+  // A new file is only picked up once the cached list is refreshed in the
+  // background, which happens after it is one second old.
+  GeneratePlainTextTestData("cached_list", 3, 10);
+  splits.clear();
+  TF_CHECK_OK(RecordIterator::ParsePatternIntoSplits(
+      "text", "/tmp/cached_list.*", 1, 1000, &splits, 1));
+  EXPECT_EQ(2, splits.size());
+  for (int i = 0; i < 100 && splits.size() < 3; ++i) {
+    Env::Default()->SleepForMicroseconds(100000);
+    splits.clear();
+    TF_CHECK_OK(RecordIterator::ParsePatternIntoSplits(
+        "text", "/tmp/cached_list.*", 1, 1000, &splits, 1));
+  }
+  EXPECT_EQ(3, splits.size());
+}
+
 TEST(RecordYielder, MatchIndirectFilePattern) {
   const int records_per_shard = 100;
   GenerateCheckpointPlainTextTestData("checkpoint", records_per_shard);
@@ -480,6 +1262,217 @@ TEST(RecordYielder, Iota) {
   yielder->Close();
 }
 
+TEST(RecordYielder, MemoryBudget) {
+  const int N = 4;
+  const int M = 250;
+  GeneratePlainTextTestData("memory_budget", N, M);
+  // Every record is "memory_budget:%010d", i.e., 24 bytes, so the budget fits
+  // 100 records.
+  const int64 kRecordBytes = 24;
+  auto budget = std::make_shared<MemoryBudget>(100 * kRecordBytes);
+  // Another user of the budget holds half of it.
+  budget->Charge(50 * kRecordBytes);
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "text:/tmp/memory_budget.*";
+  opts.seed = 301;
+  opts.bufsize = N * M;
+  opts.parallelism = 1;
+  opts.memory_budget = budget;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  std::vector<string> vals;
+  Record record;
+  TF_CHECK_OK(yielder->Yield(&record));
+  vals.emplace_back(string(record.value));
+  EXPECT_GE(50, yielder->bufsize());
+  EXPECT_LE(16, yielder->bufsize());
+
+  // The buffer grows into the released half.
+  budget->Release(50 * kRecordBytes);
+  EXPECT_LT(50, yielder->bufsize());
+  EXPECT_GE(100, yielder->bufsize());
+  while (vals.size() < N * M) {
+    TF_CHECK_OK(yielder->Yield(&record));
+    vals.emplace_back(string(record.value));
+  }
+  std::sort(vals.begin(), vals.end());
+  for (int i = 0; i < N * M; ++i) {
+    EXPECT_EQ(strings::Printf("memory_budget:%010d", i), vals[i]);
+  }
+  yielder->Close();
+  EXPECT_EQ(0, budget->usage());
+  EXPECT_LT(0, budget->peak());
+}
+
+TEST(RecordYielder, InMemory) {
+  const int N = 4;
+  const int M = 250;
+  GeneratePlainTextTestData("in_memory", N, M);
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "text:/tmp/in_memory.*";
+  opts.seed = 301;
+  opts.bufsize = 100;
+  opts.parallelism = 2;
+  opts.in_memory_max_bytes = 1 << 20;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  std::vector<std::vector<string>> epochs;
+  Record record;
+  for (int epoch = 0; epoch < 3; ++epoch) {
+    epochs.emplace_back();
+    std::vector<string>& vals = epochs.back();
+    for (int i = 0; i < N * M; ++i) {
+      TF_CHECK_OK(yielder->Yield(&record));
+      vals.emplace_back(string(record.value));
+    }
+    if (epoch == 0) {
+      // Later epochs do not read the files.
+      for (int i = 0; i < N; ++i) {
+        TF_CHECK_OK(
+            Env::Default()->DeleteFile(strings::StrCat("/tmp/in_memory.", i)));
+      }
+    }
+  }
+  yielder->Close();
+  // Each epoch is shuffled anew.
+  EXPECT_NE(epochs[1], epochs[2]);
+  for (std::vector<string>& vals : epochs) {
+    std::sort(vals.begin(), vals.end());
+    for (int i = 0; i < N * M; ++i) {
+      EXPECT_EQ(strings::Printf("in_memory:%010d", i), vals[i]);
+    }
+  }
+}
+
+TEST(RecordYielder, InMemoryTooLarge) {
+  const int N = 4;
+  const int M = 250;
+  GeneratePlainTextTestData("in_memory_too_large", N, M);
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "text:/tmp/in_memory_too_large.*";
+  opts.seed = 301;
+  opts.bufsize = 100;
+  opts.parallelism = 2;
+  // Holds about half of the records.
+  opts.in_memory_max_bytes = N * M * 15;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  Record record;
+  for (int epoch = 0; epoch < 3; ++epoch) {
+    std::vector<string> vals;
+    for (int i = 0; i < N * M; ++i) {
+      TF_CHECK_OK(yielder->Yield(&record));
+      vals.emplace_back(string(record.value));
+    }
+    std::sort(vals.begin(), vals.end());
+    for (int i = 0; i < N * M; ++i) {
+      EXPECT_EQ(strings::Printf("in_memory_too_large:%010d", i), vals[i]);
+    }
+  }
+  yielder->Close();
+}
+
+TEST(RecordYielder, GlobalShuffle) {
+  const int N = 4;
+  const int M = 250;
+  GenerateTfRecordTestData("global_shuffle", N, M, io::compression::kNone);
+  for (int i = 0; i < N; ++i) {
+    Env::Default()
+        ->DeleteFile(strings::StrCat("/tmp/global_shuffle.", i, ".idx"))
+        .IgnoreError();
+  }
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "tfrecord:/tmp/global_shuffle.*";
+  opts.seed = 301;
+  opts.bufsize = 1;
+  opts.parallelism = 2;
+  opts.global_shuffle = true;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  std::vector<std::vector<string>> epochs;
+  Record record;
+  for (int epoch = 0; epoch < 2; ++epoch) {
+    epochs.emplace_back();
+    std::vector<string>& vals = epochs.back();
+    for (int i = 0; i < N * M; ++i) {
+      TF_CHECK_OK(yielder->Yield(&record));
+      vals.emplace_back(string(record.value));
+    }
+    // The index files written in the first epoch are not read as data.
+    for (int i = 0; i < N; ++i) {
+      TF_CHECK_OK(Env::Default()->FileExists(
+          strings::StrCat("/tmp/global_shuffle.", i, ".idx")));
+    }
+  }
+  yielder->Close();
+  EXPECT_NE(epochs[0], epochs[1]);
+  for (std::vector<string>& vals : epochs) {
+    // Even with a buffer of one record, the first records come from all
+    // files, unlike with sequential reads.
+    std::set<int> files;
+    for (int i = 0; i < 20; ++i) files.insert(std::stoi(vals[i]) / M);
+    EXPECT_LT(2, files.size());
+    std::sort(vals.begin(), vals.end());
+    for (int i = 0; i < N * M; ++i) {
+      EXPECT_EQ(strings::Printf("%010d", i), vals[i]);
+    }
+  }
+}
+
+TEST(RecordYielder, GlobalShuffleSaveAndRestoreState) {
+  const int N = 4;
+  const int M = 250;
+  GenerateTfRecordTestData("global_shuffle_state", N, M,
+                           io::compression::kNone);
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "tfrecord:/tmp/global_shuffle_state.*";
+  opts.seed = 301;
+  opts.bufsize = 100;
+  opts.parallelism = 2;
+  opts.global_shuffle = true;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  std::vector<string> vals;
+  YieldEpochRecords(yielder, 1, 400, &vals);
+  auto state = std::make_shared<YielderState>();
+  TF_CHECK_OK(yielder->GetState(N * M, state.get()));
+  yielder->Close();
+  EXPECT_FALSE(state->epoch_read());
+  EXPECT_EQ(0, state->splits_size());
+  EXPECT_GT(state->shuffle_ranges_size(), 0);
+  EXPECT_EQ(N * M, state->num_shuffled_records());
+  EXPECT_EQ(0, state->num_dropped_records());
+
+  // The restored yielder yields each of the other records of the epoch once.
+  opts.initial_state = state;
+  yielder = BasicRecordYielder::New(opts);
+  YieldEpochRecords(yielder, 1, N * M, &vals);
+  std::vector<string> next_epoch;
+  YieldEpochRecords(yielder, 2, 1, &next_epoch);
+  yielder->Close();
+  std::sort(vals.begin(), vals.end());
+  for (int i = 0; i < N * M; ++i) {
+    ASSERT_EQ(strings::Printf("%010d", i), vals[i]);
+  }
+}
+
+TEST(RecordYielder, InMemoryState) {
+  const int N = 4;
+  const int M = 250;
+  GeneratePlainTextTestData("in_memory_state", N, M);
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "text:/tmp/in_memory_state.*";
+  opts.seed = 301;
+  opts.bufsize = 100;
+  opts.parallelism = 2;
+  opts.in_memory_max_bytes = 1 << 20;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  std::vector<string> vals;
+  YieldEpochRecords(yielder, 1, N * M, &vals);
+  vals.clear();
+  YieldEpochRecords(yielder, 2, 100, &vals);
+  // The records of epoch 2 come from memory, in an order which is lost on
+  // restart.
+  YielderState state;
+  EXPECT_TRUE(errors::IsUnimplemented(yielder->GetState(0, &state)));
+  yielder->Close();
+}
+
 TEST(RecordYielder, AdjustStaysLow) {
   BasicRecordYielder::Options opts;
   opts.file_pattern = "iota:100";
@@ -519,5 +1512,118 @@ TEST(RecordYielder, AdjustUp) {
   yielder->Close();
 }
 
+TEST(RecordYielder, TunedParallelism) {
+  const int N = 16;
+  const int M = 200;
+  GeneratePlainTextTestData("tuned", N, M);
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "text:/tmp/tuned.*";
+  opts.seed = 301;
+  opts.bufsize = 32;
+  opts.parallelism = 1;
+  opts.max_parallelism = 4;
+  opts.readahead_blocks = 2;
+  // The tuner only runs when the test calls RunPeriodic().
+  IoExecutor executor(4, 8, /* periodic_micros */ 0);
+  opts.io_executor = &executor;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  // The tuner runs between the epochs, and the paused iterators must neither
+  // drop nor repeat records.
+  for (int epoch = 1; epoch <= 4; ++epoch) {
+    std::vector<string> vals;
+    YieldEpochRecords(yielder, epoch, N * M, &vals);
+    std::sort(vals.begin(), vals.end());
+    for (int i = 0; i < N * M; ++i) {
+      ASSERT_EQ(strings::Printf("tuned:%010d", i), vals[i]);
+    }
+    executor.RunPeriodic();
+  }
+  yielder->Close();
+}
+
+TEST(RecordYielder, SharedExecutor) {
+  const int N = 16;
+  const int M = 100;
+  GeneratePlainTextTestData("shared", N, M);
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "text:/tmp/shared.*";
+  opts.bufsize = 32;
+  opts.parallelism = N;
+  // More shards than blocking threads of the executor, most of them waiting
+  // for room in the buffers of yielders not read from yet.
+  const int num_yielders = IoExecutor::Get()->num_blocking_threads() / N + 2;
+  std::vector<BasicRecordYielder*> yielders;
+  for (int i = 0; i < num_yielders; ++i) {
+    opts.seed = 301 + i;
+    yielders.push_back(BasicRecordYielder::New(opts));
+  }
+  for (int epoch = 1; epoch <= 2; ++epoch) {
+    for (BasicRecordYielder* yielder : yielders) {
+      std::vector<string> vals;
+      YieldEpochRecords(yielder, epoch, N * M, &vals);
+      std::sort(vals.begin(), vals.end());
+      for (int i = 0; i < N * M; ++i) {
+        ASSERT_EQ(strings::Printf("shared:%010d", i), vals[i]);
+      }
+    }
+  }
+  for (BasicRecordYielder* yielder : yielders) yielder->Close();
+}
+
+namespace {
+
+// Stalls the reads of its files until stalled_reads is notified.
+Notification* stalled_reads = new Notification;
+
+class StalledIterator : public RecordIterator {
+ public:
+  bool Next(string* key, Rope* value) override {
+    stalled_reads->WaitForNotification();
+    return false;
+  }
+};
+
+bool register_stalled_iterator = RecordIterator::RegisterWithPatternParser(
+    "stalled", [](const string& filename) { return new StalledIterator; },
+    [](const string& file_pattern, std::vector<string>* filenames) {
+      for (int i = 0; i < IoExecutor::Get()->num_blocking_threads(); ++i) {
+        filenames->push_back(strings::StrCat(file_pattern, ".", i));
+      }
+      return Status::OK();
+    });
+
+}  // namespace
+
+TEST(RecordYielder, StalledReads) {
+  ASSERT_TRUE(register_stalled_iterator);
+  // The reads of one yielder stall, e.g., on an unreachable file system, with
+  // as many iterators as the executor has blocking threads.
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = "stalled:/tmp/stalled";
+  opts.bufsize = 32;
+  opts.parallelism = IoExecutor::Get()->num_blocking_threads();
+  BasicRecordYielder* stalled = BasicRecordYielder::New(opts);
+  Env::Default()->SleepForMicroseconds(100000);
+
+  // Another yielder still reads its epochs.
+  const int N = 4;
+  const int M = 100;
+  GeneratePlainTextTestData("unstalled", N, M);
+  opts.file_pattern = "text:/tmp/unstalled.*";
+  opts.parallelism = N;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  for (int epoch = 1; epoch <= 2; ++epoch) {
+    std::vector<string> vals;
+    YieldEpochRecords(yielder, epoch, N * M, &vals);
+    std::sort(vals.begin(), vals.end());
+    for (int i = 0; i < N * M; ++i) {
+      ASSERT_EQ(strings::Printf("unstalled:%010d", i), vals[i]);
+    }
+  }
+  yielder->Close();
+  stalled_reads->Notify();
+  stalled->Close();
+}
+
 }  // namespace lingvo
 }  // namespace tensorflow
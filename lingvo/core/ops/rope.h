@@ -16,24 +16,236 @@ limitations under the License.
 #ifndef LINGVO_CORE_OPS_ROPE_H_
 #define LINGVO_CORE_OPS_ROPE_H_
 
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <ostream>
 #include <string>
+#include <utility>
+
+#include "tensorflow/core/lib/core/stringpiece.h"
+#include "tensorflow/core/lib/gtl/inlined_vector.h"
+#include "tensorflow/core/platform/tstring.h"
 
 namespace tensorflow {
 namespace lingvo {
 
-class Rope : public std::string {
+// Rope is a byte sequence made of one or more chunks. Each chunk is a view
+// into a reference-counted buffer, so copying a Rope, slicing it or appending
+// one Rope to another never copies the underlying bytes. The bytes referenced
+// by a Rope are never mutated.
+//
+// A Rope is not thread-safe, but different Ropes sharing the same buffers can
+// be used from different threads concurrently.
+class Rope {
  public:
   Rope() = default;
-  Rope(const std::string& s) : std::string(s) {}
-  Rope(std::string&& s) : std::string(std::move(s)) {}
 
-  void AppendTo(std::string* dst) const {
-    dst->append(*this);
+  // Copies 's' once into a buffer owned by the Rope.
+  Rope(const std::string& s) : Rope(std::string(s)) {}
+  Rope(const char* s) : Rope(std::string(s)) {}
+
+  // Takes over 's' without copying it.
+  Rope(std::string&& s) {
+    if (s.empty()) return;
+    auto owner = std::make_shared<std::string>(std::move(s));
+    const StringPiece data(owner->data(), owner->size());
+    chunks_.push_back(
+        {std::move(owner), data, data.size(), /* is_tstring */ false});
+    size_ = data.size();
+  }
+  Rope(tstring&& s) {
+    if (s.empty()) return;
+    auto owner = std::make_shared<tstring>(std::move(s));
+    const StringPiece data(owner->data(), owner->size());
+    chunks_.push_back(
+        {std::move(owner), data, data.size(), /* is_tstring */ true});
+    size_ = data.size();
+  }
+
+  // Returns a Rope viewing 'data'. 'owner' keeps 'data' alive for as long as
+  // any Rope references it. 'owner_bytes' is the size of the buffer 'owner'
+  // keeps alive, if it is larger than 'data' and not accounted for otherwise.
+  static Rope View(StringPiece data, std::shared_ptr<const void> owner,
+                   size_t owner_bytes = 0) {
+    Rope r;
+    r.AppendView(data, std::move(owner), owner_bytes);
+    return r;
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  // Access to the chunks making up this Rope.
+  int num_chunks() const { return chunks_.size(); }
+  StringPiece chunk(int i) const { return chunks_[i].data; }
+
+  void clear() {
+    chunks_.clear();
+    size_ = 0;
+  }
+
+  // Appends 'data' viewed through 'owner' to this Rope. See View().
+  void AppendView(StringPiece data, std::shared_ptr<const void> owner,
+                  size_t owner_bytes = 0) {
+    if (data.empty()) return;
+    chunks_.push_back({std::move(owner), data,
+                       std::max(owner_bytes, data.size()),
+                       /* is_tstring */ false});
+    size_ += data.size();
+  }
+
+  // Returns the bytes this Rope keeps alive: the buffers of its chunks, each
+  // counted once.
+  size_t RetainedBytes() const {
+    size_t bytes = 0;
+    for (int i = 0; i < chunks_.size(); ++i) {
+      bool seen = false;
+      for (int j = 0; j < i && !seen; ++j) {
+        seen = chunks_[j].owner == chunks_[i].owner;
+      }
+      if (seen) continue;
+      size_t owner_bytes = chunks_[i].owner_bytes;
+      for (int j = i + 1; j < chunks_.size(); ++j) {
+        if (chunks_[j].owner == chunks_[i].owner) {
+          owner_bytes = std::max(owner_bytes, chunks_[j].owner_bytes);
+        }
+      }
+      bytes += owner_bytes;
+    }
+    return bytes;
+  }
+
+  // Copies the bytes of this Rope into a buffer of its own if it keeps more
+  // than 'max_ratio' times its size alive, e.g., a short line viewing a large
+  // block of a file. Returns true iff the bytes were copied.
+  bool Compact(size_t max_ratio) {
+    if (RetainedBytes() <= max_ratio * size_) return false;
+    *this = Rope(ToString());
+    return true;
+  }
+
+  // Appends the chunks of 'other' to this Rope. No bytes are copied.
+  void Append(const Rope& other) {
+    for (const auto& c : other.chunks_) chunks_.push_back(c);
+    size_ += other.size_;
   }
 
-  std::string ToString() const { return *this; }
+  // Returns the bytes [pos, pos + n) of this Rope. The returned Rope shares
+  // the buffers of this Rope.
+  Rope Substr(size_t pos, size_t n = std::string::npos) const {
+    Rope r;
+    pos = std::min(pos, size_);
+    n = std::min(n, size_ - pos);
+    for (const auto& c : chunks_) {
+      if (n == 0) break;
+      if (pos >= c.data.size()) {
+        pos -= c.data.size();
+        continue;
+      }
+      const size_t len = std::min(n, c.data.size() - pos);
+      r.chunks_.push_back(
+          {c.owner, c.data.substr(pos, len), c.owner_bytes, false});
+      r.size_ += len;
+      n -= len;
+      pos = 0;
+    }
+    return r;
+  }
+
+  // Appends the bytes of this Rope to 'dst'. 'dst' is grown at most once.
+  template <typename S>
+  void AppendTo(S* dst) const {
+    if (chunks_.size() == 1) {
+      dst->append(chunks_[0].data.data(), chunks_[0].data.size());
+      return;
+    }
+    dst->reserve(dst->size() + size_);
+    for (const auto& c : chunks_) dst->append(c.data.data(), c.data.size());
+  }
+
+  // Moves the bytes of this Rope into 'dst', replacing its content. This is
+  // free if the Rope is the sole owner of a buffer it was constructed from;
+  // otherwise the bytes are copied once. The Rope is empty afterwards.
+  void MoveTo(tstring* dst) {
+    if (chunks_.size() == 1 && chunks_[0].is_tstring &&
+        chunks_[0].owner.use_count() == 1) {
+      auto* owned = const_cast<tstring*>(
+          static_cast<const tstring*>(chunks_[0].owner.get()));
+      if (owned->data() == chunks_[0].data.data() &&
+          owned->size() == chunks_[0].data.size()) {
+        *dst = std::move(*owned);
+        clear();
+        return;
+      }
+    }
+    dst->clear();
+    AppendTo(dst);
+    clear();
+  }
+
+  std::string ToString() const {
+    std::string ret;
+    AppendTo(&ret);
+    return ret;
+  }
+
+  explicit operator std::string() const { return ToString(); }
+
+  // Returns true iff this Rope holds the same bytes as 's'.
+  bool Equals(StringPiece s) const {
+    if (s.size() != size_) return false;
+    for (const auto& c : chunks_) {
+      if (memcmp(c.data.data(), s.data(), c.data.size()) != 0) return false;
+      s.remove_prefix(c.data.size());
+    }
+    return true;
+  }
+
+  bool Equals(const Rope& other) const {
+    if (other.size_ != size_) return false;
+    if (other.chunks_.size() == 1) return Equals(other.chunks_[0].data);
+    if (chunks_.size() == 1) return other.Equals(chunks_[0].data);
+    return ToString() == other.ToString();
+  }
+
+ private:
+  struct Chunk {
+    // Keeps 'data' alive.
+    std::shared_ptr<const void> owner;
+    StringPiece data;
+    // The bytes 'owner' keeps alive, at least data.size().
+    size_t owner_bytes;
+    // True iff 'owner' points to a tstring.
+    bool is_tstring;
+  };
+
+  gtl::InlinedVector<Chunk, 1> chunks_;
+  size_t size_ = 0;
 };
 
+inline bool operator==(const Rope& a, const Rope& b) { return a.Equals(b); }
+inline bool operator!=(const Rope& a, const Rope& b) { return !a.Equals(b); }
+inline bool operator==(const Rope& a, StringPiece b) { return a.Equals(b); }
+inline bool operator==(StringPiece a, const Rope& b) { return b.Equals(a); }
+inline bool operator!=(const Rope& a, StringPiece b) { return !a.Equals(b); }
+inline bool operator!=(StringPiece a, const Rope& b) { return !b.Equals(a); }
+inline bool operator==(const Rope& a, const char* b) {
+  return a.Equals(StringPiece(b));
+}
+inline bool operator==(const char* a, const Rope& b) {
+  return b.Equals(StringPiece(a));
+}
+inline bool operator!=(const Rope& a, const char* b) { return !(a == b); }
+inline bool operator!=(const char* a, const Rope& b) { return !(a == b); }
+
+inline std::ostream& operator<<(std::ostream& os, const Rope& r) {
+  for (int i = 0; i < r.num_chunks(); ++i) {
+    os.write(r.chunk(i).data(), r.chunk(i).size());
+  }
+  return os;
+}
+
 }  // namespace lingvo
 }  // namespace tensorflow
 
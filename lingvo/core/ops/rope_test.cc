@@ -0,0 +1,128 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/rope.h"
+
+#include <gtest/gtest.h>
+
+#include <sstream>
+
+namespace tensorflow {
+namespace lingvo {
+
+TEST(Rope, Basic) {
+  Rope empty;
+  EXPECT_TRUE(empty.empty());
+  EXPECT_EQ(0, empty.num_chunks());
+  EXPECT_EQ("", empty.ToString());
+
+  Rope r("hello");
+  EXPECT_EQ(5, r.size());
+  EXPECT_EQ(1, r.num_chunks());
+  EXPECT_TRUE(r == "hello");
+  EXPECT_TRUE(r != "world");
+  EXPECT_EQ("hello", string(r));
+
+  std::ostringstream os;
+  os << r;
+  EXPECT_EQ("hello", os.str());
+}
+
+TEST(Rope, CopyAndSliceShareBytes) {
+  string s(1000, 'x');
+  const char* p = s.data();
+  Rope r(std::move(s));
+  EXPECT_EQ(p, r.chunk(0).data());
+
+  Rope copy = r;
+  EXPECT_EQ(p, copy.chunk(0).data());
+
+  Rope sub = r.Substr(10, 20);
+  EXPECT_EQ(20, sub.size());
+  EXPECT_EQ(p + 10, sub.chunk(0).data());
+
+  // The slice keeps the buffer alive after the original Ropes are gone.
+  r.clear();
+  copy.clear();
+  EXPECT_EQ(string(20, 'x'), sub.ToString());
+}
+
+TEST(Rope, View) {
+  auto owner = std::make_shared<string>("abcdef");
+  Rope r = Rope::View(StringPiece(*owner).substr(1, 3), owner);
+  EXPECT_EQ(owner->data() + 1, r.chunk(0).data());
+  EXPECT_TRUE(r == "bcd");
+  EXPECT_EQ(2, owner.use_count());
+  r.clear();
+  EXPECT_EQ(1, owner.use_count());
+}
+
+TEST(Rope, RetainedBytesAndCompact) {
+  auto owner = std::make_shared<string>(1000, 'z');
+  Rope r = Rope::View(StringPiece(*owner).substr(0, 10), owner, owner->size());
+  // A view without the size of its owner only retains its own bytes.
+  r.Append(Rope::View(StringPiece(*owner).substr(10, 5), owner));
+  EXPECT_EQ(1000, r.RetainedBytes());
+  r.Append(Rope("abc"));
+  EXPECT_EQ(1003, r.RetainedBytes());
+
+  EXPECT_FALSE(r.Compact(100));
+  EXPECT_EQ(3, r.num_chunks());
+  EXPECT_TRUE(r.Compact(4));
+  EXPECT_EQ(1, r.num_chunks());
+  EXPECT_EQ(18, r.RetainedBytes());
+  EXPECT_EQ(string(15, 'z') + "abc", r.ToString());
+  EXPECT_EQ(1, owner.use_count());
+}
+
+TEST(Rope, MultipleChunks) {
+  Rope r("abc");
+  r.Append(Rope("def"));
+  r.Append(Rope());
+  r.Append(Rope("ghi"));
+  EXPECT_EQ(3, r.num_chunks());
+  EXPECT_EQ(9, r.size());
+  EXPECT_TRUE(r == "abcdefghi");
+  EXPECT_TRUE(r == Rope("abcdefghi"));
+  EXPECT_TRUE(r != Rope("abcdefghx"));
+
+  EXPECT_EQ("cdefg", r.Substr(2, 5).ToString());
+  EXPECT_EQ(3, r.Substr(2, 5).num_chunks());
+  EXPECT_EQ("hi", r.Substr(7).ToString());
+  EXPECT_EQ("", r.Substr(100).ToString());
+
+  tstring dst("x");
+  r.AppendTo(&dst);
+  EXPECT_EQ("xabcdefghi", string(dst));
+}
+
+TEST(Rope, MoveTo) {
+  tstring src(string(100, 'y'));
+  Rope r(std::move(src));
+  tstring dst;
+  r.MoveTo(&dst);
+  EXPECT_EQ(string(100, 'y'), string(dst));
+  EXPECT_TRUE(r.empty());
+
+  // Shared bytes are copied, leaving the other Rope intact.
+  Rope a("shared");
+  Rope b = a;
+  a.MoveTo(&dst);
+  EXPECT_EQ("shared", string(dst));
+  EXPECT_TRUE(b == "shared");
+}
+
+}  // namespace lingvo
+}  // namespace tensorflow
@@ -19,18 +19,31 @@ limitations under the License.
 
 #include "lingvo/core/ops/record_yielder.h"
 #include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/platform/env.h"
 
 namespace tensorflow {
 namespace lingvo {
 
 namespace {
 constexpr int kInfinite = -1;
+
+// Number of records a reader thread reads at a time.
+constexpr int kRecordsPerRead = 64;
+
+// The records buffered for each reader if not specified.
+constexpr int64 kDefaultRecordsPerReader = 1024;
 }  // namespace
 
 SequentialRecordYielder::SequentialRecordYielder(const string& file_pattern,
-                                                 const int64_t repeat_count)
+                                                 const int64_t repeat_count,
+                                                 int num_readers,
+                                                 int64 max_buffered_records)
     : file_type_(RecordIterator::GetFilePatternPrefix(file_pattern)),
-      repeat_count_(repeat_count) {
+      repeat_count_(repeat_count),
+      num_readers_(num_readers),
+      can_read_(this, &SequentialRecordYielder::CanRead),
+      no_yielding_(this, &SequentialRecordYielder::NoYielding),
+      can_yield_(this, &SequentialRecordYielder::CanYield) {
   LOG(INFO) << this << "Sequential record yielder start";
   string mutable_file_pattern(file_pattern);
   if (!file_type_.empty()) {
@@ -47,42 +60,181 @@ SequentialRecordYielder::SequentialRecordYielder(const string& file_pattern,
   CHECK(repeat_count == kInfinite || repeat_count > 0)
       << "Repeat count must either be -1 (infinite) or a positive integer.";
 
-  record_iterator_ = std::unique_ptr<RecordIterator>(
-      RecordIterator::New(file_type_, filenames_[0]));
+  if (num_readers_ > 1) {
+    num_files_to_read_ =
+        repeat_count_ == kInfinite
+            ? kint64max
+            : repeat_count_ * static_cast<int64>(filenames_.size());
+    max_records_per_file_ =
+        max_buffered_records > 0
+            ? std::max<int64>(1, max_buffered_records / num_readers_)
+            : kDefaultRecordsPerReader;
+    readers_.reset(new thread::ThreadPool(
+        Env::Default(), ThreadOptions(), "sequential_record_yielder",
+        num_readers_, /* low_latency_hint */ false));
+    for (int i = 0; i < num_readers_; ++i) {
+      readers_->Schedule([this]() { ReaderLoop(); });
+    }
+  } else {
+    record_iterator_ = std::unique_ptr<RecordIterator>(
+        RecordIterator::New(file_type_, filenames_[0]));
+  }
 }
 
 SequentialRecordYielder* SequentialRecordYielder::New(
-    const string& file_pattern, const int64_t repeat_count) {
-  return new SequentialRecordYielder(file_pattern, repeat_count);
+    const string& file_pattern, const int64_t repeat_count, int num_readers,
+    int64 max_buffered_records) {
+  return new SequentialRecordYielder(file_pattern, repeat_count, num_readers,
+                                     max_buffered_records);
 }
 
 SequentialRecordYielder::~SequentialRecordYielder() {}
 
 void SequentialRecordYielder::Close() {
+  if (readers_ != nullptr) {
+    {
+      MutexLock l(&mu_);
+      stop_ = true;
+      // Waits for the consumers woken up to return.
+      mu_.Await(no_yielding_);
+    }
+    // Waits for the readers to exit.
+    readers_.reset();
+  }
   LOG(INFO) << this << "Sequential record yielder exit";
   delete this;
 }
 
-Status SequentialRecordYielder::Yield(Record* record) {
-  string key;
-  if (record_iterator_->Next(&key, &record->value)) {
-    return Status::OK();
+Status SequentialRecordYielder::CheckRepeats() const {
+  if (repeat_count_ != kInfinite && num_repeats_ >= repeat_count_) {
+    return errors::OutOfRange("SequentialRecordYielder reached ",
+                              repeat_count_, " repeats.");
   }
+  return Status::OK();
+}
 
-  // No more records from current iterator, advance to next iterator.
+void SequentialRecordYielder::NextFile() {
   cur_file_index_ = (cur_file_index_ + 1) % filenames_.size();
   if (cur_file_index_ == 0) {
     ++num_repeats_;
     LOG(INFO) << "SequentialRecordYielder finished " << num_repeats_
               << " repeats.";
-    if (repeat_count_ != kInfinite && num_repeats_ == repeat_count_) {
-      return errors::OutOfRange("SequentialRecordYielder reached ",
-                                repeat_count_, " repeats.");
+  }
+}
+
+Status SequentialRecordYielder::Yield(Record* record) {
+  if (readers_ != nullptr) {
+    std::vector<Record> records;
+    TF_RETURN_IF_ERROR(YieldFromReaders(1, &records));
+    record->value = std::move(records.front().value);
+    record->source_id = kDefaultSourceId;
+    return Status::OK();
+  }
+  TF_RETURN_IF_ERROR(CheckRepeats());
+  string key;
+  while (!record_iterator_->Next(&key, &record->value)) {
+    // No more records from current iterator, advance to next iterator.
+    NextFile();
+    TF_RETURN_IF_ERROR(CheckRepeats());
+    record_iterator_ = std::unique_ptr<RecordIterator>(
+        RecordIterator::New(file_type_, filenames_[cur_file_index_]));
+  }
+  return Status::OK();
+}
+
+Status SequentialRecordYielder::YieldBatch(int n, std::vector<Record>* out) {
+  if (readers_ != nullptr) {
+    const size_t begin = out->size();
+    // Only cut short by the end of the data.
+    while (out->size() < begin + n) {
+      TF_RETURN_IF_ERROR(YieldFromReaders(begin + n - out->size(), out));
+    }
+    return Status::OK();
+  }
+  for (int i = 0; i < n; ++i) {
+    out->emplace_back();
+    Record* record = &out->back();
+    record->source_id = kDefaultSourceId;
+    Status s = Yield(record);
+    if (!s.ok()) {
+      out->pop_back();
+      return s;
+    }
+  }
+  return Status::OK();
+}
+
+void SequentialRecordYielder::ReaderLoop() {
+  // Whether the reader may add records of 'queue'.
+  struct HasRoom {
+    const SequentialRecordYielder* yielder;
+    const FileQueue* queue;
+    bool Eval() const {
+      return yielder->stop_ ||
+             queue->values.size() < yielder->max_records_per_file_;
+    }
+  };
+  std::vector<Rope> values;
+  while (true) {
+    int64 seq;
+    FileQueue* queue;
+    {
+      MutexLock l(&mu_);
+      mu_.Await(can_read_);
+      if (stop_) return;
+      seq = read_seq_++;
+      // Not erased before it is done.
+      queue = &queues_[seq];
+    }
+    std::unique_ptr<RecordIterator> iter(
+        RecordIterator::New(file_type_, filenames_[seq % filenames_.size()]));
+    HasRoom has_room{this, queue};
+    Condition has_room_cond(&has_room, &HasRoom::Eval);
+    bool more = true;
+    while (more) {
+      values.clear();
+      more = iter->NextBatch(kRecordsPerRead, &values, nullptr);
+      MutexLock l(&mu_);
+      for (Rope& value : values) queue->values.push_back(std::move(value));
+      if (!more) {
+        queue->done = true;
+      } else {
+        mu_.Await(has_room_cond);
+        if (stop_) return;
+      }
+    }
+  }
+}
+
+Status SequentialRecordYielder::YieldFromReaders(int n,
+                                                 std::vector<Record>* out) {
+  MutexLock l(&mu_);
+  ++num_yielding_;
+  Status s;
+  while (true) {
+    s = CheckRepeats();
+    if (!s.ok()) break;
+    mu_.Await(can_yield_);
+    if (stop_) {
+      s = errors::Cancelled("SequentialRecordYielder is closed.");
+      break;
+    }
+    FileQueue* queue = &queues_[yield_seq_];
+    if (!queue->values.empty()) {
+      for (int i = 0; i < n && !queue->values.empty(); ++i) {
+        out->emplace_back();
+        out->back().value = std::move(queue->values.front());
+        out->back().source_id = kDefaultSourceId;
+        queue->values.pop_front();
+      }
+      break;
     }
+    // Moves on to the next file, which a reader may read now.
+    queues_.erase(yield_seq_++);
+    NextFile();
   }
-  record_iterator_ = std::unique_ptr<RecordIterator>(
-      RecordIterator::New(file_type_, filenames_[cur_file_index_]));
-  return Yield(record);
+  --num_yielding_;
+  return s;
 }
 
 }  // namespace lingvo
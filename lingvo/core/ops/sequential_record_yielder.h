@@ -15,29 +15,66 @@ limitations under the License.
 #ifndef LINGVO_CORE_OPS_SEQUENTIAL_RECORD_YIELDER_H_
 #define LINGVO_CORE_OPS_SEQUENTIAL_RECORD_YIELDER_H_
 
+#include <deque>
+#include <map>
+#include <memory>
+
+#include "lingvo/core/ops/mutex.h"
 #include "lingvo/core/ops/record_yielder.h"
+#include "tensorflow/core/lib/core/threadpool.h"
 
 namespace tensorflow {
 namespace lingvo {
 
 // SequentialRecordYielder processes records in order.
+//
+// Unless 'num_readers' is greater than 1, the files are read one at a time
+// by the caller. Otherwise, as many reader threads read the next files ahead,
+// each buffering up to 'max_buffered_records' / 'num_readers' records, and
+// the records are still yielded in order. Thread-safe if 'num_readers' is
+// greater than 1.
 class SequentialRecordYielder : public RecordYielder {
  public:
   ~SequentialRecordYielder() override;
   void Close() override;
   Status Yield(Record* record) override;
+  Status YieldBatch(int n, std::vector<Record>* out) override;
 
   // Returns a sequential record yielder. The caller is responsible for calling
   // Close when this yielder is no longer required. The caller shouldn't delete
   // the yielder.
   static SequentialRecordYielder* New(const string& file_pattern,
-                                      const int64_t repeat_count);
+                                      const int64_t repeat_count,
+                                      int num_readers = 1,
+                                      int64 max_buffered_records = 0);
 
  protected:
   explicit SequentialRecordYielder(const string& file_pattern,
-                                   const int64_t repeat_count);
+                                   const int64_t repeat_count,
+                                   int num_readers,
+                                   int64 max_buffered_records);
 
  private:
+  // The records of a file read ahead.
+  struct FileQueue {
+    std::deque<Rope> values;
+    // Whether all records of the file are in 'values' or were yielded.
+    bool done = false;
+  };
+
+  // Returns an OutOfRange error iff all repetitions have been yielded.
+  Status CheckRepeats() const;
+
+  // Moves on to the next file, and counts a repetition after the last one.
+  void NextFile();
+
+  // Reads files ahead of the consumers until Close() is called.
+  void ReaderLoop();
+
+  // Yields up to 'n' records read by the reader threads. Returns a Cancelled
+  // error once Close() is called.
+  Status YieldFromReaders(int n, std::vector<Record>* out);
+
   const string file_type_;
   // Target number of repetitions of the dataset.  -1 means to repeat
   // forever.
@@ -48,6 +85,44 @@ class SequentialRecordYielder : public RecordYielder {
   std::unique_ptr<RecordIterator> record_iterator_;
   // Current number of repetitions of the dataset.
   int64_t num_repeats_ = 0;
+
+  // Used with more than 1 reader. The files are numbered in the order they
+  // are yielded: file 'seq' is filenames_[seq % filenames_.size()].
+  const int num_readers_;
+  int64 num_files_to_read_ = 0;
+  int64 max_records_per_file_ = 0;
+  mutable Mutex mu_;
+  bool stop_ GUARDED_BY(mu_) = false;
+  // Number of calls in YieldFromReaders(), which Close() waits for.
+  int num_yielding_ GUARDED_BY(mu_) = 0;
+  // The file yielded from, and the next file to be read.
+  int64 yield_seq_ GUARDED_BY(mu_) = 0;
+  int64 read_seq_ GUARDED_BY(mu_) = 0;
+  // The files read ahead, keyed by number.
+  std::map<int64, FileQueue> queues_ GUARDED_BY(mu_);
+  std::unique_ptr<thread::ThreadPool> readers_;
+
+  // Conditions.
+  Condition can_read_;
+  bool CanRead() const SHARED_LOCKS_REQUIRED(mu_) {
+    // At most num_readers_ files are read ahead, so that the file yielded
+    // from is always being read or done.
+    return stop_ || (read_seq_ < num_files_to_read_ &&
+                     read_seq_ < yield_seq_ + num_readers_);
+  }
+
+  Condition no_yielding_;
+  bool NoYielding() const SHARED_LOCKS_REQUIRED(mu_) {
+    return num_yielding_ == 0;
+  }
+
+  Condition can_yield_;
+  bool CanYield() const SHARED_LOCKS_REQUIRED(mu_) {
+    if (stop_) return true;
+    auto iter = queues_.find(yield_seq_);
+    return iter != queues_.end() &&
+           (!iter->second.values.empty() || iter->second.done);
+  }
 };
 
 }  // namespace lingvo
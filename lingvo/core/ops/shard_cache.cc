@@ -0,0 +1,414 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/shard_cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/hash/crc32c.h"
+#include "tensorflow/core/lib/hash/hash.h"
+#include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/lib/strings/numbers.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+#include "tensorflow/core/lib/strings/stringprintf.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+namespace {
+
+// A copy at <path> has its metadata at <path>.meta and is written into
+// <path>.tmp.<random> first.
+constexpr char kMetaSuffix[] = ".meta";
+constexpr char kTmpInfix[] = ".tmp.";
+
+// Files of an unfinished copy, e.g., left behind by a crashed process, are
+// deleted once they are this old.
+constexpr int64 kStaleNsec = 24LL * 3600 * 1000000000;
+
+string MetaContent(const string& filename, uint64 length, int64 mtime_nsec,
+                   uint32 crc) {
+  return strings::StrCat(filename, "\n", length, "\n", mtime_nsec, "\n", crc,
+                         "\n");
+}
+
+bool ParseMeta(const string& content, string* filename, uint64* length,
+               int64* mtime_nsec, uint32* crc) {
+  std::vector<string> lines = str_util::Split(content, '\n');
+  if (lines.size() != 5 || lines[0].empty() || !lines[4].empty() ||
+      !strings::safe_strtou64(lines[1], length) ||
+      !strings::safe_strto64(lines[2], mtime_nsec) ||
+      !strings::safe_strtou32(lines[3], crc)) {
+    return false;
+  }
+  *filename = lines[0];
+  return true;
+}
+
+// Computes the crc32c of the bytes of 'path'.
+Status FileCrc(const string& path, uint32* crc) {
+  std::unique_ptr<RandomAccessFile> file;
+  TF_RETURN_IF_ERROR(Env::Default()->NewRandomAccessFile(path, &file));
+  const size_t kBlockSize = 1 << 20;
+  std::unique_ptr<char[]> scratch(new char[kBlockSize]);
+  *crc = 0;
+  for (uint64 offset = 0;; offset += kBlockSize) {
+    StringPiece data;
+    Status s = file->Read(offset, kBlockSize, &data, scratch.get());
+    *crc = crc32c::Extend(*crc, data.data(), data.size());
+    if (errors::IsOutOfRange(s)) return Status::OK();
+    TF_RETURN_IF_ERROR(s);
+  }
+}
+
+bool IsStale(const string& path, int64 now_nsec) {
+  FileStatistics stat;
+  return Env::Default()->Stat(path, &stat).ok() &&
+         now_nsec - stat.mtime_nsec > kStaleNsec;
+}
+
+}  // namespace
+
+// Reads through the remote file and appends the bytes read to the temporary
+// file of the copy as long as they follow the bytes copied so far.
+class ShardCache::TeeFile : public RandomAccessFile {
+ public:
+  TeeFile(ShardCache* cache, const string& filename,
+          const FileStatistics& stat, RandomAccessFile* file,
+          const string& tmp_path, std::unique_ptr<WritableFile> tmp)
+      : cache_(cache),
+        filename_(filename),
+        stat_(stat),
+        file_(file),
+        tmp_path_(tmp_path),
+        tmp_(std::move(tmp)) {}
+
+  ~TeeFile() override {
+    MutexLock l(&mu_);
+    if (tmp_ != nullptr) Finish(false);
+  }
+
+  Status Read(uint64 offset, size_t n, StringPiece* result,
+              char* scratch) const override {
+    Status s = file_->Read(offset, n, result, scratch);
+    MutexLock l(&mu_);
+    if (tmp_ != nullptr) Copy(offset, *result);
+    return s;
+  }
+
+ private:
+  void Copy(uint64 offset, StringPiece data) const
+      EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    if (offset > copied_) {
+      // Bytes were skipped.
+      Finish(false);
+      return;
+    }
+    if (offset + data.size() > copied_) {
+      data.remove_prefix(copied_ - offset);
+      Status s = tmp_->Append(data);
+      if (!s.ok()) {
+        LOG(WARNING) << "Failed to copy " << filename_ << ": " << s;
+        Finish(false);
+        return;
+      }
+      crc_ = crc32c::Extend(crc_, data.data(), data.size());
+      copied_ += data.size();
+    }
+    if (copied_ == stat_.length) Finish(true);
+  }
+
+  void Finish(bool complete) const EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    Status s = tmp_->Close();
+    tmp_.reset();
+    cache_->FinishCopy(filename_, stat_, tmp_path_, crc_, complete && s.ok());
+  }
+
+  ShardCache* const cache_;
+  const string filename_;
+  const FileStatistics stat_;
+  const std::unique_ptr<RandomAccessFile> file_;
+  const string tmp_path_;
+
+  mutable Mutex mu_;
+  // Null once the copy is finished or abandoned.
+  mutable std::unique_ptr<WritableFile> tmp_ GUARDED_BY(mu_);
+  mutable uint64 copied_ GUARDED_BY(mu_) = 0;
+  mutable uint32 crc_ GUARDED_BY(mu_) = 0;
+};
+
+ShardCache::ShardCache(const string& dir, int64 max_bytes)
+    : dir_(dir), max_bytes_(max_bytes) {
+  LoadEntries();
+}
+
+ShardCache* ShardCache::Get(const string& dir, int64 max_bytes) {
+  static Mutex mu;
+  static auto* caches = new std::unordered_map<string, ShardCache*>;
+  MutexLock l(&mu);
+  ShardCache*& cache = (*caches)[dir];
+  if (cache == nullptr) {
+    Env* env = Env::Default();
+    Status s = env->RecursivelyCreateDir(dir);
+    if (s.ok()) s = env->IsDirectory(dir);
+    if (!s.ok()) {
+      LOG(WARNING) << "Does not cache files in " << dir << ": " << s;
+      caches->erase(dir);
+      return nullptr;
+    }
+    cache = new ShardCache(dir, max_bytes);
+  }
+  return cache;
+}
+
+string ShardCache::CopyPath(const string& filename) const {
+  return io::JoinPath(
+      dir_, strings::StrCat(strings::Printf("%016llx-",
+                                            static_cast<unsigned long long>(
+                                                Hash64(filename))),
+                            io::Basename(filename)));
+}
+
+void ShardCache::LoadEntries() {
+  Env* env = Env::Default();
+  std::vector<string> children;
+  if (!env->GetChildren(dir_, &children).ok()) return;
+  const int64 now_nsec = env->NowMicros() * 1000;
+  std::unordered_set<string> copies;
+  std::vector<std::tuple<int64, string, Entry>> loaded;
+  for (const string& child : children) {
+    const string path = io::JoinPath(dir_, child);
+    if (child.find(kTmpInfix) != string::npos) {
+      if (IsStale(path, now_nsec)) env->DeleteFile(path).IgnoreError();
+      continue;
+    }
+    if (!str_util::EndsWith(child, kMetaSuffix)) continue;
+    Entry entry;
+    entry.path = path.substr(0, path.size() - strlen(kMetaSuffix));
+    string content;
+    string filename;
+    uint64 size = 0;
+    FileStatistics meta_stat;
+    if (!ReadFileToString(env, path, &content).ok() ||
+        !ParseMeta(content, &filename, &entry.length, &entry.mtime_nsec,
+                   &entry.crc) ||
+        !env->GetFileSize(entry.path, &size).ok() || size != entry.length ||
+        !env->Stat(path, &meta_stat).ok()) {
+      LOG(WARNING) << "Deletes the invalid copy " << entry.path;
+      env->DeleteFile(path).IgnoreError();
+      env->DeleteFile(entry.path).IgnoreError();
+      continue;
+    }
+    copies.insert(entry.path);
+    loaded.emplace_back(meta_stat.mtime_nsec, filename, std::move(entry));
+  }
+  // A copy renamed into place by a process which crashed before renaming its
+  // metadata file.
+  for (const string& child : children) {
+    const string path = io::JoinPath(dir_, child);
+    if (child.find(kTmpInfix) == string::npos &&
+        !str_util::EndsWith(child, kMetaSuffix) && copies.count(path) == 0 &&
+        IsStale(path, now_nsec)) {
+      env->DeleteFile(path).IgnoreError();
+    }
+  }
+  // The most recently written copies are the most recently used ones.
+  std::sort(loaded.begin(), loaded.end(),
+            [](const std::tuple<int64, string, Entry>& a,
+               const std::tuple<int64, string, Entry>& b) {
+              return std::get<0>(a) < std::get<0>(b);
+            });
+  MutexLock l(&mu_);
+  for (auto& t : loaded) Insert(std::get<1>(t), std::move(std::get<2>(t)));
+  EvictIfFull();
+  LOG(INFO) << "Found " << entries_.size() << " cached files (" << bytes_
+            << " bytes) in " << dir_;
+}
+
+bool ShardCache::Contains(const string& filename) const {
+  MutexLock l(&mu_);
+  return entries_.count(filename) > 0;
+}
+
+bool ShardCache::OpenCopy(const string& filename,
+                          std::unique_ptr<RandomAccessFile>* copy) {
+  Env* env = Env::Default();
+  FileStatistics stat;
+  // If the remote file can not be examined, the copy is used all the same.
+  const bool has_stat = env->Stat(filename, &stat).ok();
+  Entry entry;
+  {
+    MutexLock l(&mu_);
+    auto it = entries_.find(filename);
+    if (it == entries_.end()) {
+      ++num_misses_;
+      return false;
+    }
+    if (has_stat && (it->second.length != stat.length ||
+                     it->second.mtime_nsec != stat.mtime_nsec)) {
+      VLOG(1) << filename << " changed since it was cached";
+      Evict(filename);
+      ++num_misses_;
+      return false;
+    }
+    entry = it->second;
+  }
+  uint64 size = 0;
+  Status s = env->GetFileSize(entry.path, &size);
+  if (s.ok() && size != entry.length) {
+    s = errors::DataLoss("Unexpected size ", size);
+  }
+  if (s.ok() && !entry.verified) {
+    uint32 crc = 0;
+    s = FileCrc(entry.path, &crc);
+    if (s.ok() && crc != entry.crc) s = errors::DataLoss("Checksum mismatch");
+  }
+  if (s.ok()) s = env->NewRandomAccessFile(entry.path, copy);
+  MutexLock l(&mu_);
+  auto it = entries_.find(filename);
+  if (!s.ok()) {
+    LOG(WARNING) << "Invalid copy " << entry.path << " of " << filename << ": "
+                 << s;
+    if (it != entries_.end() && it->second.path == entry.path) {
+      Evict(filename);
+    }
+    ++num_misses_;
+    return false;
+  }
+  if (it != entries_.end()) {
+    it->second.verified = true;
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+  }
+  ++num_hits_;
+  return true;
+}
+
+RandomAccessFile* ShardCache::Tee(const string& filename,
+                                  RandomAccessFile* file) {
+  Env* env = Env::Default();
+  FileStatistics stat;
+  if (!env->Stat(filename, &stat).ok() || stat.length <= 0 ||
+      (max_bytes_ > 0 && stat.length > max_bytes_)) {
+    return file;
+  }
+  {
+    MutexLock l(&mu_);
+    if (entries_.count(filename) > 0 || !copying_.insert(filename).second) {
+      return file;
+    }
+  }
+  const uint64 suffix =
+      Hash64Combine(env->NowMicros(), std::random_device{}());
+  const string tmp_path = strings::StrCat(
+      CopyPath(filename), kTmpInfix,
+      strings::Printf("%016llx", static_cast<unsigned long long>(suffix)));
+  std::unique_ptr<WritableFile> tmp;
+  Status s = env->NewWritableFile(tmp_path, &tmp);
+  if (!s.ok()) {
+    LOG(WARNING) << "Failed to copy " << filename << ": " << s;
+    MutexLock l(&mu_);
+    copying_.erase(filename);
+    return file;
+  }
+  return new TeeFile(this, filename, stat, file, tmp_path, std::move(tmp));
+}
+
+void ShardCache::FinishCopy(const string& filename, const FileStatistics& stat,
+                            const string& tmp_path, uint32 crc,
+                            bool complete) {
+  Env* env = Env::Default();
+  const string path = CopyPath(filename);
+  if (complete) {
+    // Another process copying the same file renames the same bytes into
+    // place.
+    const string meta_tmp_path = tmp_path + kMetaSuffix;
+    Status s = WriteStringToFile(
+        env, meta_tmp_path,
+        MetaContent(filename, stat.length, stat.mtime_nsec, crc));
+    if (s.ok()) s = env->RenameFile(tmp_path, path);
+    if (s.ok()) s = env->RenameFile(meta_tmp_path, path + kMetaSuffix);
+    if (!s.ok()) {
+      LOG(WARNING) << "Failed to cache " << filename << ": " << s;
+      env->DeleteFile(meta_tmp_path).IgnoreError();
+      complete = false;
+    }
+  }
+  if (!complete) env->DeleteFile(tmp_path).IgnoreError();
+  MutexLock l(&mu_);
+  copying_.erase(filename);
+  if (!complete) return;
+  Entry entry;
+  entry.path = path;
+  entry.length = stat.length;
+  entry.mtime_nsec = stat.mtime_nsec;
+  entry.crc = crc;
+  entry.verified = true;
+  Insert(filename, std::move(entry));
+  VLOG(1) << "Cached " << filename << " as " << path;
+  EvictIfFull();
+}
+
+void ShardCache::Insert(const string& filename, Entry entry) {
+  auto it = entries_.find(filename);
+  if (it != entries_.end()) {
+    // Replaced by a copy at the same path.
+    bytes_ -= it->second.length;
+    lru_.erase(it->second.lru);
+    entries_.erase(it);
+  }
+  lru_.push_front(filename);
+  entry.lru = lru_.begin();
+  bytes_ += entry.length;
+  entries_[filename] = std::move(entry);
+}
+
+void ShardCache::Evict(const string& filename) {
+  auto it = entries_.find(filename);
+  if (it == entries_.end()) return;
+  // Readers which opened the copy keep reading it.
+  Env* env = Env::Default();
+  env->DeleteFile(it->second.path + kMetaSuffix).IgnoreError();
+  env->DeleteFile(it->second.path).IgnoreError();
+  bytes_ -= it->second.length;
+  lru_.erase(it->second.lru);
+  entries_.erase(it);
+}
+
+void ShardCache::EvictIfFull() {
+  // Keeps the most recent copy even if it alone exceeds the limit.
+  while (max_bytes_ > 0 && bytes_ > max_bytes_ && lru_.size() > 1) {
+    const string filename = lru_.back();
+    Evict(filename);
+  }
+}
+
+ShardCache::Stats ShardCache::GetStats() const {
+  MutexLock l(&mu_);
+  Stats stats;
+  stats.num_hits = num_hits_;
+  stats.num_misses = num_misses_;
+  stats.num_files = entries_.size();
+  stats.bytes = bytes_;
+  return stats;
+}
+
+}  // namespace lingvo
+}  // namespace tensorflow
@@ -0,0 +1,133 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef LINGVO_CORE_OPS_SHARD_CACHE_H_
+#define LINGVO_CORE_OPS_SHARD_CACHE_H_
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "lingvo/core/ops/mutex.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/file_system.h"
+#include "tensorflow/core/platform/macros.h"
+#include "tensorflow/core/platform/thread_annotations.h"
+
+namespace tensorflow {
+namespace lingvo {
+
+// ShardCache keeps local copies of data files, typically on a slow remote file
+// system, in a local directory, so that they are read from the remote file
+// system only once across epochs.
+//
+// A file is copied while it is read: Tee() wraps the remote file and writes
+// the bytes read from it, as long as they are read front to back, into a
+// temporary file. Once the end of the file is read, the copy is renamed into
+// place next to a small metadata file with the size and modification time of
+// the remote file and the crc32c of its bytes. Files read out of order or
+// only in part (e.g., chunked record files or text files read in several
+// splits) are not copied.
+//
+// A copy is used only while the remote file keeps its size and modification
+// time. The checksum of copies made by another process, or by an earlier
+// run, is verified before their first use. Several processes may share a
+// directory: copies are written under unique temporary names and renamed
+// atomically.
+//
+// Copies are evicted in least recently used order to keep the directory
+// within 'max_bytes', if positive. Thread-safe.
+class ShardCache {
+ public:
+  ShardCache(const string& dir, int64 max_bytes);
+
+  // Returns the process-wide cache in 'dir', which 'max_bytes' applies to
+  // only the first time. Returns null if 'dir' can not be created.
+  static ShardCache* Get(const string& dir, int64 max_bytes);
+
+  const string& dir() const { return dir_; }
+
+  // Returns true if there is a copy of 'filename', without validating it.
+  bool Contains(const string& filename) const;
+
+  // Opens the copy of 'filename' and returns true if there is a valid one.
+  bool OpenCopy(const string& filename,
+                std::unique_ptr<RandomAccessFile>* copy);
+
+  // Takes ownership of 'file', which reads 'filename'. Returns a file reading
+  // through 'file' which copies 'filename' into the cache, or 'file' itself
+  // if 'filename' is already cached, being copied or too large.
+  RandomAccessFile* Tee(const string& filename, RandomAccessFile* file);
+
+  struct Stats {
+    int64 num_hits = 0;    // OpenCopy() calls which opened a copy.
+    int64 num_misses = 0;  // Those which did not.
+    int64 num_files = 0;   // Copies in the cache.
+    int64 bytes = 0;       // Their total size.
+  };
+  Stats GetStats() const;
+
+ private:
+  class TeeFile;
+
+  struct Entry {
+    string path;
+    uint64 length = 0;
+    int64 mtime_nsec = 0;
+    uint32 crc = 0;
+    // False until the checksum of a copy made by someone else is verified.
+    bool verified = false;
+    std::list<string>::iterator lru;
+  };
+
+  // Returns the path of the copy of 'filename'.
+  string CopyPath(const string& filename) const;
+
+  // Loads the copies found in dir_.
+  void LoadEntries();
+
+  // Called by TeeFile when all of 'filename' is written into 'tmp_path', or
+  // with 'complete' false when the copy is abandoned.
+  void FinishCopy(const string& filename, const FileStatistics& stat,
+                  const string& tmp_path, uint32 crc, bool complete);
+
+  void Insert(const string& filename, Entry entry)
+      EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void Evict(const string& filename) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void EvictIfFull() EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const string dir_;
+  const int64 max_bytes_;
+
+  mutable Mutex mu_;
+  std::unordered_map<string, Entry> entries_ GUARDED_BY(mu_);
+  // Most recently used first.
+  std::list<string> lru_ GUARDED_BY(mu_);
+  // Files being copied.
+  std::unordered_set<string> copying_ GUARDED_BY(mu_);
+  int64 bytes_ GUARDED_BY(mu_) = 0;
+  int64 num_hits_ GUARDED_BY(mu_) = 0;
+  int64 num_misses_ GUARDED_BY(mu_) = 0;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(ShardCache);
+};
+
+}  // namespace lingvo
+}  // namespace tensorflow
+
+#endif  // LINGVO_CORE_OPS_SHARD_CACHE_H_
@@ -0,0 +1,307 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "lingvo/core/ops/shard_cache.h"
+
+#include <atomic>
+
+#include <gtest/gtest.h>
+#include "lingvo/core/ops/record_yielder.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/lib/io/record_writer.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+#include "tensorflow/core/lib/strings/stringprintf.h"
+#include "tensorflow/core/platform/env.h"
+
+namespace tensorflow {
+namespace lingvo {
+namespace {
+
+// Stands in for a file on a remote file system, counting the bytes read.
+class RemoteFile : public RandomAccessFile {
+ public:
+  RemoteFile(const string& filename, std::atomic<int64>* bytes_read)
+      : bytes_read_(bytes_read) {
+    TF_CHECK_OK(Env::Default()->NewRandomAccessFile(filename, &file_));
+  }
+
+  Status Read(uint64 offset, size_t n, StringPiece* result,
+              char* scratch) const override {
+    Status s = file_->Read(offset, n, result, scratch);
+    *bytes_read_ += result->size();
+    return s;
+  }
+
+ private:
+  std::unique_ptr<RandomAccessFile> file_;
+  std::atomic<int64>* bytes_read_;
+};
+
+// Returns a new empty directory.
+string EmptyDir(const string& name) {
+  const string dir = io::JoinPath("/tmp", name);
+  Env* env = Env::Default();
+  TF_CHECK_OK(env->RecursivelyCreateDir(dir));
+  std::vector<string> children;
+  TF_CHECK_OK(env->GetChildren(dir, &children));
+  for (const string& child : children) {
+    TF_CHECK_OK(env->DeleteFile(io::JoinPath(dir, child)));
+  }
+  return dir;
+}
+
+string WriteRemoteFile(const string& name, int size) {
+  const string filename = io::JoinPath(EmptyDir("shard_cache_remote"), name);
+  string content;
+  for (int i = 0; i < size; ++i) content.push_back('a' + (i * 7) % 26);
+  TF_CHECK_OK(WriteStringToFile(Env::Default(), filename, content));
+  return filename;
+}
+
+// Reads 'file' from 'offset' to its end in blocks of 'block_size' bytes.
+string ReadToEnd(RandomAccessFile* file, uint64 offset = 0,
+                 size_t block_size = 1000) {
+  string content;
+  std::unique_ptr<char[]> scratch(new char[block_size]);
+  while (true) {
+    StringPiece data;
+    Status s = file->Read(offset, block_size, &data, scratch.get());
+    content.append(data.data(), data.size());
+    offset += data.size();
+    if (!s.ok()) {
+      EXPECT_TRUE(errors::IsOutOfRange(s)) << s;
+      return content;
+    }
+  }
+}
+
+// Reads 'filename' through 'cache' and returns its content.
+string ReadThroughCache(ShardCache* cache, const string& filename,
+                        std::atomic<int64>* bytes_read) {
+  std::unique_ptr<RandomAccessFile> file;
+  if (!cache->OpenCopy(filename, &file)) {
+    file.reset(cache->Tee(filename, new RemoteFile(filename, bytes_read)));
+  }
+  return ReadToEnd(file.get());
+}
+
+int NumFiles(const string& dir) {
+  std::vector<string> children;
+  TF_CHECK_OK(Env::Default()->GetChildren(dir, &children));
+  return children.size();
+}
+
+TEST(ShardCache, CopiesFilesReadFrontToBack) {
+  const string filename = WriteRemoteFile("front_to_back", 10000);
+  string content;
+  TF_CHECK_OK(ReadFileToString(Env::Default(), filename, &content));
+  const string dir = EmptyDir("shard_cache_front_to_back");
+  ShardCache cache(dir, 0);
+  std::atomic<int64> bytes_read{0};
+  EXPECT_EQ(content, ReadThroughCache(&cache, filename, &bytes_read));
+  EXPECT_TRUE(cache.Contains(filename));
+  // The copy and its metadata.
+  EXPECT_EQ(2, NumFiles(dir));
+  for (int epoch = 0; epoch < 3; ++epoch) {
+    EXPECT_EQ(content, ReadThroughCache(&cache, filename, &bytes_read));
+  }
+  // Only the first epoch read the remote file.
+  EXPECT_EQ(content.size(), bytes_read);
+  ShardCache::Stats stats = cache.GetStats();
+  EXPECT_EQ(3, stats.num_hits);
+  EXPECT_EQ(1, stats.num_misses);
+  EXPECT_EQ(1, stats.num_files);
+  EXPECT_EQ(content.size(), stats.bytes);
+
+  // Another cache of the same directory, e.g., in another process, finds the
+  // copy.
+  ShardCache other(dir, 0);
+  EXPECT_EQ(content, ReadThroughCache(&other, filename, &bytes_read));
+  EXPECT_EQ(1, other.GetStats().num_hits);
+  EXPECT_EQ(content.size(), bytes_read);
+}
+
+TEST(ShardCache, DoesNotCopyFilesReadInPart) {
+  const string filename = WriteRemoteFile("in_part", 10000);
+  const string dir = EmptyDir("shard_cache_in_part");
+  ShardCache cache(dir, 0);
+  std::atomic<int64> bytes_read{0};
+  // A read skipping the first bytes.
+  std::unique_ptr<RandomAccessFile> file(
+      cache.Tee(filename, new RemoteFile(filename, &bytes_read)));
+  ReadToEnd(file.get(), 100);
+  file.reset();
+  EXPECT_FALSE(cache.Contains(filename));
+  // A file closed before its end.
+  file.reset(cache.Tee(filename, new RemoteFile(filename, &bytes_read)));
+  char scratch[100];
+  StringPiece data;
+  TF_CHECK_OK(file->Read(0, sizeof(scratch), &data, scratch));
+  file.reset();
+  EXPECT_FALSE(cache.Contains(filename));
+  // No temporary file is left behind.
+  EXPECT_EQ(0, NumFiles(dir));
+}
+
+TEST(ShardCache, IgnoresChangedAndCorruptedCopies) {
+  const string filename = WriteRemoteFile("changed", 10000);
+  const string dir = EmptyDir("shard_cache_changed");
+  std::atomic<int64> bytes_read{0};
+  {
+    ShardCache cache(dir, 0);
+    ReadThroughCache(&cache, filename, &bytes_read);
+    EXPECT_TRUE(cache.Contains(filename));
+  }
+  // Flips a byte of the copy.
+  std::vector<string> children;
+  TF_CHECK_OK(Env::Default()->GetChildren(dir, &children));
+  for (const string& child : children) {
+    if (str_util::EndsWith(child, ".meta")) continue;
+    const string path = io::JoinPath(dir, child);
+    string content;
+    TF_CHECK_OK(ReadFileToString(Env::Default(), path, &content));
+    content[5000] ^= 1;
+    TF_CHECK_OK(WriteStringToFile(Env::Default(), path, content));
+  }
+  {
+    ShardCache cache(dir, 0);
+    EXPECT_TRUE(cache.Contains(filename));
+    std::unique_ptr<RandomAccessFile> file;
+    EXPECT_FALSE(cache.OpenCopy(filename, &file));
+    EXPECT_FALSE(cache.Contains(filename));
+    EXPECT_EQ(0, NumFiles(dir));
+
+    // A copy of a file which changed afterwards is not used either.
+    ReadThroughCache(&cache, filename, &bytes_read);
+    EXPECT_TRUE(cache.Contains(filename));
+    TF_CHECK_OK(WriteStringToFile(Env::Default(), filename, "changed"));
+    EXPECT_FALSE(cache.OpenCopy(filename, &file));
+    EXPECT_EQ("changed", ReadThroughCache(&cache, filename, &bytes_read));
+  }
+}
+
+TEST(ShardCache, EvictsLeastRecentlyUsedCopies) {
+  const string dir = EmptyDir("shard_cache_lru");
+  EmptyDir("shard_cache_remote");
+  std::vector<string> filenames;
+  for (const char* name : {"a", "b", "c"}) {
+    filenames.push_back(io::JoinPath("/tmp/shard_cache_remote", name));
+    TF_CHECK_OK(WriteStringToFile(Env::Default(), filenames.back(),
+                                  string(1000, name[0])));
+  }
+  ShardCache cache(dir, 2500);
+  std::atomic<int64> bytes_read{0};
+  ReadThroughCache(&cache, filenames[0], &bytes_read);
+  ReadThroughCache(&cache, filenames[1], &bytes_read);
+  // Makes b the least recently used copy.
+  ReadThroughCache(&cache, filenames[0], &bytes_read);
+  ReadThroughCache(&cache, filenames[2], &bytes_read);
+  EXPECT_TRUE(cache.Contains(filenames[0]));
+  EXPECT_FALSE(cache.Contains(filenames[1]));
+  EXPECT_TRUE(cache.Contains(filenames[2]));
+  EXPECT_EQ(2000, cache.GetStats().bytes);
+  EXPECT_EQ(4, NumFiles(dir));
+}
+
+TEST(ShardCache, YielderReadsCopies) {
+  const int N = 4;
+  const int M = 100;
+  const string data_dir = EmptyDir("shard_cache_data");
+  for (int i = 0; i < N; ++i) {
+    string content;
+    for (int j = 0; j < M; ++j) {
+      strings::StrAppend(&content, strings::Printf("%010d\n", i * M + j));
+    }
+    TF_CHECK_OK(WriteStringToFile(
+        Env::Default(), io::JoinPath(data_dir, strings::StrCat("data.", i)),
+        content));
+  }
+  const string dir = EmptyDir("shard_cache_yielder");
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = strings::StrCat("text:", data_dir, "/data.*");
+  opts.seed = 301;
+  opts.bufsize = 10;
+  opts.parallelism = 2;
+  opts.cache_dir = dir;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  for (int epoch = 0; epoch < 3; ++epoch) {
+    std::vector<string> vals;
+    Record record;
+    for (int i = 0; i < N * M; ++i) {
+      TF_CHECK_OK(yielder->Yield(&record));
+      vals.emplace_back(string(record.value));
+    }
+    std::sort(vals.begin(), vals.end());
+    for (int i = 0; i < N * M; ++i) {
+      EXPECT_EQ(strings::Printf("%010d", i), vals[i]);
+    }
+  }
+  yielder->Close();
+  ShardCache::Stats stats = ShardCache::Get(dir, 0)->GetStats();
+  EXPECT_EQ(N, stats.num_files);
+  // The second epoch and at least a part of the third one read the copies.
+  EXPECT_LE(N + 1, stats.num_hits);
+}
+
+TEST(ShardCache, GlobalShuffleReadsCopies) {
+  // More files than a shard keeps open, so that some are opened again.
+  const int N = 70;
+  const int M = 10;
+  const string data_dir = EmptyDir("shard_cache_shuffled_data");
+  for (int i = 0; i < N; ++i) {
+    std::unique_ptr<WritableFile> file;
+    TF_CHECK_OK(Env::Default()->NewWritableFile(
+        io::JoinPath(data_dir, strings::StrCat("data.", i)), &file));
+    io::RecordWriter writer(file.get());
+    for (int j = 0; j < M; ++j) {
+      TF_CHECK_OK(writer.WriteRecord(strings::Printf("%010d", i * M + j)));
+    }
+  }
+  const string dir = EmptyDir("shard_cache_shuffled");
+  ShardCache* cache = ShardCache::Get(dir, 0);
+  std::atomic<int64> bytes_read{0};
+  for (int i = 0; i < N; ++i) {
+    ReadThroughCache(cache, io::JoinPath(data_dir, strings::StrCat("data.", i)),
+                     &bytes_read);
+  }
+  ASSERT_EQ(N, cache->GetStats().num_files);
+  const int64 num_hits = cache->GetStats().num_hits;
+
+  BasicRecordYielder::Options opts;
+  opts.file_pattern = strings::StrCat("tfrecord:", data_dir, "/data.*");
+  opts.seed = 301;
+  opts.bufsize = 1;
+  opts.parallelism = 1;
+  opts.global_shuffle = true;
+  opts.cache_dir = dir;
+  BasicRecordYielder* yielder = BasicRecordYielder::New(opts);
+  std::vector<string> vals;
+  Record record;
+  for (int i = 0; i < N * M; ++i) {
+    TF_CHECK_OK(yielder->Yield(&record));
+    vals.emplace_back(string(record.value));
+  }
+  yielder->Close();
+  std::sort(vals.begin(), vals.end());
+  for (int i = 0; i < N * M; ++i) {
+    EXPECT_EQ(strings::Printf("%010d", i), vals[i]);
+  }
+  EXPECT_LE(num_hits + N, cache->GetStats().num_hits);
+}
+
+}  // namespace
+}  // namespace lingvo
+}  // namespace tensorflow
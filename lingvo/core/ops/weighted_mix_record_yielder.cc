@@ -16,17 +16,94 @@ limitations under the License.
 #include "lingvo/core/ops/weighted_mix_record_yielder.h"
 
 #include <algorithm>
+#include <numeric>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "lingvo/core/ops/yielder_state.pb.h"
+#include "tensorflow/core/lib/hash/hash.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/platform/env.h"
 
 namespace tensorflow {
 namespace lingvo {
+namespace {
+
+// The id of the next WeightedMixRecordYielder.
+std::atomic<int64> next_id{0};
+
+// The ids of the mixers not closed yet, so that the threads drop their
+// states for the others.
+struct LiveMixers {
+  Mutex mu;
+  std::unordered_set<int64> ids GUARDED_BY(mu);
+};
+
+LiveMixers* GetLiveMixers() {
+  static LiveMixers* live = new LiveMixers;
+  return live;
+}
+
+// How often the child yielders which do not notify the mixer are polled
+// while none has records ready.
+constexpr int64 kPollMicros = 1000;
+
+}  // namespace
+
+WeightedMixRecordYielder::AliasTable::AliasTable(
+    const std::vector<float>& input_weights)
+    : prob(input_weights.size(), 1.0),
+      alias(input_weights.size()),
+      weights(input_weights) {
+  const size_t n = weights.size();
+  double sum = std::accumulate(weights.begin(), weights.end(), 0.0);
+  if (sum <= 0) {
+    // All weights are 0, which the constructor of the mixer accepts: the
+    // sources are mixed evenly.
+    weights.assign(n, 1.0);
+    sum = n;
+  }
+  // Scaled so that the average is 1. Each index below it is topped up by
+  // one above it.
+  std::vector<double> scaled(n);
+  std::vector<size_t> small;
+  std::vector<size_t> large;
+  for (size_t i = 0; i < n; ++i) {
+    alias[i] = i;
+    scaled[i] = weights[i] * n / sum;
+    (scaled[i] < 1.0 ? small : large).push_back(i);
+  }
+  while (!small.empty() && !large.empty()) {
+    const size_t s = small.back();
+    small.pop_back();
+    const size_t l = large.back();
+    prob[s] = scaled[s];
+    alias[s] = l;
+    scaled[l] -= 1.0 - scaled[s];
+    if (scaled[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  // The indices left, if any, are off 1 by rounding errors only, and keep
+  // prob 1.
+}
+
+size_t WeightedMixRecordYielder::AliasTable::Sample(
+    std::mt19937_64* rnd) const {
+  const size_t i = (*rnd)() % prob.size();
+  return std::uniform_real_distribution<double>()(*rnd) < prob[i] ? i
+                                                                   : alias[i];
+}
 
 WeightedMixRecordYielder::WeightedMixRecordYielder(
     const int64 seed, const std::vector<RecordYielder*>& yielders,
-    const std::vector<float>& input_source_weights)
-    : rnd_(seed),
-      sample_distribution_(input_source_weights.begin(),
-                           input_source_weights.end()),
-      yielders_(yielders) {
+    const std::vector<float>& input_source_weights, int64 max_deficit)
+    : seed_(seed),
+      max_deficit_(max_deficit),
+      id_(next_id++),
+      yielders_(yielders),
+      owed_(yielders.size()) {
   if (yielders.size() != input_source_weights.size()) {
     LOG(FATAL) << "Unable to create WeightedMixRecordYielder: every yielder "
                << "should have a corresponding weight. " << yielders.size()
@@ -37,23 +114,37 @@ WeightedMixRecordYielder::WeightedMixRecordYielder(
   if (yielders.empty()) {
     LOG(FATAL) << "There should be at least one yielder provided.";
   }
-
+  // Unlike SetWeights(), all weights may be 0 here, as they always could.
   for (float x : input_source_weights) {
     if (x < 0) {
       LOG(FATAL) << "All weights should be greater or equal to zero. Got " << x;
     }
   }
+  {
+    MutexLock l(&table_mu_);
+    table_ = std::make_shared<const AliasTable>(input_source_weights);
+  }
+  for (RecordYielder* yielder : yielders_) {
+    if (!yielder->SetReadyNotifier(&ready_)) poll_ = true;
+  }
+  LiveMixers* live = GetLiveMixers();
+  MutexLock l(&live->mu);
+  live->ids.insert(id_);
 }
 
 WeightedMixRecordYielder* WeightedMixRecordYielder::New(
     const int64 seed, const std::vector<RecordYielder*>& yielders,
-    const std::vector<float>& input_source_weights) {
-  WeightedMixRecordYielder* yielder =
-      new WeightedMixRecordYielder(seed, yielders, input_source_weights);
+    const std::vector<float>& input_source_weights, int64 max_deficit) {
+  WeightedMixRecordYielder* yielder = new WeightedMixRecordYielder(
+      seed, yielders, input_source_weights, max_deficit);
   return yielder;
 }
 
-WeightedMixRecordYielder::~WeightedMixRecordYielder() {}
+WeightedMixRecordYielder::~WeightedMixRecordYielder() {
+  LiveMixers* live = GetLiveMixers();
+  MutexLock l(&live->mu);
+  live->ids.erase(id_);
+}
 
 void WeightedMixRecordYielder::Close() {
   for (RecordYielder* yielder : yielders_) {
@@ -63,13 +154,72 @@ void WeightedMixRecordYielder::Close() {
   delete this;
 }
 
-Status WeightedMixRecordYielder::Yield(Record* record) {
-  size_t yielder_idx = 0;
+Status WeightedMixRecordYielder::CheckWeights(
+    const std::vector<float>& weights) const {
+  if (weights.size() != yielders_.size()) {
+    return errors::InvalidArgument(yielders_.size(), " yielders and ",
+                                   weights.size(), " weights were provided.");
+  }
+  for (float x : weights) {
+    if (x < 0) {
+      return errors::InvalidArgument(
+          "All weights should be greater or equal to zero. Got ", x);
+    }
+  }
+  if (std::accumulate(weights.begin(), weights.end(), 0.0) <= 0) {
+    return errors::InvalidArgument("Some weight should be positive.");
+  }
+  return Status::OK();
+}
+
+WeightedMixRecordYielder::ThreadState*
+WeightedMixRecordYielder::GetThreadState() {
+  thread_local std::unordered_map<int64, ThreadState> states;
+  auto iter = states.find(id_);
+  if (iter == states.end()) {
+    {
+      // Drops the states of the mixers closed since.
+      LiveMixers* live = GetLiveMixers();
+      MutexLock l(&live->mu);
+      for (auto it = states.begin(); it != states.end();) {
+        it = live->ids.count(it->first) > 0 ? std::next(it) : states.erase(it);
+      }
+    }
+    iter = states.emplace(id_, ThreadState()).first;
+    iter->second.rnd.seed(Hash64Combine(seed_, num_streams_++));
+  }
+  ThreadState* state = &iter->second;
+  if (state->version != version_.load(std::memory_order_acquire)) {
+    MutexLock l(&table_mu_);
+    state->table = table_;
+    state->version = version_;
+  }
+  return state;
+}
+
+Status WeightedMixRecordYielder::SetWeights(
+    const std::vector<float>& input_source_weights) {
+  TF_RETURN_IF_ERROR(CheckWeights(input_source_weights));
+  auto table = std::make_shared<const AliasTable>(input_source_weights);
   {
-    MutexLock l(&mu_);
-    yielder_idx = sample_distribution_(rnd_);
-    // Release the lock immediately once we fix which yielder to use.
+    MutexLock l(&table_mu_);
+    table_ = std::move(table);
+    version_.fetch_add(1, std::memory_order_release);
+  }
+  LOG(INFO) << this << " Input source weights set to "
+            << str_util::Join(input_source_weights, ",");
+  return Status::OK();
+}
+
+Status WeightedMixRecordYielder::Yield(Record* record) {
+  if (max_deficit_ > 0) {
+    std::vector<Record> records;
+    TF_RETURN_IF_ERROR(YieldReadyBatch(1, &records));
+    *record = std::move(records.front());
+    return Status::OK();
   }
+  ThreadState* state = GetThreadState();
+  const size_t yielder_idx = state->table->Sample(&state->rnd);
   while (true) {
     // Retry indefinitely until we get an Ok status from the specific yielder.
     // This will stall the training if there is any unrecoverable error with
@@ -83,5 +233,115 @@ Status WeightedMixRecordYielder::Yield(Record* record) {
   }
 }
 
+Status WeightedMixRecordYielder::YieldBatch(int n, std::vector<Record>* out) {
+  if (max_deficit_ > 0) return YieldReadyBatch(n, out);
+  // Positions in the batch of the records of each yielder.
+  std::vector<std::vector<int>> positions(yielders_.size());
+  ThreadState* state = GetThreadState();
+  const AliasTable* table = state->table.get();
+  std::mt19937_64* rnd = &state->rnd;
+  for (int i = 0; i < n; ++i) {
+    positions[table->Sample(rnd)].push_back(i);
+  }
+  const size_t begin = out->size();
+  out->resize(begin + n);
+  std::vector<Record> records;
+  for (int i = 0; i < yielders_.size(); ++i) {
+    const std::vector<int>& pos = positions[i];
+    records.clear();
+    while (records.size() < pos.size()) {
+      // Retry indefinitely, as Yield() does.
+      Status s = yielders_[i]->YieldBatch(pos.size() - records.size(),
+                                          &records);
+      if (!s.ok()) LOG(WARNING) << s;
+    }
+    for (int j = 0; j < pos.size(); ++j) {
+      (*out)[begin + pos[j]] = std::move(records[j]);
+    }
+  }
+  return Status::OK();
+}
+
+Status WeightedMixRecordYielder::YieldReadyBatch(int n,
+                                                 std::vector<Record>* out) {
+  const int num_yielders = yielders_.size();
+  std::vector<int64> num_sampled(num_yielders);
+  // The table is kept by the state of this thread until it samples again.
+  ThreadState* state = GetThreadState();
+  const AliasTable* table = state->table.get();
+  std::mt19937_64* rnd = &state->rnd;
+  for (int i = 0; i < n; ++i) {
+    ++num_sampled[table->Sample(rnd)];
+  }
+  // A snapshot of owed_, as other threads may change it.
+  std::vector<int64> owed(num_yielders);
+  for (int i = 0; i < num_yielders; ++i) {
+    owed[i] = (owed_[i] += num_sampled[i]);
+  }
+  // The children owed the most records go first.
+  std::vector<int> order(num_yielders);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&owed](int a, int b) { return owed[a] > owed[b]; });
+
+  const size_t begin = out->size();
+  const size_t end = begin + n;
+  auto take = [this, out, &owed](int i, int64 num_wanted, bool wait) {
+    const size_t size = out->size();
+    // Errors are retried, as Yield() does.
+    Status s = wait ? yielders_[i]->YieldBatch(num_wanted, out)
+                    : yielders_[i]->TryYieldBatch(num_wanted, out);
+    if (!s.ok()) LOG(WARNING) << s;
+    const int64 num_taken = out->size() - size;
+    owed_[i] -= num_taken;
+    owed[i] -= num_taken;
+  };
+  // First the records owed to the children which have some ready.
+  for (int i : order) {
+    const int64 num_wanted = std::min<int64>(end - out->size(), owed[i]);
+    if (num_wanted > 0) take(i, num_wanted, /* wait */ false);
+  }
+  // The children owed more than max_deficit_ are waited for.
+  for (int i : order) {
+    while (out->size() < end && owed[i] > max_deficit_) {
+      take(i, std::min<int64>(end - out->size(), owed[i] - max_deficit_),
+           /* wait */ true);
+    }
+  }
+  // Then any records ready, from the children with a positive weight and
+  // less than max_deficit_ records ahead of it, or still owed some. While
+  // none has records ready, waits for any of them, as waiting for one could
+  // wait for a stalled one.
+  while (true) {
+    const int64 count = ready_.count();
+    for (int i : order) {
+      const int64 room = owed[i] + (table->weights[i] > 0 ? max_deficit_ : 0);
+      const int64 num_wanted = std::min<int64>(end - out->size(), room);
+      if (num_wanted > 0) take(i, num_wanted, /* wait */ false);
+    }
+    if (out->size() == end) break;
+    if (poll_) {
+      Env::Default()->SleepForMicroseconds(kPollMicros);
+    } else {
+      ready_.WaitForChange(count);
+    }
+    // Other threads may have taken records of the children since.
+    for (int i = 0; i < num_yielders; ++i) owed[i] = owed_[i];
+  }
+  // The records of each child are together so far.
+  std::shuffle(out->begin() + begin, out->end(), *rnd);
+  return Status::OK();
+}
+
+Status WeightedMixRecordYielder::GetState(int64 max_buffered_records,
+                                          YielderState* state) {
+  state->Clear();
+  for (RecordYielder* yielder : yielders_) {
+    TF_RETURN_IF_ERROR(yielder->GetState(
+        max_buffered_records / yielders_.size(), state->add_children()));
+  }
+  return Status::OK();
+}
+
 }  // namespace lingvo
 }  // namespace tensorflow
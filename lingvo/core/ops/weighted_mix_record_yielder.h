@@ -15,6 +15,12 @@ limitations under the License.
 #ifndef LINGVO_CORE_OPS_WEIGHTED_MIX_RECORD_YIELDER_H_
 #define LINGVO_CORE_OPS_WEIGHTED_MIX_RECORD_YIELDER_H_
 
+#include <atomic>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "lingvo/core/ops/mutex.h"
 #include "lingvo/core/ops/record_yielder.h"
 
 namespace tensorflow {
@@ -47,13 +53,49 @@ namespace lingvo {
 //   }
 //   yielder->Close();
 //
+// The weights can be changed while records are yielded with SetWeights().
+//
+// If 'max_deficit' is positive, a record is taken from another child yielder
+// when the sampled one has none ready, e.g., while it reads from slow storage
+// or the next epoch, rather than wait for it. The records each child is owed
+// are tracked, and taken from it first once it has records again, much like
+// in deficit round robin. A child is only waited for once it is owed more
+// than 'max_deficit' records, so that the mix follows the weights within
+// that many records per child. Likewise, a child yields at most
+// 'max_deficit' records ahead of its weight, and none while its weight is 0.
+// While no child which may yield has records ready, the mixer waits for the
+// children to notify it (see ReadyNotifier).
+//
 // WeightedMixRecordYielder can be accessed by multiple threads concurrently.
+// Each thread samples the child yielders with its own random stream and its
+// own copy of the weight table, without taking a lock unless the weights
+// changed since it last sampled.
 class WeightedMixRecordYielder : public RecordYielder {
  public:
   ~WeightedMixRecordYielder() override;
   void Close() override;
   Status Yield(Record* record) override;
 
+  // Samples the child yielders of all 'n' records at once and fetches each
+  // child's records with a single YieldBatch call. Always yields 'n' records.
+  Status YieldBatch(int n, std::vector<Record>* out) override;
+
+  // Saves the states of the child yielders as its children, with
+  // 'max_buffered_records' split evenly among them.
+  Status GetState(int64 max_buffered_records, YielderState* state) override;
+
+  // Replaces the input_source_weights, e.g., to change the mix during
+  // training while the child yielders keep their buffers. The records
+  // sampled after it returns follow the new weights. Unlike at construction,
+  // where all weights may be 0 and the sources are then mixed evenly, some
+  // weight must be positive.
+  Status SetWeights(const std::vector<float>& input_source_weights);
+
+  // Returns the error SetWeights() would return for 'input_source_weights',
+  // i.e., an error unless there is one weight per child yielder, all
+  // non-negative and some positive.
+  Status CheckWeights(const std::vector<float>& input_source_weights) const;
+
   // Creates new WeightedMixRecordYielder and takes ownership over yielders
   // provided. Those yielders should be properly initialized already and will be
   // closed once WeightedMixRecordYielder is closed. Caller is responsible
@@ -62,25 +104,79 @@ class WeightedMixRecordYielder : public RecordYielder {
   static WeightedMixRecordYielder* New(
       const int64 seed,
       const std::vector<RecordYielder*>& yielders,
-      const std::vector<float>& input_source_weights);
+      const std::vector<float>& input_source_weights,
+      int64 max_deficit = 0);
 
  protected:
   WeightedMixRecordYielder(
       const int64 seed,
       const std::vector<RecordYielder*>& yielders,
-      const std::vector<float>& input_source_weights);
+      const std::vector<float>& input_source_weights,
+      int64 max_deficit);
 
 
  private:
-  mutable Mutex mu_;
+  // Walker's alias table, which samples the index of a weight in O(1).
+  struct AliasTable {
+    // If all 'input_weights' are 0, samples all indices evenly.
+    explicit AliasTable(const std::vector<float>& input_weights);
+
+    size_t Sample(std::mt19937_64* rnd) const;
 
-  // PRG used for randomization.
-  std::mt19937_64 rnd_ GUARDED_BY(mu_);
+    // Index i is picked with probability prob[i], else alias[i] is.
+    std::vector<double> prob;
+    std::vector<size_t> alias;
 
-  std::discrete_distribution<size_t> sample_distribution_;
+    // The weights the table samples by, all 1 if 'input_weights' are all 0.
+    std::vector<float> weights;
+  };
+
+  // What a thread samples this mixer with: its own random stream, and the
+  // table of the weights of 'version'.
+  struct ThreadState {
+    std::mt19937_64 rnd;
+    int64 version = -1;
+    std::shared_ptr<const AliasTable> table;
+  };
+
+  // Returns the state of the calling thread for this mixer, with the table
+  // of the current weights. A thread keeps a state per mixer, and the
+  // streams of a mixer follow from its seed. Only takes table_mu_ once the
+  // weights changed since the thread last sampled. A batch is sampled with
+  // the table returned once.
+  ThreadState* GetThreadState();
+
+  // Yields 'n' records, from the children which have them ready if
+  // max_deficit_ is positive.
+  Status YieldReadyBatch(int n, std::vector<Record>* out);
+
+  const int64 seed_;
+  const int64 max_deficit_;
+  // Unique among the mixers of the process.
+  const int64 id_;
+  // Number of random streams created so far.
+  std::atomic<int64> num_streams_{0};
+
+  // The table of the current weights and its version, bumped by
+  // SetWeights(). The threads keep the table of the last version they saw.
+  // A replaced table is deleted once every thread which sampled with it has
+  // seen a later version, or exited.
+  Mutex table_mu_;
+  std::shared_ptr<const AliasTable> table_ GUARDED_BY(table_mu_);
+  std::atomic<int64> version_{0};
 
   // A list of child yielders used as an input to the mixer.
   std::vector<RecordYielder*> yielders_;
+
+  // The records sampled from each child minus those it yielded, if
+  // max_deficit_ is positive. Negative while it yields ahead of its weight.
+  std::vector<std::atomic<int64>> owed_;
+
+  // Notified by the children when they may have records ready. The children
+  // which do not notify it are polled while none has records ready, if
+  // 'poll_'.
+  ReadyNotifier ready_;
+  bool poll_ = false;
 };
 
 }  // namespace lingvo
@@ -17,13 +17,17 @@ limitations under the License.
 
 #include <error.h>
 
+#include <memory>
+
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include "lingvo/core/ops/input_common.h"
 #include "lingvo/core/ops/record_yielder.h"
 #include "lingvo/core/ops/yielder_test_helper.h"
 #include "tensorflow/core/lib/core/stringpiece.h"
+#include "tensorflow/core/lib/core/threadpool.h"
 #include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/lib/strings/stringprintf.h"
 #include "tensorflow/core/platform/env.h"
 
 namespace tensorflow {
@@ -76,6 +80,41 @@ TEST(RecordYielderTest, WeightedMixerBasicTest) {
   yielder->Close();
 }
 
+TEST(RecordYielderTest, WeightedMixerYieldBatch) {
+  const int N = 10;
+  const int M = 1000;
+  GeneratePlainTextTestData("yielder1", N, M);
+  GeneratePlainTextTestData("yielder2", N, M);
+
+  std::vector<RecordYielder*> yielders;
+  for (const string& name : {"yielder1", "yielder2"}) {
+    BasicRecordYielder::Options opts;
+    opts.file_pattern =
+        strings::StrCat("text:", io::JoinPath("/tmp", name + ".*"));
+    opts.seed = 301;
+    opts.bufsize = 2000;
+    opts.parallelism = 1;
+    yielders.push_back(BasicRecordYielder::New(opts));
+  }
+  WeightedMixRecordYielder* yielder =
+      WeightedMixRecordYielder::New(301, yielders, {0.25, 0.75});
+
+  std::vector<Record> records;
+  while (records.size() < N * M) {
+    TF_CHECK_OK(yielder->YieldBatch(16, &records));
+  }
+  ASSERT_EQ(N * M, records.size());
+  std::vector<string> vals;
+  for (const Record& record : records) {
+    vals.emplace_back(string(record.value));
+  }
+  auto input_source_distribution = ComputeInputSourceDistribution(vals);
+  ASSERT_NEAR(input_source_distribution["yielder1"], 0.25, 0.02);
+  ASSERT_NEAR(input_source_distribution["yielder2"], 0.75, 0.02);
+
+  yielder->Close();
+}
+
 TEST(RecordYielderTest, WeightedMixerUnevenMixTest) {
   const int N = 10;
   const int M = 1000;
@@ -185,18 +224,344 @@ TEST(RecordYielderTest, WeightedMixerUnevenInputSourcesTest) {
   yielder->Close();
 }
 
+// Returns a mixer of the sources "yielder1" and "yielder2" generated by
+// GeneratePlainTextTestData().
+WeightedMixRecordYielder* NewMixer(const std::vector<float>& weights) {
+  std::vector<RecordYielder*> yielders;
+  for (const string& name : {"yielder1", "yielder2"}) {
+    BasicRecordYielder::Options opts;
+    opts.file_pattern =
+        strings::StrCat("text:", io::JoinPath("/tmp", name + ".*"));
+    opts.seed = 301;
+    opts.bufsize = 2000;
+    opts.parallelism = 1;
+    yielders.push_back(BasicRecordYielder::New(opts));
+  }
+  return WeightedMixRecordYielder::New(301, yielders, weights);
+}
+
+// Yields 'n' records and returns the fraction of them from "yielder1".
+float YieldFromFirst(RecordYielder* yielder, int n) {
+  std::vector<Record> records;
+  while (records.size() < n) {
+    TF_CHECK_OK(yielder->YieldBatch(std::min<int>(64, n - records.size()),
+                                    &records));
+  }
+  std::vector<string> vals;
+  for (const Record& record : records) {
+    vals.emplace_back(string(record.value));
+  }
+  return ComputeInputSourceDistribution(vals)["yielder1"];
+}
+
+TEST(RecordYielderTest, WeightedMixerSetWeights) {
+  GeneratePlainTextTestData("yielder1", 10, 1000);
+  GeneratePlainTextTestData("yielder2", 10, 1000);
+  WeightedMixRecordYielder* yielder = NewMixer({1.0, 0.0});
+  EXPECT_EQ(1.0, YieldFromFirst(yielder, 1000));
+
+  TF_CHECK_OK(yielder->SetWeights({0.0, 1.0}));
+  EXPECT_EQ(0.0, YieldFromFirst(yielder, 1000));
+
+  TF_CHECK_OK(yielder->SetWeights({0.2, 0.8}));
+  EXPECT_NEAR(0.2, YieldFromFirst(yielder, 10000), 0.02);
+
+  // Invalid weights are rejected and the weights are kept.
+  EXPECT_EQ(error::INVALID_ARGUMENT, yielder->SetWeights({1.0}).code());
+  EXPECT_EQ(error::INVALID_ARGUMENT,
+            yielder->SetWeights({1.0, -1.0}).code());
+  EXPECT_EQ(error::INVALID_ARGUMENT, yielder->SetWeights({0.0, 0.0}).code());
+  EXPECT_NEAR(0.2, YieldFromFirst(yielder, 10000), 0.02);
+
+  yielder->Close();
+}
+
+TEST(RecordYielderTest, WeightedMixerThreads) {
+  GeneratePlainTextTestData("yielder1", 10, 1000);
+  GeneratePlainTextTestData("yielder2", 10, 1000);
+  WeightedMixRecordYielder* yielder = NewMixer({0.3, 0.7});
+
+  // Each thread samples with its own stream, and keeps sampling while the
+  // weights change, so that the replaced tables are deleted while some
+  // threads may still sample with them.
+  const int kNumThreads = 4;
+  std::vector<float> before(kNumThreads);
+  std::vector<float> after(kNumThreads);
+  std::vector<Notification> ready(kNumThreads);
+  std::atomic<bool> switched{false};
+  {
+    thread::ThreadPool pool(Env::Default(), "mixer_test", kNumThreads);
+    for (int i = 0; i < kNumThreads; ++i) {
+      pool.Schedule([yielder, &before, &after, &ready, &switched, i]() {
+        before[i] = YieldFromFirst(yielder, 10000);
+        ready[i].Notify();
+        while (!switched) YieldFromFirst(yielder, 64);
+        after[i] = YieldFromFirst(yielder, 10000);
+      });
+    }
+    for (Notification& notification : ready) {
+      notification.WaitForNotification();
+    }
+    for (int i = 0; i < 100; ++i) {
+      TF_CHECK_OK(yielder->SetWeights({0.5, 0.5}));
+      TF_CHECK_OK(yielder->SetWeights({0.8, 0.2}));
+    }
+    switched = true;
+  }
+  for (int i = 0; i < kNumThreads; ++i) {
+    EXPECT_NEAR(0.3, before[i], 0.03);
+    EXPECT_NEAR(0.8, after[i], 0.03);
+  }
+
+  yielder->Close();
+}
+
+// Returns a mock child which yields 'value' forever.
+MockRecordYielder* NewConstantYielder(const string& value) {
+  auto* yielder = new MockRecordYielder;
+  EXPECT_CALL(*yielder, Yield(testing::_))
+      .WillRepeatedly(testing::Invoke([value](Record* record) {
+        record->value = value;
+        return Status::OK();
+      }));
+  EXPECT_CALL(*yielder, Close());
+  return yielder;
+}
+
+TEST(RecordYielderTest, WeightedMixerAlternatingMixers) {
+  // A thread keeps a stream per mixer, so that sampling two mixers with the
+  // same seed in turn yields the same sequence from both.
+  std::vector<std::unique_ptr<MockRecordYielder>> children;
+  std::vector<WeightedMixRecordYielder*> mixers;
+  for (int i = 0; i < 2; ++i) {
+    children.emplace_back(NewConstantYielder("a"));
+    children.emplace_back(NewConstantYielder("b"));
+    mixers.push_back(WeightedMixRecordYielder::New(
+        301, {children[2 * i].get(), children[2 * i + 1].get()},
+        {0.5, 0.5}));
+  }
+  std::vector<string> vals[2];
+  Record record;
+  record.source_id = kDefaultSourceId;
+  for (int i = 0; i < 1000; ++i) {
+    for (int j = 0; j < 2; ++j) {
+      TF_CHECK_OK(mixers[j]->Yield(&record));
+      vals[j].emplace_back(string(record.value));
+    }
+  }
+  EXPECT_EQ(vals[0], vals[1]);
+  EXPECT_GT(std::count(vals[0].begin(), vals[0].end(), "a"), 400);
+  EXPECT_GT(std::count(vals[0].begin(), vals[0].end(), "b"), 400);
+
+  for (WeightedMixRecordYielder* mixer : mixers) mixer->Close();
+}
+
+TEST(RecordYielderTest, WeightedMixerZeroWeights) {
+  // All weights 0 are accepted at construction and mix the sources evenly.
+  std::unique_ptr<MockRecordYielder> a(NewConstantYielder("a"));
+  std::unique_ptr<MockRecordYielder> b(NewConstantYielder("b"));
+  WeightedMixRecordYielder* mixer =
+      WeightedMixRecordYielder::New(301, {a.get(), b.get()}, {0.0, 0.0});
+  const int kNumRecords = 10000;
+  int num_a = 0;
+  Record record;
+  record.source_id = kDefaultSourceId;
+  for (int i = 0; i < kNumRecords; ++i) {
+    TF_CHECK_OK(mixer->Yield(&record));
+    if (string(record.value) == "a") ++num_a;
+  }
+  EXPECT_NEAR(0.5, static_cast<double>(num_a) / kNumRecords, 0.03);
+  mixer->Close();
+}
+
+TEST(RecordYielderTest, WeightedMixerWeightsByName) {
+  GeneratePlainTextTestData("yielder1", 10, 1000);
+  GeneratePlainTextTestData("yielder2", 10, 1000);
+  WeightedMixRecordYielder* yielder = NewMixer({0.5, 0.5});
+  RegisterYielderForWeights("mixer_test", yielder);
+
+  TF_CHECK_OK(SetYielderWeights("mixer_test", {0.0, 1.0}));
+  EXPECT_EQ(0.0, YieldFromFirst(yielder, 1000));
+  EXPECT_EQ(error::NOT_FOUND,
+            SetYielderWeights("other", {1.0, 0.0}).code());
+  EXPECT_EQ(error::INVALID_ARGUMENT,
+            SetYielderWeights("mixer_test", {1.0}).code());
+
+  UnregisterYielderForWeights("mixer_test", yielder);
+  EXPECT_EQ(error::NOT_FOUND,
+            SetYielderWeights("mixer_test", {1.0, 0.0}).code());
+  yielder->Close();
+}
+
+TEST(RecordYielderTest, WeightedMixerWeightsByNameAllOrNone) {
+  // Two mixers under one name, of 2 and 3 children, which all yield only
+  // from their first child.
+  std::vector<std::unique_ptr<MockRecordYielder>> children;
+  for (int i = 0; i < 5; ++i) {
+    children.emplace_back(NewConstantYielder(i == 0 || i == 2 ? "a" : "b"));
+  }
+  std::vector<WeightedMixRecordYielder*> mixers = {
+      WeightedMixRecordYielder::New(
+          301, {children[0].get(), children[1].get()}, {1.0, 0.0}),
+      WeightedMixRecordYielder::New(
+          301, {children[2].get(), children[3].get(), children[4].get()},
+          {1.0, 0.0, 0.0})};
+  for (WeightedMixRecordYielder* mixer : mixers) {
+    RegisterYielderForWeights("all_or_none", mixer);
+  }
+
+  // The weights do not fit the second mixer, so the first one keeps its
+  // weights too.
+  EXPECT_EQ(error::INVALID_ARGUMENT,
+            SetYielderWeights("all_or_none", {0.0, 1.0}).code());
+  Record record;
+  record.source_id = kDefaultSourceId;
+  for (WeightedMixRecordYielder* mixer : mixers) {
+    for (int i = 0; i < 100; ++i) {
+      TF_CHECK_OK(mixer->Yield(&record));
+      ASSERT_EQ("a", string(record.value));
+    }
+  }
+
+  for (WeightedMixRecordYielder* mixer : mixers) {
+    UnregisterYielderForWeights("all_or_none", mixer);
+    mixer->Close();
+  }
+}
+
+// Yields the records "stalled:<i>" once Release() is called. Until then, it
+// has none ready.
+class StalledYielder : public RecordYielder {
+ public:
+  void Release() {
+    released_ = true;
+    ReadyNotifier* notifier = notifier_;
+    if (notifier != nullptr) notifier->Notify();
+  }
+
+  bool SetReadyNotifier(ReadyNotifier* notifier) override {
+    notifier_ = notifier;
+    return true;
+  }
+
+  Status Yield(Record* record) override {
+    while (!released_) Env::Default()->SleepForMicroseconds(1000);
+    record->value = strings::Printf("stalled:%010d", num_yielded_++);
+    return Status::OK();
+  }
+
+  Status TryYieldBatch(int n, std::vector<Record>* out) override {
+    if (!released_) return Status::OK();
+    return YieldBatch(n, out);
+  }
+
+  void Close() override { delete this; }
+
+ private:
+  std::atomic<bool> released_{false};
+  std::atomic<int64> num_yielded_{0};
+  std::atomic<ReadyNotifier*> notifier_{nullptr};
+};
+
+TEST(RecordYielderTest, WeightedMixerStalledSource) {
+  GeneratePlainTextTestData("yielder1", 10, 1000);
+  BasicRecordYielder::Options opts;
+  opts.file_pattern =
+      strings::StrCat("text:", io::JoinPath("/tmp", "yielder1.*"));
+  opts.seed = 301;
+  opts.bufsize = 2000;
+  opts.parallelism = 1;
+  StalledYielder* stalled = new StalledYielder;
+  WeightedMixRecordYielder* yielder = WeightedMixRecordYielder::New(
+      301, {BasicRecordYielder::New(opts), stalled}, {0.5, 0.5},
+      /* max_deficit */ 200);
+
+  // The records of the stalled source are taken from the other one while it
+  // is owed fewer than max_deficit records.
+  std::vector<string> vals;
+  Record record;
+  for (int i = 0; i < 300; ++i) {
+    TF_CHECK_OK(yielder->Yield(&record));
+    vals.emplace_back(string(record.value));
+  }
+  EXPECT_EQ(1.0, ComputeInputSourceDistribution(vals)["yielder1"]);
+
+  // They are made up for once it has records.
+  stalled->Release();
+  EXPECT_GT(0.4, YieldFromFirst(yielder, 300));
+
+  // The mix follows the weights within max_deficit.
+  EXPECT_NEAR(0.5, YieldFromFirst(yielder, 20000), 0.03);
+  yielder->Close();
+}
+
+TEST(RecordYielderTest, WeightedMixerStalledSourceZeroWeight) {
+  GeneratePlainTextTestData("yielder1", 10, 1000);
+  BasicRecordYielder::Options opts;
+  opts.file_pattern =
+      strings::StrCat("text:", io::JoinPath("/tmp", "yielder1.*"));
+  opts.seed = 301;
+  opts.bufsize = 2000;
+  opts.parallelism = 1;
+  StalledYielder* stalled = new StalledYielder;
+  WeightedMixRecordYielder* yielder = WeightedMixRecordYielder::New(
+      301, {BasicRecordYielder::New(opts), stalled}, {0.0, 1.0},
+      /* max_deficit */ 200);
+
+  // The source of weight 0 has records ready, but the mixer waits for the
+  // stalled one to notify it instead.
+  std::vector<float> fractions;
+  {
+    thread::ThreadPool pool(Env::Default(), "mixer_test", 1);
+    pool.Schedule([yielder, &fractions]() {
+      for (int i = 0; i < 5; ++i) {
+        fractions.push_back(YieldFromFirst(yielder, 64));
+      }
+    });
+    Env::Default()->SleepForMicroseconds(100000);
+    stalled->Release();
+  }
+  EXPECT_THAT(fractions, testing::Each(0.0));
+  yielder->Close();
+}
+
+TEST(RecordYielderTest, WeightedMixerMaxDeficit) {
+  GeneratePlainTextTestData("yielder1", 10, 1000);
+  GeneratePlainTextTestData("yielder2", 10, 1000);
+  std::vector<RecordYielder*> yielders;
+  for (const string& name : {"yielder1", "yielder2"}) {
+    BasicRecordYielder::Options opts;
+    opts.file_pattern =
+        strings::StrCat("text:", io::JoinPath("/tmp", name + ".*"));
+    opts.seed = 301;
+    opts.bufsize = 2000;
+    opts.parallelism = 1;
+    yielders.push_back(BasicRecordYielder::New(opts));
+  }
+  // The sources have records most of the time, and the mix follows the
+  // weights over a few epochs of the smaller one.
+  WeightedMixRecordYielder* yielder = WeightedMixRecordYielder::New(
+      301, yielders, {0.25, 0.75}, /* max_deficit */ 100);
+  EXPECT_NEAR(0.25, YieldFromFirst(yielder, 40000), 0.02);
+  yielder->Close();
+}
+
 TEST(RecordYielderTest, RecordYielderRetryLoop) {
   MockRecordYielder yielder1;
   MockRecordYielder yielder2;
-  // Yielder1 always returns OK. Yielder2 returns DEADLINE_EXCEEDED 3 times in a
-  // row and then returns OK.
-  // Each of them yields max of 5 records and then saturates.
+  // Both yielders tag their records with their source id. Yielder2 returns
+  // DEADLINE_EXCEEDED 3 times in a row, which the mixer retries, and then
+  // returns OK.
+  auto tag = [](int source_id) {
+    return [source_id](Record* record) {
+      record->source_id = source_id;
+      return Status::OK();
+    };
+  };
   EXPECT_CALL(yielder1, Yield(testing::_))
-      .Times(5)
-      .WillRepeatedly(testing::Return(Status::OK()));
+      .WillRepeatedly(testing::Invoke(tag(1)));
   EXPECT_CALL(yielder2, Yield(testing::_))
-      .Times(5)
-      .WillRepeatedly(testing::Return(Status::OK()));
+      .WillRepeatedly(testing::Invoke(tag(2)));
   EXPECT_CALL(yielder2, Yield(testing::_))
       .Times(3)
       .WillRepeatedly(testing::Return(Status(error::DEADLINE_EXCEEDED, "")))
@@ -205,13 +570,41 @@ TEST(RecordYielderTest, RecordYielderRetryLoop) {
   WeightedMixRecordYielder* yielder =
       WeightedMixRecordYielder::New(304, {&yielder1, &yielder2}, {0.5, 0.5});
 
+  // Whatever the seed, the records split evenly up to the sampling noise,
+  // about 0.005 for this many records.
+  const int kNumRecords = 10000;
+  int num_from_first = 0;
   Record record;
-  record.source_id = kDefaultSourceId;
-  for (int i = 0; i < 10; ++i) {
-    // Thanks to the seed selected every child yielder will be selected exactly
-    // 5 times.
+  for (int i = 0; i < kNumRecords; ++i) {
+    record.source_id = kDefaultSourceId;
     TF_CHECK_OK(yielder->Yield(&record));
+    ASSERT_NE(kDefaultSourceId, record.source_id);
+    if (record.source_id == 1) ++num_from_first;
   }
+  EXPECT_NEAR(0.5, static_cast<double>(num_from_first) / kNumRecords, 0.03);
+  EXPECT_CALL(yielder1, Close());
+  EXPECT_CALL(yielder2, Close());
+  yielder->Close();
+}
+
+TEST(RecordYielderTest, RecordYielderRetryLoopYieldBatch) {
+  MockRecordYielder yielder1;
+  MockRecordYielder yielder2;
+  // Yielder2 returns DEADLINE_EXCEEDED 3 times in a row and then returns OK.
+  EXPECT_CALL(yielder1, Yield(testing::_))
+      .WillRepeatedly(testing::Return(Status::OK()));
+  EXPECT_CALL(yielder2, Yield(testing::_))
+      .WillRepeatedly(testing::Return(Status::OK()));
+  EXPECT_CALL(yielder2, Yield(testing::_))
+      .Times(3)
+      .WillRepeatedly(testing::Return(Status(error::DEADLINE_EXCEEDED, "")))
+      .RetiresOnSaturation();
+
+  WeightedMixRecordYielder* yielder =
+      WeightedMixRecordYielder::New(303, {&yielder1, &yielder2}, {0.5, 0.5});
+  std::vector<Record> records;
+  TF_CHECK_OK(yielder->YieldBatch(10, &records));
+  EXPECT_EQ(10, records.size());
   EXPECT_CALL(yielder1, Close());
   EXPECT_CALL(yielder2, Close());
   yielder->Close();
@@ -237,5 +630,6 @@ TEST(RecordYielderDeathTest, WeightedMixerNegativeWeights) {
       "All weights should be greater or equal to zero. Got -0.1");
 }
 
+
 }  // namespace lingvo
 }  // namespace tensorflow
@@ -642,6 +642,74 @@ dynamic_padding_constants: Must be set if `dynamic_padding_dimension` is
     provided. The constant value to use for padding.
 )doc");
 
+REGISTER_OP("SaveInputState")
+    .Attr("state_file: string")
+    .Attr("max_buffered_records: int = 0")
+    .SetIsStateful()
+    .Doc(R"doc(
+Saves the reading position of the input op whose input_state_file is
+state_file into that file, so that the input op resumes from it after a
+restart.
+
+state_file: The input_state_file of an input op.
+max_buffered_records: At most this many records read but not yet yielded are
+    saved, sampled at random. The others are not yielded again in their epoch
+    after a restart. Records already yielded to the batcher but not yet in a
+    batch, at most a few batches' worth, are lost as well.
+)doc");
+
+REGISTER_OP("SetInputSourceWeights")
+    .Input("weights: float")
+    .Attr("weights_name: string")
+    .SetIsStateful()
+    .SetShapeFn([](shape_inference::InferenceContext* c) {
+      shape_inference::ShapeHandle unused;
+      return c->WithRank(c->input(0), 1, &unused);
+    })
+    .Doc(R"doc(
+Replaces the input_source_weights of the input ops whose
+input_source_weights_name is weights_name, e.g., to change the mix of the
+input sources during training. The records read so far are kept, and the
+records yielded after the op has run follow the new weights.
+
+weights: A vector with a non-negative weight per input source, some positive.
+weights_name: The input_source_weights_name of the input ops.
+)doc");
+
+REGISTER_OP("InputPipelineStats")
+    .Output("summary: string")
+    .Attr("stats_name: string")
+    .SetIsStateful()
+    .SetShapeFn(shape_inference::ScalarShape)
+    .Doc(R"doc(
+Returns the counters and histograms added so far by the input ops whose
+input_stats_name is stats_name, as a serialized Summary tagged
+'<stats_name>/<name>':
+
+  source_<i>/records, source_<i>/bytes: Records and bytes read from the files of
+      the i-th input source into the shuffling buffer.
+  read_usecs: Latency of the reads of the file iterators, each of a batch of
+      records.
+  buffer_fill_percent: How full the shuffling buffer is, sampled whenever
+      records are taken from it.
+  yield_wait_usecs: Time the batcher threads waited for the buffer to fill up.
+  process_usecs, merge_usecs: Latency of processing a record and of merging a
+      batch.
+  records_failed: Records the processor failed on or filtered out.
+  records_skipped: Records skipped for a bucket key beyond the last bucket.
+  batch_wait_usecs: Time each call of the input op waited for a batch.
+  bucket_<i>/batches, bucket_<i>/samples, bucket_<i>/fill_percent: Batches and
+      samples of the i-th bucket, and how full each batch was.
+  padding/tokens, padding/padded_tokens, padding/efficiency: Sum of the bucket
+      keys of the samples, the same padded to the bucket upper bound, and the
+      ratio of the two.
+
+The counters are cumulative since the process started.
+
+summary: A scalar string, a serialized Summary proto.
+stats_name: The input_stats_name of the input ops.
+)doc");
+
 REGISTER_OP("StaticMapStringInt")
     .Input("x: string")
     .Output("y: int32")
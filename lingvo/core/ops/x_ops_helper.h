@@ -32,6 +32,22 @@ limitations under the License.
       .Attr("require_sequential_order: bool = False") \
       .Attr("repeat_count: int = -1")                 \
       .Attr("use_chaining: bool = False")             \
+      .Attr("file_readahead_blocks: int = 0")         \
+      .Attr("file_list_max_age_secs: int = 0")        \
+      .Attr("input_state_file: string = ''")          \
+      .Attr("memory_budget_bytes: int = 0")           \
+      .Attr("file_cache_dir: string = ''")            \
+      .Attr("file_cache_max_bytes: int = 0")          \
+      .Attr("in_memory_cache_max_bytes: int = 0")     \
+      .Attr("file_global_shuffle: bool = False")      \
+      .Attr("file_interleave_cycle_length: int = 0")  \
+      .Attr("file_interleave_block_length: int = 1")  \
+      .Attr("input_stats_name: string = ''")          \
+      .Attr("file_parallelism_max: int = 0")          \
+      .Attr("num_threads_max: int = 0")               \
+      .Attr("input_source_weights_name: string = ''") \
+      .Attr("input_source_max_deficit: int = 0")      \
+      .Attr("sequential_num_readers: int = 1")        \
       .SetIsStateful()
 
 #define INPUT_DOCS \
@@ -61,8 +77,9 @@ num_threads: Number of threads to use for the record batcher. Each thread\
   fills separate batches based on bucket limits.\
 require_sequential_order: If true, the input op is required to process the file\
   glob as well as the contents of each file in a deterministic sequential order.\
-  Setting this automatically disables file_random_seed, file_buffer_size,\
-  file_parallelism, num_threads, and requires a single file_pattern.\
+  Setting this automatically disables file_random_seed, file_parallelism,\
+  num_threads, and requires a single file_pattern. file_buffer_size only\
+  bounds the records read ahead with sequential_num_readers.\
 repeat_count: Number of repetitions of a dataset before throwing OutOfRange\
   error when using require_sequential_order. Must only be set if\
   require_sequential_order is True.)\
@@ -70,6 +87,57 @@ use_chaining: If true, the input op is outputing records from file patterns in \
   order. That is, first all records from first file pattern will be yielded, \
   then all records from the second file pattern and so on. If false, the \
   records from different file patterns will be mixed.\
+file_readahead_blocks: If positive, each of the file_parallelism readers opens\
+  its next file and reads up to this many 2MB blocks of it in the background\
+  while the current file is being parsed.\
+file_list_max_age_secs: If non-zero, the files matching file_pattern are listed\
+  once and cached. A list older than this many seconds is refreshed in the\
+  background for later epochs. If negative, it is never refreshed.\
+input_state_file: If not empty, SaveInputState saves the reading position of\
+  this op into this file, and the op resumes from it if it exists. No two\
+  input ops may share a file.\
+memory_budget_bytes: If positive, the bytes of the records buffered by the\
+  yielders and of the samples and batches held by the batcher are kept within\
+  this budget by shrinking the shuffling buffers as needed.\
+file_cache_dir: If not empty, the data files read front to back are copied\
+  into this local directory during the first epoch, and read from there in\
+  later epochs.\
+file_cache_max_bytes: If positive, the least recently used copies are deleted\
+  to keep file_cache_dir within this many bytes.\
+in_memory_cache_max_bytes: If positive, the records of the first epoch are\
+  kept in memory if they total at most this many bytes, and later epochs are\
+  shuffled and yielded from memory without reading the files again.\
+file_global_shuffle: If true, every epoch reads the records of all files in a\
+  random permutation by their offsets, so that they are well shuffled with a\
+  small file_buffer_size. The offsets of each file are read from an index\
+  file next to it, which is written on first read if missing. Requires\
+  uncompressed TFRecord files.\
+file_interleave_cycle_length: If greater than 1, each of the file_parallelism\
+  iterators reads this many files at a time, taking\
+  file_interleave_block_length records from each in turn. This mixes records\
+  of many files with a much smaller file_buffer_size.\
+file_interleave_block_length: Number of consecutive records taken from a file\
+  when interleaving.\
+input_stats_name: If not empty, the input op adds counters and histograms of\
+  its yielders and batcher to the stats of this name, which\
+  InputPipelineStats returns.\
+file_parallelism_max: If greater than file_parallelism, the number of files\
+  read concurrently is tuned between file_parallelism and this many, growing\
+  while the batcher waits for records and shrinking while the readers wait\
+  for room in the buffer.\
+num_threads_max: If greater than num_threads, the number of batcher threads\
+  is tuned between num_threads and this many, growing while the input op\
+  waits for batches and shrinking while the threads wait for records.\
+input_source_weights_name: If not empty, SetInputSourceWeights ops with this\
+  name replace input_source_weights while the input op runs. Requires\
+  input_source_weights for several file patterns, without use_chaining.\
+input_source_max_deficit: If positive, records are taken from other input\
+  sources while the one sampled has none ready, e.g., on slow storage, rather\
+  than wait for it. Up to this many records per source are made up for later\
+  to keep the mix of input_source_weights.\
+sequential_num_readers: With require_sequential_order, if greater than 1, this\
+  many threads read the next files ahead, buffering up to file_buffer_size\
+  records in total, and the records are still yielded in order.\
 )"
 
 #endif  // LINGVO_CORE_OPS_X_OPS_HELPER_H_
@@ -28,6 +28,15 @@ class MockRecordYielder : public BasicRecordYielder {
   MOCK_METHOD1(Yield, Status(Record* record));
   MOCK_METHOD0(Close, void());
   MOCK_CONST_METHOD0(current_epoch, int64());
+
+  // Batches are yielded one record at a time by the mocked Yield(), rather
+  // than from the buffer of a BasicRecordYielder that was never started.
+  Status YieldBatch(int n, std::vector<Record>* out) override {
+    return RecordYielder::YieldBatch(n, out);
+  }
+  Status TryYieldBatch(int n, std::vector<Record>* out) override {
+    return RecordYielder::YieldBatch(n, out);
+  }
 };
 
 // Generates n plain text files with m lines each.
@@ -0,0 +1,107 @@
+/* Copyright 2018 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Converts TFRecord files into chunked record files which can be read with
+// the "chunked:" file pattern prefix by the lingvo input ops.
+//
+// Usage:
+//   tfrecord_to_chunked --input=/path/data.tfrecord --output=/path/data.chunked
+//     [--input_compression=GZIP] [--compression=ZLIB] [--chunk_size=1048576]
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lingvo/core/ops/chunked_record.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/io/record_reader.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/util/command_line_flags.h"
+
+namespace tensorflow {
+namespace lingvo {
+namespace {
+
+Status Convert(const string& input, const string& input_compression,
+               const string& output, const string& compression,
+               int64 chunk_size, int64* num_records) {
+  Env* env = Env::Default();
+  std::unique_ptr<RandomAccessFile> in_file;
+  TF_RETURN_IF_ERROR(env->NewRandomAccessFile(input, &in_file));
+  io::SequentialRecordReader reader(
+      in_file.get(),
+      io::RecordReaderOptions::CreateRecordReaderOptions(input_compression));
+
+  std::unique_ptr<WritableFile> out_file;
+  TF_RETURN_IF_ERROR(env->NewWritableFile(output, &out_file));
+  ChunkedRecordWriter::Options opts;
+  opts.compression_type = compression;
+  opts.chunk_size = chunk_size;
+  ChunkedRecordWriter writer(out_file.get(), opts);
+
+  tstring record;
+  *num_records = 0;
+  while (true) {
+    Status s = reader.ReadRecord(&record);
+    if (errors::IsOutOfRange(s)) break;
+    TF_RETURN_IF_ERROR(s);
+    TF_RETURN_IF_ERROR(writer.WriteRecord(record));
+    ++*num_records;
+  }
+  TF_RETURN_IF_ERROR(writer.Close());
+  return out_file->Close();
+}
+
+}  // namespace
+}  // namespace lingvo
+}  // namespace tensorflow
+
+int main(int argc, char** argv) {
+  std::string input;
+  std::string input_compression;
+  std::string output;
+  std::string compression = "ZLIB";
+  tensorflow::int64 chunk_size = 1 << 20;
+  std::vector<tensorflow::Flag> flags = {
+      tensorflow::Flag("input", &input, "Input TFRecord file."),
+      tensorflow::Flag("input_compression", &input_compression,
+                       "Compression of the input file: '', 'ZLIB' or 'GZIP'."),
+      tensorflow::Flag("output", &output, "Output chunked record file."),
+      tensorflow::Flag("compression", &compression,
+                       "Compression of the output chunks: '' or 'ZLIB'."),
+      tensorflow::Flag("chunk_size", &chunk_size,
+                       "Uncompressed size in bytes of the output chunks."),
+  };
+  const std::string usage = tensorflow::Flags::Usage(argv[0], flags);
+  if (!tensorflow::Flags::Parse(&argc, argv, flags) || input.empty() ||
+      output.empty()) {
+    std::cerr << usage;
+    return 1;
+  }
+
+  tensorflow::int64 num_records = 0;
+  tensorflow::Status s = tensorflow::lingvo::Convert(
+      input, input_compression, output, compression, chunk_size,
+      &num_records);
+  if (!s.ok()) {
+    std::cerr << "Failed to convert " << input << ": " << s << std::endl;
+    return 1;
+  }
+  std::cout << "Wrote " << num_records << " records to " << output
+            << std::endl;
+  return 0;
+}